@@ -0,0 +1,100 @@
+# Benchmarks of the hot paths of the client, run by `rake bench`:
+#
+#   mruby bench/bench.rb [host] [port] [iterations] [server]
+#
+# Prints one JSON object per case on stdout: ops/sec, latency percentiles
+# (a call, or a whole batch when pipelined) and the mruby objects allocated
+# per call. Needs mruby-time and mruby-objectspace (both in the default gembox).
+
+HOST = ARGV[0] || "127.0.0.1"
+PORT = (ARGV[1] || 6379).to_i
+ITERATIONS = (ARGV[2] || 10000).to_i
+SERVER = ARGV[3] || "redis-server"
+
+VALUE_SIZES = [16, 1024, 65536]
+PIPELINE_DEPTH = 100
+FANOUT = 10 # keys of MGET, fields of HGETALL, elements of LRANGE
+ALLOC_CALLS = 100
+
+def to_json(h)
+  "{" + h.map { |k, v| "\"#{k}\":" + (v.is_a?(String) ? "\"#{v}\"" : v.to_s) }.join(",") + "}"
+end
+
+def percentile(sorted, q)
+  return 0 if sorted.empty?
+  sorted[((sorted.size - 1) * q).round]
+end
+
+# live objects created by n calls of the block, the GC being off meanwhile
+def allocations(n)
+  counts = {}
+  GC.start
+  GC.disable
+  before = ObjectSpace.count_objects(counts)[:TOTAL] - counts[:FREE]
+  i = 0
+  while i < n
+    yield
+    i += 1
+  end
+  after = ObjectSpace.count_objects(counts)[:TOTAL] - counts[:FREE]
+  GC.enable
+  (after - before).to_f / n
+end
+
+def run(r, name, size, pipelined, &block)
+  iterations = ITERATIONS
+  iterations = ITERATIONS / 10 if size >= 65536
+  batch = pipelined ? PIPELINE_DEPTH : 1
+  rounds = iterations / batch
+  rounds = 1 if rounds < 1
+  call = pipelined ? lambda { r.pipelined { PIPELINE_DEPTH.times(&block) } } : block
+
+  # warm up, then latencies
+  (rounds / 10 + 1).times { call.call }
+  latencies = Array.new(rounds)
+  started = Time.now
+  i = 0
+  while i < rounds
+    t = Time.now
+    call.call
+    latencies[i] = ((Time.now - t) * 1000000).to_i
+    i += 1
+  end
+  elapsed = Time.now - started
+  latencies.sort!
+
+  n = pipelined ? ALLOC_CALLS / PIPELINE_DEPTH + 1 : ALLOC_CALLS
+  allocs = allocations(n) { call.call } / batch
+
+  puts to_json(
+    :bench => name, :value_size => size, :pipelined => pipelined, :ops => rounds * batch,
+    :seconds => elapsed, :ops_per_sec => (rounds * batch / elapsed).to_i,
+    :p50_us => percentile(latencies, 0.5), :p90_us => percentile(latencies, 0.9),
+    :p99_us => percentile(latencies, 0.99), :max_us => latencies.last,
+    :allocs_per_call => allocs, :server => SERVER
+  )
+end
+
+r = Redis.new HOST, PORT
+keys = Array.new(FANOUT) { |i| "bench:key:#{i}" }
+
+VALUE_SIZES.each do |size|
+  value = "x" * size
+  r.del "bench:key", "bench:hash", "bench:list", *keys
+  keys.each { |k| r.set k, value }
+  FANOUT.times do |i|
+    r.hset "bench:hash", "field#{i}", value
+    r.rpush "bench:list", value
+  end
+
+  [false, true].each do |pipelined|
+    run(r, "SET", size, pipelined) { r.set "bench:key", value }
+    run(r, "GET", size, pipelined) { r.get "bench:key" }
+    run(r, "MGET", size, pipelined) { r.mget(*keys) }
+    run(r, "HGETALL", size, pipelined) { r.hgetall "bench:hash" }
+    run(r, "LRANGE", size, pipelined) { r.lrange "bench:list", 0, -1 }
+  end
+end
+
+r.del "bench:key", "bench:hash", "bench:list", *keys
+r.close
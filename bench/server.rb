@@ -0,0 +1,106 @@
+# A RESP stand-in for `rake bench`, run by CRuby in the rake process when no
+# redis-server is at hand. It knows the handful of commands bench.rb sends and
+# keeps the data in memory, so the numbers measure the client, not a server.
+require 'socket'
+
+module Bench
+  class Server
+    attr_reader :port
+
+    def initialize(host = "127.0.0.1", port = 0)
+      @server = TCPServer.new(host, port)
+      @port = @server.addr[1]
+      @data = {}
+      @lock = Mutex.new
+    end
+
+    def start
+      @thread = Thread.new do
+        loop do
+          client = @server.accept
+          Thread.new(client) { |c| serve c }
+        end
+      end
+      self
+    end
+
+    def stop
+      @thread.kill if @thread
+      @server.close
+    end
+
+    private
+
+    def serve(client)
+      client.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+      while (argv = read_command(client))
+        client.write @lock.synchronize { call(argv) }
+      end
+    rescue IOError, SystemCallError
+    ensure
+      client.close
+    end
+
+    def read_command(io)
+      line = io.gets("\r\n") or return nil
+      raise IOError, "inline commands are not supported" unless line.start_with?("*")
+
+      Array.new(line[1..-1].to_i) do
+        len = io.gets("\r\n")[1..-1].to_i
+        arg = io.read(len + 2)
+        arg[0, len]
+      end
+    end
+
+    def call(argv)
+      cmd = argv.shift.upcase
+      case cmd
+      when "PING" then status "PONG"
+      when "SELECT", "FLUSHDB" then
+        @data.clear if cmd == "FLUSHDB"
+        status "OK"
+      when "SET"
+        @data[argv[0]] = argv[1]
+        status "OK"
+      when "GET" then bulk @data[argv[0]]
+      when "MGET" then array argv.map { |k| bulk(@data[k].is_a?(String) ? @data[k] : nil) }
+      when "DEL"
+        integer argv.count { |k| @data.delete(k) }
+      when "HSET"
+        h = (@data[argv.shift] ||= {})
+        added = 0
+        argv.each_slice(2) do |f, v|
+          added += 1 unless h.key?(f)
+          h[f] = v
+        end
+        integer added
+      when "HGETALL" then array((@data[argv[0]] || {}).flat_map { |f, v| [bulk(f), bulk(v)] })
+      when "RPUSH"
+        l = (@data[argv.shift] ||= [])
+        l.concat argv
+        integer l.size
+      when "LRANGE"
+        l = @data[argv[0]] || []
+        array((l[argv[1].to_i..argv[2].to_i] || []).map { |v| bulk v })
+      else
+        "-ERR unknown command '#{cmd}'\r\n"
+      end
+    end
+
+    def status(s)
+      "+#{s}\r\n"
+    end
+
+    def integer(i)
+      ":#{i}\r\n"
+    end
+
+    def bulk(s)
+      s.nil? ? "$-1\r\n" : "$#{s.bytesize}\r\n#{s}\r\n"
+    end
+
+    def array(elements)
+      "*#{elements.size}\r\n#{elements.join}"
+    end
+  end
+end
@@ -16,6 +16,9 @@ extern "C" {
 #define E_REDIS_ERR_OOM (mrb_class_get_under(mrb, mrb_class_get(mrb, "Redis"), "OOMError"))
 #define E_REDIS_ERR_AUTH (mrb_class_get_under(mrb, mrb_class_get(mrb, "Redis"), "AuthError"))
 #define E_REDIS_ERR_CLOSED (mrb_class_get_under(mrb, mrb_class_get(mrb, "Redis"), "ClosedError"))
+#define E_REDIS_ERR_TIMEOUT (mrb_class_get_under(mrb, mrb_class_get(mrb, "Redis"), "TimeoutError"))
+#define E_REDIS_ERR_POOL_TIMEOUT                                                                                       \
+  (mrb_class_get_under(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "Redis"), "Pool"), "TimeoutError"))
 
 #ifdef __cplusplus
 }
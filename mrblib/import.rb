@@ -0,0 +1,41 @@
+class Redis
+  # Sends one command per row of rows (the row itself, or what the block
+  # returns for it; nil skips the row) with at most opts[:window] commands
+  # waiting for their reply, so that neither the output buffer nor the
+  # replies grow with the number of rows. An error reply doesn't stop the
+  # import: it is returned with the index of its row.
+  #
+  #   redis.import(rows, window: 1000) { |row| [:hset, row[0], row[1], row[2]] }
+  #   # => {count: 3, errors: [[1, #<Redis::ReplyError: WRONGTYPE ...>]]}
+  def import(rows, opts = {})
+    window = opts[:window] || 1000
+    raise ArgumentError, "window should be positive" unless window > 0
+
+    pending = Array.new(window) # row index of the replies owed, a ring
+    errors = []
+    sent = 0
+    received = 0
+    begin
+      rows.each_with_index do |row, i|
+        command = block_given? ? yield(row) : row
+        next if command.nil?
+        if sent - received == window
+          reply = __import_reply
+          errors << [pending[received % window], reply] if reply.is_a?(Exception)
+          received += 1
+        end
+        __import_send(command)
+        pending[sent % window] = i
+        sent += 1
+      end
+    ensure
+      # also after an exception of the block, so that the connection stays in step
+      while received < sent
+        reply = __import_reply
+        errors << [pending[received % window], reply] if reply.is_a?(Exception)
+        received += 1
+      end
+    end
+    {count: sent, errors: errors}
+  end
+end
@@ -0,0 +1,12 @@
+class Redis
+  class Pool
+    def with
+      redis = checkout
+      begin
+        yield redis
+      ensure
+        checkin redis
+      end
+    end
+  end
+end
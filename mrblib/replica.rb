@@ -0,0 +1,62 @@
+class Redis
+  # A primary and its read replicas. Read only commands go to a replica
+  # chosen by the strategy, everything else to the primary.
+  #
+  #   set = Redis::ReplicaSet.new "10.0.0.1:6379", ["10.0.0.2:6379", ["10.0.0.3", 6379]],
+  #                               strategy: :latency, read_your_writes: 0.5
+  #   set.set "key", "value"   # primary, the reads of the next 0.5 sec too
+  #   set.get "key"
+  class ReplicaSet
+    READ_COMMANDS = [
+      :get, :[], :mget, :exists?, :ttl, :keys, :randomkey,
+      :scan, :sscan, :hscan, :zscan, :scan_each, :sscan_each, :hscan_each, :zscan_each,
+      :hget, :hgetall, :hexists?, :hkeys, :hvals, :hmget,
+      :llen, :lrange, :lindex,
+      :smembers, :sismember, :scard,
+      :zcard, :zrange, :zrevrange, :zrangebyscore, :zrevrangebyscore, :zrank, :zrevrank, :zscore,
+      :pfcount,
+    ]
+
+    WRITE_COMMANDS = [
+      :set, :[]=, :setnx, :del, :expire, :incr, :decr, :incrby, :decrby, :mset,
+      :hset, :hsetnx, :hdel, :hincrby, :hmset,
+      :lpush, :rpush, :lpop, :rpop, :ltrim,
+      :sadd, :srem, :spop,
+      :zadd, :zincrby, :zrem, :zpopmin, :zpopmax,
+      :pfadd, :pfmerge, :publish, :flushdb, :flushall,
+      :eval, :evalsha, :script_load,
+    ]
+
+    READ_COMMANDS.each do |command|
+      define_method(command) { |*args, &block| __read(command, *args, &block) }
+    end
+
+    WRITE_COMMANDS.each do |command|
+      define_method(command) { |*args, &block| __write(command, *args, &block) }
+    end
+
+    attr_reader :primary, :replicas
+
+    # primary and replicas: "host:port", [host, port] or a connected Redis.
+    # opts: :strategy (:round_robin, :least_outstanding or :latency),
+    # :read_your_writes (sec), :retry_after (sec), :timeout (connect, sec)
+    def initialize(primary, replicas, opts = {})
+      @primary = ReplicaSet.connect(primary, opts[:timeout])
+      @replicas = replicas.map { |replica| ReplicaSet.connect(replica, opts[:timeout]) }
+      __setup(@replicas.size, opts[:strategy] || :round_robin, (opts[:read_your_writes] || 0).to_f,
+              (opts[:retry_after] || 1).to_f)
+    end
+
+    def self.connect(node, timeout)
+      return node if node.is_a?(Redis)
+      host, port = node.is_a?(Array) ? node : node.to_s.split(":")
+      Redis.new host, port.to_i, timeout || 1
+    end
+
+    def close
+      @primary.close
+      @replicas.each(&:close)
+      nil
+    end
+  end
+end
@@ -0,0 +1,118 @@
+class Redis
+  # What Redis::Cluster and Redis::Distributed share: the commands routed to
+  # the node owning their key, through #call (see src/mrb_redis_router.c).
+  module Router
+    # single-key commands, routed to the node owning the key. #call gives
+    # their reply as Redis's methods do: true/false for setnx, expire and
+    # hset, nil for an empty hkeys/hvals, Float scores...
+    [
+      :get, :set, :setnx, :incr, :decr, :incrby, :decrby, :expire, :ttl,
+      :hget, :hset, :hdel, :hincrby, :hkeys, :hvals, :hmget,
+      :lpush, :rpush, :lpop, :rpop, :llen, :lrange, :ltrim, :lindex,
+      :sadd, :srem, :smembers, :sismember, :scard, :spop,
+      :zcard, :zrank, :zrevrank, :zrem, :zscore, :zincrby,
+      :pfadd, :pfcount,
+    ].each do |command|
+      define_method(command) { |*args| call(command, *args) }
+    end
+
+    # like Redis#zadd: (key, score, member, ...), (key, [[score, member], ...])
+    # or (key, {member => score}), with the options nx/xx/gt/lt/ch/incr
+    def zadd(key, *args)
+      opts = args.size >= 2 && args.last.is_a?(Hash) ? args.pop : {}
+      flags = []
+      [:nx, :xx, :gt, :lt, :ch, :incr].each { |flag| flags << flag.to_s.upcase if opts[flag] }
+      pairs = []
+      if args.size == 1 && args[0].is_a?(Hash)
+        args[0].each { |member, score| pairs << score << member }
+      elsif args.size == 1 && args[0].is_a?(Array)
+        args[0].each do |pair|
+          raise ArgumentError, "pairs should be [score, member]" unless pair.is_a?(Array) && pair.size == 2
+          pairs << pair[0] << pair[1]
+        end
+      elsif args.size > 0 && args.size.even?
+        pairs = args
+      else
+        raise ArgumentError, "wrong number of arguments"
+      end
+      raise ArgumentError, "no member given" if pairs.empty?
+      call(:zadd, key, *flags, *pairs)
+    end
+
+    # like Redis#zrange: withscores:, limit: [offset, count], by_score:, rev:
+    def zrange(key, start, stop, opts = {})
+      call(:zrange, key, start, stop, *zrange_options(opts, true))
+    end
+
+    def zrevrange(key, start, stop, opts = {})
+      call(:zrevrange, key, start, stop, *zrange_options(opts, false))
+    end
+
+    def zrangebyscore(key, min, max, opts = {})
+      call(:zrangebyscore, key, min, max, *zrange_options(opts, false))
+    end
+
+    def zrevrangebyscore(key, max, min, opts = {})
+      call(:zrevrangebyscore, key, max, min, *zrange_options(opts, false))
+    end
+
+    # [member, score] or nil, with count [[member, score], ...]
+    def zpopmin(key, count = nil)
+      count ? call(:zpopmin, key, count) : call(:zpopmin, key)
+    end
+
+    def zpopmax(key, count = nil)
+      count ? call(:zpopmax, key, count) : call(:zpopmax, key)
+    end
+
+    # like Redis#hmset
+    def hmset(key, *pairs)
+      call(:hmset, key, *pairs)
+      self
+    end
+
+    def [](key)
+      call(:get, key)
+    end
+
+    def []=(key, value)
+      call(:set, key, value)
+    end
+
+    def exists?(key)
+      call(:exists, key) == 1
+    end
+
+    def hgetall(key)
+      reply = call(:hgetall, key)
+      return nil if reply.empty?
+      hash = {}
+      (reply.length / 2).times { |i| hash[reply[i * 2]] = reply[i * 2 + 1] }
+      hash
+    end
+
+    private
+
+    def zrange_options(opts, zrange)
+      args = []
+      if zrange
+        args << "BYSCORE" if opts[:by_score]
+        args << "REV" if opts[:rev]
+      end
+      if (limit = opts[:limit])
+        raise ArgumentError, "limit should be [offset, count]" unless limit.is_a?(Array) && limit.size == 2
+        args << "LIMIT" << limit[0] << limit[1]
+      end
+      args << "WITHSCORES" if opts[:withscores]
+      args
+    end
+  end
+
+  class Cluster
+    include Router
+  end
+
+  class Distributed
+    include Router
+  end
+end
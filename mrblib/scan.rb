@@ -0,0 +1,53 @@
+class Redis
+  # SCAN based iteration: elements come page by page as the cursor
+  # advances, so memory stays flat and the server is never blocked the way
+  # KEYS blocks it. Options are :match, :count, :type (scan_each only) and
+  # :prefetch, which requests the next page before yielding the current one.
+  def scan_each(opts = {}, &block)
+    return to_enum(:scan_each, opts) unless block
+    __scan_each(:scan, nil, opts) { |keys| keys.each(&block) }
+  end
+
+  def sscan_each(key, opts = {}, &block)
+    return to_enum(:sscan_each, key, opts) unless block
+    __scan_each(:sscan, key, opts) { |members| members.each(&block) }
+  end
+
+  def hscan_each(key, opts = {})
+    return to_enum(:hscan_each, key, opts) unless block_given?
+    __scan_each(:hscan, key, opts) do |pairs|
+      i = 0
+      while i < pairs.length
+        yield pairs[i], pairs[i + 1]
+        i += 2
+      end
+    end
+  end
+
+  def zscan_each(key, opts = {})
+    return to_enum(:zscan_each, key, opts) unless block_given?
+    __scan_each(:zscan, key, opts) do |pairs|
+      i = 0
+      while i < pairs.length
+        yield pairs[i], pairs[i + 1].to_f
+        i += 2
+      end
+    end
+  end
+
+  # each page is received with the token of its request: another iteration
+  # running in the block reads our prefetched page into it, not in its place
+  def __scan_each(command, key, opts)
+    prefetch = opts[:prefetch]
+    token = __scan_send(command, key, "0", opts)
+    loop do
+      cursor, elements = __scan_recv(token)
+      more = cursor != "0"
+      token = __scan_send(command, key, cursor, opts) if more && prefetch
+      yield elements
+      break unless more
+      token = __scan_send(command, key, cursor, opts) unless prefetch
+    end
+    nil
+  end
+end
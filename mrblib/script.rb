@@ -0,0 +1,29 @@
+class Redis
+  # A Lua script run by its SHA1. The first call on a connection, or one
+  # after a restart or SCRIPT FLUSH, falls back to EVAL on NOSCRIPT; inside
+  # pipelined and multi the script is sent by EVAL until the connection is
+  # known to have it.
+  #
+  #   CAPPED_PUSH = Redis::Script.new(<<-LUA)
+  #     redis.call("LPUSH", KEYS[1], ARGV[1])
+  #     return redis.call("LTRIM", KEYS[1], 0, tonumber(ARGV[2]) - 1)
+  #   LUA
+  #   CAPPED_PUSH.call(redis, ["events"], [event, 100])
+  class Script
+    attr_reader :source, :sha
+
+    def initialize(source)
+      @source = source
+      @sha = Script.sha1(source)
+    end
+
+    def call(redis, keys = [], argv = [])
+      redis.__script_call(@sha, @source, keys, argv)
+    end
+
+    # SCRIPT LOAD, so that EVALSHA is sent from the start, pipelines included
+    def load(redis)
+      redis.script_load(@source)
+    end
+  end
+end
@@ -0,0 +1,22 @@
+class Redis
+  # A Redis connected to the master that Redis Sentinel names, and moving
+  # to the new one on failover.
+  #
+  #   redis = Redis::Sentinel.new ["10.0.0.1:26379", ["10.0.0.2", 26379]], "mymaster", timeout: 0.5
+  #   redis.get "key"
+  class Sentinel < Redis
+    # sentinels: "host:port" or [host, port]. opts: :timeout (connect,
+    # sec), :sentinel_password, and the options of Redis.new
+    # (:command_timeout, :protocol).
+    def initialize(sentinels, master_name, opts = {})
+      nodes = sentinels.map do |node|
+        host, port = node.is_a?(Array) ? node : node.to_s.split(":")
+        [host.to_s, port.to_i]
+      end
+      timeout = (opts[:timeout] || 1).to_f
+      host, port = Sentinel.__resolve(nodes, master_name.to_s, timeout, opts[:sentinel_password])
+      super(host, port, timeout, opts)
+      __watch(nodes, master_name.to_s, timeout, opts[:sentinel_password])
+    end
+  end
+end
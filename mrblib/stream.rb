@@ -0,0 +1,51 @@
+class Redis
+  # Consumes the entries of a stream as consumer of group, at least once:
+  # an entry is acknowledged only after the block returned for it, and the
+  # acknowledgements of a batch go with the read of the next batch, in the
+  # same round trip. The entries delivered to consumer before and never
+  # acknowledged (a crash, a break) come first. Runs until the block
+  # breaks; options are :count, entries per batch, and :block, how long a
+  # read waits for new entries in milliseconds.
+  #
+  #   redis.xconsume("jobs", "workers", "worker-1", count: 100) do |id, fields|
+  #     perform(fields)   # fields is nil for an entry deleted while pending
+  #   end
+  def xconsume(key, group, consumer, opts = {})
+    count = opts[:count] || 100
+    block = opts[:block] || 1000
+    id = "0"
+    acks = []
+    begin
+      loop do
+        replies = pipelined do
+          xack(key, group, acks) unless acks.empty?
+          xreadgroup(group, consumer, key, id, count: count, block: block)
+        end
+        acks = []
+        entries = __stream_entries(replies.last, key)
+        # the history is over, new entries from now on
+        id = ">" if entries.empty?
+        entries.each do |entry_id, fields|
+          yield entry_id, fields
+          acks << entry_id
+        end
+      end
+    ensure
+      begin
+        xack(key, group, acks) unless acks.empty?
+      rescue StandardError
+        # delivered again, which at least once allows
+      end
+    end
+  end
+
+  # the entries of key in a reply of XREADGROUP read inside pipelined:
+  # a Hash with RESP3, [[stream, entries], ...] with RESP2, nil after BLOCK
+  def __stream_entries(reply, key)
+    raise reply if reply.is_a?(Exception)
+    return [] if reply.nil?
+    return reply[key] || [] if reply.is_a?(Hash)
+    pair = reply.find { |stream, _| stream == key }
+    pair ? pair[1] : []
+  end
+end
@@ -0,0 +1,77 @@
+class Redis
+  # Handlers of a subscription, given to the block of Redis#subscribe.
+  # subscribe/unsubscribe/psubscribe/punsubscribe handlers get the channel
+  # (or pattern) and the number of subscriptions left, message gets the
+  # channel and the message, pmessage the pattern, the channel and the
+  # message.
+  class Subscription
+    attr_reader :callbacks
+
+    def initialize
+      @callbacks = {}
+    end
+
+    def subscribe(&block)
+      @callbacks[:subscribe] = block
+    end
+
+    def unsubscribe(&block)
+      @callbacks[:unsubscribe] = block
+    end
+
+    def message(&block)
+      @callbacks[:message] = block
+    end
+
+    def psubscribe(&block)
+      @callbacks[:psubscribe] = block
+    end
+
+    def punsubscribe(&block)
+      @callbacks[:punsubscribe] = block
+    end
+
+    def pmessage(&block)
+      @callbacks[:pmessage] = block
+    end
+  end
+
+  # Enters subscriber mode and dispatches what the server pushes until
+  # nothing is subscribed anymore. Called from a handler, it only adds
+  # channels to the running subscription.
+  def subscribe(*channels, &block)
+    __subscribe(:subscribe, 0, channels, &block)
+  end
+
+  # Same as subscribe, but unsubscribes from everything once no message
+  # came for timeout seconds.
+  def subscribe_with_timeout(timeout, *channels, &block)
+    __subscribe(:subscribe, timeout, channels, &block)
+  end
+
+  def psubscribe(*patterns, &block)
+    __subscribe(:psubscribe, 0, patterns, &block)
+  end
+
+  def psubscribe_with_timeout(timeout, *patterns, &block)
+    __subscribe(:psubscribe, timeout, patterns, &block)
+  end
+
+  # Without arguments, unsubscribes from every channel.
+  def unsubscribe(*channels)
+    __subscription_send(:unsubscribe, channels)
+  end
+
+  def punsubscribe(*patterns)
+    __subscription_send(:punsubscribe, patterns)
+  end
+
+  def __subscribe(command, timeout, channels)
+    return __subscription_send(command, channels) if subscribed?
+    raise ArgumentError, "#{command} needs a block" unless block_given?
+
+    on = Subscription.new
+    yield on
+    __subscription_loop(command, channels, timeout.to_f, on.callbacks)
+  end
+end
@@ -0,0 +1,13 @@
+class Redis
+  # Runs the commands of the block with their own timeout, raising
+  # Redis::TimeoutError when one of them waits longer than sec seconds.
+  def with_timeout(sec)
+    saved = command_timeout
+    self.command_timeout = sec
+    begin
+      yield self
+    ensure
+      self.command_timeout = saved
+    end
+  end
+end
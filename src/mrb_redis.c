@@ -34,15 +34,23 @@
 #include "mruby/numeric.h"
 #include "mruby/string.h"
 #include "mruby/variable.h"
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <hiredis/hiredis.h>
+#include <hiredis/sds.h>
 #include <mruby/error.h>
 #include <mruby/redis.h>
 #include <mruby/throw.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
 #include "mrb_pointer.h"
 
 #define DONE mrb_gc_arena_restore(mrb, 0);
@@ -69,19 +77,6 @@
   lens[2] = RSTRING_LEN(arg2);                                                                                         \
   lens[3] = RSTRING_LEN(arg3)
 
-typedef struct ReplyHandlingRule {
-  mrb_bool status_to_symbol;
-  mrb_bool integer_to_bool;
-  mrb_bool emptyarray_to_nil;
-  mrb_bool return_exception;
-} ReplyHandlingRule;
-
-#define DEFAULT_REPLY_HANDLING_RULE                                                                                    \
-  {                                                                                                                    \
-    .status_to_symbol = FALSE, .integer_to_bool = FALSE, .emptyarray_to_nil = FALSE, .return_exception = FALSE,        \
-  }
-
-static inline mrb_value mrb_redis_get_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule);
 static inline int mrb_redis_create_command_noarg(mrb_state *mrb, const char *cmd, const char **argv, size_t *lens);
 static inline int mrb_redis_create_command_str(mrb_state *mrb, const char *cmd, const char **argv, size_t *lens);
 static inline int mrb_redis_create_command_int(mrb_state *mrb, const char *cmd, const char **argv, size_t *lens);
@@ -93,298 +88,1395 @@ static inline int mrb_redis_create_command_str_str_int(mrb_state *mrb, const cha
                                                        size_t *lens);
 static inline int mrb_redis_create_command_str_int_int(mrb_state *mrb, const char *cmd, const char **argv,
                                                        size_t *lens);
-static inline int mrb_redis_create_command_str_float_str(mrb_state *mrb, const char *cmd, const char **argv,
-                                                         size_t *lens);
 static inline redisContext *mrb_redis_get_context(mrb_state *mrb, mrb_value self);
 static inline mrb_value mrb_redis_execute_command(mrb_state *mrb, mrb_value self, int argc, const char **argv,
                                                   const size_t *lens, const ReplyHandlingRule *rule);
+static mrb_value mrb_redis_execute_cached(mrb_state *mrb, mrb_value self, enum mrb_redis_cache_kind kind, int argc,
+                                          const char **argv, const size_t *lens, const ReplyHandlingRule *rule);
+
+static mrb_value mrb_redis_execute_variadic(mrb_state *mrb, mrb_value self, const char *cmd, const mrb_value *head,
+                                            mrb_int head_len, const mrb_value *rest, mrb_int rest_len, mrb_int step,
+                                            enum mrb_redis_merge merge, const ReplyHandlingRule *rule);
+static inline mrb_value mrb_redis_scan_option(mrb_state *mrb, mrb_value opts, const char *name);
+
+/*
+ * A borrowed context goes back to its pool as the pool handed it out:
+ * socket timeouts cleared, or marked as broken when it owes replies or
+ * keeps server side state (MULTI, subscriptions, tracking, another db, user
+ * or protocol), so that the pool closes it instead of handing it out again.
+ * Called from the GC free function too: no mruby calls here.
+ */
+static void mrb_redis_scrub_context(mrb_redis_data *data)
+{
+  redisContext *rc = data->rc;
+
+  if (data->queue_counter > 0 || data->scan_pending || data->pipelining || data->subscribed || data->multi ||
+      data->cache || data->session_changed) {
+    rc->err = REDIS_ERR_OTHER;
+  } else if (data->command_timeout > 0) {
+    struct timeval none = {0, 0};
+    if (redisSetTimeout(rc, none) != REDIS_OK) {
+      rc->err = REDIS_ERR_OTHER;
+    }
+  }
+}
+
+static inline void mrb_redis_release_context(mrb_redis_data *data)
+{
+  if (data->rc == NULL) {
+    return;
+  }
+  if (data->pool) {
+    mrb_redis_scrub_context(data);
+    mrb_redis_pool_release(data->pool, data->rc);
+  } else if (!data->shared) {
+    redisFree(data->rc);
+  }
+  data->rc = NULL;
+}
 
 static void redisContext_free(mrb_state *mrb, void *p)
 {
-  redisFree(p);
+  mrb_redis_data *data = (mrb_redis_data *)p;
+
+  if (data) {
+    mrb_redis_release_context(data);
+    mrb_redis_cache_free(mrb, data->cache);
+    mrb_free(mrb, data->reconnect);
+    mrb_redis_sentinel_free(mrb, data->sentinel);
+    mrb_redis_stats_fold(&data->stats);
+    mrb_free(mrb, data->pipeline_rules);
+    mrb_free(mrb, data->argv);
+    mrb_free(mrb, data->argvlen);
+    mrb_free(mrb, data);
+  }
 }
 
 static const struct mrb_data_type redisContext_type = {
     "redisContext", redisContext_free,
 };
 
-static inline void mrb_redis_check_error(redisContext *context, mrb_state *mrb)
-{
-  if (context->err != 0) {
-    if (errno != 0) {
-      mrb_sys_fail(mrb, context->errstr);
-    } else {
-      switch (context->err) {
-      case REDIS_ERR_EOF:
-        mrb_raise(mrb, E_EOF_ERROR, context->errstr);
-        break;
-      case REDIS_ERR_PROTOCOL:
-        mrb_raise(mrb, E_REDIS_ERR_PROTOCOL, context->errstr);
-        break;
-      case REDIS_ERR_OOM:
-        mrb_raise(mrb, E_REDIS_ERR_OOM, context->errstr);
-        break;
-      default:
-        mrb_raise(mrb, E_REDIS_ERROR, context->errstr);
-      }
+/*
+ * Replies of the blocking client are built as mruby objects by the hiredis
+ * reader itself: no redisReply tree is allocated and copied afterwards. The
+ * state lives on the stack of the call reading the reply and reaches the
+ * callbacks through reader->privdata, so a context can move between
+ * mrb_states (Redis::Pool, connect_set_raw) without anything to update.
+ */
+typedef struct mrb_redis_reader_state {
+  mrb_state *mrb;
+  const ReplyHandlingRule *rule;
+  mrb_value root;
+  mrb_value pending_key; /* array_to_hash: the key waiting for its value */
+  mrb_value error;       /* the first error reply met */
+  int ai;                /* arena index right after the root was created */
+  mrb_value *frame;      /* subscriber mode: the elements of the top array land here */
+  mrb_int frame_len;     /* number of elements of that array, -1 for any other reply */
+  mrb_bool push;         /* RESP3: the reply is an out of band push frame */
+  size_t bytes;          /* size of the reply on the wire, for the stats */
+} mrb_redis_reader_state;
+
+/* RESP3 big number: an Integer when it fits, its decimal String otherwise */
+static mrb_value mrb_redis_bignum_value(mrb_state *mrb, const char *str, size_t len)
+{
+  char buf[32], *end;
+  long long v;
+
+  if (len > 0 && len < sizeof(buf)) {
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    errno = 0;
+    v = strtoll(buf, &end, 10);
+    if (errno == 0 && *end == '\0' && FIXABLE(v)) {
+      return mrb_fixnum_value((mrb_int)v);
     }
   }
+  return mrb_str_new(mrb, str, len);
 }
 
-static mrb_value mrb_redis_connect_set_raw(mrb_state *mrb, mrb_value self)
+/* a score as Redis formats it: "1.5", "inf", "-inf" */
+static mrb_value mrb_redis_score_value(mrb_state *mrb, const char *str, size_t len)
 {
-  redisContext *rc;
-  mrb_value host, port;
-  mrb_int timeout = 1;
-  struct timeval timeout_struct = {timeout, 0};
+  char buf[64];
 
-  if (mrb_get_args(mrb, "oo|i", &host, &port, &timeout) == 3) {
-    timeout_struct.tv_sec = timeout;
+  if (len >= sizeof(buf)) {
+    len = sizeof(buf) - 1;
   }
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  return mrb_float_value(mrb, strtod(buf, NULL));
+}
 
-  rc = redisConnectWithTimeout(mrb_str_to_cstr(mrb, host), mrb_fixnum(port), timeout_struct);
-  if (rc->err) {
-    mrb_raise(mrb, E_REDIS_ERROR, "redis connection failed.");
+/* withscores: the scores of a flat [member, score, ...] reply are at odd indexes of the top array */
+static inline mrb_bool mrb_redis_reader_is_score(const redisReadTask *task, const ReplyHandlingRule *rule)
+{
+  if (rule->score_to_float) {
+    return TRUE;
   }
-
-  mrb_udptr_set(mrb, (void *)rc);
-
-  return self;
+  return rule->withscores && task->parent && task->parent->parent == NULL && task->idx % 2 == 1;
 }
 
-static mrb_value mrb_redis_connect(mrb_state *mrb, mrb_value self)
+/* 0 for the reply itself, 1 for its elements... */
+static inline int mrb_redis_reader_depth(const redisReadTask *task)
 {
-  mrb_value host, port;
-  mrb_int timeout = 1;
-  struct timeval timeout_struct = {timeout, 0};
-  mrb_int argc = 0;
+  int depth = 0;
 
-  redisContext *rc = (redisContext *)DATA_PTR(self);
-  if (rc) {
-    redisFree(rc);
+  while (task->parent) {
+    task = task->parent;
+    depth++;
   }
-  DATA_TYPE(self) = &redisContext_type;
-  DATA_PTR(self) = NULL;
+  return depth;
+}
 
-  argc = mrb_get_args(mrb, "|oo|i", &host, &port, &timeout);
+/* a pub/sub frame has at most 4 elements: pmessage, pattern, channel, message */
+#define MRB_REDIS_FRAME_SLOTS 4
 
-  if (argc == 3) {
-    timeout_struct.tv_sec = timeout;
-    rc = redisConnectWithTimeout(mrb_str_to_cstr(mrb, host), mrb_fixnum(port), timeout_struct);
-  } else if (argc == 2) {
-    rc = redisConnectWithTimeout(mrb_str_to_cstr(mrb, host), mrb_fixnum(port), timeout_struct);
-  } else if (argc == 0) {
-    rc = (redisContext *)mrb_udptr_get(mrb);
+/* attaches a new value to its parent, objects are kept alive by the root */
+static void *mrb_redis_reader_attach(const redisReadTask *task, mrb_value v)
+{
+  mrb_redis_reader_state *state = (mrb_redis_reader_state *)task->privdata;
+  mrb_state *mrb = state->mrb;
+  void *obj = (mrb_array_p(v) || mrb_hash_p(v)) ? mrb_ptr(v) : (void *)state;
+
+  if (task->parent == NULL) {
+    state->root = v;
+    state->ai = mrb_gc_arena_save(mrb);
+    return obj;
+  }
+  if (state->frame && task->parent->parent == NULL) {
+    if (task->idx < MRB_REDIS_FRAME_SLOTS) {
+      state->frame[task->idx] = v;
+    }
+    /* the slots are protected by the arena */
+    state->ai = mrb_gc_arena_save(mrb);
+    return obj;
   }
 
-  if (rc->err) {
-    redisFree(rc);
-    mrb_raise(mrb, E_REDIS_ERROR, "redis connection failed.");
+  mrb_value parent = mrb_obj_value(task->parent->obj);
+  if (state->rule->withscores && task->parent->parent == NULL && !mrb_array_p(v)) {
+    /* RESP2 flat [member, score, ...], RESP3 sends the pairs as arrays already */
+    if (task->idx % 2 == 0) {
+      state->pending_key = v;
+      return obj;
+    }
+    mrb_ary_push(mrb, parent, mrb_assoc_new(mrb, state->pending_key, v));
+    mrb_gc_arena_restore(mrb, state->ai);
+    return obj;
+  }
+  if (mrb_hash_p(parent)) {
+    if (task->idx % 2 == 0) {
+      /* protected by the arena until its value comes */
+      state->pending_key = v;
+      return obj;
+    }
+    mrb_hash_set(mrb, parent, state->pending_key, v);
+  } else {
+    mrb_ary_set(mrb, parent, task->idx, v);
   }
+  mrb_gc_arena_restore(mrb, state->ai);
 
-  DATA_PTR(self) = rc;
+  return obj;
+}
 
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "keepalive"), mrb_symbol_value(mrb_intern_lit(mrb, "off")));
+static void *mrb_redis_reader_create_string(const redisReadTask *task, char *str, size_t len)
+{
+  mrb_redis_reader_state *state = (mrb_redis_reader_state *)task->privdata;
+  mrb_state *mrb = state->mrb;
+  const ReplyHandlingRule *rule = state->rule;
+  mrb_value v;
 
-  return self;
+  switch (task->type) {
+  case REDIS_REPLY_STRING:
+#ifdef REDIS_REPLY_MAP
+  case REDIS_REPLY_VERB:
+#endif
+    /* $len CRLF payload CRLF */
+    state->bytes += len + mrb_redis_digits(len) + 5;
+    break;
+  default:
+    /* +line CRLF */
+    state->bytes += len + 3;
+  }
+
+  switch (task->type) {
+  case REDIS_REPLY_STATUS:
+    if (rule->status_to_symbol) {
+      v = mrb_symbol_value(mrb_intern(mrb, str, len));
+    } else {
+      v = mrb_str_new(mrb, str, len);
+    }
+    break;
+  case REDIS_REPLY_ERROR:
+    v = mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, mrb_str_new(mrb, str, len));
+    if (mrb_nil_p(state->error)) {
+      state->error = v;
+    }
+    break;
+#ifdef REDIS_REPLY_MAP
+  case REDIS_REPLY_BIGNUM:
+    v = mrb_redis_bignum_value(mrb, str, len);
+    break;
+  case REDIS_REPLY_VERB:
+    /* "txt:" or "mkd:" comes first */
+    v = len >= 4 ? mrb_str_new(mrb, str + 4, len - 4) : mrb_str_new(mrb, str, len);
+    break;
+#endif
+  default:
+    if (rule->emptystring_to_nil && len == 0) {
+      v = mrb_nil_value();
+    } else if (mrb_redis_reader_is_score(task, rule)) {
+      v = mrb_redis_score_value(mrb, str, len);
+    } else {
+      v = mrb_str_new(mrb, str, len);
+    }
+  }
+
+  return mrb_redis_reader_attach(task, v);
 }
 
-static mrb_value mrb_redis_enable_keepalive(mrb_state *mrb, mrb_value self)
+static void *mrb_redis_reader_create_array(const redisReadTask *task, size_t elements)
 {
-  redisContext *rc = mrb_redis_get_context(mrb, self);
-  errno = 0;
-  if (redisEnableKeepAlive(rc) == REDIS_OK) {
-    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "keepalive"), mrb_symbol_value(mrb_intern_lit(mrb, "on")));
+  mrb_redis_reader_state *state = (mrb_redis_reader_state *)task->privdata;
+  mrb_state *mrb = state->mrb;
+  const ReplyHandlingRule *rule = state->rule;
+  mrb_value v;
+
+  state->bytes += mrb_redis_digits(elements) + 3;
+  if (state->frame && task->parent == NULL) {
+    /* no Array for the frame itself */
+    state->frame_len = elements;
+    return state;
+  }
+#ifdef REDIS_REPLY_PUSH
+  if (task->type == REDIS_REPLY_PUSH && task->parent == NULL) {
+    state->push = TRUE;
+  }
+#endif
+  if (rule->emptyarray_to_nil && elements == 0) {
+    v = mrb_nil_value();
+#ifdef REDIS_REPLY_MAP
+  } else if (task->type == REDIS_REPLY_MAP) {
+    /* elements counts the keys and the values */
+    v = mrb_hash_new_capa(mrb, elements / 2);
+#endif
+  } else if (rule->stream_depth > 0 && mrb_redis_reader_depth(task) == rule->stream_depth) {
+    /* the fields of a stream entry */
+    v = mrb_hash_new_capa(mrb, elements / 2);
+  } else if (rule->array_to_hash && task->parent == NULL) {
+    v = mrb_hash_new_capa(mrb, elements / 2);
+  } else if (rule->withscores && task->parent == NULL) {
+    v = mrb_ary_new_capa(mrb, elements / 2);
   } else {
-    mrb_sys_fail(mrb, rc->errstr);
+    v = mrb_ary_new_capa(mrb, elements);
   }
-  return mrb_nil_value();
+
+  return mrb_redis_reader_attach(task, v);
 }
 
-static mrb_value mrb_redis_keepalive(mrb_state *mrb, mrb_value self)
+static void *mrb_redis_reader_create_integer(const redisReadTask *task, long long value)
 {
-  mrb_redis_get_context(mrb, self); // Check if closed
-  return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "keepalive"));
+  mrb_redis_reader_state *state = (mrb_redis_reader_state *)task->privdata;
+  mrb_value v;
+
+  state->bytes +=
+      mrb_redis_digits(value < 0 ? -(unsigned long long)value : (unsigned long long)value) + (value < 0) + 3;
+  if (state->rule->integer_to_bool)
+    v = mrb_bool_value(value);
+  else if (FIXABLE(value))
+    v = mrb_fixnum_value(value);
+  else
+    v = mrb_float_value(state->mrb, value);
+
+  return mrb_redis_reader_attach(task, v);
 }
 
-static mrb_value mrb_redis_host(mrb_state *mrb, mrb_value self)
+#ifdef REDIS_REPLY_DOUBLE
+static void *mrb_redis_reader_create_double(const redisReadTask *task, double value, char *str, size_t len)
 {
-  redisContext *rc = mrb_redis_get_context(mrb, self);
-  if (rc->connection_type != REDIS_CONN_TCP) {
-    // Never expect to come here since mruby-redis does not support unix socket connection...
-    return mrb_nil_value();
-  }
-  return mrb_str_new_cstr(mrb, rc->tcp.host);
+  mrb_redis_reader_state *state = (mrb_redis_reader_state *)task->privdata;
+  state->bytes += len + 3;
+  return mrb_redis_reader_attach(task, mrb_float_value(state->mrb, value));
 }
 
-static mrb_value mrb_redis_port(mrb_state *mrb, mrb_value self)
+static void *mrb_redis_reader_create_bool(const redisReadTask *task, int value)
 {
-  redisContext *rc = mrb_redis_get_context(mrb, self);
-  if (rc->connection_type != REDIS_CONN_TCP) {
-    // Never expect to come here since mruby-redis does not support unix socket connection...
-    return mrb_nil_value();
-  }
-  return mrb_fixnum_value((mrb_int)(rc->tcp.port));
+  ((mrb_redis_reader_state *)task->privdata)->bytes += 4;
+  return mrb_redis_reader_attach(task, mrb_bool_value(value));
 }
+#endif
 
-static mrb_value mrb_redis_ping(mrb_state *mrb, mrb_value self)
+static void *mrb_redis_reader_create_nil(const redisReadTask *task)
 {
-  const char *argv[1];
-  size_t lens[1];
-  int argc = mrb_redis_create_command_noarg(mrb, "PING", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  /* $-1 CRLF, RESP3 _ CRLF is counted the same */
+  ((mrb_redis_reader_state *)task->privdata)->bytes += 5;
+  return mrb_redis_reader_attach(task, mrb_nil_value());
 }
 
-static mrb_value mrb_redis_auth(mrb_state *mrb, mrb_value self)
+static void mrb_redis_reader_free_object(void *obj)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "AUTH", argv, lens);
-  ReplyHandlingRule rule = {.return_exception = TRUE};
-  mrb_value reply = mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-  if (mrb_exception_p(reply)) {
-    if (mrb_obj_is_instance_of(mrb, reply, E_REDIS_REPLY_ERROR)) {
-      mrb_raisef(mrb, E_REDIS_ERR_AUTH, "incorrect password");
-    } else {
-      mrb_exc_raise(mrb, reply);
-    }
-  }
-  return reply;
+  /* the objects belong to the GC */
 }
 
-static mrb_value mrb_redis_select(mrb_state *mrb, mrb_value self)
+static redisReplyObjectFunctions mrb_redis_reader_functions = {
+    .createString = mrb_redis_reader_create_string,
+    .createArray = mrb_redis_reader_create_array,
+    .createInteger = mrb_redis_reader_create_integer,
+#ifdef REDIS_REPLY_DOUBLE
+    .createDouble = mrb_redis_reader_create_double,
+    .createBool = mrb_redis_reader_create_bool,
+#endif
+    .createNil = mrb_redis_reader_create_nil,
+    .freeObject = mrb_redis_reader_free_object,
+};
+
+static inline void mrb_redis_reader_install(redisContext *rc)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_int(mrb, "SELECT", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  rc->reader->fn = &mrb_redis_reader_functions;
+#ifdef REDIS_OPT_NO_PUSH_AUTOFREE
+  /* the default push handler would call freeReplyObject on our replies */
+  redisSetPushCallback(rc, NULL);
+#endif
 }
 
-static mrb_value mrb_redis_set(mrb_state *mrb, mrb_value self)
+mrb_value mrb_redis_wrap_context(mrb_state *mrb, redisContext *rc, mrb_redis_pool *pool)
 {
-  mrb_value key, val, opt;
-  mrb_bool b = 0;
-  const char *argv[7];
-  size_t lens[7];
-  int c = 3;
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-
-  mrb_get_args(mrb, "SS|H?", &key, &val, &opt, &b);
-
-  CREATE_REDIS_COMMAND_ARG2(argv, lens, "SET", key, val);
-  if (b) {
-    mrb_value ex = mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "EX"));
-    mrb_value px = mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "PX"));
-    mrb_bool nx = mrb_bool(mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "NX")));
-    mrb_bool xx = mrb_bool(mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "XX")));
-
-    if (!mrb_nil_p(ex) && !mrb_nil_p(px)) {
-      mrb_raise(mrb, E_ARGUMENT_ERROR, "Only one of EX or PX can be set");
-    }
-
-    if (nx && xx) {
-      mrb_raise(mrb, E_ARGUMENT_ERROR, "Either NX or XX is true");
-    }
+  mrb_redis_data *data = (mrb_redis_data *)mrb_calloc(mrb, 1, sizeof(mrb_redis_data));
+  mrb_value self;
 
-    if (!mrb_nil_p(ex)) {
-      argv[c] = "EX";
-      lens[c] = strlen("EX");
-      c++;
-      if (mrb_fixnum_p(ex)) {
-        ex = mrb_fixnum_to_str(mrb, ex, 10);
-      }
-      if (!mrb_string_p(ex)) {
-        mrb_raisef(mrb, E_TYPE_ERROR, "EX should be int or str, but %S given", ex);
-      }
-      argv[c] = RSTRING_PTR(ex);
-      lens[c] = RSTRING_LEN(ex);
-      c++;
-    }
+  mrb_redis_reader_install(rc);
+  data->rc = rc;
+  data->pool = pool;
+  data->pushes = mrb_nil_value();
+  self = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_get(mrb, "Redis"), data, &redisContext_type));
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "keepalive"), mrb_symbol_value(mrb_intern_lit(mrb, "off")));
 
-    if (!mrb_nil_p(px)) {
-      argv[c] = "PX";
-      lens[c] = strlen("PX");
-      c++;
-      if (mrb_fixnum_p(px)) {
-        px = mrb_fixnum_to_str(mrb, px, 10);
-      }
-      if (!mrb_string_p(px)) {
-        mrb_raisef(mrb, E_TYPE_ERROR, "PX should be int or str, but %S given", px);
-      }
-      argv[c] = RSTRING_PTR(px);
-      lens[c] = RSTRING_LEN(px);
-      c++;
-    }
+  return self;
+}
 
-    if (nx) {
-      argv[c] = "NX";
-      lens[c] = strlen("NX");
-      c++;
-    }
+static void mrb_redis_scratch_free(mrb_state *mrb, void *p)
+{
+  mrb_free(mrb, p);
+}
 
-    if (xx) {
-      argv[c] = "XX";
-      lens[c] = strlen("XX");
-      c++;
-    }
+static const struct mrb_data_type mrb_redis_scratch_type = {
+    "redisScratch", mrb_redis_scratch_free,
+};
 
-    if (!mrb_hash_empty_p(mrb, opt)) {
-      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown option(s) specified %S (note: only string can be key, not the symbol",
-                 mrb_hash_keys(mrb, opt));
-    }
-  }
+/*
+ * size bytes owned by an object left in the GC arena, collected after the
+ * calling method returns. For the buffers sized by Ruby arguments: no
+ * alloca, and nothing to free when a command raises halfway.
+ */
+void *mrb_redis_scratch(mrb_state *mrb, size_t size)
+{
+  struct RData *holder = mrb_data_object_alloc(mrb, mrb->object_class, NULL, &mrb_redis_scratch_type);
 
-  return mrb_redis_execute_command(mrb, self, c, argv, lens, &rule);
+  holder->data = mrb_malloc(mrb, size ? size : 1);
+  return holder->data;
 }
 
-static mrb_value mrb_redis_get(mrb_state *mrb, mrb_value self)
+/* takes the context away from a Redis checked out of pool, ready to be given back to it */
+redisContext *mrb_redis_detach_context(mrb_state *mrb, mrb_value self, mrb_redis_pool *pool)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "GET", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-}
+  mrb_redis_data *data = (mrb_redis_data *)mrb_data_get_ptr(mrb, self, &redisContext_type);
+  redisContext *rc;
 
-static mrb_value mrb_redis_keys(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "KEYS", argv, lens);
-  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  if (data->pool != pool) {
+    /* its own pool, or nobody, frees it: not this one */
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "connection was not checked out of this pool");
+  }
+  mrb_redis_scrub_context(data);
+  rc = data->rc;
+  mrb_redis_cache_free(mrb, data->cache);
+  data->cache = NULL;
+  data->multi = FALSE;
+  data->rc = NULL;
+  data->pool = NULL;
+  data->scan_pending = FALSE;
+  data->queue_counter = 0;
+  data->pipelining = FALSE;
+  data->pipeline_len = 0;
+  data->subscribed = FALSE;
+  data->subscription_replies = 0;
+  return rc;
 }
 
-static mrb_value mrb_redis_exists(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "EXISTS", argv, lens);
-  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+/*
+ * The context was reconnected: nothing is owed by the new server
+ * connection, and the server side state (tracking, subscriptions) is gone.
+ * The client cache stays, emptied until its tracking is on again.
+ */
+void mrb_redis_reset_context(mrb_state *mrb, mrb_redis_data *data)
+{
+  mrb_redis_reader_install(data->rc);
+  if (data->cache) {
+    mrb_redis_cache_lost(mrb, data->cache);
+  }
+  data->multi = FALSE;
+  data->scan_pending = FALSE;
+  data->queue_counter = 0;
+  data->subscribed = FALSE;
+  data->subscription_replies = 0;
 }
 
-static mrb_value mrb_redis_expire(mrb_state *mrb, mrb_value self)
+static inline void mrb_redis_set_io_error(redisContext *rc, int type, const char *errstr)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_int(mrb, "EXPIRE", argv, lens);
-  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  rc->err = type;
+  snprintf(rc->errstr, sizeof(rc->errstr), "%s", errstr);
 }
 
-static mrb_value mrb_redis_flushdb(mrb_state *mrb, mrb_value self)
+/* a read or a write of the socket gave up after the command timeout */
+static inline mrb_bool mrb_redis_timed_out(redisContext *rc)
 {
-  const char *argv[1];
-  size_t lens[1];
-  int argc = mrb_redis_create_command_noarg(mrb, "FLUSHDB", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+#ifdef REDIS_ERR_TIMEOUT
+  if (rc->err == REDIS_ERR_TIMEOUT) {
+    return TRUE;
+  }
+#endif
+  return rc->err == REDIS_ERR_IO && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT);
 }
 
-static mrb_value mrb_redis_flushall(mrb_state *mrb, mrb_value self)
+static inline void mrb_redis_check_error(redisContext *context, mrb_state *mrb)
+{
+  if (context->err != 0) {
+    if (mrb_redis_timed_out(context)) {
+      /* the late reply would be taken for the reply of the next command */
+      shutdown(context->fd, SHUT_RDWR);
+      mrb_redis_set_io_error(context, REDIS_ERR_EOF, "Connection closed after a timeout");
+      errno = 0;
+      mrb_raise(mrb, E_REDIS_ERR_TIMEOUT, "command timed out");
+    }
+    if (errno != 0) {
+      mrb_sys_fail(mrb, context->errstr);
+    } else {
+      switch (context->err) {
+      case REDIS_ERR_EOF:
+        mrb_raise(mrb, E_EOF_ERROR, context->errstr);
+        break;
+      case REDIS_ERR_PROTOCOL:
+        mrb_raise(mrb, E_REDIS_ERR_PROTOCOL, context->errstr);
+        break;
+      case REDIS_ERR_OOM:
+        mrb_raise(mrb, E_REDIS_ERR_OOM, context->errstr);
+        break;
+      default:
+        mrb_raise(mrb, E_REDIS_ERROR, context->errstr);
+      }
+    }
+  }
+}
+
+/* writes the decimal n ending just before end, returns where it starts */
+static inline char *mrb_redis_format_size(char *end, size_t n)
+{
+  do {
+    *--end = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  return end;
+}
+
+/* writes prefix n "\r\n", returns the end */
+static inline char *mrb_redis_format_line(char *p, char prefix, size_t n)
+{
+  size_t digits = mrb_redis_digits(n);
+
+  *p++ = prefix;
+  mrb_redis_format_size(p + digits, n);
+  p += digits;
+  *p++ = '\r';
+  *p++ = '\n';
+  return p;
+}
+
+/* size of the RESP frame of a command, see mrb_redis_format_frame */
+size_t mrb_redis_frame_size(const mrb_redis_command *compiled, int argc, const size_t *lens)
+{
+  size_t total, i;
+
+  if (compiled && compiled->arity >= 0) {
+    total = compiled->header_len;
+  } else {
+    total = 3 + mrb_redis_digits(argc);
+    total += compiled ? compiled->header_len : 5 + mrb_redis_digits(lens[0]) + lens[0];
+  }
+  for (i = 1; i < (size_t)argc; i++) {
+    total += 5 + mrb_redis_digits(lens[i]) + lens[i];
+  }
+  return total;
+}
+
+/*
+ * Writes the RESP frame of a command at p, which has room for
+ * mrb_redis_frame_size bytes, and returns its end. The head of a command
+ * compiled by Redis::Command ("*N\r\n$len\r\nNAME\r\n", or its name
+ * part when the arity is not fixed) is copied as is.
+ */
+char *mrb_redis_format_frame(char *p, const mrb_redis_command *compiled, int argc, const char **argv,
+                             const size_t *lens)
+{
+  int i;
+
+  if (compiled && compiled->arity >= 0) {
+    memcpy(p, compiled->header, compiled->header_len);
+    p += compiled->header_len;
+  } else {
+    p = mrb_redis_format_line(p, '*', argc);
+    if (compiled) {
+      memcpy(p, compiled->header, compiled->header_len);
+      p += compiled->header_len;
+    } else {
+      p = mrb_redis_format_line(p, '$', lens[0]);
+      memcpy(p, argv[0], lens[0]);
+      p += lens[0];
+      *p++ = '\r';
+      *p++ = '\n';
+    }
+  }
+  for (i = 1; i < argc; i++) {
+    p = mrb_redis_format_line(p, '$', lens[i]);
+    memcpy(p, argv[i], lens[i]);
+    p += lens[i];
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  return p;
+}
+
+/*
+ * Formats a command straight into the output buffer of the context: its
+ * size is known beforehand, so the frame is written in one pass, without
+ * the intermediate buffer of redisFormatCommandArgv.
+ */
+static int mrb_redis_format_command(redisContext *rc, const mrb_redis_command *compiled, int argc, const char **argv,
+                                    const size_t *lens)
+{
+  size_t total = mrb_redis_frame_size(compiled, argc, lens);
+  sds obuf = sdsMakeRoomFor(rc->obuf, total);
+
+  if (obuf == NULL) {
+    errno = 0;
+    mrb_redis_set_io_error(rc, REDIS_ERR_OOM, "Out of memory");
+    return REDIS_ERR;
+  }
+  rc->obuf = obuf;
+  mrb_redis_format_frame(obuf + sdslen(obuf), compiled, argc, argv, lens);
+  sdsIncrLen(obuf, (int)total);
+
+  return REDIS_OK;
+}
+
+/* appends a command to the output buffer, returns its entry in the stats */
+static inline int mrb_redis_append(mrb_state *mrb, mrb_redis_data *data, int argc, const char **argv,
+                                   const size_t *lens)
+{
+  const mrb_redis_command *compiled = data->compiled;
+
+  /* the compiled head only applies to the command of Redis::Command#call, not to a health check before it */
+  if (compiled && (argv[0] != compiled->name || (compiled->arity >= 0 && argc != compiled->arity + 1))) {
+    compiled = NULL;
+  }
+  if (mrb_redis_format_command(data->rc, compiled, argc, argv, lens) != REDIS_OK) {
+    mrb_redis_check_error(data->rc, mrb);
+  }
+  return mrb_redis_stats_count(&data->stats, argc, argv, lens);
+}
+
+static inline void mrb_redis_reader_begin(mrb_state *mrb, redisContext *rc, mrb_redis_reader_state *state,
+                                          const ReplyHandlingRule *rule)
+{
+  state->mrb = mrb;
+  state->rule = rule;
+  state->root = mrb_nil_value();
+  state->pending_key = mrb_nil_value();
+  state->error = mrb_nil_value();
+  state->ai = mrb_gc_arena_save(mrb);
+  state->frame = NULL;
+  state->frame_len = -1;
+  state->push = FALSE;
+  state->bytes = 0;
+  rc->reader->privdata = state;
+}
+
+/* reads exactly len bytes from the socket, bypassing the reader buffer */
+/*
+ * Redis#command_timeout is the SO_RCVTIMEO/SO_SNDTIMEO of the socket, which
+ * bounds each read or write, not the whole command: a reply trickling in
+ * would go on for long. Each read or write after the first one of a reply
+ * waits at most for what is left until the deadline of the command.
+ */
+typedef struct mrb_redis_deadline {
+  uint64_t at;  /* usec of mrb_redis_stats_clock, 0 without command_timeout */
+  mrb_bool cut; /* the socket timeout was lowered, to be set back */
+} mrb_redis_deadline;
+
+static inline void mrb_redis_deadline_begin(mrb_redis_data *data, mrb_redis_deadline *deadline)
+{
+  deadline->at = data->command_timeout > 0 ? mrb_redis_stats_clock() + (uint64_t)(data->command_timeout * 1e6) : 0;
+  deadline->cut = FALSE;
+}
+
+static int mrb_redis_deadline_cut(redisContext *rc, mrb_redis_deadline *deadline)
+{
+  uint64_t now;
+
+  if (deadline == NULL || deadline->at == 0) {
+    return REDIS_OK;
+  }
+  now = mrb_redis_stats_clock();
+  if (now >= deadline->at) {
+    errno = ETIMEDOUT;
+    mrb_redis_set_io_error(rc, REDIS_ERR_IO, "Command timed out");
+    return REDIS_ERR;
+  }
+  deadline->cut = TRUE;
+  return redisSetTimeout(rc, mrb_redis_timeval((deadline->at - now) / 1e6));
+}
+
+/* the socket timeout back to command_timeout for the next command */
+static inline void mrb_redis_deadline_end(mrb_state *mrb, mrb_redis_data *data, mrb_redis_deadline *deadline)
+{
+  if (deadline->cut && data->rc->err == 0) {
+    mrb_redis_set_command_timeout(mrb, data, data->command_timeout);
+  }
+}
+
+static int mrb_redis_read_full(redisContext *rc, char *p, size_t len, mrb_redis_deadline *deadline)
+{
+  while (len > 0) {
+    ssize_t nread;
+
+    if (mrb_redis_deadline_cut(rc, deadline) != REDIS_OK) {
+      return REDIS_ERR;
+    }
+    nread = read(rc->fd, p, len);
+    if (nread > 0) {
+      p += nread;
+      len -= nread;
+    } else if (nread == 0) {
+      errno = 0;
+      mrb_redis_set_io_error(rc, REDIS_ERR_EOF, "Server closed the connection");
+      return REDIS_ERR;
+    } else if (errno != EINTR) {
+      mrb_redis_set_io_error(rc, REDIS_ERR_IO, strerror(errno));
+      return REDIS_ERR;
+    }
+  }
+  return REDIS_OK;
+}
+
+/*
+ * The zero copy path reads and moves the reader buffer of hiredis itself
+ * (buf, pos, len, ridx, reply): only with the versions whose redisReader is
+ * known to be laid out and used that way, from v0.13 (the Darwin build) to
+ * 1.x. With any other, zero_copy_threshold is ignored.
+ */
+#if HIREDIS_MAJOR == 1 || (HIREDIS_MAJOR == 0 && HIREDIS_MINOR >= 13)
+#define MRB_REDIS_ZERO_COPY 1
+#endif
+
+/*
+ * A top-level bulk string of zero_copy_threshold bytes or more is not
+ * accumulated in the reader buffer: the payload goes from the socket
+ * straight into a preallocated RString. Returns FALSE when the next reply
+ * is something else, or when the rule would make the bulk string something
+ * else than a String (a score...): it is then left to the reader.
+ */
+static mrb_bool mrb_redis_read_large_bulk(mrb_state *mrb, mrb_redis_data *data, const ReplyHandlingRule *rule,
+                                          mrb_redis_deadline *deadline, mrb_value *out)
+{
+#ifdef MRB_REDIS_ZERO_COPY
+  redisContext *rc = data->rc;
+  redisReader *r = rc->reader;
+  const char *p, *crlf;
+  char *endp, tail[2];
+  long long len;
+  size_t avail, copied;
+  int done = 0;
+  mrb_value str;
+
+  if (r->ridx != -1 || r->reply != NULL) {
+    /* a reply is half parsed */
+    return FALSE;
+  }
+  if (rule->score_to_float || rule->emptystring_to_nil) {
+    /* converted by mrb_redis_reader_create_string */
+    return FALSE;
+  }
+
+  do {
+    if (redisBufferWrite(rc, &done) == REDIS_ERR) {
+      return FALSE;
+    }
+  } while (!done);
+  if (r->pos == r->len && redisBufferRead(rc) == REDIS_ERR) {
+    return FALSE;
+  }
+
+  p = r->buf + r->pos;
+  avail = r->len - r->pos;
+  if (avail < 4 || *p != '$' || (crlf = mrb_redis_find_crlf(p, avail < 24 ? avail : 24)) == NULL) {
+    return FALSE;
+  }
+  len = strtoll(p + 1, &endp, 10);
+  if (endp != crlf || len < 0 || (size_t)len < data->zero_copy_threshold) {
+    return FALSE;
+  }
+
+  str = mrb_str_buf_new(mrb, len);
+  mrb_str_resize(mrb, str, len);
+
+  /* the beginning of the payload may already be in the reader buffer */
+  r->pos += crlf + 2 - p;
+  data->stats.bytes_read += (crlf + 2 - p) + len + 2;
+  avail = r->len - r->pos;
+  copied = avail < (size_t)len ? avail : (size_t)len;
+  memcpy(RSTRING_PTR(str), r->buf + r->pos, copied);
+  r->pos += copied;
+  avail -= copied;
+
+  if (mrb_redis_read_full(rc, RSTRING_PTR(str) + copied, len - copied, deadline) == REDIS_ERR) {
+    mrb_redis_check_error(rc, mrb);
+  }
+  /* trailing CRLF */
+  if (avail >= 2) {
+    r->pos += 2;
+  } else {
+    r->pos += avail;
+    if (mrb_redis_read_full(rc, tail, 2 - avail, deadline) == REDIS_ERR) {
+      mrb_redis_check_error(rc, mrb);
+    }
+  }
+
+  *out = str;
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* redisGetReply, the reads and writes after the first one bounded by the deadline */
+static int mrb_redis_get_reply_by(redisContext *rc, mrb_redis_deadline *deadline, void **reply)
+{
+  int done = 0, ios = 0;
+
+  if (deadline == NULL || deadline->at == 0) {
+    return redisGetReply(rc, reply);
+  }
+  if (redisGetReplyFromReader(rc, reply) != REDIS_OK) {
+    return REDIS_ERR;
+  }
+  if (*reply != NULL) {
+    return REDIS_OK;
+  }
+  do {
+    if ((ios++ > 0 && mrb_redis_deadline_cut(rc, deadline) != REDIS_OK) || redisBufferWrite(rc, &done) != REDIS_OK) {
+      return REDIS_ERR;
+    }
+  } while (!done);
+  do {
+    if ((ios++ > 0 && mrb_redis_deadline_cut(rc, deadline) != REDIS_OK) || redisBufferRead(rc) != REDIS_OK ||
+        redisGetReplyFromReader(rc, reply) != REDIS_OK) {
+      return REDIS_ERR;
+    }
+  } while (*reply == NULL);
+  return REDIS_OK;
+}
+
+/* runs redisGetReply with the reader functions writing into state */
+static void mrb_redis_reader_run(mrb_state *mrb, redisContext *rc, mrb_redis_reader_state *state,
+                                 mrb_redis_deadline *deadline)
+{
+  void *reply = NULL;
+  int ret = REDIS_ERR;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  rc->reader->privdata = state;
+  errno = 0;
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    ret = mrb_redis_get_reply_by(rc, deadline, &reply);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    /* a callback raised (NoMemoryError): the half parsed reply can't be resumed */
+    rc->reader->privdata = NULL;
+    rc->reader->err = REDIS_ERR_PROTOCOL;
+    rc->err = REDIS_ERR_OTHER;
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+  rc->reader->privdata = NULL;
+  if (ret != REDIS_OK || reply == NULL) {
+    mrb_redis_check_error(rc, mrb);
+    mrb_raise(mrb, E_REDIS_ERROR, "no reply");
+  }
+}
+
+/*
+ * Reads the next reply of the connection, converted by the reader
+ * functions. RESP3 push frames met on the way are queued for the handler
+ * set by Redis#on_push (dropped without one) and the reading goes on. The
+ * first error reply found in it is stored in *error, nothing is raised for
+ * it.
+ */
+static mrb_value mrb_redis_read_reply_ex(mrb_state *mrb, mrb_redis_data *data, const ReplyHandlingRule *rule,
+                                         mrb_value *error)
+{
+  mrb_redis_reader_state state;
+  mrb_redis_deadline deadline;
+  mrb_value large;
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_redis_deadline_begin(data, &deadline);
+  for (;;) {
+    if (data->zero_copy_threshold > 0 && mrb_redis_read_large_bulk(mrb, data, rule, &deadline, &large)) {
+      mrb_redis_deadline_end(mrb, data, &deadline);
+      *error = mrb_nil_value();
+      return large;
+    }
+
+    mrb_redis_reader_begin(mrb, data->rc, &state, rule);
+    mrb_redis_reader_run(mrb, data->rc, &state, &deadline);
+    data->stats.bytes_read += state.bytes;
+    if (!state.push) {
+      break;
+    }
+    if (mrb_array_p(data->pushes)) {
+      mrb_ary_push(mrb, data->pushes, state.root);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_redis_deadline_end(mrb, data, &deadline);
+
+  if (rule->first_element && mrb_array_p(state.root)) {
+    /* here rather than in the method, so that pipelined gets the same value */
+    state.root = RARRAY_LEN(state.root) > 0 ? RARRAY_PTR(state.root)[0] : mrb_nil_value();
+  }
+  *error = state.error;
+  return state.root;
+}
+
+static mrb_value mrb_redis_read_reply(mrb_state *mrb, mrb_redis_data *data, const ReplyHandlingRule *rule)
+{
+  mrb_value error, reply = mrb_redis_read_reply_ex(mrb, data, rule, &error);
+
+  if (!rule->return_exception && !mrb_nil_p(error)) {
+    mrb_exc_raise(mrb, error);
+  }
+  return reply;
+}
+
+/*
+ * Subscriber mode: reads the next pushed frame into MRB_REDIS_FRAME_SLOTS
+ * values instead of an Array. Waits at most timeout seconds (0 waits
+ * forever) for the server, returns FALSE when nothing came in time.
+ */
+static mrb_bool mrb_redis_read_frame(mrb_state *mrb, mrb_redis_data *data, mrb_value *frame, mrb_int *len,
+                                     double timeout)
+{
+  redisContext *rc = data->rc;
+  redisReader *r = rc->reader;
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  mrb_redis_reader_state state;
+  mrb_int i;
+
+  if (r->pos == r->len && r->ridx == -1) {
+    /*
+     * nothing buffered: wait for the socket, the pending commands are written
+     * first. Waiting here rather than in read(2) keeps the command timeout
+     * of the socket out of it.
+     */
+    struct pollfd pfd;
+    int done = 0, ret;
+
+    do {
+      if (redisBufferWrite(rc, &done) == REDIS_ERR) {
+        mrb_redis_check_error(rc, mrb);
+      }
+    } while (!done);
+    pfd.fd = rc->fd;
+    pfd.events = POLLIN;
+    do {
+      ret = poll(&pfd, 1, timeout <= 0 ? -1 : timeout > INT_MAX / 1000 ? INT_MAX : (int)(timeout * 1000));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+      mrb_redis_set_io_error(rc, REDIS_ERR_IO, strerror(errno));
+      mrb_redis_check_error(rc, mrb);
+    }
+    if (ret == 0) {
+      return FALSE;
+    }
+  }
+
+  for (i = 0; i < MRB_REDIS_FRAME_SLOTS; i++) {
+    frame[i] = mrb_nil_value();
+  }
+  mrb_redis_reader_begin(mrb, rc, &state, &rule);
+  state.frame = frame;
+  mrb_redis_reader_run(mrb, rc, &state, NULL);
+  data->stats.bytes_read += state.bytes;
+  if (state.frame_len < 0) {
+    if (mrb_exception_p(state.root)) {
+      mrb_exc_raise(mrb, state.root);
+    }
+    mrb_raise(mrb, E_REDIS_ERR_PROTOCOL, "unexpected reply in subscriber mode");
+  }
+  *len = state.frame_len < MRB_REDIS_FRAME_SLOTS ? state.frame_len : MRB_REDIS_FRAME_SLOTS;
+
+  return TRUE;
+}
+
+/* seconds given as Integer or Float */
+double mrb_redis_seconds(mrb_state *mrb, mrb_value sec)
+{
+  double d = mrb_to_flo(mrb, sec);
+
+  if (d < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "timeout should not be negative");
+  }
+  return d;
+}
+
+struct timeval mrb_redis_timeval(double sec)
+{
+  struct timeval tv;
+
+  tv.tv_sec = (time_t)sec;
+  tv.tv_usec = (suseconds_t)((sec - (double)tv.tv_sec) * 1000000);
+  return tv;
+}
+
+/*
+ * (host, port[, timeout][, opts]) or ({path: "/path/to/redis.sock"[, timeout: sec]}),
+ * the latter connects through a unix domain socket. timeout is in seconds,
+ * 0.05 for 50 msec.
+ */
+static redisContext *mrb_redis_connect_with_args(mrb_state *mrb, mrb_value *argv, mrb_int argc)
+{
+  struct timeval timeout_struct = {1, 0};
+
+  if (argc >= 3 && mrb_hash_p(argv[argc - 1])) {
+    /* options, see mrb_redis_connect */
+    argc--;
+  }
+
+  if (argc == 1 && mrb_hash_p(argv[0])) {
+    mrb_value path = mrb_hash_get(mrb, argv[0], mrb_symbol_value(mrb_intern_lit(mrb, "path")));
+    mrb_value timeout = mrb_hash_get(mrb, argv[0], mrb_symbol_value(mrb_intern_lit(mrb, "timeout")));
+
+    if (mrb_nil_p(path)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "path is required");
+    }
+    if (!mrb_nil_p(timeout)) {
+      timeout_struct = mrb_redis_timeval(mrb_redis_seconds(mrb, timeout));
+    }
+    return redisConnectUnixWithTimeout(mrb_str_to_cstr(mrb, path), timeout_struct);
+  }
+
+  if (argc != 2 && argc != 3) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
+  }
+  if (argc == 3) {
+    timeout_struct = mrb_redis_timeval(mrb_redis_seconds(mrb, argv[2]));
+  }
+  return redisConnectWithTimeout(mrb_str_to_cstr(mrb, argv[0]), mrb_fixnum(argv[1]), timeout_struct);
+}
+
+/*
+ * Switches the connection to RESP3. The reader functions know the RESP3
+ * types: maps come as Hash, doubles as Float, booleans as true/false.
+ */
+static void mrb_redis_hello(mrb_state *mrb, mrb_value self, mrb_redis_data *data, mrb_int protocol)
+{
+  const char *argv[] = {"HELLO", "3"};
+  size_t lens[] = {5, 1};
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  if (protocol != 3) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "protocol should be 2 or 3");
+  }
+#ifndef REDIS_REPLY_MAP
+  mrb_raise(mrb, E_NOTIMP_ERROR, "RESP3 needs hiredis 1.0.0 or later");
+#endif
+  mrb_redis_execute_command(mrb, self, 2, argv, lens, &rule);
+  data->protocol = 3;
+  data->session_changed = TRUE;
+}
+
+static mrb_value mrb_redis_connect_set_raw(mrb_state *mrb, mrb_value self)
+{
+  redisContext *rc;
+  mrb_value *argv;
+  mrb_int argc;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  rc = mrb_redis_connect_with_args(mrb, argv, argc);
+  if (rc == NULL || rc->err) {
+    if (rc) {
+      redisFree(rc);
+    }
+    mrb_raise(mrb, E_REDIS_ERROR, "redis connection failed.");
+  }
+
+  mrb_redis_reader_install(rc);
+  mrb_udptr_set(mrb, (void *)rc);
+
+  return self;
+}
+
+static mrb_value mrb_redis_connect(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *argv;
+  mrb_int argc = 0;
+  mrb_redis_data *data;
+  redisContext *rc = NULL;
+
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data) {
+    redisContext_free(mrb, data);
+  }
+  DATA_TYPE(self) = &redisContext_type;
+  DATA_PTR(self) = NULL;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+
+  if (argc == 0) {
+    rc = (redisContext *)mrb_udptr_get(mrb);
+  } else {
+    rc = mrb_redis_connect_with_args(mrb, argv, argc);
+  }
+
+  if (rc == NULL || rc->err) {
+    mrb_bool timed_out = rc && mrb_redis_timed_out(rc);
+    if (rc && argc != 0) {
+      redisFree(rc);
+    }
+    if (timed_out) {
+      mrb_raise(mrb, E_REDIS_ERR_TIMEOUT, "redis connection timed out.");
+    }
+    mrb_raise(mrb, E_REDIS_ERROR, "redis connection failed.");
+  }
+
+  mrb_redis_reader_install(rc);
+  data = (mrb_redis_data *)mrb_calloc(mrb, 1, sizeof(mrb_redis_data));
+  data->rc = rc;
+  /* the context set by connect_set_raw is shared by every mrb_state */
+  data->shared = (argc == 0);
+  data->pushes = mrb_nil_value();
+  DATA_PTR(self) = data;
+
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "keepalive"), mrb_symbol_value(mrb_intern_lit(mrb, "off")));
+
+  if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+    mrb_value protocol = mrb_hash_get(mrb, argv[argc - 1], mrb_symbol_value(mrb_intern_lit(mrb, "protocol")));
+    mrb_value command_timeout =
+        mrb_hash_get(mrb, argv[argc - 1], mrb_symbol_value(mrb_intern_lit(mrb, "command_timeout")));
+    if (!mrb_nil_p(command_timeout)) {
+      mrb_redis_set_command_timeout(mrb, data, mrb_redis_seconds(mrb, command_timeout));
+    }
+    if (!mrb_nil_p(protocol) && mrb_fixnum(mrb_to_int(mrb, protocol)) != 2) {
+      mrb_redis_hello(mrb, self, data, mrb_fixnum(mrb_to_int(mrb, protocol)));
+    }
+  }
+
+  return self;
+}
+
+static mrb_value mrb_redis_enable_keepalive(mrb_state *mrb, mrb_value self)
+{
+  redisContext *rc = mrb_redis_get_context(mrb, self);
+  errno = 0;
+  if (redisEnableKeepAlive(rc) == REDIS_OK) {
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "keepalive"), mrb_symbol_value(mrb_intern_lit(mrb, "on")));
+  } else {
+    mrb_sys_fail(mrb, rc->errstr);
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value mrb_redis_keepalive(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_get_context(mrb, self); // Check if closed
+  return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "keepalive"));
+}
+
+/* SO_RCVTIMEO and SO_SNDTIMEO of the socket, lowered to the deadline of a reply as it comes; 0 waits forever */
+void mrb_redis_set_command_timeout(mrb_state *mrb, mrb_redis_data *data, double sec)
+{
+  errno = 0;
+  if (redisSetTimeout(data->rc, mrb_redis_timeval(sec)) != REDIS_OK) {
+    mrb_redis_check_error(data->rc, mrb);
+  }
+  data->command_timeout = sec;
+}
+
+static mrb_value mrb_redis_set_command_timeout_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value sec;
+
+  mrb_get_args(mrb, "o", &sec);
+  mrb_redis_get_context(mrb, self);
+  mrb_redis_set_command_timeout(mrb, (mrb_redis_data *)DATA_PTR(self),
+                                mrb_nil_p(sec) ? 0 : mrb_redis_seconds(mrb, sec));
+
+  return sec;
+}
+
+static mrb_value mrb_redis_command_timeout(mrb_state *mrb, mrb_value self)
+{
+  double sec;
+
+  mrb_redis_get_context(mrb, self);
+  sec = ((mrb_redis_data *)DATA_PTR(self))->command_timeout;
+
+  return sec > 0 ? mrb_float_value(mrb, sec) : mrb_nil_value();
+}
+
+static mrb_value mrb_redis_set_zero_copy_threshold(mrb_state *mrb, mrb_value self)
+{
+  mrb_int threshold;
+  mrb_redis_data *data;
+
+  mrb_get_args(mrb, "i", &threshold);
+  if (threshold < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "threshold should not be negative");
+  }
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  data->zero_copy_threshold = (size_t)threshold;
+
+  return mrb_fixnum_value(threshold);
+}
+
+static mrb_value mrb_redis_zero_copy_threshold(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_get_context(mrb, self);
+  return mrb_fixnum_value(((mrb_redis_data *)DATA_PTR(self))->zero_copy_threshold);
+}
+
+static mrb_value mrb_redis_set_command_chunk_size(mrb_state *mrb, mrb_value self)
+{
+  mrb_int size;
+
+  mrb_get_args(mrb, "i", &size);
+  if (size < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "chunk size should not be negative");
+  }
+  mrb_redis_get_context(mrb, self);
+  ((mrb_redis_data *)DATA_PTR(self))->command_chunk_size = size;
+
+  return mrb_fixnum_value(size);
+}
+
+static mrb_value mrb_redis_command_chunk_size(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_get_context(mrb, self);
+  return mrb_fixnum_value(((mrb_redis_data *)DATA_PTR(self))->command_chunk_size);
+}
+
+static mrb_value mrb_redis_host(mrb_state *mrb, mrb_value self)
+{
+  redisContext *rc = mrb_redis_get_context(mrb, self);
+  if (rc->connection_type != REDIS_CONN_TCP) {
+    // connected through a unix socket, see Redis#path
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, rc->tcp.host);
+}
+
+static mrb_value mrb_redis_port(mrb_state *mrb, mrb_value self)
+{
+  redisContext *rc = mrb_redis_get_context(mrb, self);
+  if (rc->connection_type != REDIS_CONN_TCP) {
+    // connected through a unix socket, see Redis#path
+    return mrb_nil_value();
+  }
+  return mrb_fixnum_value((mrb_int)(rc->tcp.port));
+}
+
+static mrb_value mrb_redis_path(mrb_state *mrb, mrb_value self)
+{
+  redisContext *rc = mrb_redis_get_context(mrb, self);
+  if (rc->connection_type != REDIS_CONN_UNIX) {
+    return mrb_nil_value();
+  }
+  return mrb_str_new_cstr(mrb, rc->unix_sock.path);
+}
+
+static mrb_value mrb_redis_ping(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[1];
+  size_t lens[1];
+  int argc = mrb_redis_create_command_noarg(mrb, "PING", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_auth(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "AUTH", argv, lens);
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+  mrb_value reply = mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  if (mrb_exception_p(reply)) {
+    if (mrb_obj_is_instance_of(mrb, reply, E_REDIS_REPLY_ERROR)) {
+      mrb_raisef(mrb, E_REDIS_ERR_AUTH, "incorrect password");
+    } else {
+      mrb_exc_raise(mrb, reply);
+    }
+  }
+  /* sent again after a reconnect */
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "password"), mrb_str_new(mrb, argv[1], lens[1]));
+  ((mrb_redis_data *)DATA_PTR(self))->session_changed = TRUE;
+  return reply;
+}
+
+static mrb_value mrb_redis_select(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_int(mrb, "SELECT", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  mrb_value reply = mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+
+  /* sent again after a reconnect */
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "db"), mrb_str_new(mrb, argv[1], lens[1]));
+  ((mrb_redis_data *)DATA_PTR(self))->session_changed = TRUE;
+  return reply;
+}
+
+static mrb_value mrb_redis_set(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key, val, opt;
+  mrb_bool b = 0;
+  const char *argv[7];
+  size_t lens[7];
+  int c = 3;
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  mrb_get_args(mrb, "SS|H?", &key, &val, &opt, &b);
+
+  CREATE_REDIS_COMMAND_ARG2(argv, lens, "SET", key, val);
+  if (b) {
+    mrb_value ex = mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "EX"));
+    mrb_value px = mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "PX"));
+    mrb_bool nx = mrb_bool(mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "NX")));
+    mrb_bool xx = mrb_bool(mrb_hash_delete_key(mrb, opt, mrb_str_new_cstr(mrb, "XX")));
+
+    if (!mrb_nil_p(ex) && !mrb_nil_p(px)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "Only one of EX or PX can be set");
+    }
+
+    if (nx && xx) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "Either NX or XX is true");
+    }
+
+    if (!mrb_nil_p(ex)) {
+      argv[c] = "EX";
+      lens[c] = strlen("EX");
+      c++;
+      if (mrb_fixnum_p(ex)) {
+        ex = mrb_fixnum_to_str(mrb, ex, 10);
+      }
+      if (!mrb_string_p(ex)) {
+        mrb_raisef(mrb, E_TYPE_ERROR, "EX should be int or str, but %S given", ex);
+      }
+      argv[c] = RSTRING_PTR(ex);
+      lens[c] = RSTRING_LEN(ex);
+      c++;
+    }
+
+    if (!mrb_nil_p(px)) {
+      argv[c] = "PX";
+      lens[c] = strlen("PX");
+      c++;
+      if (mrb_fixnum_p(px)) {
+        px = mrb_fixnum_to_str(mrb, px, 10);
+      }
+      if (!mrb_string_p(px)) {
+        mrb_raisef(mrb, E_TYPE_ERROR, "PX should be int or str, but %S given", px);
+      }
+      argv[c] = RSTRING_PTR(px);
+      lens[c] = RSTRING_LEN(px);
+      c++;
+    }
+
+    if (nx) {
+      argv[c] = "NX";
+      lens[c] = strlen("NX");
+      c++;
+    }
+
+    if (xx) {
+      argv[c] = "XX";
+      lens[c] = strlen("XX");
+      c++;
+    }
+
+    if (!mrb_hash_empty_p(mrb, opt)) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown option(s) specified %S (note: only string can be key, not the symbol",
+                 mrb_hash_keys(mrb, opt));
+    }
+  }
+
+  return mrb_redis_execute_command(mrb, self, c, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_get(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "GET", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_cached(mrb, self, MRB_REDIS_CACHE_STRING, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_keys(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "KEYS", argv, lens);
+  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_exists(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "EXISTS", argv, lens);
+  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_expire(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_int(mrb, "EXPIRE", argv, lens);
+  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_flushdb(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[1];
+  size_t lens[1];
+  int argc = mrb_redis_create_command_noarg(mrb, "FLUSHDB", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_flushall(mrb_state *mrb, mrb_value self)
 {
   const char *argv[1];
   size_t lens[1];
@@ -393,805 +1485,1752 @@ static mrb_value mrb_redis_flushall(mrb_state *mrb, mrb_value self)
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_randomkey(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_randomkey(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[1];
+  size_t lens[1];
+  int argc = mrb_redis_create_command_noarg(mrb, "RANDOMKEY", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_del(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "DEL", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_incr(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "INCR", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_decr(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "DECR", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_incrby(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_int(mrb, "INCRBY", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_decrby(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_int(mrb, "DECRBY", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_llen(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "LLEN", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_rpush(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "RPUSH", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_lpush(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "LPUSH", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_rpop(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "RPOP", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_lpop(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "LPOP", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_lrange(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[4];
+  size_t lens[4];
+  int argc = mrb_redis_create_command_str_int_int(mrb, "LRANGE", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_ltrim(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[4];
+  size_t lens[4];
+  int argc = mrb_redis_create_command_str_int_int(mrb, "LTRIM", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_lindex(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_int(mrb, "LINDEX", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_sadd(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key, *members;
+  mrb_int members_len;
+
+  mrb_get_args(mrb, "o*", &key, &members, &members_len);
+  if (members_len == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too few arguments");
+  }
+
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_variadic(mrb, self, "SADD", &key, 1, members, members_len, 1, MERGE_SUM, &rule);
+}
+
+static mrb_value mrb_redis_srem(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key, *members;
+  mrb_int members_len;
+
+  mrb_get_args(mrb, "o*", &key, &members, &members_len);
+  if (members_len < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
+  }
+
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_variadic(mrb, self, "SREM", &key, 1, members, members_len, 1, MERGE_SUM, &rule);
+}
+
+static mrb_value mrb_redis_sismember(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "SISMEMBER", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_smembers(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "SMEMBERS", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_scard(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "SCARD", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_spop(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "SPOP", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hset(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[4];
+  size_t lens[4];
+  int argc = mrb_redis_create_command_str_str_str(mrb, "HSET", argv, lens);
+  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hsetnx(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[4];
+  size_t lens[4];
+  int argc = mrb_redis_create_command_str_str_str(mrb, "HSETNX", argv, lens);
+  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hget(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "HGET", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_cached(mrb, self, MRB_REDIS_CACHE_FIELD, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hgetall(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "HGETALL", argv, lens);
+  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE, .array_to_hash = TRUE};
+  return mrb_redis_execute_cached(mrb, self, MRB_REDIS_CACHE_HASH, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hdel(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "HDEL", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hexists(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "HEXISTS", argv, lens);
+  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hkeys(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "HKEYS", argv, lens);
+  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hmget(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *mrb_argv, reply;
+  mrb_int argc = 0, head_len;
+  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE, .emptystring_to_nil = TRUE, .return_exception = TRUE};
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+  head_len = argc > 0 ? 1 : 0;
+  reply = mrb_redis_execute_variadic(mrb, self, "HMGET", mrb_argv, head_len, mrb_argv + head_len, argc - head_len, 1,
+                                     MERGE_ARRAY, &rule);
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, mrb_exc_new_str(mrb, E_ARGUMENT_ERROR, mrb_funcall(mrb, reply, "message", 0)));
+  }
+
+  return reply;
+}
+
+static mrb_value mrb_redis_hmset(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *mrb_argv, reply;
+  mrb_int argc = 0, head_len;
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+  head_len = argc > 0 ? 1 : 0;
+  reply = mrb_redis_execute_variadic(mrb, self, "HMSET", mrb_argv, head_len, mrb_argv + head_len, argc - head_len, 2,
+                                     MERGE_STATUS, &rule);
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, mrb_exc_new_str(mrb, E_ARGUMENT_ERROR, mrb_funcall(mrb, reply, "message", 0)));
+  }
+
+  if (((mrb_redis_data *)DATA_PTR(self))->pipelining) {
+    /* like any command method, the "OK" is in the array returned by Redis#pipelined */
+    return mrb_nil_value();
+  }
+  return self;
+}
+
+static mrb_value mrb_redis_hvals(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "HVALS", argv, lens);
+  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_hincrby(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[4];
+  size_t lens[4];
+  int argc = mrb_redis_create_command_str_str_int(mrb, "HINCRBY", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+static mrb_value mrb_redis_mset(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *mrb_argv, reply;
+  mrb_int argc = 0;
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+  reply = mrb_redis_execute_variadic(mrb, self, "MSET", NULL, 0, mrb_argv, argc, 2, MERGE_STATUS, &rule);
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, mrb_exc_new_str(mrb, E_ARGUMENT_ERROR, mrb_funcall(mrb, reply, "message", 0)));
+  }
+
+  if (((mrb_redis_data *)DATA_PTR(self))->pipelining) {
+    /* like any command method, the "OK" is in the array returned by Redis#pipelined */
+    return mrb_nil_value();
+  }
+  return self;
+}
+
+/* MGET of the keys missing from the client side cache only */
+static mrb_value mrb_redis_mget_cached(mrb_state *mrb, mrb_value self, mrb_redis_data *data, const mrb_value *keys,
+                                       mrb_int argc, const ReplyHandlingRule *rule)
+{
+  mrb_value result = mrb_ary_new_capa(mrb, argc), misses = mrb_ary_new(mrb), positions = mrb_ary_new(mrb), fetched;
+  mrb_int i;
+
+  mrb_redis_cache_poll(mrb, data->cache);
+  for (i = 0; i < argc; i++) {
+    mrb_value key = mrb_str_to_str(mrb, keys[i]), v;
+    if (mrb_redis_cache_lookup(mrb, data->cache, MRB_REDIS_CACHE_STRING, RSTRING_PTR(key), RSTRING_LEN(key), NULL, 0,
+                               &v)) {
+      mrb_ary_push(mrb, result, mrb_string_p(v) && RSTRING_LEN(v) == 0 ? mrb_nil_value() : v);
+    } else {
+      mrb_ary_push(mrb, result, mrb_nil_value());
+      mrb_ary_push(mrb, misses, key);
+      mrb_ary_push(mrb, positions, mrb_fixnum_value(i));
+    }
+  }
+  if (RARRAY_LEN(misses) == 0) {
+    return result;
+  }
+
+  fetched = mrb_redis_execute_variadic(mrb, self, "MGET", NULL, 0, RARRAY_PTR(misses), RARRAY_LEN(misses), 1,
+                                       MERGE_ARRAY, rule);
+  if (!mrb_array_p(fetched)) {
+    return fetched;
+  }
+  for (i = 0; i < RARRAY_LEN(fetched) && i < RARRAY_LEN(misses); i++) {
+    mrb_value v = RARRAY_PTR(fetched)[i], key = RARRAY_PTR(misses)[i];
+    mrb_ary_set(mrb, result, mrb_fixnum(RARRAY_PTR(positions)[i]), v);
+    /* nil is either a missing key or an empty string here */
+    if (!mrb_nil_p(v) && data->cache) {
+      mrb_redis_cache_store(mrb, data->cache, MRB_REDIS_CACHE_STRING, RSTRING_PTR(key), RSTRING_LEN(key), NULL, 0, v);
+    }
+  }
+
+  return result;
+}
+
+static mrb_value mrb_redis_mget(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *mrb_argv, reply;
+  mrb_int argc = 0;
+  mrb_redis_data *data;
+  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE, .emptystring_to_nil = TRUE, .return_exception = TRUE};
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->cache && argc > 0 && !data->pipelining && !data->multi && !data->subscribed && data->queue_counter == 0) {
+    reply = mrb_redis_mget_cached(mrb, self, data, mrb_argv, argc, &rule);
+  } else {
+    reply = mrb_redis_execute_variadic(mrb, self, "MGET", NULL, 0, mrb_argv, argc, 1, MERGE_ARRAY, &rule);
+  }
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, mrb_exc_new_str(mrb, E_ARGUMENT_ERROR, mrb_funcall(mrb, reply, "message", 0)));
+  }
+
+  return reply;
+}
+
+
+
+static mrb_value mrb_redis_ttl(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2];
+  size_t lens[2];
+  int argc = mrb_redis_create_command_str(mrb, "TTL", argv, lens);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+}
+
+/* a score, or a bound like "(1.5" or "-inf", as a command argument */
+mrb_value mrb_redis_score_arg(mrb_state *mrb, mrb_value v)
 {
-  const char *argv[1];
-  size_t lens[1];
-  int argc = mrb_redis_create_command_noarg(mrb, "RANDOMKEY", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  switch (mrb_type(v)) {
+  case MRB_TT_FLOAT:
+    if (isinf(mrb_float(v))) {
+      return mrb_str_new_cstr(mrb, mrb_float(v) > 0 ? "+inf" : "-inf");
+    }
+    /* round trips through the double of Redis */
+    return mrb_float_to_str(mrb, v, "%.17g");
+  case MRB_TT_FIXNUM:
+    return mrb_fixnum_to_str(mrb, v, 10);
+  case MRB_TT_STRING:
+    return v;
+  default:
+    mrb_raisef(mrb, E_TYPE_ERROR, "score should be a number or a string, but %S given", v);
+  }
+  return mrb_nil_value();
 }
 
-static mrb_value mrb_redis_del(mrb_state *mrb, mrb_value self)
+/* the flags of a trailing option Hash, upper cased when true */
+static mrb_int mrb_redis_zset_flags(mrb_state *mrb, mrb_value opts, const char *const (*flags)[2], size_t n,
+                                    mrb_value *out)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "DEL", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_int len = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (mrb_test(mrb_redis_scan_option(mrb, opts, flags[i][0]))) {
+      out[len++] = mrb_str_new_cstr(mrb, flags[i][1]);
+    }
+  }
+  return len;
 }
 
-static mrb_value mrb_redis_incr(mrb_state *mrb, mrb_value self)
+/*
+ * zadd(key, score, member[, score, member...][, opts]),
+ * zadd(key, [[score, member], ...][, opts]) or zadd(key, {member => score}[, opts])
+ * with opts among nx/xx/gt/lt/ch/incr. Returns the number of members added
+ * (changed with ch:), or with incr: the new score, nil when a flag stopped it.
+ */
+static mrb_value mrb_redis_zadd(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "INCR", argv, lens);
+  static const char *const flags[][2] = {{"nx", "NX"}, {"xx", "XX"}, {"gt", "GT"},
+                                         {"lt", "LT"}, {"ch", "CH"}, {"incr", "INCR"}};
+  mrb_value key, *rest, opts = mrb_nil_value(), head[7], pairs;
+  mrb_int rest_len, head_len = 1, i;
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+
+  mrb_get_args(mrb, "S*", &key, &rest, &rest_len);
+  if (rest_len >= 2 && mrb_hash_p(rest[rest_len - 1])) {
+    opts = rest[--rest_len];
+  }
+  head[0] = key;
+  head_len += mrb_redis_zset_flags(mrb, opts, flags, sizeof(flags) / sizeof(flags[0]), head + 1);
+
+  if (rest_len == 1 && mrb_hash_p(rest[0])) {
+    mrb_value members = mrb_hash_keys(mrb, rest[0]);
+
+    pairs = mrb_ary_new_capa(mrb, RARRAY_LEN(members) * 2);
+    for (i = 0; i < RARRAY_LEN(members); i++) {
+      mrb_value member = RARRAY_PTR(members)[i];
+      mrb_ary_push(mrb, pairs, mrb_redis_score_arg(mrb, mrb_hash_get(mrb, rest[0], member)));
+      mrb_ary_push(mrb, pairs, member);
+    }
+  } else if (rest_len == 1 && mrb_array_p(rest[0])) {
+    pairs = mrb_ary_new_capa(mrb, RARRAY_LEN(rest[0]) * 2);
+    for (i = 0; i < RARRAY_LEN(rest[0]); i++) {
+      mrb_value pair = RARRAY_PTR(rest[0])[i];
+      if (!mrb_array_p(pair) || RARRAY_LEN(pair) != 2) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "pairs should be [score, member]");
+      }
+      mrb_ary_push(mrb, pairs, mrb_redis_score_arg(mrb, RARRAY_PTR(pair)[0]));
+      mrb_ary_push(mrb, pairs, RARRAY_PTR(pair)[1]);
+    }
+  } else if (rest_len > 0 && rest_len % 2 == 0) {
+    pairs = mrb_ary_new_capa(mrb, rest_len);
+    for (i = 0; i < rest_len; i += 2) {
+      mrb_ary_push(mrb, pairs, mrb_redis_score_arg(mrb, rest[i]));
+      mrb_ary_push(mrb, pairs, rest[i + 1]);
+    }
+  } else {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
+  }
+  if (RARRAY_LEN(pairs) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no member given");
+  }
+
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "incr"))) {
+    rule.score_to_float = TRUE;
+    return mrb_redis_execute_variadic(mrb, self, "ZADD", head, head_len, RARRAY_PTR(pairs), RARRAY_LEN(pairs), 2,
+                                      MERGE_NONE, &rule);
+  }
+  return mrb_redis_execute_variadic(mrb, self, "ZADD", head, head_len, RARRAY_PTR(pairs), RARRAY_LEN(pairs), 2,
+                                    MERGE_SUM, &rule);
 }
 
-static mrb_value mrb_redis_decr(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zcard(mrb_state *mrb, mrb_value self)
 {
   const char *argv[2];
   size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "DECR", argv, lens);
+  int argc = mrb_redis_create_command_str(mrb, "ZCARD", argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_incrby(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_int(mrb, "INCRBY", argv, lens);
+/*
+ * (key, start, stop[, opts]) of ZRANGE, ZREVRANGE, ZRANGEBYSCORE and
+ * ZREVRANGEBYSCORE. opts: withscores: true for [[member, score], ...],
+ * limit: [offset, count], and for ZRANGE by_score:/rev: (Redis 6.2).
+ */
+static mrb_value mrb_redis_zrange_generic(mrb_state *mrb, mrb_value self, const char *cmd, mrb_bool zrange)
+{
+  static const char *const flags[][2] = {{"by_score", "BYSCORE"}, {"rev", "REV"}};
+  mrb_value key, start, stop, opts = mrb_nil_value(), limit, args[10];
+  mrb_int len = 0;
+  mrb_redis_data *data;
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  int argc;
+
+  mrb_get_args(mrb, "Soo|H", &key, &start, &stop, &opts);
+  args[len++] = key;
+  args[len++] = mrb_redis_score_arg(mrb, start);
+  args[len++] = mrb_redis_score_arg(mrb, stop);
+  if (zrange) {
+    len += mrb_redis_zset_flags(mrb, opts, flags, sizeof(flags) / sizeof(flags[0]), args + len);
+  }
+  limit = mrb_redis_scan_option(mrb, opts, "limit");
+  if (!mrb_nil_p(limit)) {
+    if (!mrb_array_p(limit) || RARRAY_LEN(limit) != 2) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "limit should be [offset, count]");
+    }
+    args[len++] = mrb_str_new_lit(mrb, "LIMIT");
+    args[len++] = mrb_fixnum_to_str(mrb, mrb_to_int(mrb, RARRAY_PTR(limit)[0]), 10);
+    args[len++] = mrb_fixnum_to_str(mrb, mrb_to_int(mrb, RARRAY_PTR(limit)[1]), 10);
+  }
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "withscores"))) {
+    args[len++] = mrb_str_new_lit(mrb, "WITHSCORES");
+    rule.withscores = TRUE;
+  }
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  argc = mrb_redis_build_args(mrb, data, cmd, NULL, 0, args, len);
+  return mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, &rule);
 }
 
-static mrb_value mrb_redis_decrby(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrange(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_int(mrb, "DECRBY", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return mrb_redis_zrange_generic(mrb, self, "ZRANGE", TRUE);
 }
 
-static mrb_value mrb_redis_llen(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrevrange(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "LLEN", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return mrb_redis_zrange_generic(mrb, self, "ZREVRANGE", FALSE);
 }
 
-static mrb_value mrb_redis_rpush(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrangebyscore(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "RPUSH", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return mrb_redis_zrange_generic(mrb, self, "ZRANGEBYSCORE", FALSE);
 }
 
-static mrb_value mrb_redis_lpush(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrevrangebyscore(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_zrange_generic(mrb, self, "ZREVRANGEBYSCORE", FALSE);
+}
+
+static mrb_value mrb_redis_basic_zrank(mrb_state *mrb, mrb_value self, const char *cmd)
 {
   const char *argv[3];
   size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "LPUSH", argv, lens);
+  int argc = mrb_redis_create_command_str_str(mrb, cmd, argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_rpop(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrank(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "RPOP", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return mrb_redis_basic_zrank(mrb, self, "ZRANK");
 }
 
-static mrb_value mrb_redis_lpop(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrevrank(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "LPOP", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return mrb_redis_basic_zrank(mrb, self, "ZREVRANK");
 }
 
-static mrb_value mrb_redis_lrange(mrb_state *mrb, mrb_value self)
+/* the score as a Float, nil without the member */
+static mrb_value mrb_redis_zscore(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[4];
-  size_t lens[4];
-  int argc = mrb_redis_create_command_str_int_int(mrb, "LRANGE", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  const char *argv[3];
+  size_t lens[3];
+  int argc = mrb_redis_create_command_str_str(mrb, "ZSCORE", argv, lens);
+  ReplyHandlingRule rule = {.score_to_float = TRUE};
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_ltrim(mrb_state *mrb, mrb_value self)
+/* the new score as a Float */
+static mrb_value mrb_redis_zincrby(mrb_state *mrb, mrb_value self)
 {
+  mrb_value key, increment, member;
   const char *argv[4];
   size_t lens[4];
-  int argc = mrb_redis_create_command_str_int_int(mrb, "LTRIM", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-}
+  ReplyHandlingRule rule = {.score_to_float = TRUE};
 
-static mrb_value mrb_redis_lindex(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_int(mrb, "LINDEX", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_get_args(mrb, "SoS", &key, &increment, &member);
+  increment = mrb_redis_score_arg(mrb, increment);
+  CREATE_REDIS_COMMAND_ARG3(argv, lens, "ZINCRBY", key, increment, member);
+  return mrb_redis_execute_command(mrb, self, 4, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_sadd(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zrem(mrb_state *mrb, mrb_value self)
 {
   mrb_value key, *members;
-  mrb_int members_len;
-  const char **argv;
-  size_t *lens;
-  size_t argc;
-  int i;
+  mrb_int len;
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
 
-  mrb_get_args(mrb, "o*", &key, &members, &members_len);
-  if (members_len == 0) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "too few arguments");
+  mrb_get_args(mrb, "S*", &key, &members, &len);
+  if (len == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no member given");
   }
-  argc = 2 + members_len;
+  return mrb_redis_execute_variadic(mrb, self, "ZREM", &key, 1, members, len, 1, MERGE_SUM, &rule);
+}
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  lens = (size_t *)alloca(argc * sizeof(size_t));
+/* without count, [member, score] or nil, with it [[member, score], ...] */
+static mrb_value mrb_redis_zpop(mrb_state *mrb, mrb_value self, const char *cmd)
+{
+  mrb_value args[2], count = mrb_nil_value();
+  mrb_redis_data *data;
+  ReplyHandlingRule rule = {.withscores = TRUE};
+  int argc;
 
-  CREATE_REDIS_COMMAND_ARG1(argv, lens, "SADD", key);
-  for (i = 0; i < members_len; i++) {
-    argv[i + 2] = RSTRING_PTR(members[i]);
-    lens[i + 2] = RSTRING_LEN(members[i]);
+  mrb_get_args(mrb, "S|o", &args[0], &count);
+  if (!mrb_nil_p(count)) {
+    args[1] = mrb_fixnum_to_str(mrb, mrb_to_int(mrb, count), 10);
   }
+  rule.first_element = mrb_nil_p(count);
 
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  argc = mrb_redis_build_args(mrb, data, cmd, NULL, 0, args, mrb_nil_p(count) ? 1 : 2);
+  return mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, &rule);
 }
 
-static mrb_value mrb_redis_srem(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zpopmin(mrb_state *mrb, mrb_value self)
 {
-  mrb_value key, *members;
-  mrb_int members_len;
-  const char **argv;
-  size_t *lens, argc;
-  int i;
+  return mrb_redis_zpop(mrb, self, "ZPOPMIN");
+}
 
-  mrb_get_args(mrb, "o*", &key, &members, &members_len);
-  if (members_len < 1) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
-  }
-  argc = members_len + 2;
+static mrb_value mrb_redis_zpopmax(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_zpop(mrb, self, "ZPOPMAX");
+}
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  lens = (size_t *)alloca(argc * sizeof(size_t));
+/*
+ * Streams. Entries come as [id, [field, value, ...]]: with the
+ * stream_depth rule the reader builds the Hash of the fields right away,
+ * at the depth they have in the reply of each command.
+ */
+static inline mrb_value mrb_redis_stream_int(mrb_state *mrb, mrb_value v)
+{
+  return mrb_fixnum_to_str(mrb, mrb_to_int(mrb, v), 10);
+}
 
-  CREATE_REDIS_COMMAND_ARG1(argv, lens, "SREM", key);
-  for (i = 0; i < members_len; i++) {
-    argv[i + 2] = RSTRING_PTR(members[i]);
-    lens[i + 2] = RSTRING_LEN(members[i]);
+/* appends v, or the elements of v when it is an Array */
+static inline void mrb_redis_stream_push(mrb_state *mrb, mrb_value args, mrb_value v)
+{
+  if (mrb_array_p(v)) {
+    mrb_ary_concat(mrb, args, v);
+  } else {
+    mrb_ary_push(mrb, args, v);
   }
+}
 
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+static mrb_value mrb_redis_stream_execute(mrb_state *mrb, mrb_value self, const char *cmd, mrb_value args,
+                                          const ReplyHandlingRule *rule)
+{
+  mrb_redis_data *data;
+  int argc;
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  argc = mrb_redis_build_args(mrb, data, cmd, NULL, 0, RARRAY_PTR(args), RARRAY_LEN(args));
+  return mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, rule);
 }
 
-static mrb_value mrb_redis_sismember(mrb_state *mrb, mrb_value self)
+/*
+ * xadd(key, {field => value} or [field, value, ...], opts)
+ * with id:, maxlen:, minid:, approximate:, limit:, nomkstream:
+ */
+static mrb_value mrb_redis_xadd(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "SISMEMBER", argv, lens);
+  mrb_value key, fields, opts = mrb_nil_value(), args, maxlen, minid, limit, id;
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+
+  mrb_get_args(mrb, "So|H", &key, &fields, &opts);
+  args = mrb_ary_new_capa(mrb, 10);
+  mrb_ary_push(mrb, args, key);
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "nomkstream"))) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "NOMKSTREAM"));
+  }
+  maxlen = mrb_redis_scan_option(mrb, opts, "maxlen");
+  minid = mrb_redis_scan_option(mrb, opts, "minid");
+  if (!mrb_nil_p(maxlen) && !mrb_nil_p(minid)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Only one of maxlen or minid can be set");
+  }
+  if (!mrb_nil_p(maxlen) || !mrb_nil_p(minid)) {
+    mrb_ary_push(mrb, args, mrb_nil_p(maxlen) ? mrb_str_new_lit(mrb, "MINID") : mrb_str_new_lit(mrb, "MAXLEN"));
+    /* "~": trimmed by whole macro nodes, much cheaper than to the exact length */
+    if (mrb_test(mrb_redis_scan_option(mrb, opts, "approximate"))) {
+      mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "~"));
+    }
+    mrb_ary_push(mrb, args, mrb_nil_p(maxlen) ? minid : mrb_redis_stream_int(mrb, maxlen));
+    limit = mrb_redis_scan_option(mrb, opts, "limit");
+    if (!mrb_nil_p(limit)) {
+      mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "LIMIT"));
+      mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, limit));
+    }
+  }
+  id = mrb_redis_scan_option(mrb, opts, "id");
+  mrb_ary_push(mrb, args, mrb_nil_p(id) ? mrb_str_new_lit(mrb, "*") : id);
+
+  if (mrb_hash_p(fields)) {
+    mrb_value names = mrb_hash_keys(mrb, fields);
+    mrb_int i;
+
+    for (i = 0; i < RARRAY_LEN(names); i++) {
+      mrb_ary_push(mrb, args, RARRAY_PTR(names)[i]);
+      mrb_ary_push(mrb, args, mrb_hash_get(mrb, fields, RARRAY_PTR(names)[i]));
+    }
+  } else if (mrb_array_p(fields) && RARRAY_LEN(fields) % 2 == 0) {
+    mrb_ary_concat(mrb, args, fields);
+  } else {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "fields should be a Hash or [field, value, ...]");
+  }
+  if (mrb_hash_p(fields) ? mrb_hash_empty_p(mrb, fields) : RARRAY_LEN(fields) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no field given");
+  }
+
+  return mrb_redis_stream_execute(mrb, self, "XADD", args, &rule);
 }
 
-static mrb_value mrb_redis_smembers(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_xlen(mrb_state *mrb, mrb_value self)
 {
   const char *argv[2];
   size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "SMEMBERS", argv, lens);
+  int argc = mrb_redis_create_command_str(mrb, "XLEN", argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_scard(mrb_state *mrb, mrb_value self)
+/* xrange(key, start = "-", stop = "+", opts) with count:, [[id, {field => value}], ...] */
+static mrb_value mrb_redis_xrange(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "SCARD", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_value key, start = mrb_str_new_lit(mrb, "-"), stop = mrb_str_new_lit(mrb, "+"), opts = mrb_nil_value(), args,
+                 count;
+  ReplyHandlingRule rule = {.stream_depth = 2};
+
+  mrb_get_args(mrb, "S|SSH", &key, &start, &stop, &opts);
+  args = mrb_ary_new_capa(mrb, 5);
+  mrb_ary_push(mrb, args, key);
+  mrb_ary_push(mrb, args, start);
+  mrb_ary_push(mrb, args, stop);
+  count = mrb_redis_scan_option(mrb, opts, "count");
+  if (!mrb_nil_p(count)) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "COUNT"));
+    mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, count));
+  }
+  return mrb_redis_stream_execute(mrb, self, "XRANGE", args, &rule);
 }
 
-static mrb_value mrb_redis_spop(mrb_state *mrb, mrb_value self)
+/* xgroup_create(key, group, id = "$", opts) with mkstream: */
+static mrb_value mrb_redis_xgroup_create(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "SPOP", argv, lens);
+  mrb_value key, group, id = mrb_str_new_lit(mrb, "$"), opts = mrb_nil_value(), args;
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+
+  mrb_get_args(mrb, "SS|SH", &key, &group, &id, &opts);
+  args = mrb_ary_new_capa(mrb, 5);
+  mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "CREATE"));
+  mrb_ary_push(mrb, args, key);
+  mrb_ary_push(mrb, args, group);
+  mrb_ary_push(mrb, args, id);
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "mkstream"))) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "MKSTREAM"));
+  }
+  return mrb_redis_stream_execute(mrb, self, "XGROUP", args, &rule);
 }
 
-static mrb_value mrb_redis_hset(mrb_state *mrb, mrb_value self)
+/*
+ * XREAD and XREADGROUP: {stream => [[id, {field => value}], ...]}, nil
+ * when BLOCK timed out. RESP3 sends the streams as a map, RESP2 as
+ * [[stream, entries], ...] turned into the same Hash here (not inside
+ * pipelined, whose replies are only those of the reader).
+ */
+static mrb_value mrb_redis_xread_generic(mrb_state *mrb, mrb_value self, mrb_value args, mrb_value keys,
+                                         mrb_value ids, mrb_value opts, const char *cmd)
+{
+  mrb_value count, block, reply, streams;
+  mrb_redis_data *data;
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  mrb_int nkeys, i;
+
+  count = mrb_redis_scan_option(mrb, opts, "count");
+  if (!mrb_nil_p(count)) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "COUNT"));
+    mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, count));
+  }
+  block = mrb_redis_scan_option(mrb, opts, "block");
+  if (!mrb_nil_p(block)) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "BLOCK"));
+    mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, block));
+  }
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "noack"))) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "NOACK"));
+  }
+  mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "STREAMS"));
+
+  keys = mrb_array_p(keys) ? keys : mrb_ary_new_from_values(mrb, 1, &keys);
+  nkeys = RARRAY_LEN(keys);
+  if (nkeys == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no stream given");
+  }
+  mrb_ary_concat(mrb, args, keys);
+  if (mrb_array_p(ids)) {
+    if (RARRAY_LEN(ids) != nkeys) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "one id per stream");
+    }
+    mrb_ary_concat(mrb, args, ids);
+  } else {
+    /* the same id for every stream */
+    for (i = 0; i < nkeys; i++) {
+      mrb_ary_push(mrb, args, ids);
+    }
+  }
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  rule.stream_depth = data->protocol == 3 ? 3 : 4;
+  reply = mrb_redis_stream_execute(mrb, self, cmd, args, &rule);
+  if (!mrb_array_p(reply)) {
+    return reply;
+  }
+  streams = mrb_hash_new_capa(mrb, RARRAY_LEN(reply));
+  for (i = 0; i < RARRAY_LEN(reply); i++) {
+    mrb_value pair = RARRAY_PTR(reply)[i];
+    if (mrb_array_p(pair) && RARRAY_LEN(pair) == 2) {
+      mrb_hash_set(mrb, streams, RARRAY_PTR(pair)[0], RARRAY_PTR(pair)[1]);
+    }
+  }
+  return streams;
+}
+
+/* xread(keys, ids, opts) with count:, block: (milliseconds) */
+static mrb_value mrb_redis_xread(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[4];
-  size_t lens[4];
-  int argc = mrb_redis_create_command_str_str_str(mrb, "HSET", argv, lens);
-  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_value keys, ids, opts = mrb_nil_value();
+
+  mrb_get_args(mrb, "oo|H", &keys, &ids, &opts);
+  return mrb_redis_xread_generic(mrb, self, mrb_ary_new_capa(mrb, 8), keys, ids, opts, "XREAD");
 }
 
-static mrb_value mrb_redis_hsetnx(mrb_state *mrb, mrb_value self)
+/* xreadgroup(group, consumer, keys, ids = ">", opts) with count:, block:, noack: */
+static mrb_value mrb_redis_xreadgroup(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[4];
-  size_t lens[4];
-  int argc = mrb_redis_create_command_str_str_str(mrb, "HSETNX", argv, lens);
-  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_value group, consumer, keys, ids = mrb_str_new_lit(mrb, ">"), opts = mrb_nil_value(), args;
+
+  mrb_get_args(mrb, "SSo|oH", &group, &consumer, &keys, &ids, &opts);
+  if (mrb_hash_p(ids) && mrb_nil_p(opts)) {
+    opts = ids;
+    ids = mrb_str_new_lit(mrb, ">");
+  }
+  args = mrb_ary_new_capa(mrb, 12);
+  mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "GROUP"));
+  mrb_ary_push(mrb, args, group);
+  mrb_ary_push(mrb, args, consumer);
+  return mrb_redis_xread_generic(mrb, self, args, keys, ids, opts, "XREADGROUP");
 }
 
-static mrb_value mrb_redis_hget(mrb_state *mrb, mrb_value self)
+/* xack(key, group, id, ...) or xack(key, group, [id, ...]): the number of entries acknowledged */
+static mrb_value mrb_redis_xack(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "HGET", argv, lens);
+  mrb_value head[2], *ids;
+  mrb_int len;
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+
+  mrb_get_args(mrb, "SS*", &head[0], &head[1], &ids, &len);
+  if (len == 1 && mrb_array_p(ids[0])) {
+    len = RARRAY_LEN(ids[0]);
+    ids = RARRAY_PTR(ids[0]);
+  }
+  if (len == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no id given");
+  }
+  return mrb_redis_execute_variadic(mrb, self, "XACK", head, 2, ids, len, 1, MERGE_SUM, &rule);
 }
 
-static mrb_value mrb_redis_hgetall(mrb_state *mrb, mrb_value self)
+/*
+ * xclaim(key, group, consumer, min_idle_ms, ids, opts) with idle:, time:,
+ * retrycount:, force:, justid:. The entries, or their ids with justid.
+ */
+static mrb_value mrb_redis_xclaim(mrb_state *mrb, mrb_value self)
+{
+  static const char *const options[] = {"idle", "time", "retrycount"};
+  static const char *const names[] = {"IDLE", "TIME", "RETRYCOUNT"};
+  mrb_value key, group, consumer, min_idle, ids, opts = mrb_nil_value(), args, v;
+  ReplyHandlingRule rule = {.stream_depth = 2};
+  size_t i;
+
+  mrb_get_args(mrb, "SSSoo|H", &key, &group, &consumer, &min_idle, &ids, &opts);
+  args = mrb_ary_new_capa(mrb, 16);
+  mrb_ary_push(mrb, args, key);
+  mrb_ary_push(mrb, args, group);
+  mrb_ary_push(mrb, args, consumer);
+  mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, min_idle));
+  mrb_redis_stream_push(mrb, args, ids);
+  for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    v = mrb_redis_scan_option(mrb, opts, options[i]);
+    if (!mrb_nil_p(v)) {
+      mrb_ary_push(mrb, args, mrb_str_new_cstr(mrb, names[i]));
+      mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, v));
+    }
+  }
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "force"))) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "FORCE"));
+  }
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "justid"))) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "JUSTID"));
+  }
+  return mrb_redis_stream_execute(mrb, self, "XCLAIM", args, &rule);
+}
+
+/*
+ * xautoclaim(key, group, consumer, min_idle_ms, start = "0-0", opts) with
+ * count:, justid:. [next start, entries] and, from Redis 7, the ids of the
+ * entries deleted in the meantime.
+ */
+static mrb_value mrb_redis_xautoclaim(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key, group, consumer, min_idle, start = mrb_str_new_lit(mrb, "0-0"), opts = mrb_nil_value(), args, count;
+  ReplyHandlingRule rule = {.stream_depth = 3};
+
+  mrb_get_args(mrb, "SSSo|SH", &key, &group, &consumer, &min_idle, &start, &opts);
+  args = mrb_ary_new_capa(mrb, 8);
+  mrb_ary_push(mrb, args, key);
+  mrb_ary_push(mrb, args, group);
+  mrb_ary_push(mrb, args, consumer);
+  mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, min_idle));
+  mrb_ary_push(mrb, args, start);
+  count = mrb_redis_scan_option(mrb, opts, "count");
+  if (!mrb_nil_p(count)) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "COUNT"));
+    mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, count));
+  }
+  if (mrb_test(mrb_redis_scan_option(mrb, opts, "justid"))) {
+    mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "JUSTID"));
+  }
+  return mrb_redis_stream_execute(mrb, self, "XAUTOCLAIM", args, &rule);
+}
+
+/*
+ * xpending(key, group) for the summary [count, smallest id, greatest id,
+ * [[consumer, count], ...]], xpending(key, group, count: n) with start:,
+ * stop:, idle:, consumer: for [[id, consumer, idle ms, deliveries], ...].
+ */
+static mrb_value mrb_redis_xpending(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "HGETALL", argv, lens);
-  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
-  mrb_value reply = mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-  if (mrb_array_p(reply)) {
-    // Convert [k1, v1, ..., kN, vN] --> {k1 => v1, ..., kN =>}
-    mrb_value hash = mrb_hash_new_capa(mrb, RARRAY_LEN(reply) / 2);
-    for (mrb_int i = 0; i < RARRAY_LEN(reply); i += 2) {
-      mrb_hash_set(mrb, hash, mrb_ary_ref(mrb, reply, i), mrb_ary_ref(mrb, reply, i + 1));
+  mrb_value key, group, opts = mrb_nil_value(), args, count, idle, start, stop, consumer;
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  mrb_get_args(mrb, "SS|H", &key, &group, &opts);
+  args = mrb_ary_new_capa(mrb, 8);
+  mrb_ary_push(mrb, args, key);
+  mrb_ary_push(mrb, args, group);
+  count = mrb_redis_scan_option(mrb, opts, "count");
+  if (!mrb_nil_p(count)) {
+    idle = mrb_redis_scan_option(mrb, opts, "idle");
+    if (!mrb_nil_p(idle)) {
+      mrb_ary_push(mrb, args, mrb_str_new_lit(mrb, "IDLE"));
+      mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, idle));
+    }
+    start = mrb_redis_scan_option(mrb, opts, "start");
+    stop = mrb_redis_scan_option(mrb, opts, "stop");
+    mrb_ary_push(mrb, args, mrb_nil_p(start) ? mrb_str_new_lit(mrb, "-") : start);
+    mrb_ary_push(mrb, args, mrb_nil_p(stop) ? mrb_str_new_lit(mrb, "+") : stop);
+    mrb_ary_push(mrb, args, mrb_redis_stream_int(mrb, count));
+    consumer = mrb_redis_scan_option(mrb, opts, "consumer");
+    if (!mrb_nil_p(consumer)) {
+      mrb_ary_push(mrb, args, consumer);
     }
-    return hash;
-  } else {
-    return reply;
   }
+  return mrb_redis_stream_execute(mrb, self, "XPENDING", args, &rule);
 }
 
-static mrb_value mrb_redis_hdel(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_pub(mrb_state *mrb, mrb_value self)
 {
   const char *argv[3];
   size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "HDEL", argv, lens);
+  int argc = mrb_redis_create_command_str_str(mrb, "PUBLISH", argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
-static mrb_value mrb_redis_hexists(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_pfadd(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "HEXISTS", argv, lens);
-  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_value key, *mrb_rest_argv;
+  mrb_int rest_argc = 0;
+
+  mrb_get_args(mrb, "o*", &key, &mrb_rest_argv, &rest_argc);
+
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_variadic(mrb, self, "PFADD", &key, 1, mrb_rest_argv, rest_argc, 1, MERGE_MAX, &rule);
 }
 
-static mrb_value mrb_redis_hkeys(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_pfcount(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "HKEYS", argv, lens);
-  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_value key, *mrb_rest_argv;
+  mrb_int rest_argc = 0;
+
+  mrb_get_args(mrb, "o*", &key, &mrb_rest_argv, &rest_argc);
+
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_variadic(mrb, self, "PFCOUNT", &key, 1, mrb_rest_argv, rest_argc, 1, MERGE_NONE, &rule);
 }
 
-static mrb_value mrb_redis_hmget(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_pfmerge(mrb_state *mrb, mrb_value self)
 {
-  mrb_value *mrb_argv, array;
-  mrb_int argc = 0;
-  int i, ai;
-  const char **argv;
-  size_t *argvlen;
-  mrb_int argc_current;
-  redisContext *rc;
-  redisReply *rr;
+  mrb_value head[2], *mrb_rest_argv;
+  mrb_int rest_argc = 0;
 
-  mrb_get_args(mrb, "*", &mrb_argv, &argc);
-  argc++;
+  mrb_get_args(mrb, "oo*", &head[0], &head[1], &mrb_rest_argv, &rest_argc);
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  return mrb_redis_execute_variadic(mrb, self, "PFMERGE", head, 2, mrb_rest_argv, rest_argc, 1, MERGE_NONE, &rule);
+}
 
-  argv[0] = "HMGET";
-  argvlen[0] = sizeof("HMGET") - 1;
+static mrb_value mrb_redis_close(mrb_state *mrb, mrb_value self)
+{
+  redisContext_free(mrb, DATA_PTR(self));
 
-  ai = mrb_gc_arena_save(mrb);
-  for (argc_current = 1; argc_current < argc; argc_current++) {
-    mrb_value curr = mrb_str_to_str(mrb, mrb_argv[argc_current - 1]);
-    argv[argc_current] = RSTRING_PTR(curr);
-    argvlen[argc_current] = RSTRING_LEN(curr);
-    mrb_gc_arena_restore(mrb, ai);
-  }
+  DATA_PTR(self) = NULL;
+  DATA_TYPE(self) = NULL;
 
-  array = mrb_nil_value();
-  rc = mrb_redis_get_context(mrb, self);
-  rr = redisCommandArgv(rc, argc, argv, argvlen);
-  if (rc->err) {
-    mrb_redis_check_error(rc, mrb);
-  }
-  if (rr->type == REDIS_REPLY_ARRAY) {
-    if (rr->elements > 0) {
-      array = mrb_ary_new(mrb);
+  return mrb_nil_value();
+}
 
-      for (i = 0; i < rr->elements; i++) {
-        if (rr->element[i]->len > 0) {
-          mrb_ary_push(mrb, array, mrb_str_new(mrb, rr->element[i]->str, rr->element[i]->len));
-        } else {
-          mrb_ary_push(mrb, array, mrb_nil_value());
-        }
-      }
+static inline mrb_value mrb_redis_get_ary_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule);
+
+mrb_value mrb_redis_get_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule)
+{
+  switch (reply->type) {
+  case REDIS_REPLY_STRING:
+    if (rule->emptystring_to_nil && reply->len == 0) {
+      return mrb_nil_value();
     }
-  } else {
-    mrb_value msg = mrb_str_new_cstr(mrb, rr->str);
-    freeReplyObject(rr);
-    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S", msg);
+    if (rule->score_to_float) {
+      return mrb_redis_score_value(mrb, reply->str, reply->len);
+    }
+    return mrb_str_new(mrb, reply->str, reply->len);
+    break;
+  case REDIS_REPLY_ARRAY:
+    return mrb_redis_get_ary_reply(reply, mrb, rule);
+    break;
+  case REDIS_REPLY_INTEGER: {
+    if (rule->integer_to_bool)
+      return mrb_bool_value(reply->integer);
+    else if (FIXABLE(reply->integer))
+      return mrb_fixnum_value(reply->integer);
+    else
+      return mrb_float_value(mrb, reply->integer);
+  } break;
+  case REDIS_REPLY_NIL:
+    return mrb_nil_value();
+    break;
+#ifdef REDIS_REPLY_MAP
+  case REDIS_REPLY_MAP: {
+    mrb_value hash = mrb_hash_new_capa(mrb, reply->elements / 2);
+    int ai = mrb_gc_arena_save(mrb);
+    size_t i;
+    for (i = 0; i + 1 < reply->elements; i += 2) {
+      mrb_hash_set(mrb, hash, mrb_redis_get_reply(reply->element[i], mrb, rule),
+                   mrb_redis_get_reply(reply->element[i + 1], mrb, rule));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    return hash;
+  } break;
+  case REDIS_REPLY_SET:
+  case REDIS_REPLY_PUSH:
+    return mrb_redis_get_ary_reply(reply, mrb, rule);
+    break;
+  case REDIS_REPLY_DOUBLE:
+    return mrb_float_value(mrb, reply->dval);
+    break;
+  case REDIS_REPLY_BOOL:
+    return mrb_bool_value(reply->integer);
+    break;
+  case REDIS_REPLY_BIGNUM:
+    return mrb_redis_bignum_value(mrb, reply->str, reply->len);
+    break;
+  case REDIS_REPLY_VERB:
+    /* hiredis already moved the format out of str */
+    return mrb_str_new(mrb, reply->str, reply->len);
+    break;
+#endif
+  case REDIS_REPLY_STATUS: {
+    if (rule->status_to_symbol) {
+      mrb_sym status = mrb_intern(mrb, reply->str, reply->len);
+      return mrb_symbol_value(status);
+    } else {
+      return mrb_str_new(mrb, reply->str, reply->len);
+    }
+  } break;
+  case REDIS_REPLY_ERROR: {
+    mrb_value err = mrb_str_new(mrb, reply->str, reply->len);
+    mrb_value exc = mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, err);
+    if (rule->return_exception) {
+      return exc;
+    } else {
+      mrb_exc_raise(mrb, exc);
+    }
+  } break;
+  default:
+    mrb_raise(mrb, E_REDIS_ERROR, "unknown reply type");
   }
-
-  freeReplyObject(rr);
-  return array;
 }
 
-static mrb_value mrb_redis_hmset(mrb_state *mrb, mrb_value self)
+/* withscores and first_element, as the reader applies them: [[m1, s1], ...] out of the top array */
+static mrb_value mrb_redis_get_scores_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule)
 {
-  mrb_value *mrb_argv;
-  mrb_int argc = 0;
-  redisContext *rc = mrb_redis_get_context(mrb, self);
-  redisReply *rr;
-  const char **argv;
-  size_t *argvlen;
-  int ai;
-  mrb_int argc_current;
+  ReplyHandlingRule member_rule = DEFAULT_REPLY_HANDLING_RULE, score_rule = {.score_to_float = TRUE};
+  mrb_value ary = mrb_ary_new_capa(mrb, reply->elements / 2);
+  int ai = mrb_gc_arena_save(mrb);
+  size_t i = 0;
+
+  while (i < reply->elements) {
+    redisReply *member, *score;
+
+    if (reply->element[i]->type == REDIS_REPLY_ARRAY && reply->element[i]->elements == 2) {
+      /* RESP3 sends the pairs as arrays already */
+      member = reply->element[i]->element[0];
+      score = reply->element[i]->element[1];
+      i++;
+    } else if (i + 1 < reply->elements) {
+      member = reply->element[i];
+      score = reply->element[i + 1];
+      i += 2;
+    } else {
+      break;
+    }
+    mrb_ary_push(mrb, ary,
+                 mrb_assoc_new(mrb, mrb_redis_get_reply(member, mrb, &member_rule),
+                               mrb_redis_get_reply(score, mrb, &score_rule)));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  if (rule->first_element) {
+    return RARRAY_LEN(ary) > 0 ? RARRAY_PTR(ary)[0] : mrb_nil_value();
+  }
+  return ary;
+}
 
-  mrb_get_args(mrb, "*", &mrb_argv, &argc);
-  argc++;
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
+static inline mrb_value mrb_redis_get_ary_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule)
+{
+  if (rule->emptyarray_to_nil && reply->elements == 0) {
+    return mrb_nil_value();
+  }
+  if (rule->withscores) {
+    return mrb_redis_get_scores_reply(reply, mrb, rule);
+  }
+  if (rule->array_to_hash) {
+    mrb_value hash = mrb_hash_new_capa(mrb, reply->elements / 2);
+    int ai = mrb_gc_arena_save(mrb);
+    size_t i;
+    for (i = 0; i + 1 < reply->elements; i += 2) {
+      mrb_hash_set(mrb, hash, mrb_redis_get_reply(reply->element[i], mrb, rule),
+                   mrb_redis_get_reply(reply->element[i + 1], mrb, rule));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    return hash;
+  }
+  mrb_value ary = mrb_ary_new_capa(mrb, reply->elements);
+  int ai = mrb_gc_arena_save(mrb);
+  size_t element_couter;
+  for (element_couter = 0; element_couter < reply->elements; element_couter++) {
+    mrb_value element = mrb_redis_get_reply(reply->element[element_couter], mrb, rule);
+    mrb_ary_push(mrb, ary, element);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return ary;
+}
 
-  argv[0] = "HMSET";
-  argvlen[0] = sizeof("HMSET") - 1;
+/*
+ * Fills the argument buffer of the connection with "cmd head... rest...".
+ * The buffer grows with the largest command sent and is reused, so that
+ * huge variadic commands don't live on the C stack.
+ */
+int mrb_redis_build_args(mrb_state *mrb, mrb_redis_data *data, const char *cmd, const mrb_value *head,
+                         mrb_int head_len, const mrb_value *rest, mrb_int rest_len)
+{
+  mrb_int argc = 1 + head_len + rest_len, i;
 
-  ai = mrb_gc_arena_save(mrb);
-  for (argc_current = 1; argc_current < argc; argc_current++) {
-    mrb_value curr = mrb_str_to_str(mrb, mrb_argv[argc_current - 1]);
-    argv[argc_current] = RSTRING_PTR(curr);
-    argvlen[argc_current] = RSTRING_LEN(curr);
-    mrb_gc_arena_restore(mrb, ai);
+  if (argc > INT_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many arguments");
+  }
+  if (argc > data->args_capa) {
+    mrb_int capa = data->args_capa ? data->args_capa : 16;
+    while (capa < argc) {
+      capa *= 2;
+    }
+    data->argv = (const char **)mrb_realloc(mrb, data->argv, capa * sizeof(char *));
+    data->argvlen = (size_t *)mrb_realloc(mrb, data->argvlen, capa * sizeof(size_t));
+    data->args_capa = capa;
   }
 
-  rr = redisCommandArgv(rc, argc, argv, argvlen);
-  if (rc->err) {
-    mrb_redis_check_error(rc, mrb);
+  data->argv[0] = cmd;
+  data->argvlen[0] = strlen(cmd);
+  /* converted arguments stay in the arena until the command is sent */
+  for (i = 0; i < head_len; i++) {
+    mrb_value curr = mrb_str_to_str(mrb, head[i]);
+    data->argv[1 + i] = RSTRING_PTR(curr);
+    data->argvlen[1 + i] = RSTRING_LEN(curr);
   }
-  if (rr->type == REDIS_REPLY_STATUS && rr != NULL) {
-    freeReplyObject(rr);
-  } else {
-    mrb_value msg = mrb_str_new_cstr(mrb, rr->str);
-    freeReplyObject(rr);
-    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S", msg);
+  for (i = 0; i < rest_len; i++) {
+    mrb_value curr = mrb_str_to_str(mrb, rest[i]);
+    data->argv[1 + head_len + i] = RSTRING_PTR(curr);
+    data->argvlen[1 + head_len + i] = RSTRING_LEN(curr);
   }
 
-  return self;
+  return (int)argc;
 }
 
-static mrb_value mrb_redis_hvals(mrb_state *mrb, mrb_value self)
+/*
+ * The SCAN family. scan_each with prefetch: true sends the request for the
+ * next page before yielding the current one. __scan_send returns a token,
+ * an Array its page is pushed to, kept in the "scan_token" ivar while the
+ * server owes that page. Any other command issued in the meantime, a nested
+ * scan_each included, first reads the page into its token, so the
+ * connection never gets out of step and each iteration gets its own pages.
+ */
+static void mrb_redis_drain_scan(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
 {
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "HVALS", argv, lens);
-  ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+  mrb_value token, reply;
+
+  if (!data->scan_pending) {
+    return;
+  }
+  data->scan_pending = FALSE;
+  token = mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "scan_token"));
+  reply = mrb_redis_read_reply(mrb, data, &rule);
+  if (mrb_array_p(token)) {
+    mrb_ary_push(mrb, token, reply);
+  }
 }
 
-static mrb_value mrb_redis_hincrby(mrb_state *mrb, mrb_value self)
+/* called before sending a command: the connection must not owe anything else */
+static inline void mrb_redis_ready(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
 {
-  const char *argv[4];
-  size_t lens[4];
-  int argc = mrb_redis_create_command_str_str_int(mrb, "HINCRBY", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  if (data->subscribed) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "only (p)subscribe and (p)unsubscribe are allowed in subscriber mode");
+  }
+  mrb_redis_drain_scan(mrb, self, data);
 }
 
-static mrb_value mrb_redis_mset(mrb_state *mrb, mrb_value self)
+/* hands the push frames queued while reading replies to the Redis#on_push handler */
+static void mrb_redis_dispatch_pushes(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
 {
-  mrb_value *mrb_argv;
-  mrb_int argc = 0;
-  redisContext *rc = mrb_redis_get_context(mrb, self);
-  redisReply *rr;
-  const char **argv;
-  size_t *argvlen;
-  int ai;
-  mrb_int argc_current;
-
-  mrb_get_args(mrb, "*", &mrb_argv, &argc);
-  argc++;
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
-
-  argv[0] = "MSET";
-  argvlen[0] = sizeof("MSET") - 1;
-
-  ai = mrb_gc_arena_save(mrb);
-  for (argc_current = 1; argc_current < argc; argc_current++) {
-    mrb_value curr = mrb_str_to_str(mrb, mrb_argv[argc_current - 1]);
-    argv[argc_current] = RSTRING_PTR(curr);
-    argvlen[argc_current] = RSTRING_LEN(curr);
-    mrb_gc_arena_restore(mrb, ai);
-  }
+  mrb_value blk;
 
-  rr = redisCommandArgv(rc, argc, argv, argvlen);
-  if (rc->err) {
-    mrb_redis_check_error(rc, mrb);
+  if (!mrb_array_p(data->pushes) || RARRAY_LEN(data->pushes) == 0) {
+    return;
   }
-  if (rr->type == REDIS_REPLY_STATUS && rr != NULL) {
-    freeReplyObject(rr);
-  } else {
-    mrb_value msg = mrb_str_new_cstr(mrb, rr->str);
-    freeReplyObject(rr);
-    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S", msg);
+  blk = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "push_handler"));
+  while (mrb_array_p(data->pushes) && RARRAY_LEN(data->pushes) > 0) {
+    mrb_value message = mrb_ary_shift(mrb, data->pushes);
+    mrb_yield(mrb, blk, message);
+    /* the handler may have closed the connection */
+    if ((data = (mrb_redis_data *)DATA_PTR(self)) == NULL) {
+      return;
+    }
   }
-
-  return self;
 }
 
-static mrb_value mrb_redis_mget(mrb_state *mrb, mrb_value self)
+/* on_push { |message| }: RESP3 push frames met while reading replies, on_push without a block drops them */
+static mrb_value mrb_redis_on_push(mrb_state *mrb, mrb_value self)
 {
-  mrb_value *mrb_argv, array;
-  mrb_int argc = 0;
-  int i, ai;
-  const char **argv;
-  size_t *argvlen;
-  mrb_int argc_current;
-  redisContext *rc;
-  redisReply *rr;
+  mrb_value blk = mrb_nil_value();
+  mrb_redis_data *data;
 
-  mrb_get_args(mrb, "*", &mrb_argv, &argc);
-  argc++;
+  mrb_get_args(mrb, "&", &blk);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (mrb_nil_p(blk)) {
+    mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "push_handler"));
+    mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "push_queue"));
+    data->pushes = mrb_nil_value();
+    return mrb_nil_value();
+  }
+  if (!mrb_array_p(data->pushes)) {
+    /* the ivar keeps the queue alive */
+    data->pushes = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "push_queue"), data->pushes);
+  }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "push_handler"), blk);
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
+  return blk;
+}
 
-  argv[0] = "MGET";
-  argvlen[0] = sizeof("MGET") - 1;
+static mrb_value mrb_redis_protocol(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_get_context(mrb, self);
+  return mrb_fixnum_value(((mrb_redis_data *)DATA_PTR(self))->protocol == 3 ? 3 : 2);
+}
 
-  ai = mrb_gc_arena_save(mrb);
-  for (argc_current = 1; argc_current < argc; argc_current++) {
-    mrb_value curr = mrb_str_to_str(mrb, mrb_argv[argc_current - 1]);
-    argv[argc_current] = RSTRING_PTR(curr);
-    argvlen[argc_current] = RSTRING_LEN(curr);
-    mrb_gc_arena_restore(mrb, ai);
+static inline mrb_value mrb_redis_scan_option(mrb_state *mrb, mrb_value opts, const char *name)
+{
+  if (mrb_nil_p(opts)) {
+    return mrb_nil_value();
   }
+  return mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+}
 
-  array = mrb_nil_value();
-  rc = mrb_redis_get_context(mrb, self);
-  rr = redisCommandArgv(rc, argc, argv, argvlen);
-  if (rc->err) {
-    mrb_redis_check_error(rc, mrb);
-  }
-  if (rr->type == REDIS_REPLY_ARRAY) {
-    if (rr->elements > 0) {
-      array = mrb_ary_new(mrb);
+/* "SCAN cursor" or "xSCAN key cursor", followed by MATCH/COUNT/TYPE */
+static int mrb_redis_build_scan_args(mrb_state *mrb, mrb_redis_data *data, const char *cmd, mrb_value key,
+                                     mrb_value cursor, mrb_value opts)
+{
+  static const char *const options[][2] = {{"match", "MATCH"}, {"count", "COUNT"}, {"type", "TYPE"}};
+  mrb_value args[8];
+  mrb_int argc = 0;
+  size_t i;
 
-      for (i = 0; i < rr->elements; i++) {
-        if (rr->element[i]->len > 0) {
-          mrb_ary_push(mrb, array, mrb_str_new(mrb, rr->element[i]->str, rr->element[i]->len));
-        } else {
-          mrb_ary_push(mrb, array, mrb_nil_value());
-        }
-      }
+  if (!mrb_nil_p(key)) {
+    args[argc++] = key;
+  }
+  args[argc++] = cursor;
+  for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    mrb_value v = mrb_redis_scan_option(mrb, opts, options[i][0]);
+    if (!mrb_nil_p(v)) {
+      args[argc++] = mrb_str_new_cstr(mrb, options[i][1]);
+      args[argc++] = v;
     }
-  } else {
-    char const *msg = rr->str;
-    freeReplyObject(rr);
-    mrb_raise(mrb, E_ARGUMENT_ERROR, msg);
   }
 
-  freeReplyObject(rr);
-  return array;
+  return mrb_redis_build_args(mrb, data, cmd, NULL, 0, args, argc);
 }
 
+static mrb_value mrb_redis_scan_generic(mrb_state *mrb, mrb_value self, const char *cmd, mrb_value key,
+                                        mrb_value cursor, mrb_value opts)
+{
+  mrb_redis_data *data;
+  int argc;
 
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  argc = mrb_redis_build_scan_args(mrb, data, cmd, key, cursor, opts);
 
-static mrb_value mrb_redis_ttl(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "TTL", argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, &rule);
 }
 
-static mrb_value mrb_redis_zadd(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_scan(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[4];
-  size_t lens[4];
-  int argc = mrb_redis_create_command_str_float_str(mrb, "ZADD", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-}
+  mrb_value cursor, opts = mrb_nil_value();
 
-static mrb_value mrb_redis_zcard(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[2];
-  size_t lens[2];
-  int argc = mrb_redis_create_command_str(mrb, "ZCARD", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_get_args(mrb, "o|H", &cursor, &opts);
+  return mrb_redis_scan_generic(mrb, self, "SCAN", mrb_nil_value(), cursor, opts);
 }
 
-static mrb_value mrb_redis_basic_zrange(mrb_state *mrb, mrb_value self, const char *cmd)
+static mrb_value mrb_redis_sscan(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[4];
-  size_t lens[4];
-  int argc = mrb_redis_create_command_str_int_int(mrb, cmd, argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-}
+  mrb_value key, cursor, opts = mrb_nil_value();
 
-static mrb_value mrb_redis_zrange(mrb_state *mrb, mrb_value self)
-{
-  return mrb_redis_basic_zrange(mrb, self, "ZRANGE");
+  mrb_get_args(mrb, "So|H", &key, &cursor, &opts);
+  return mrb_redis_scan_generic(mrb, self, "SSCAN", key, cursor, opts);
 }
 
-static mrb_value mrb_redis_zrevrange(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_hscan(mrb_state *mrb, mrb_value self)
 {
-  return mrb_redis_basic_zrange(mrb, self, "ZREVRANGE");
-}
+  mrb_value key, cursor, opts = mrb_nil_value();
 
-static mrb_value mrb_redis_basic_zrank(mrb_state *mrb, mrb_value self, const char *cmd)
-{
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, cmd, argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_get_args(mrb, "So|H", &key, &cursor, &opts);
+  return mrb_redis_scan_generic(mrb, self, "HSCAN", key, cursor, opts);
 }
 
-static mrb_value mrb_redis_zrank(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_zscan(mrb_state *mrb, mrb_value self)
 {
-  return mrb_redis_basic_zrank(mrb, self, "ZRANK");
-}
+  mrb_value key, cursor, opts = mrb_nil_value();
 
-static mrb_value mrb_redis_zrevrank(mrb_state *mrb, mrb_value self)
-{
-  return mrb_redis_basic_zrank(mrb, self, "ZREVRANK");
+  mrb_get_args(mrb, "So|H", &key, &cursor, &opts);
+  return mrb_redis_scan_generic(mrb, self, "ZSCAN", key, cursor, opts);
 }
 
-static mrb_value mrb_redis_zscore(mrb_state *mrb, mrb_value self)
+/* __scan_send(:sscan, key, cursor, opts): sends the request of a page without waiting for it */
+static mrb_value mrb_redis_scan_send(mrb_state *mrb, mrb_value self)
 {
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "ZSCORE", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
-}
+  mrb_sym command;
+  mrb_value key, cursor, opts, token;
+  mrb_redis_data *data;
+  char cmd[8];
+  const char *name;
+  int argc;
+  size_t i;
+
+  mrb_get_args(mrb, "nooH", &command, &key, &cursor, &opts);
+  name = mrb_sym2name(mrb, command);
+  if (strlen(name) >= sizeof(cmd)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown scan command");
+  }
+  for (i = 0; name[i]; i++) {
+    cmd[i] = toupper((unsigned char)name[i]);
+  }
+  cmd[i] = '\0';
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->pipelining || data->queue_counter > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't scan while replies of queued commands are pending");
+  }
+  /* pages prefetched by other iterations, or left behind by one stopped early */
+  mrb_redis_ready(mrb, self, data);
+
+  argc = mrb_redis_build_scan_args(mrb, data, cmd, key, cursor, opts);
+  mrb_redis_append(mrb, data, argc, data->argv, data->argvlen);
+  token = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "scan_token"), token);
+  data->scan_pending = TRUE;
 
-static mrb_value mrb_redis_pub(mrb_state *mrb, mrb_value self)
-{
-  const char *argv[3];
-  size_t lens[3];
-  int argc = mrb_redis_create_command_str_str(mrb, "PUBLISH", argv, lens);
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  return token;
 }
 
-static mrb_value mrb_redis_pfadd(mrb_state *mrb, mrb_value self)
+/* __scan_recv(token): [cursor, elements] of the page sent by the __scan_send that returned token */
+static mrb_value mrb_redis_scan_recv(mrb_state *mrb, mrb_value self)
 {
-  mrb_value key, *mrb_rest_argv;
-  mrb_int argc = 0, rest_argc = 0;
-  const char **argv;
-  size_t *argvlen;
-
-  mrb_get_args(mrb, "o*", &key, &mrb_rest_argv, &rest_argc);
-  argc = rest_argc + 2;
+  mrb_redis_data *data;
+  mrb_value token, reply;
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
+  mrb_get_args(mrb, "A", &token);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (RARRAY_LEN(token) == 0) {
+    mrb_redis_drain_scan(mrb, self, data);
+  }
+  if (RARRAY_LEN(token) == 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no scan in progress");
+  }
+  reply = mrb_ary_shift(mrb, token);
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, reply);
+  }
 
-  CREATE_REDIS_COMMAND_ARG1(argv, argvlen, "PFADD", key);
+  return reply;
+}
 
-  if (argc > 2) {
-    int ai = mrb_gc_arena_save(mrb);
-    mrb_int argc_current;
-    for (argc_current = 2; argc_current < argc; argc_current++) {
-      mrb_value curr = mrb_str_to_str(mrb, mrb_rest_argv[argc_current - 2]);
-      argv[argc_current] = RSTRING_PTR(curr);
-      argvlen[argc_current] = RSTRING_LEN(curr);
-      mrb_gc_arena_restore(mrb, ai);
+/*
+ * Subscriber mode. The channels and patterns the server will have once it
+ * processed every command sent so far are kept in the "subscribed_channels"
+ * and "subscribed_patterns" ivars, together with the number of (un)subscribe
+ * confirmations it still owes. The loop ends when both sets are empty and
+ * every confirmation has been read, so the connection is in step again
+ * whatever the handlers unsubscribed from.
+ */
+static const char *mrb_redis_subscription_command(mrb_state *mrb, mrb_sym command)
+{
+  static const char *const commands[][2] = {{"subscribe", "SUBSCRIBE"},
+                                            {"psubscribe", "PSUBSCRIBE"},
+                                            {"unsubscribe", "UNSUBSCRIBE"},
+                                            {"punsubscribe", "PUNSUBSCRIBE"}};
+  const char *name = mrb_sym2name(mrb, command);
+  size_t i;
+
+  for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strcmp(name, commands[i][0]) == 0) {
+      return commands[i][1];
     }
   }
-
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, argvlen, &rule);
+  mrb_raise(mrb, E_ARGUMENT_ERROR, "unknown subscription command");
+  return NULL;
 }
 
-static mrb_value mrb_redis_pfcount(mrb_state *mrb, mrb_value self)
+static mrb_value mrb_redis_subscription_set(mrb_state *mrb, mrb_value self, mrb_bool pattern)
 {
-  mrb_value key, *mrb_rest_argv;
-  mrb_int argc = 0, rest_argc = 0;
-  const char **argv;
-  size_t *argvlen;
+  mrb_sym name = pattern ? mrb_intern_lit(mrb, "subscribed_patterns") : mrb_intern_lit(mrb, "subscribed_channels");
+  mrb_value set = mrb_iv_get(mrb, self, name);
 
-  mrb_get_args(mrb, "o*", &key, &mrb_rest_argv, &rest_argc);
-  argc = rest_argc + 2;
+  if (!mrb_hash_p(set)) {
+    set = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, name, set);
+  }
+  return set;
+}
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
+static inline mrb_int mrb_redis_subscription_count(mrb_state *mrb, mrb_value self, mrb_bool pattern)
+{
+  /* read twice per message: no array of the keys */
+  return mrb_hash_size(mrb, mrb_redis_subscription_set(mrb, self, pattern));
+}
 
-  CREATE_REDIS_COMMAND_ARG1(argv, argvlen, "PFCOUNT", key);
+static void mrb_redis_subscription_send(mrb_state *mrb, mrb_value self, mrb_redis_data *data, const char *cmd,
+                                        const mrb_value *channels, mrb_int len)
+{
+  mrb_bool pattern = cmd[0] == 'P';
+  mrb_bool unsubscribe = cmd[pattern] == 'U';
+  mrb_value set = mrb_redis_subscription_set(mrb, self, pattern);
+  mrb_int replies = len, i;
+  int argc;
 
-  if (argc > 2) {
-    int ai = mrb_gc_arena_save(mrb);
-    mrb_int argc_current;
-    for (argc_current = 2; argc_current < argc; argc_current++) {
-      mrb_value curr = mrb_str_to_str(mrb, mrb_rest_argv[argc_current - 2]);
-      argv[argc_current] = RSTRING_PTR(curr);
-      argvlen[argc_current] = RSTRING_LEN(curr);
-      mrb_gc_arena_restore(mrb, ai);
+  if (len == 0 && !unsubscribe) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no channel given");
+  }
+  for (i = 0; i < len; i++) {
+    mrb_value channel = mrb_str_to_str(mrb, channels[i]);
+    if (unsubscribe) {
+      mrb_hash_delete_key(mrb, set, channel);
+    } else {
+      mrb_hash_set(mrb, set, channel, mrb_true_value());
+    }
+  }
+  if (len == 0) {
+    /* one confirmation per channel, or a single one when there is none */
+    replies = RARRAY_LEN(mrb_hash_keys(mrb, set));
+    if (replies == 0) {
+      replies = 1;
     }
+    mrb_iv_set(mrb, self,
+               pattern ? mrb_intern_lit(mrb, "subscribed_patterns") : mrb_intern_lit(mrb, "subscribed_channels"),
+               mrb_hash_new(mrb));
   }
 
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, argvlen, &rule);
+  argc = mrb_redis_build_args(mrb, data, cmd, NULL, 0, channels, len);
+  mrb_redis_append(mrb, data, argc, data->argv, data->argvlen);
+  data->subscription_replies += replies;
 }
 
-static mrb_value mrb_redis_pfmerge(mrb_state *mrb, mrb_value self)
+static void mrb_redis_subscription_unsubscribe_all(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
 {
-  mrb_value dest_struct, src_struct, *mrb_rest_argv;
-  mrb_int argc = 0, rest_argc = 0;
-  const char **argv;
-  size_t *argvlen;
+  if (mrb_redis_subscription_count(mrb, self, FALSE) > 0) {
+    mrb_redis_subscription_send(mrb, self, data, "UNSUBSCRIBE", NULL, 0);
+  }
+  if (mrb_redis_subscription_count(mrb, self, TRUE) > 0) {
+    mrb_redis_subscription_send(mrb, self, data, "PUNSUBSCRIBE", NULL, 0);
+  }
+}
 
-  mrb_get_args(mrb, "oo*", &dest_struct, &src_struct, &mrb_rest_argv, &rest_argc);
-  argc = rest_argc + 3;
+/* calls the handler of the frame kind with the rest of the frame */
+static void mrb_redis_subscription_dispatch(mrb_state *mrb, mrb_redis_data *data, mrb_value callbacks,
+                                            mrb_value *frame, mrb_int len)
+{
+  mrb_value kind = frame[0], blk;
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
+  if (len < 1 || !mrb_string_p(kind)) {
+    mrb_raise(mrb, E_REDIS_ERR_PROTOCOL, "unexpected reply in subscriber mode");
+  }
+  if (RSTRING_LEN(kind) >= 9 && memcmp(RSTRING_PTR(kind) + RSTRING_LEN(kind) - 9, "subscribe", 9) == 0 &&
+      data->subscription_replies > 0) {
+    data->subscription_replies--;
+  }
+  if (mrb_nil_p(callbacks)) {
+    return;
+  }
+  blk = mrb_hash_get(mrb, callbacks, mrb_symbol_value(mrb_intern(mrb, RSTRING_PTR(kind), RSTRING_LEN(kind))));
+  if (!mrb_nil_p(blk)) {
+    mrb_yield_argv(mrb, blk, len - 1, frame + 1);
+  }
+}
 
-  CREATE_REDIS_COMMAND_ARG2(argv, argvlen, "PFMERGE", dest_struct, src_struct);
+static mrb_redis_data *mrb_redis_subscription_run(mrb_state *mrb, mrb_value self, mrb_redis_data *data,
+                                                  mrb_value callbacks, double timeout)
+{
+  mrb_value frame[MRB_REDIS_FRAME_SLOTS];
+  mrb_int len;
+  int ai = mrb_gc_arena_save(mrb);
 
-  if (argc > 3) {
-    int ai = mrb_gc_arena_save(mrb);
-    mrb_int argc_current;
-    for (argc_current = 3; argc_current < argc; argc_current++) {
-      mrb_value curr = mrb_str_to_str(mrb, mrb_rest_argv[argc_current - 3]);
-      argv[argc_current] = RSTRING_PTR(curr);
-      argvlen[argc_current] = RSTRING_LEN(curr);
-      mrb_gc_arena_restore(mrb, ai);
+  while (data->subscription_replies > 0 || mrb_redis_subscription_count(mrb, self, FALSE) > 0 ||
+         mrb_redis_subscription_count(mrb, self, TRUE) > 0) {
+    if (!mrb_redis_read_frame(mrb, data, frame, &len, timeout)) {
+      /* idle for too long, the confirmations are still dispatched */
+      mrb_redis_subscription_unsubscribe_all(mrb, self, data);
+      timeout = 0;
+      continue;
     }
+    mrb_redis_subscription_dispatch(mrb, data, callbacks, frame, len);
+    mrb_gc_arena_restore(mrb, ai);
+    /* a handler may have closed the connection */
+    mrb_redis_get_context(mrb, self);
+    data = (mrb_redis_data *)DATA_PTR(self);
   }
-
-  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, argvlen, &rule);
+  return data;
 }
 
-static mrb_value mrb_redis_close(mrb_state *mrb, mrb_value self)
+/* __subscription_loop(:subscribe, channels, timeout, callbacks) */
+static mrb_value mrb_redis_subscription_loop(mrb_state *mrb, mrb_value self)
 {
-  redisContext *rc = DATA_PTR(self);
+  mrb_sym command;
+  mrb_value *channels, callbacks;
+  mrb_int len;
+  mrb_float timeout;
+  mrb_redis_data *data;
+  const char *cmd;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  mrb_get_args(mrb, "nafH", &command, &channels, &len, &timeout, &callbacks);
+  cmd = mrb_redis_subscription_command(mrb, command);
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->pipelining || data->queue_counter > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't subscribe while replies of queued commands are pending");
+  }
+  mrb_redis_ready(mrb, self, data);
+
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "subscribed_channels"), mrb_hash_new(mrb));
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "subscribed_patterns"), mrb_hash_new(mrb));
+  data->subscription_replies = 0;
+  data->subscribed = TRUE;
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    mrb_redis_subscription_send(mrb, self, data, cmd, channels, len);
+    data = mrb_redis_subscription_run(mrb, self, data, callbacks, timeout);
+    data->subscribed = FALSE;
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    data = (mrb_redis_data *)DATA_PTR(self);
+    if (data && data->subscribed) {
+      data->subscribed = FALSE;
+      if (data->rc && !data->rc->err) {
+        /* leave subscriber mode before the exception goes up, the messages left are dropped */
+        mrb_redis_subscription_unsubscribe_all(mrb, self, data);
+        mrb_redis_subscription_run(mrb, self, data, mrb_nil_value(), 0);
+      }
+    }
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
 
-  redisFree(rc);
+  return mrb_nil_value();
+}
 
-  DATA_PTR(self) = NULL;
-  DATA_TYPE(self) = NULL;
+/* __subscription_send(:unsubscribe, channels): from the handlers, the loop reads the confirmations */
+static mrb_value mrb_redis_subscription_send_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym command;
+  mrb_value *channels;
+  mrb_int len;
+  mrb_redis_data *data;
+  const char *cmd;
+
+  mrb_get_args(mrb, "na", &command, &channels, &len);
+  cmd = mrb_redis_subscription_command(mrb, command);
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (!data->subscribed) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "not in subscriber mode");
+  }
+  mrb_redis_subscription_send(mrb, self, data, cmd, channels, len);
 
   return mrb_nil_value();
 }
 
-static inline mrb_value mrb_redis_get_ary_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule);
-
-static inline mrb_value mrb_redis_get_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule)
+static mrb_value mrb_redis_subscribed_p(mrb_state *mrb, mrb_value self)
 {
-  switch (reply->type) {
-  case REDIS_REPLY_STRING:
-    return mrb_str_new(mrb, reply->str, reply->len);
-    break;
-  case REDIS_REPLY_ARRAY:
-    return mrb_redis_get_ary_reply(reply, mrb, rule);
-    break;
-  case REDIS_REPLY_INTEGER: {
-    if (rule->integer_to_bool)
-      return mrb_bool_value(reply->integer);
-    else if (FIXABLE(reply->integer))
-      return mrb_fixnum_value(reply->integer);
-    else
-      return mrb_float_value(mrb, reply->integer);
-  } break;
-  case REDIS_REPLY_NIL:
-    return mrb_nil_value();
-    break;
-  case REDIS_REPLY_STATUS: {
-    if (rule->status_to_symbol) {
-      mrb_sym status = mrb_intern(mrb, reply->str, reply->len);
-      return mrb_symbol_value(status);
-    } else {
-      return mrb_str_new(mrb, reply->str, reply->len);
-    }
-  } break;
-  case REDIS_REPLY_ERROR: {
-    mrb_value err = mrb_str_new(mrb, reply->str, reply->len);
-    mrb_value exc = mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, err);
-    if (rule->return_exception) {
-      return exc;
-    } else {
-      freeReplyObject(reply);
-      mrb_exc_raise(mrb, exc);
-    }
-  } break;
-  default:
-    freeReplyObject(reply);
-    mrb_raise(mrb, E_REDIS_ERROR, "unknown reply type");
-  }
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+  return mrb_bool_value(data && data->subscribed);
 }
 
-static inline mrb_value mrb_redis_get_ary_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule)
+/* remembers how to convert the reply of a command appended inside Redis#pipelined */
+static inline void mrb_redis_pipeline_push(mrb_state *mrb, mrb_redis_data *data, const ReplyHandlingRule *rule)
 {
-  if (rule->emptyarray_to_nil && reply->elements == 0) {
-    return mrb_nil_value();
+  if (data->pipeline_len == data->pipeline_capa) {
+    mrb_int capa = data->pipeline_capa ? data->pipeline_capa * 2 : 16;
+    data->pipeline_rules =
+        (ReplyHandlingRule *)mrb_realloc(mrb, data->pipeline_rules, capa * sizeof(ReplyHandlingRule));
+    data->pipeline_capa = capa;
   }
-  mrb_value ary = mrb_ary_new_capa(mrb, reply->elements);
+  data->pipeline_rules[data->pipeline_len] = *rule;
+  /* an error reply must not stop the decoding of the following replies */
+  data->pipeline_rules[data->pipeline_len].return_exception = TRUE;
+  data->pipeline_len++;
+}
+
+/*
+ * Reads count replies into a preallocated array. The first reply read
+ * writes every appended command at once, the following ones are mostly
+ * parsed out of the read buffer without any syscall.
+ */
+static mrb_value mrb_redis_read_replies(mrb_state *mrb, mrb_redis_data *data, mrb_int count,
+                                        const ReplyHandlingRule *rules)
+{
+  ReplyHandlingRule queue_rule = {
+      .status_to_symbol = TRUE,
+      .return_exception = TRUE,
+  };
+  mrb_value replies = mrb_ary_new_capa(mrb, count);
   int ai = mrb_gc_arena_save(mrb);
-  size_t element_couter;
-  for (element_couter = 0; element_couter < reply->elements; element_couter++) {
-    mrb_value element = mrb_redis_get_reply(reply->element[element_couter], mrb, rule);
-    mrb_ary_push(mrb, ary, element);
+  mrb_int i;
+
+  for (i = 0; i < count; i++) {
+    mrb_value reply = mrb_redis_read_reply(mrb, data, rules ? &rules[i] : &queue_rule);
+
+    if (mrb_exception_p(reply)) {
+      data->stats.errors++;
+    }
+    mrb_ary_push(mrb, replies, reply);
     mrb_gc_arena_restore(mrb, ai);
   }
-  return ary;
+
+  return replies;
 }
 
 static mrb_value mrb_redisAppendCommandArgv(mrb_state *mrb, mrb_value self)
 {
   mrb_sym command;
   mrb_value *mrb_argv;
-  mrb_int argc = 0, argc_current;
-  const char **argv;
-  size_t *argvlen;
-  mrb_int command_len;
-  mrb_sym queue_counter_sym;
-  mrb_value queue_counter_val;
+  mrb_int argc = 0;
   mrb_int queue_counter;
-  redisContext *context;
-  int rc;
+  mrb_redis_data *data;
 
   mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
-  argc++;
 
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
-
-  argv[0] = mrb_sym2name_len(mrb, command, &command_len);
-  argvlen[0] = command_len;
-
-  for (argc_current = 1; argc_current < argc; argc_current++) {
-    mrb_value curr = mrb_str_to_str(mrb, mrb_argv[argc_current - 1]);
-    argv[argc_current] = RSTRING_PTR(curr);
-    argvlen[argc_current] = RSTRING_LEN(curr);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (mrb_int_add_overflow(data->queue_counter, 1, &queue_counter)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "integer addition would overflow");
   }
 
-  queue_counter_sym = mrb_intern_lit(mrb, "queue_counter");
-  queue_counter_val = mrb_iv_get(mrb, self, queue_counter_sym);
-  queue_counter = 1;
-  if (mrb_fixnum_p(queue_counter_val)) {
-    queue_counter = mrb_fixnum(queue_counter_val);
-    if (mrb_int_add_overflow(queue_counter, 1, &queue_counter)) {
-      mrb_raise(mrb, E_RUNTIME_ERROR, "integer addition would overflow");
-    }
+  mrb_redis_ready(mrb, self, data);
+  argc = mrb_redis_build_args(mrb, data, mrb_sym2name(mrb, command), NULL, 0, mrb_argv, argc);
+  if (strcasecmp(data->argv[0], "AUTH") == 0 || strcasecmp(data->argv[0], "SELECT") == 0 ||
+      strcasecmp(data->argv[0], "HELLO") == 0 || strcasecmp(data->argv[0], "CLIENT") == 0) {
+    data->session_changed = TRUE;
   }
-
-  context = mrb_redis_get_context(mrb, self);
-  errno = 0;
-  rc = redisAppendCommandArgv(context, argc, argv, argvlen);
-  if (rc == REDIS_OK) {
-    mrb_iv_set(mrb, self, queue_counter_sym, mrb_fixnum_value(queue_counter));
+  if (data->cache) {
+    mrb_redis_cache_written(mrb, data->cache, argc, data->argv, data->argvlen);
+  }
+  mrb_redis_append(mrb, data, argc, data->argv, data->argvlen);
+  if (data->pipelining) {
+    /* the reply is collected by Redis#pipelined, converted as Redis#reply does */
+    ReplyHandlingRule rule = {.status_to_symbol = TRUE};
+    mrb_redis_pipeline_push(mrb, data, &rule);
   } else {
-    mrb_redis_check_error(context, mrb);
+    data->queue_counter = queue_counter;
   }
 
   return self;
@@ -1199,78 +3238,171 @@ static mrb_value mrb_redisAppendCommandArgv(mrb_state *mrb, mrb_value self)
 
 static mrb_value mrb_redisGetReply(mrb_state *mrb, mrb_value self)
 {
-  mrb_sym queue_counter_sym = mrb_intern_lit(mrb, "queue_counter");
-  mrb_value queue_counter_val = mrb_iv_get(mrb, self, queue_counter_sym);
-  mrb_int queue_counter = -1;
-  redisContext *context;
-  redisReply *reply = NULL;
+  mrb_redis_data *data;
   mrb_value reply_val;
   ReplyHandlingRule rule = {
       .status_to_symbol = TRUE,
       .return_exception = TRUE,
   };
-  int rc;
 
-  if (mrb_fixnum_p(queue_counter_val)) {
-    queue_counter = mrb_fixnum(queue_counter_val);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->pipelining) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "replies are returned by Redis#pipelined");
   }
 
-  context = mrb_redis_get_context(mrb, self);
-  reply_val = self;
-  errno = 0;
-  rc = redisGetReply(context, (void **)&reply);
-  if (rc == REDIS_OK && reply != NULL) {
-    struct mrb_jmpbuf *prev_jmp = mrb->jmp;
-    struct mrb_jmpbuf c_jmp;
-
-    MRB_TRY(&c_jmp)
-    {
-      mrb->jmp = &c_jmp;
-      reply_val = mrb_redis_get_reply(reply, mrb, &rule);
-      if (queue_counter > 1) {
-        mrb_iv_set(mrb, self, queue_counter_sym, mrb_fixnum_value(--queue_counter));
-      } else {
-        mrb_iv_remove(mrb, self, queue_counter_sym);
-      }
-      mrb->jmp = prev_jmp;
-    }
-    MRB_CATCH(&c_jmp)
-    {
-      mrb->jmp = prev_jmp;
-      freeReplyObject(reply);
-      MRB_THROW(mrb->jmp);
-    }
-    MRB_END_EXC(&c_jmp);
-
-    freeReplyObject(reply);
-  } else {
-    mrb_redis_check_error(context, mrb);
+  reply_val = mrb_redis_read_reply(mrb, data, &rule);
+  if (data->queue_counter > 0) {
+    data->queue_counter--;
   }
+  mrb_redis_dispatch_pushes(mrb, self, data);
 
   return reply_val;
 }
 
 static mrb_value mrb_redisGetBulkReply(mrb_state *mrb, mrb_value self)
 {
-  mrb_value queue_counter_val = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "queue_counter"));
+  mrb_redis_data *data;
+  mrb_value replies;
   mrb_int queue_counter;
-  mrb_value bulk_reply;
-  int ai;
 
-  if (!mrb_fixnum_p(queue_counter_val))
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  queue_counter = data->queue_counter;
+
+  if (data->pipelining) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "replies are returned by Redis#pipelined");
+  }
+  if (queue_counter <= 0)
     mrb_raise(mrb, E_RUNTIME_ERROR, "nothing queued yet");
 
-  queue_counter = mrb_fixnum(queue_counter_val);
-  bulk_reply = mrb_ary_new_capa(mrb, queue_counter);
+  data->queue_counter = 0;
+  mrb_redis_stats_pipeline(&data->stats, queue_counter);
+  replies = mrb_redis_read_replies(mrb, data, queue_counter, NULL);
+  mrb_redis_dispatch_pushes(mrb, self, data);
+
+  return replies;
+}
+
+/*
+ * Redis#import (mrblib/import.rb) keeps at most window commands in flight:
+ * __import_send appends one, written out by the next read of a reply that
+ * isn't buffered yet, and __import_reply reads the oldest one. Error
+ * replies are returned, not raised, to be collected per row.
+ */
+static mrb_value mrb_redis_import_send(mrb_state *mrb, mrb_value self)
+{
+  mrb_value command;
+  mrb_redis_data *data;
+  mrb_value *args;
+  mrb_int len;
+  int argc, ai;
+
+  mrb_get_args(mrb, "A", &command);
+  len = RARRAY_LEN(command);
+  if (len == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty command");
+  }
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->pipelining || data->multi || data->queue_counter > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "import can't be mixed with pipelined, multi or queued commands");
+  }
+  mrb_redis_ready(mrb, self, data);
+
   ai = mrb_gc_arena_save(mrb);
+  args = RARRAY_PTR(command);
+  argc = mrb_redis_build_args(mrb, data, RSTRING_PTR(mrb_str_to_str(mrb, args[0])), NULL, 0, args + 1, len - 1);
+  if (data->cache) {
+    mrb_redis_cache_written(mrb, data->cache, argc, data->argv, data->argvlen);
+  }
+  mrb_redis_append(mrb, data, argc, data->argv, data->argvlen);
+  mrb_gc_arena_restore(mrb, ai);
 
-  do {
-    mrb_value reply = mrb_redisGetReply(mrb, self);
-    mrb_ary_push(mrb, bulk_reply, reply);
-    mrb_gc_arena_restore(mrb, ai);
-  } while (--queue_counter > 0);
+  return mrb_nil_value();
+}
+
+static mrb_value mrb_redis_import_reply(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data;
+  mrb_value reply;
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  reply = mrb_redis_read_reply(mrb, data, &rule);
+  mrb_redis_dispatch_pushes(mrb, self, data);
+
+  return reply;
+}
+
+/* drops the commands appended by an aborted Redis#pipelined block, nothing has been written yet */
+static inline void mrb_redis_pipeline_discard(mrb_redis_data *data)
+{
+  data->pipelining = FALSE;
+  data->pipeline_len = 0;
+  if (data->rc) {
+    sdsclear(data->rc->obuf);
+  }
+}
+
+static mrb_value mrb_redis_pipelined(mrb_state *mrb, mrb_value self)
+{
+  mrb_value blk, replies;
+  mrb_redis_data *data;
+  mrb_int count;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  mrb_get_args(mrb, "&", &blk);
+  if (mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->pipelining) {
+    /* nested blocks join the outer pipeline */
+    mrb_yield(mrb, blk, self);
+    return mrb_nil_value();
+  }
+  if (data->queue_counter > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "replies of queued commands are still pending");
+  }
+  mrb_redis_ready(mrb, self, data);
+
+  data->pipelining = TRUE;
+  data->pipeline_len = 0;
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    mrb_yield(mrb, blk, self);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    /* the block may have closed the connection */
+    if (DATA_PTR(self)) {
+      mrb_redis_pipeline_discard((mrb_redis_data *)DATA_PTR(self));
+    }
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  data->pipelining = FALSE;
+  count = data->pipeline_len;
+  data->pipeline_len = 0;
 
-  return bulk_reply;
+  mrb_redis_stats_pipeline(&data->stats, count);
+  replies = mrb_redis_read_replies(mrb, data, count, data->pipeline_rules);
+  mrb_redis_dispatch_pushes(mrb, self, data);
+
+  return replies;
 }
 
 static mrb_value mrb_redis_multi(mrb_state *mrb, mrb_value self)
@@ -1279,7 +3411,9 @@ static mrb_value mrb_redis_multi(mrb_state *mrb, mrb_value self)
   size_t lens[1];
   int argc = mrb_redis_create_command_noarg(mrb, "MULTI", argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  mrb_value reply = mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
+  ((mrb_redis_data *)DATA_PTR(self))->multi = TRUE;
+  return reply;
 }
 
 static mrb_value mrb_redis_exec(mrb_state *mrb, mrb_value self)
@@ -1288,6 +3422,8 @@ static mrb_value mrb_redis_exec(mrb_state *mrb, mrb_value self)
   size_t lens[1];
   int argc = mrb_redis_create_command_noarg(mrb, "EXEC", argv, lens);
   ReplyHandlingRule rule = {.emptyarray_to_nil = TRUE};
+  mrb_redis_get_context(mrb, self);
+  ((mrb_redis_data *)DATA_PTR(self))->multi = FALSE;
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
@@ -1297,37 +3433,20 @@ static mrb_value mrb_redis_discard(mrb_state *mrb, mrb_value self)
   size_t lens[1];
   int argc = mrb_redis_create_command_noarg(mrb, "DISCARD", argv, lens);
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  mrb_redis_get_context(mrb, self);
+  ((mrb_redis_data *)DATA_PTR(self))->multi = FALSE;
   return mrb_redis_execute_command(mrb, self, argc, argv, lens, &rule);
 }
 
 static mrb_value mrb_redis_watch(mrb_state *mrb, mrb_value self)
 {
-  mrb_int argc = 0, rest_argc = 0;
   mrb_value key, *mrb_rest_argv;
-  const char **argv;
-  size_t *argvlen;
+  mrb_int rest_argc = 0;
 
   mrb_get_args(mrb, "o*", &key, &mrb_rest_argv, &rest_argc);
-  argc = rest_argc + 2;
-
-  argv = (const char **)alloca(argc * sizeof(char *));
-  argvlen = (size_t *)alloca(argc * sizeof(size_t));
-
-  CREATE_REDIS_COMMAND_ARG1(argv, argvlen, "WATCH", key);
-
-  if (argc > 2) {
-    int ai = mrb_gc_arena_save(mrb);
-    mrb_int argc_current;
-    for (argc_current = 2; argc_current < argc; argc_current++) {
-      mrb_value curr = mrb_str_to_str(mrb, mrb_rest_argv[argc_current - 2]);
-      argv[argc_current] = RSTRING_PTR(curr);
-      argvlen[argc_current] = RSTRING_LEN(curr);
-      mrb_gc_arena_restore(mrb, ai);
-    }
-  }
 
   ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
-  return mrb_redis_execute_command(mrb, self, argc, argv, argvlen, &rule);
+  return mrb_redis_execute_variadic(mrb, self, "WATCH", &key, 1, mrb_rest_argv, rest_argc, 1, MERGE_STATUS, &rule);
 }
 
 static mrb_value mrb_redis_unwatch(mrb_state *mrb, mrb_value self)
@@ -1430,41 +3549,225 @@ static inline int mrb_redis_create_command_str_int_int(mrb_state *mrb, const cha
   CREATE_REDIS_COMMAND_ARG3(argv, lens, cmd, str1, str2, str3);
   return 4;
 }
-static inline int mrb_redis_create_command_str_float_str(mrb_state *mrb, const char *cmd, const char **argv,
-                                                         size_t *lens)
+static inline redisContext *mrb_redis_get_context(mrb_state *mrb, mrb_value self)
 {
-  mrb_value str1, str2, str3;
-  mrb_float float2;
-  mrb_get_args(mrb, "SfS", &str1, &float2, &str3);
-  str2 = mrb_float_to_str(mrb, mrb_float_value(mrb, float2), "%g");
-  CREATE_REDIS_COMMAND_ARG3(argv, lens, cmd, str1, str2, str3);
-  return 4;
+  mrb_redis_data *data = DATA_PTR(self);
+  if (!data || !data->rc) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return data->rc;
 }
 
-static inline redisContext *mrb_redis_get_context(mrb_state *mrb, mrb_value self)
+/* folds the reply of a chunk into the result of the whole command, the first error reply goes to *error */
+static mrb_value mrb_redis_merge_chunk(mrb_state *mrb, enum mrb_redis_merge merge, mrb_value result, mrb_value reply,
+                                       mrb_value *error)
 {
-  redisContext *context = DATA_PTR(self);
-  if (!context) {
-    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  if (mrb_exception_p(reply)) {
+    if (mrb_nil_p(*error)) {
+      *error = reply;
+    }
+  } else if (mrb_nil_p(result)) {
+    result = reply;
+  } else if (merge == MERGE_ARRAY && mrb_array_p(result) && mrb_array_p(reply)) {
+    mrb_ary_concat(mrb, result, reply);
+  } else if (merge == MERGE_SUM && mrb_fixnum_p(result) && mrb_fixnum_p(reply)) {
+    result = mrb_fixnum_value(mrb_fixnum(result) + mrb_fixnum(reply));
+  } else if (merge == MERGE_MAX && mrb_fixnum_p(result) && mrb_fixnum_p(reply)) {
+    if (mrb_fixnum(reply) > mrb_fixnum(result)) {
+      result = reply;
+    }
+  } else {
+    /* MERGE_STATUS, or QUEUED replies inside MULTI */
+    result = reply;
+  }
+  return result;
+}
+
+/*
+ * Runs a variadic command built in the argument buffer. With
+ * Redis#command_chunk_size set, a longer rest is split into commands of
+ * at most that many arguments (a multiple of step, to keep MSET pairs
+ * together), which are pipelined and whose replies are merged. Every chunk
+ * is sent even after an error reply.
+ */
+static mrb_value mrb_redis_execute_variadic(mrb_state *mrb, mrb_value self, const char *cmd, const mrb_value *head,
+                                            mrb_int head_len, const mrb_value *rest, mrb_int rest_len, mrb_int step,
+                                            enum mrb_redis_merge merge, const ReplyHandlingRule *rule)
+{
+  mrb_redis_data *data;
+  ReplyHandlingRule chunk_rule = *rule;
+  mrb_value result = mrb_nil_value(), error = mrb_nil_value();
+  mrb_int chunk, offset, count = 0, i;
+  int argc, ai;
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  chunk = data->command_chunk_size - data->command_chunk_size % step;
+
+  if (merge == MERGE_NONE || data->pipelining || chunk <= 0 || rest_len <= chunk || rest_len % step != 0) {
+    argc = mrb_redis_build_args(mrb, data, cmd, head, head_len, rest, rest_len);
+    return mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, rule);
+  }
+
+  chunk_rule.return_exception = TRUE;
+  ai = mrb_gc_arena_save(mrb);
+  if ((data->sentinel || data->reconnect) && !data->reconnecting && !data->multi && data->queue_counter == 0) {
+    /* the policies resend a failed command alone: each chunk is a round trip of its own */
+    for (offset = 0; offset < rest_len; offset += chunk) {
+      /* a push handler may have closed the connection */
+      mrb_redis_get_context(mrb, self);
+      data = (mrb_redis_data *)DATA_PTR(self);
+      argc = mrb_redis_build_args(mrb, data, cmd, head, head_len, rest + offset,
+                                  rest_len - offset < chunk ? rest_len - offset : chunk);
+      result = mrb_redis_merge_chunk(
+          mrb, merge, result, mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, &chunk_rule),
+          &error);
+      mrb_gc_arena_restore(mrb, ai);
+      mrb_gc_protect(mrb, result);
+      mrb_gc_protect(mrb, error);
+    }
+  } else {
+    /* every chunk is written first, then the replies are read as Redis#pipelined reads them */
+    mrb_redis_ready(mrb, self, data);
+    for (offset = 0; offset < rest_len; offset += chunk) {
+      argc = mrb_redis_build_args(mrb, data, cmd, head, head_len, rest + offset,
+                                  rest_len - offset < chunk ? rest_len - offset : chunk);
+      if (data->cache) {
+        mrb_redis_cache_written(mrb, data->cache, argc, data->argv, data->argvlen);
+      }
+      mrb_redis_append(mrb, data, argc, data->argv, data->argvlen);
+      mrb_gc_arena_restore(mrb, ai);
+      count++;
+    }
+    mrb_redis_stats_pipeline(&data->stats, count);
+    for (i = 0; i < count; i++) {
+      mrb_value reply = mrb_redis_read_reply(mrb, data, &chunk_rule);
+
+      if (mrb_exception_p(reply)) {
+        data->stats.errors++;
+      }
+      result = mrb_redis_merge_chunk(mrb, merge, result, reply, &error);
+      mrb_gc_arena_restore(mrb, ai);
+      mrb_gc_protect(mrb, result);
+      mrb_gc_protect(mrb, error);
+    }
+    mrb_redis_dispatch_pushes(mrb, self, data);
+  }
+
+  if (!mrb_nil_p(error)) {
+    if (rule->return_exception) {
+      return error;
+    }
+    mrb_exc_raise(mrb, error);
   }
-  return context;
+  return result;
+}
+
+/* sends a command and reads its reply, the first error reply in it goes to *error */
+mrb_value mrb_redis_roundtrip(mrb_state *mrb, mrb_redis_data *data, int argc, const char **argv, const size_t *lens,
+                              const ReplyHandlingRule *rule, mrb_value *error)
+{
+  int idx = mrb_redis_append(mrb, data, argc, argv, lens);
+  uint64_t start = mrb_redis_stats_clock();
+  mrb_value reply;
+
+  /* the latency includes the write, done by the first read */
+  data->stats.inflight = idx + 1;
+  reply = mrb_redis_read_reply_ex(mrb, data, rule, error);
+  data->stats.inflight = 0;
+  mrb_redis_stats_sample(&data->stats, idx, mrb_redis_stats_clock() - start, !mrb_nil_p(*error));
+
+  return reply;
 }
 
 static inline mrb_value mrb_redis_execute_command(mrb_state *mrb, mrb_value self, int argc, const char **argv,
                                                   const size_t *lens, const ReplyHandlingRule *rule)
 {
-  mrb_value ret;
-  redisReply *rr;
-  redisContext *rc = mrb_redis_get_context(mrb, self);
+  mrb_redis_data *data;
+  mrb_value reply, error;
 
-  rr = redisCommandArgv(rc, argc, argv, lens);
-  if (rc->err) {
-    mrb_redis_check_error(rc, mrb);
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  mrb_redis_ready(mrb, self, data);
+  if (data->cache) {
+    /* read your own writes, whatever the redirect connection says and when */
+    mrb_redis_cache_written(mrb, data->cache, argc, argv, lens);
+  }
+  if (data->pipelining) {
+    mrb_redis_append(mrb, data, argc, argv, lens);
+    mrb_redis_pipeline_push(mrb, data, rule);
+    /* the reply is in the array returned by Redis#pipelined */
+    return mrb_nil_value();
+  }
+
+  if (data->sentinel && !data->reconnecting && !data->multi && data->queue_counter == 0) {
+    reply = mrb_redis_sentinel_execute(mrb, self, data, argc, argv, lens, rule, &error);
+  } else if (data->reconnect && !data->reconnecting && !data->multi && data->queue_counter == 0) {
+    reply = mrb_redis_reconnect_execute(mrb, self, data, argc, argv, lens, rule, &error);
+  } else {
+    reply = mrb_redis_roundtrip(mrb, data, argc, argv, lens, rule, &error);
+  }
+  if (!rule->return_exception && !mrb_nil_p(error)) {
+    mrb_exc_raise(mrb, error);
+  }
+  mrb_redis_dispatch_pushes(mrb, self, data);
+
+  return reply;
+}
+
+mrb_value mrb_redis_call(mrb_state *mrb, mrb_value self, int argc, const char **argv, const size_t *lens,
+                         const ReplyHandlingRule *rule)
+{
+  return mrb_redis_execute_command(mrb, self, argc, argv, lens, rule);
+}
+
+/* EVAL/EVALSHA script numkeys key... arg..., keys and args are Arrays */
+mrb_value mrb_redis_eval(mrb_state *mrb, mrb_value self, const char *cmd, mrb_value script, mrb_value keys,
+                         mrb_value args, const ReplyHandlingRule *rule)
+{
+  mrb_redis_data *data;
+  mrb_value head[2], rest;
+  int argc;
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  head[0] = script;
+  head[1] = mrb_fixnum_to_str(mrb, mrb_fixnum_value(RARRAY_LEN(keys)), 10);
+  rest = mrb_ary_new_capa(mrb, RARRAY_LEN(keys) + RARRAY_LEN(args));
+  mrb_ary_concat(mrb, rest, keys);
+  mrb_ary_concat(mrb, rest, args);
+  argc = mrb_redis_build_args(mrb, data, cmd, head, 2, RARRAY_PTR(rest), RARRAY_LEN(rest));
+  return mrb_redis_execute_command(mrb, self, argc, data->argv, data->argvlen, rule);
+}
+
+/*
+ * GET/HGET/HGETALL through the client side cache. Inside a transaction or
+ * a pipeline the command goes to the server as usual: its reply is not the
+ * value.
+ */
+static mrb_value mrb_redis_execute_cached(mrb_state *mrb, mrb_value self, enum mrb_redis_cache_kind kind, int argc,
+                                          const char **argv, const size_t *lens, const ReplyHandlingRule *rule)
+{
+  const char *field = argc > 2 ? argv[2] : NULL;
+  size_t fieldlen = argc > 2 ? lens[2] : 0;
+  mrb_redis_data *data;
+  mrb_value reply;
+
+  mrb_redis_get_context(mrb, self);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data->cache == NULL || data->pipelining || data->multi || data->subscribed || data->queue_counter > 0) {
+    return mrb_redis_execute_command(mrb, self, argc, argv, lens, rule);
+  }
+  mrb_redis_cache_poll(mrb, data->cache);
+  if (mrb_redis_cache_lookup(mrb, data->cache, kind, argv[1], lens[1], field, fieldlen, &reply)) {
+    return reply;
+  }
+  reply = mrb_redis_execute_command(mrb, self, argc, argv, lens, rule);
+  if (data->cache) {
+    mrb_redis_cache_store(mrb, data->cache, kind, argv[1], lens[1], field, fieldlen, reply);
   }
 
-  ret = mrb_redis_get_reply(rr, mrb, rule);
-  freeReplyObject(rr);
-  return ret;
+  return reply;
 }
 
 void mrb_mruby_redis_gem_init(mrb_state *mrb)
@@ -1481,6 +3784,7 @@ void mrb_mruby_redis_gem_init(mrb_state *mrb)
   mrb_define_class_under(mrb, redis, "OOMError", E_RUNTIME_ERROR);
   mrb_define_class_under(mrb, redis, "AuthError", E_RUNTIME_ERROR);
   mrb_define_class_under(mrb, redis, "ClosedError", E_RUNTIME_ERROR);
+  mrb_define_class_under(mrb, redis, "TimeoutError", E_REDIS_ERROR);
 
   mrb_define_method(mrb, redis, "initialize", mrb_redis_connect, MRB_ARGS_ANY());
 
@@ -1493,8 +3797,17 @@ void mrb_mruby_redis_gem_init(mrb_state *mrb)
   mrb_define_method(mrb, redis, "auth", mrb_redis_auth, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, redis, "select", mrb_redis_select, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, redis, "ping", mrb_redis_ping, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "zero_copy_threshold=", mrb_redis_set_zero_copy_threshold, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "zero_copy_threshold", mrb_redis_zero_copy_threshold, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "protocol", mrb_redis_protocol, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "on_push", mrb_redis_on_push, MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, redis, "command_chunk_size=", mrb_redis_set_command_chunk_size, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "command_chunk_size", mrb_redis_command_chunk_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "command_timeout=", mrb_redis_set_command_timeout_m, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "command_timeout", mrb_redis_command_timeout, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "host", mrb_redis_host, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "port", mrb_redis_port, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "path", mrb_redis_path, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "set", mrb_redis_set, MRB_ARGS_ARG(2, 1));
   mrb_define_method(mrb, redis, "get", mrb_redis_get, MRB_ARGS_ANY());
   mrb_define_method(mrb, redis, "exists?", mrb_redis_exists, MRB_ARGS_REQ(1));
@@ -1505,6 +3818,15 @@ void mrb_mruby_redis_gem_init(mrb_state *mrb)
   mrb_define_method(mrb, redis, "[]=", mrb_redis_set, MRB_ARGS_ANY());
   mrb_define_method(mrb, redis, "[]", mrb_redis_get, MRB_ARGS_ANY());
   mrb_define_method(mrb, redis, "keys", mrb_redis_keys, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "scan", mrb_redis_scan, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, redis, "sscan", mrb_redis_sscan, MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, redis, "hscan", mrb_redis_hscan, MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, redis, "zscan", mrb_redis_zscan, MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, redis, "__scan_send", mrb_redis_scan_send, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, redis, "__scan_recv", mrb_redis_scan_recv, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "__subscription_loop", mrb_redis_subscription_loop, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, redis, "__subscription_send", mrb_redis_subscription_send_m, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, redis, "subscribed?", mrb_redis_subscribed_p, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "del", mrb_redis_del, MRB_ARGS_ANY());
   mrb_define_method(mrb, redis, "incr", mrb_redis_incr, MRB_ARGS_OPT(1));
   mrb_define_method(mrb, redis, "decr", mrb_redis_decr, MRB_ARGS_OPT(1));
@@ -1538,13 +3860,29 @@ void mrb_mruby_redis_gem_init(mrb_state *mrb)
   mrb_define_method(mrb, redis, "hvals", mrb_redis_hvals, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, redis, "hincrby", mrb_redis_hincrby, MRB_ARGS_REQ(3));
   mrb_define_method(mrb, redis, "ttl", mrb_redis_ttl, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, redis, "zadd", mrb_redis_zadd, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, redis, "zadd", mrb_redis_zadd, (MRB_ARGS_REQ(2) | MRB_ARGS_REST()));
   mrb_define_method(mrb, redis, "zcard", mrb_redis_zcard, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, redis, "zrange", mrb_redis_zrange, MRB_ARGS_REQ(3));
-  mrb_define_method(mrb, redis, "zrevrange", mrb_redis_zrevrange, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, redis, "zrange", mrb_redis_zrange, (MRB_ARGS_REQ(3) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "zrevrange", mrb_redis_zrevrange, (MRB_ARGS_REQ(3) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "zrangebyscore", mrb_redis_zrangebyscore, (MRB_ARGS_REQ(3) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "zrevrangebyscore", mrb_redis_zrevrangebyscore, (MRB_ARGS_REQ(3) | MRB_ARGS_OPT(1)));
   mrb_define_method(mrb, redis, "zrank", mrb_redis_zrank, MRB_ARGS_REQ(2));
   mrb_define_method(mrb, redis, "zrevrank", mrb_redis_zrevrank, MRB_ARGS_REQ(2));
   mrb_define_method(mrb, redis, "zscore", mrb_redis_zscore, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, redis, "zincrby", mrb_redis_zincrby, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, redis, "zrem", mrb_redis_zrem, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, redis, "zpopmin", mrb_redis_zpopmin, (MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "zpopmax", mrb_redis_zpopmax, (MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "xadd", mrb_redis_xadd, (MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "xlen", mrb_redis_xlen, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "xrange", mrb_redis_xrange, (MRB_ARGS_REQ(1) | MRB_ARGS_OPT(3)));
+  mrb_define_method(mrb, redis, "xgroup_create", mrb_redis_xgroup_create, (MRB_ARGS_REQ(2) | MRB_ARGS_OPT(2)));
+  mrb_define_method(mrb, redis, "xread", mrb_redis_xread, (MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "xreadgroup", mrb_redis_xreadgroup, (MRB_ARGS_REQ(3) | MRB_ARGS_OPT(2)));
+  mrb_define_method(mrb, redis, "xack", mrb_redis_xack, (MRB_ARGS_REQ(2) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, redis, "xclaim", mrb_redis_xclaim, (MRB_ARGS_REQ(5) | MRB_ARGS_OPT(1)));
+  mrb_define_method(mrb, redis, "xautoclaim", mrb_redis_xautoclaim, (MRB_ARGS_REQ(4) | MRB_ARGS_OPT(2)));
+  mrb_define_method(mrb, redis, "xpending", mrb_redis_xpending, (MRB_ARGS_REQ(2) | MRB_ARGS_OPT(1)));
   mrb_define_method(mrb, redis, "pfadd", mrb_redis_pfadd, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
   mrb_define_method(mrb, redis, "pfcount", mrb_redis_pfcount, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
   mrb_define_method(mrb, redis, "pfmerge", mrb_redis_pfmerge, (MRB_ARGS_REQ(2) | MRB_ARGS_REST()));
@@ -1553,6 +3891,9 @@ void mrb_mruby_redis_gem_init(mrb_state *mrb)
   mrb_define_method(mrb, redis, "queue", mrb_redisAppendCommandArgv, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
   mrb_define_method(mrb, redis, "reply", mrb_redisGetReply, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "bulk_reply", mrb_redisGetBulkReply, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "__import_send", mrb_redis_import_send, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "__import_reply", mrb_redis_import_reply, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "pipelined", mrb_redis_pipelined, MRB_ARGS_BLOCK());
   mrb_define_method(mrb, redis, "multi", mrb_redis_multi, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "exec", mrb_redis_exec, MRB_ARGS_NONE());
   mrb_define_method(mrb, redis, "discard", mrb_redis_discard, MRB_ARGS_NONE());
@@ -1561,6 +3902,19 @@ void mrb_mruby_redis_gem_init(mrb_state *mrb)
   mrb_define_method(mrb, redis, "setnx", mrb_redis_setnx, MRB_ARGS_REQ(2));
   mrb_define_method(mrb, redis, "cluster", mrb_redis_cluster, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, redis, "asking", mrb_redis_asking, MRB_ARGS_NONE());
+
+  mrb_redis_async_init(mrb, redis);
+  mrb_redis_cluster_init(mrb, redis);
+  mrb_redis_pool_init(mrb, redis);
+  mrb_redis_cache_init(mrb, redis);
+  mrb_redis_stats_init(mrb, redis);
+  mrb_redis_script_init(mrb, redis);
+  mrb_redis_reconnect_init(mrb, redis);
+  mrb_redis_replica_init(mrb, redis);
+  mrb_redis_sentinel_init(mrb, redis);
+  mrb_redis_distributed_init(mrb, redis);
+  mrb_redis_command_init(mrb, redis);
+  mrb_redis_resp_init(mrb, redis);
   DONE;
 }
 
@@ -8,6 +8,243 @@
 #define MRB_REDIS_H
 
 #include "mruby.h"
+#include <hiredis/hiredis.h>
+#include <stdint.h>
+
+typedef struct ReplyHandlingRule {
+  mrb_bool status_to_symbol;
+  mrb_bool integer_to_bool;
+  mrb_bool emptyarray_to_nil;
+  mrb_bool return_exception;
+  mrb_bool emptystring_to_nil; /* MGET/HMGET */
+  mrb_bool array_to_hash;      /* [k1, v1, ..., kN, vN] --> {k1 => v1, ..., kN => vN} */
+  mrb_bool score_to_float;     /* bulk strings are scores: ZSCORE/ZINCRBY */
+  mrb_bool withscores;         /* [m1, s1, ..., mN, sN] --> [[m1, s1], ..., [mN, sN]] with Float scores */
+  int stream_depth;            /* the [f1, v1, ...] arrays this deep are stream entries: {f1 => v1, ...} */
+  mrb_bool first_element;      /* [[m1, s1]] --> [m1, s1], [] --> nil: ZPOPMIN/ZPOPMAX without count */
+} ReplyHandlingRule;
+
+#define DEFAULT_REPLY_HANDLING_RULE                                                                                    \
+  {                                                                                                                    \
+    .status_to_symbol = FALSE, .integer_to_bool = FALSE, .emptyarray_to_nil = FALSE, .return_exception = FALSE,        \
+  }
+
+/* latency histogram: 4 buckets per power of two microseconds, up to 2^26 (67 sec) */
+#define MRB_REDIS_STATS_BUCKETS 104
+
+typedef struct mrb_redis_command_stats {
+  char name[32]; /* upper case */
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t samples; /* calls whose latency was measured, the pipelined ones are not */
+  uint64_t total_usec;
+  uint64_t max_usec;
+  uint64_t buckets[MRB_REDIS_STATS_BUCKETS];
+} mrb_redis_command_stats;
+
+typedef struct mrb_redis_stats {
+  uint64_t commands;
+  uint64_t errors;
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  uint64_t reconnects;
+  uint64_t pipelines; /* Redis#pipelined and Redis#bulk_reply flushes */
+  uint64_t pipelined_commands;
+  uint64_t max_pipeline_depth;
+  mrb_redis_command_stats *per_command; /* malloc'ed: folded into the process wide stats without mruby */
+  int len;
+  int capa;
+  int last;     /* index of the last command looked up */
+  int inflight; /* 1 + index of the command whose reply is being read */
+} mrb_redis_stats;
+
+typedef struct mrb_redis_pool mrb_redis_pool;
+typedef struct mrb_redis_cache mrb_redis_cache;
+typedef struct mrb_redis_reconnect mrb_redis_reconnect;
+typedef struct mrb_redis_sentinel mrb_redis_sentinel;
+
+/* DATA_PTR of a Redis::Command: the RESP head of a command, formatted once */
+typedef struct mrb_redis_command {
+  char *name;
+  size_t name_len;
+  mrb_int arity;      /* arguments after the name, -1 when any number is accepted */
+  char *header;       /* "*N\r\n$len\r\nNAME\r\n", without "*N\r\n" when the arity is not fixed */
+  size_t header_len;
+} mrb_redis_command;
+
+/* DATA_PTR of a Redis instance */
+typedef struct mrb_redis_data {
+  redisContext *rc;
+  mrb_redis_pool *pool; /* borrowed from Redis::Pool, given back instead of freed */
+  mrb_bool shared;      /* set by Redis.connect_set_raw, owned by nobody */
+  mrb_int queue_counter; /* replies pending for Redis#queue */
+  mrb_bool pipelining;   /* inside Redis#pipelined: commands are only appended */
+  ReplyHandlingRule *pipeline_rules; /* how to convert the reply of each pipelined command */
+  mrb_int pipeline_len;
+  mrb_int pipeline_capa;
+  size_t zero_copy_threshold; /* bulk replies this large skip the reader buffer, 0 disables it */
+  const char **argv; /* argument buffer of the variadic commands */
+  size_t *argvlen;
+  mrb_int args_capa;
+  mrb_int command_chunk_size; /* variadic commands longer than this are split, 0 disables it */
+  mrb_bool scan_pending;      /* a prefetched SCAN reply is owed by the server */
+  mrb_bool subscribed;        /* inside Redis#subscribe: only (un)subscribe commands are allowed */
+  mrb_int subscription_replies; /* (un)subscribe confirmations owed by the server */
+  mrb_bool multi;               /* between MULTI and EXEC/DISCARD: replies are QUEUED */
+  mrb_redis_cache *cache;       /* client side cache, NULL when disabled */
+  int protocol;                 /* 3 after HELLO 3, RESP2 otherwise */
+  mrb_value pushes;             /* RESP3 push frames waiting for Redis#on_push, kept alive by an ivar */
+  mrb_redis_stats stats;
+  mrb_redis_reconnect *reconnect; /* reconnect policy, NULL when disabled */
+  mrb_bool reconnecting;          /* AUTH/SELECT are being replayed on a new connection */
+  double command_timeout;         /* sec, a command and its reply take at most this long, 0 disables it */
+  mrb_redis_sentinel *sentinel;   /* Redis::Sentinel: where the master is, NULL otherwise */
+  const mrb_redis_command *compiled; /* set during Redis::Command#call, whose head is not formatted again */
+  mrb_bool session_changed;          /* AUTH, SELECT or HELLO 3 sent: not the session Redis::Pool hands out */
+} mrb_redis_data;
+
+mrb_value mrb_redis_wrap_context(mrb_state *mrb, redisContext *rc, mrb_redis_pool *pool);
+redisContext *mrb_redis_detach_context(mrb_state *mrb, mrb_value self, mrb_redis_pool *pool);
+void mrb_redis_pool_release(mrb_redis_pool *pool, redisContext *rc);
+
+/*
+ * shared between the Redis class and the other clients (Redis::Async, ...).
+ * reply is never freed, not even when it raises: the caller owns it.
+ */
+mrb_value mrb_redis_get_reply(redisReply *reply, mrb_state *mrb, const ReplyHandlingRule *rule);
+/* timeouts: seconds given as Integer or Float, ArgumentError when negative */
+double mrb_redis_seconds(mrb_state *mrb, mrb_value sec);
+struct timeval mrb_redis_timeval(double sec);
+
+/* a Float score, or a bound like "(1.5", as a command argument */
+mrb_value mrb_redis_score_arg(mrb_state *mrb, mrb_value v);
+void *mrb_redis_scratch(mrb_state *mrb, size_t size);
+
+/* runs a command on a Redis instance, like the methods defined in C do */
+mrb_value mrb_redis_call(mrb_state *mrb, mrb_value self, int argc, const char **argv, const size_t *lens,
+                         const ReplyHandlingRule *rule);
+/* fills data->argv/argvlen with cmd, head and rest converted to String; returns argc */
+int mrb_redis_build_args(mrb_state *mrb, mrb_redis_data *data, const char *cmd, const mrb_value *head,
+                         mrb_int head_len, const mrb_value *rest, mrb_int rest_len);
+mrb_value mrb_redis_roundtrip(mrb_state *mrb, mrb_redis_data *data, int argc, const char **argv, const size_t *lens,
+                              const ReplyHandlingRule *rule, mrb_value *error);
+void mrb_redis_reset_context(mrb_state *mrb, mrb_redis_data *data);
+void mrb_redis_set_command_timeout(mrb_state *mrb, mrb_redis_data *data, double sec);
+mrb_value mrb_redis_try_roundtrip(mrb_state *mrb, mrb_redis_data *data, int argc, const char **argv,
+                                  const size_t *lens, const ReplyHandlingRule *rule, mrb_value *error, mrb_value *exc);
+mrb_bool mrb_redis_retryable(const char *name, size_t len);
+void mrb_redis_reconnected(mrb_state *mrb, mrb_value self, mrb_redis_data *data);
+mrb_value mrb_redis_eval(mrb_state *mrb, mrb_value self, const char *cmd, mrb_value script, mrb_value keys,
+                         mrb_value args, const ReplyHandlingRule *rule);
+
+/* client side cache, see mrb_redis_cache.c */
+enum mrb_redis_cache_kind { MRB_REDIS_CACHE_STRING, MRB_REDIS_CACHE_FIELD, MRB_REDIS_CACHE_HASH };
+void mrb_redis_cache_poll(mrb_state *mrb, mrb_redis_cache *cache);
+mrb_bool mrb_redis_cache_lookup(mrb_state *mrb, mrb_redis_cache *cache, enum mrb_redis_cache_kind kind,
+                                const char *key, size_t keylen, const char *field, size_t fieldlen, mrb_value *out);
+void mrb_redis_cache_store(mrb_state *mrb, mrb_redis_cache *cache, enum mrb_redis_cache_kind kind, const char *key,
+                           size_t keylen, const char *field, size_t fieldlen, mrb_value reply);
+void mrb_redis_cache_written(mrb_state *mrb, mrb_redis_cache *cache, int argc, const char **argv, const size_t *lens);
+void mrb_redis_cache_free(mrb_state *mrb, mrb_redis_cache *cache);
+void mrb_redis_cache_lost(mrb_state *mrb, mrb_redis_cache *cache);
+void mrb_redis_cache_reconnected(mrb_state *mrb, mrb_value self, mrb_redis_data *data);
+
+static inline size_t mrb_redis_digits(unsigned long long n)
+{
+  size_t digits = 1;
+  while (n >= 10) {
+    n /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+/* RESP formatting and parsing, see mrb_redis.c and mrb_redis_resp.c */
+size_t mrb_redis_frame_size(const mrb_redis_command *compiled, int argc, const size_t *lens);
+char *mrb_redis_format_frame(char *p, const mrb_redis_command *compiled, int argc, const char **argv,
+                             const size_t *lens);
+const char *mrb_redis_find_crlf(const char *p, size_t len);
+
+/* see mrb_redis_stats.c */
+uint64_t mrb_redis_stats_clock(void);
+int mrb_redis_stats_count(mrb_redis_stats *stats, int argc, const char **argv, const size_t *lens);
+void mrb_redis_stats_sample(mrb_redis_stats *stats, int idx, uint64_t usec, mrb_bool error);
+void mrb_redis_stats_pipeline(mrb_redis_stats *stats, mrb_int depth);
+void mrb_redis_stats_fold(mrb_redis_stats *stats);
+
+/* see mrb_redis_reconnect.c */
+mrb_value mrb_redis_reconnect_execute(mrb_state *mrb, mrb_value self, mrb_redis_data *data, int argc, const char **argv,
+                                      const size_t *lens, const ReplyHandlingRule *rule, mrb_value *error);
+
+/* see mrb_redis_sentinel.c */
+mrb_value mrb_redis_sentinel_execute(mrb_state *mrb, mrb_value self, mrb_redis_data *data, int argc, const char **argv,
+                                     const size_t *lens, const ReplyHandlingRule *rule, mrb_value *error);
+void mrb_redis_sentinel_free(mrb_state *mrb, mrb_redis_sentinel *s);
+
+/* hash slot of a key as Redis Cluster computes it, {hashtag} aware */
+const char *mrb_redis_hashtag(const char *key, size_t len, size_t *taglen);
+int mrb_redis_keyslot(const char *key, size_t len);
+
+/* how the replies of a command split in chunks, or over several nodes, are merged */
+enum mrb_redis_merge { MERGE_NONE, MERGE_ARRAY, MERGE_SUM, MERGE_MAX, MERGE_STATUS };
+
+/*
+ * see mrb_redis_router.c: what Redis::Cluster and Redis::Distributed share.
+ * Their structure starts with a mrb_redis_router, only the way a key is
+ * mapped to a node (slots, ring) is their own.
+ */
+typedef struct mrb_redis_router_node {
+  char *host;
+  int port;
+  redisContext *rc; /* connected lazily */
+} mrb_redis_router_node;
+
+typedef struct mrb_redis_router mrb_redis_router;
+struct mrb_redis_router {
+  mrb_redis_router_node *nodes;
+  int nodes_len;
+  int nodes_capa;
+  struct timeval timeout;
+  mrb_bool keyless; /* commands without a key run on any node, instead of raising */
+  /* shard of a key: its slot, its node on the ring... -1 stands for no key */
+  int (*shard)(mrb_redis_router *r, const char *key, size_t len);
+  /* node the commands of a shard are sent to */
+  int (*shard_node)(mrb_redis_router *r, int shard);
+  /* runs a command on its shard, raises when it can't */
+  redisReply *(*command)(mrb_state *mrb, mrb_redis_router *r, int shard, int argc, const char **argv,
+                         const size_t *lens);
+  /* non zero when the reply sends the command elsewhere, NULL when it never does */
+  int (*redirected)(mrb_state *mrb, mrb_redis_router *r, redisReply *rr);
+};
+
+int mrb_redis_router_find(mrb_redis_router *r, const char *host, size_t host_len, int port);
+int mrb_redis_router_add(mrb_state *mrb, mrb_redis_router *r, const char *host, size_t host_len, int port);
+int mrb_redis_router_spec(mrb_state *mrb, mrb_value spec, const char **host, size_t *host_len);
+redisContext *mrb_redis_router_context(mrb_redis_router *r, int index);
+void mrb_redis_router_disconnect(mrb_redis_router *r, int index);
+void mrb_redis_router_free(mrb_state *mrb, mrb_redis_router *r);
+mrb_value mrb_redis_router_node_name(mrb_state *mrb, mrb_redis_router *r, int index);
+mrb_value mrb_redis_router_nodes(mrb_state *mrb, mrb_redis_router *r);
+mrb_value mrb_redis_router_reply(mrb_state *mrb, redisReply *rr, const ReplyHandlingRule *rule);
+mrb_value mrb_redis_router_call(mrb_state *mrb, mrb_redis_router *r);
+mrb_value mrb_redis_router_multi_key(mrb_state *mrb, mrb_redis_router *r, const char *cmd, mrb_int step,
+                                     enum mrb_redis_merge merge);
+
+/* see mrb_redis_script.c: 20 bytes digest */
+void mrb_redis_sha1(const char *str, size_t len, unsigned char *digest);
+
+void mrb_redis_async_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_cluster_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_pool_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_cache_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_stats_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_script_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_reconnect_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_replica_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_sentinel_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_distributed_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_command_init(mrb_state *mrb, struct RClass *redis);
+void mrb_redis_resp_init(mrb_state *mrb, struct RClass *redis);
 
 void mrb_mruby_redis_gem_init(mrb_state *mrb);
 
@@ -0,0 +1,419 @@
+/*
+// mrb_redis_async.c - Redis::Async, non-blocking client on top of redisAsyncContext
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include <errno.h>
+#include <hiredis/async.h>
+#include <hiredis/hiredis.h>
+#include <mruby/error.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * hiredis drives the connection through the ev.* hooks: it only tells us which
+ * events it is interested in, and we run a small poll(2) loop in Redis::Async#wait
+ * (or Redis::Async.wait_all for several connections) that calls back into
+ * redisAsyncHandleRead/Write. Reply blocks are kept in the "callbacks" Hash of
+ * the owner object so that the GC can see them while a command is in flight.
+ */
+typedef struct mrb_redis_async {
+  redisAsyncContext *ac;
+  mrb_state *mrb;       /* NULL while the context is being torn down */
+  struct RObject *self; /* owner of the callbacks table */
+  short events;         /* POLLIN/POLLOUT requested by hiredis */
+  mrb_int pending;
+  mrb_int next_id;
+} mrb_redis_async;
+
+static void mrb_redis_async_free(mrb_state *mrb, void *p)
+{
+  mrb_redis_async *a = (mrb_redis_async *)p;
+
+  if (a == NULL) {
+    return;
+  }
+  /* callbacks fired by redisAsyncFree must not touch the (dying) mruby objects */
+  a->mrb = NULL;
+  if (a->ac) {
+    redisAsyncFree(a->ac);
+  }
+  mrb_free(mrb, a);
+}
+
+static const struct mrb_data_type mrb_redis_async_type = {
+    "redisAsyncContext", mrb_redis_async_free,
+};
+
+static void mrb_redis_async_add_read(void *privdata)
+{
+  ((mrb_redis_async *)privdata)->events |= POLLIN;
+}
+
+static void mrb_redis_async_del_read(void *privdata)
+{
+  ((mrb_redis_async *)privdata)->events &= ~POLLIN;
+}
+
+static void mrb_redis_async_add_write(void *privdata)
+{
+  ((mrb_redis_async *)privdata)->events |= POLLOUT;
+}
+
+static void mrb_redis_async_del_write(void *privdata)
+{
+  ((mrb_redis_async *)privdata)->events &= ~POLLOUT;
+}
+
+static void mrb_redis_async_cleanup(void *privdata)
+{
+  ((mrb_redis_async *)privdata)->events = 0;
+}
+
+static void mrb_redis_async_on_connect(const redisAsyncContext *ac, int status)
+{
+  if (status != REDIS_OK) {
+    /* hiredis frees the context right after this callback */
+    ((mrb_redis_async *)ac->data)->ac = NULL;
+  }
+}
+
+static void mrb_redis_async_on_disconnect(const redisAsyncContext *ac, int status)
+{
+  ((mrb_redis_async *)ac->data)->ac = NULL;
+}
+
+static inline void mrb_redis_async_set_exception(mrb_state *mrb, mrb_value self, mrb_value exc)
+{
+  mrb_sym exception_sym = mrb_intern_lit(mrb, "exception");
+
+  /* keep the first one, it is raised once control is back in Redis::Async#wait */
+  if (mrb_nil_p(mrb_iv_get(mrb, self, exception_sym))) {
+    mrb_iv_set(mrb, self, exception_sym, exc);
+  }
+}
+
+static void mrb_redis_async_reply_callback(redisAsyncContext *ac, void *r, void *privdata)
+{
+  mrb_redis_async *a = (mrb_redis_async *)ac->data;
+  mrb_state *mrb = a->mrb;
+  mrb_value self, block, reply;
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+  struct mrb_jmpbuf *prev_jmp;
+  struct mrb_jmpbuf c_jmp;
+  int ai;
+
+  a->pending--;
+  if (mrb == NULL) {
+    return;
+  }
+
+  ai = mrb_gc_arena_save(mrb);
+  self = mrb_obj_value(a->self);
+  block = mrb_hash_delete_key(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "callbacks")),
+                              mrb_fixnum_value((mrb_int)(intptr_t)privdata));
+
+  prev_jmp = mrb->jmp;
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    if (r == NULL) {
+      reply = mrb_exc_new_str(mrb, E_REDIS_ERR_CLOSED, mrb_str_new_lit(mrb, "connection closed before reply"));
+    } else {
+      reply = mrb_redis_get_reply((redisReply *)r, mrb, &rule);
+    }
+    if (!mrb_nil_p(block)) {
+      mrb_yield(mrb, block, reply);
+    }
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    /* never unwind through hiredis, it still owns the reply */
+    mrb->jmp = prev_jmp;
+    mrb_redis_async_set_exception(mrb, self, mrb_obj_value(mrb->exc));
+    mrb->exc = NULL;
+  }
+  MRB_END_EXC(&c_jmp);
+
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+static inline mrb_redis_async *mrb_redis_async_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_async *a = (mrb_redis_async *)mrb_data_get_ptr(mrb, self, &mrb_redis_async_type);
+  if (!a || !a->ac) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return a;
+}
+
+static mrb_value mrb_redis_async_connect(mrb_state *mrb, mrb_value self)
+{
+  mrb_value host;
+  mrb_int port;
+  mrb_redis_async *a;
+  redisAsyncContext *ac;
+
+  a = (mrb_redis_async *)DATA_PTR(self);
+  if (a) {
+    mrb_redis_async_free(mrb, a);
+  }
+  DATA_TYPE(self) = &mrb_redis_async_type;
+  DATA_PTR(self) = NULL;
+
+  mrb_get_args(mrb, "Si", &host, &port);
+
+  ac = redisAsyncConnect(mrb_str_to_cstr(mrb, host), port);
+  if (ac == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_OOM, "can't allocate redis async context");
+  }
+  if (ac->err) {
+    mrb_value msg = mrb_str_new_cstr(mrb, ac->errstr);
+    redisAsyncFree(ac);
+    mrb_raisef(mrb, E_REDIS_ERROR, "redis connection failed: %S", msg);
+  }
+
+  a = (mrb_redis_async *)mrb_calloc(mrb, 1, sizeof(mrb_redis_async));
+  a->ac = ac;
+  a->mrb = mrb;
+  a->self = mrb_obj_ptr(self);
+  /* the non-blocking connect completes on the first writable event */
+  a->events = POLLOUT;
+
+  ac->data = a;
+  ac->ev.data = a;
+  ac->ev.addRead = mrb_redis_async_add_read;
+  ac->ev.delRead = mrb_redis_async_del_read;
+  ac->ev.addWrite = mrb_redis_async_add_write;
+  ac->ev.delWrite = mrb_redis_async_del_write;
+  ac->ev.cleanup = mrb_redis_async_cleanup;
+  redisAsyncSetConnectCallback(ac, mrb_redis_async_on_connect);
+  redisAsyncSetDisconnectCallback(ac, mrb_redis_async_on_disconnect);
+
+  DATA_PTR(self) = a;
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "callbacks"), mrb_hash_new(mrb));
+
+  return self;
+}
+
+static mrb_value mrb_redis_async_call(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *mrb_argv, block;
+  mrb_int argc = 0, argc_current;
+  const char **argv;
+  size_t *argvlen;
+  mrb_redis_async *a;
+  mrb_int id;
+  int ai;
+
+  mrb_get_args(mrb, "*&", &mrb_argv, &argc, &block);
+  if (argc < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
+  }
+  a = mrb_redis_async_get(mrb, self);
+
+  argv = (const char **)mrb_redis_scratch(mrb, argc * sizeof(char *));
+  argvlen = (size_t *)mrb_redis_scratch(mrb, argc * sizeof(size_t));
+
+  ai = mrb_gc_arena_save(mrb);
+  for (argc_current = 0; argc_current < argc; argc_current++) {
+    mrb_value curr = mrb_argv[argc_current];
+    if (mrb_symbol_p(curr)) {
+      mrb_int len;
+      argv[argc_current] = mrb_sym2name_len(mrb, mrb_symbol(curr), &len);
+      argvlen[argc_current] = len;
+    } else {
+      curr = mrb_str_to_str(mrb, curr);
+      argv[argc_current] = RSTRING_PTR(curr);
+      argvlen[argc_current] = RSTRING_LEN(curr);
+    }
+  }
+
+  id = a->next_id++;
+  if (redisAsyncCommandArgv(a->ac, mrb_redis_async_reply_callback, (void *)(intptr_t)id, argc, argv, argvlen) !=
+      REDIS_OK) {
+    mrb_raise(mrb, E_REDIS_ERROR, a->ac->errstr ? a->ac->errstr : "can't queue async command");
+  }
+  mrb_gc_arena_restore(mrb, ai);
+
+  a->pending++;
+  if (!mrb_nil_p(block)) {
+    mrb_hash_set(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "callbacks")), mrb_fixnum_value(id), block);
+  }
+
+  return self;
+}
+
+static inline double mrb_redis_async_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void mrb_redis_async_raise_pending(mrb_state *mrb, mrb_redis_async **list, mrb_int n)
+{
+  mrb_sym exception_sym = mrb_intern_lit(mrb, "exception");
+  mrb_int i;
+
+  for (i = 0; i < n; i++) {
+    mrb_value self = mrb_obj_value(list[i]->self);
+    mrb_value exc = mrb_iv_get(mrb, self, exception_sym);
+    if (!mrb_nil_p(exc)) {
+      mrb_iv_remove(mrb, self, exception_sym);
+      mrb_exc_raise(mrb, exc);
+    }
+  }
+}
+
+/*
+ * Run the event loop until every connection in list has no pending reply, or
+ * until timeout seconds elapsed (negative timeout waits forever).
+ * Returns TRUE when all replies have been dispatched.
+ */
+static mrb_bool mrb_redis_async_run(mrb_state *mrb, mrb_redis_async **list, mrb_int n, mrb_float timeout)
+{
+  struct pollfd *fds = (struct pollfd *)mrb_redis_scratch(mrb, n * sizeof(struct pollfd));
+  mrb_redis_async **polled = (mrb_redis_async **)mrb_redis_scratch(mrb, n * sizeof(mrb_redis_async *));
+  double deadline = timeout < 0 ? 0 : mrb_redis_async_now() + timeout;
+  mrb_int i, nfds;
+  int timeout_ms, rc;
+
+  for (;;) {
+    nfds = 0;
+    for (i = 0; i < n; i++) {
+      mrb_redis_async *a = list[i];
+      if (a->ac == NULL || a->pending <= 0 || a->events == 0) {
+        continue;
+      }
+      fds[nfds].fd = a->ac->c.fd;
+      fds[nfds].events = a->events;
+      fds[nfds].revents = 0;
+      polled[nfds++] = a;
+    }
+    if (nfds == 0) {
+      return TRUE;
+    }
+
+    if (timeout < 0) {
+      timeout_ms = -1;
+    } else {
+      double rest = deadline - mrb_redis_async_now();
+      if (rest <= 0) {
+        return FALSE;
+      }
+      timeout_ms = (int)(rest * 1000) + 1;
+    }
+
+    rc = poll(fds, nfds, timeout_ms);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      mrb_sys_fail(mrb, "poll");
+    }
+
+    for (i = 0; i < nfds; i++) {
+      mrb_redis_async *a = polled[i];
+      short revents = fds[i].revents;
+      if (revents & (POLLIN | POLLERR | POLLHUP) && a->ac && (a->events & POLLIN)) {
+        redisAsyncHandleRead(a->ac);
+      }
+      if (revents & (POLLOUT | POLLERR | POLLHUP) && a->ac && (a->events & POLLOUT)) {
+        redisAsyncHandleWrite(a->ac);
+      }
+    }
+    mrb_redis_async_raise_pending(mrb, polled, nfds);
+  }
+}
+
+static mrb_value mrb_redis_async_wait(mrb_state *mrb, mrb_value self)
+{
+  mrb_value timeout = mrb_nil_value();
+  mrb_redis_async *a;
+
+  mrb_get_args(mrb, "|o", &timeout);
+  a = mrb_redis_async_get(mrb, self);
+
+  return mrb_bool_value(mrb_redis_async_run(mrb, &a, 1, mrb_nil_p(timeout) ? -1 : mrb_to_flo(mrb, timeout)));
+}
+
+static mrb_value mrb_redis_async_wait_all(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value clients, timeout = mrb_nil_value();
+  mrb_redis_async **list;
+  mrb_int i, n;
+
+  mrb_get_args(mrb, "A|o", &clients, &timeout);
+  n = RARRAY_LEN(clients);
+  list = (mrb_redis_async **)mrb_redis_scratch(mrb, n * sizeof(mrb_redis_async *));
+  for (i = 0; i < n; i++) {
+    list[i] = mrb_redis_async_get(mrb, mrb_ary_ref(mrb, clients, i));
+  }
+
+  return mrb_bool_value(mrb_redis_async_run(mrb, list, n, mrb_nil_p(timeout) ? -1 : mrb_to_flo(mrb, timeout)));
+}
+
+static mrb_value mrb_redis_async_pending(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(mrb_redis_async_get(mrb, self)->pending);
+}
+
+static mrb_value mrb_redis_async_connected(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_async *a = (mrb_redis_async *)mrb_data_get_ptr(mrb, self, &mrb_redis_async_type);
+  return mrb_bool_value(a && a->ac && (a->ac->c.flags & REDIS_CONNECTED));
+}
+
+static mrb_value mrb_redis_async_close(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_async *a = (mrb_redis_async *)mrb_data_get_ptr(mrb, self, &mrb_redis_async_type);
+
+  if (a && a->ac) {
+    redisAsyncContext *ac = a->ac;
+
+    /*
+     * Pending callbacks are dropped. The struct itself lives until the object is
+     * collected since close may be called from inside a reply callback, in which
+     * case hiredis defers the actual free until the callback returns.
+     */
+    a->mrb = NULL;
+    a->ac = NULL;
+    redisAsyncFree(ac);
+    a->pending = 0;
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "callbacks"), mrb_hash_new(mrb));
+  }
+
+  return mrb_nil_value();
+}
+
+void mrb_redis_async_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *async;
+
+  async = mrb_define_class_under(mrb, redis, "Async", mrb->object_class);
+  MRB_SET_INSTANCE_TT(async, MRB_TT_DATA);
+
+  mrb_define_method(mrb, async, "initialize", mrb_redis_async_connect, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, async, "call", mrb_redis_async_call, (MRB_ARGS_REQ(1) | MRB_ARGS_REST() | MRB_ARGS_BLOCK()));
+  mrb_define_method(mrb, async, "wait", mrb_redis_async_wait, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, async, "pending", mrb_redis_async_pending, MRB_ARGS_NONE());
+  mrb_define_method(mrb, async, "connected?", mrb_redis_async_connected, MRB_ARGS_NONE());
+  mrb_define_method(mrb, async, "close", mrb_redis_async_close, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, async, "wait_all", mrb_redis_async_wait_all, MRB_ARGS_ARG(1, 1));
+}
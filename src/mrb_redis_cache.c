@@ -0,0 +1,727 @@
+/*
+// mrb_redis_cache.c - client side caching of GET/HGET/HGETALL/MGET
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include <errno.h>
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * The server tracks the keys read by the connection (CLIENT TRACKING) and
+ * sends their invalidations to a second connection subscribed to
+ * __redis__:invalidate (the RESP2 redirect mode). That connection is a
+ * plain hiredis context with the default reply objects: it is only polled,
+ * without blocking, before the lookups of each command.
+ *
+ * Entries are grouped by Redis key, since that is what gets invalidated: a
+ * key holds its GET value, its HGETALL value and one value per HGET field.
+ * Keys are evicted whole, least recently used first, once the cache holds
+ * more than max_memory bytes.
+ */
+typedef struct mrb_redis_cache_value {
+  struct mrb_redis_cache_value *next; /* next field of the same key */
+  mrb_bool nil;
+  size_t fieldlen; /* HGET: the field, stored before the payload */
+  size_t len;
+  char data[];
+} mrb_redis_cache_value;
+
+typedef struct mrb_redis_cache_entry {
+  struct mrb_redis_cache_entry *chain;      /* same bucket */
+  struct mrb_redis_cache_entry *prev, *next; /* LRU list, most recent first */
+  uint32_t hash;
+  size_t memory;
+  mrb_redis_cache_value *string; /* GET */
+  mrb_redis_cache_value *all;    /* HGETALL */
+  mrb_redis_cache_value *fields; /* HGET */
+  size_t keylen;
+  char key[];
+} mrb_redis_cache_entry;
+
+struct mrb_redis_cache {
+  redisContext *redirect; /* NULL once lost: lookups always miss */
+  char *password;         /* of the redirect connection, to open it again after a reconnection */
+  mrb_redis_cache_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  mrb_redis_cache_entry *head, *tail;
+  size_t memory;
+  size_t max_memory;
+  mrb_int hits, misses, evictions, invalidations;
+};
+
+#define MRB_REDIS_CACHE_CHANNEL "__redis__:invalidate"
+
+static uint32_t mrb_redis_cache_hash(const char *key, size_t len)
+{
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void mrb_redis_cache_free_values(mrb_state *mrb, mrb_redis_cache_value *v)
+{
+  while (v) {
+    mrb_redis_cache_value *next = v->next;
+    mrb_free(mrb, v);
+    v = next;
+  }
+}
+
+static mrb_redis_cache_entry *mrb_redis_cache_find(mrb_redis_cache *cache, const char *key, size_t keylen,
+                                                   uint32_t hash)
+{
+  mrb_redis_cache_entry *e;
+
+  for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->chain) {
+    if (e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void mrb_redis_cache_unlink_lru(mrb_redis_cache *cache, mrb_redis_cache_entry *e)
+{
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    cache->head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    cache->tail = e->prev;
+  }
+  e->prev = e->next = NULL;
+}
+
+static void mrb_redis_cache_touch(mrb_redis_cache *cache, mrb_redis_cache_entry *e)
+{
+  if (cache->head == e) {
+    return;
+  }
+  if (e->prev || e->next || cache->tail == e) {
+    mrb_redis_cache_unlink_lru(cache, e);
+  }
+  e->next = cache->head;
+  if (cache->head) {
+    cache->head->prev = e;
+  }
+  cache->head = e;
+  if (cache->tail == NULL) {
+    cache->tail = e;
+  }
+}
+
+static void mrb_redis_cache_remove(mrb_state *mrb, mrb_redis_cache *cache, mrb_redis_cache_entry *e)
+{
+  mrb_redis_cache_entry **p = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+  while (*p != e) {
+    p = &(*p)->chain;
+  }
+  *p = e->chain;
+  mrb_redis_cache_unlink_lru(cache, e);
+  cache->memory -= e->memory;
+  cache->count--;
+  mrb_redis_cache_free_values(mrb, e->string);
+  mrb_redis_cache_free_values(mrb, e->all);
+  mrb_redis_cache_free_values(mrb, e->fields);
+  mrb_free(mrb, e);
+}
+
+static void mrb_redis_cache_flush(mrb_state *mrb, mrb_redis_cache *cache)
+{
+  while (cache->head) {
+    mrb_redis_cache_remove(mrb, cache, cache->head);
+  }
+}
+
+static void mrb_redis_cache_invalidate(mrb_state *mrb, mrb_redis_cache *cache, const char *key, size_t keylen)
+{
+  mrb_redis_cache_entry *e = mrb_redis_cache_find(cache, key, keylen, mrb_redis_cache_hash(key, keylen));
+
+  if (e) {
+    mrb_redis_cache_remove(mrb, cache, e);
+    cache->invalidations++;
+  }
+}
+
+static inline mrb_bool mrb_redis_cache_command_is(const char *name, size_t len, const char *upper)
+{
+  return len == strlen(upper) && strncasecmp(name, upper, len) == 0;
+}
+
+/*
+ * A command of this connection that isn't a read: its own invalidation
+ * comes later on the redirect connection, the keys are evicted now so that
+ * the next read doesn't answer the value from before the write. Where the
+ * keys are depends on the command, every argument is evicted.
+ */
+void mrb_redis_cache_written(mrb_state *mrb, mrb_redis_cache *cache, int argc, const char **argv, const size_t *lens)
+{
+  mrb_redis_cache_entry *e;
+  int i;
+
+  if (cache->count == 0 || mrb_redis_retryable(argv[0], lens[0])) {
+    return;
+  }
+  if (mrb_redis_cache_command_is(argv[0], lens[0], "FLUSHDB") ||
+      mrb_redis_cache_command_is(argv[0], lens[0], "FLUSHALL") ||
+      mrb_redis_cache_command_is(argv[0], lens[0], "SWAPDB") ||
+      mrb_redis_cache_command_is(argv[0], lens[0], "SELECT")) {
+    /* the keys cached are not the ones of the db anymore */
+    mrb_redis_cache_flush(mrb, cache);
+    return;
+  }
+  for (i = 1; i < argc && cache->count > 0; i++) {
+    if ((e = mrb_redis_cache_find(cache, argv[i], lens[i], mrb_redis_cache_hash(argv[i], lens[i])))) {
+      mrb_redis_cache_remove(mrb, cache, e);
+    }
+  }
+}
+
+/* the redirect connection or the tracking is gone: nothing cached can be trusted anymore */
+void mrb_redis_cache_lost(mrb_state *mrb, mrb_redis_cache *cache)
+{
+  mrb_redis_cache_flush(mrb, cache);
+  if (cache->redirect) {
+    redisFree(cache->redirect);
+  }
+  cache->redirect = NULL;
+}
+
+/* ["message", "__redis__:invalidate", [key, ...]], nil instead of the keys after a FLUSHALL */
+static void mrb_redis_cache_handle(mrb_state *mrb, mrb_redis_cache *cache, redisReply *reply)
+{
+  redisReply *keys;
+  size_t i;
+
+  if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || reply->element[0]->type != REDIS_REPLY_STRING ||
+      strcmp(reply->element[0]->str, "message") != 0) {
+    return;
+  }
+  keys = reply->element[2];
+  if (keys->type == REDIS_REPLY_NIL) {
+    cache->invalidations += cache->count;
+    mrb_redis_cache_flush(mrb, cache);
+  } else if (keys->type == REDIS_REPLY_ARRAY) {
+    for (i = 0; i < keys->elements; i++) {
+      if (keys->element[i]->type == REDIS_REPLY_STRING) {
+        mrb_redis_cache_invalidate(mrb, cache, keys->element[i]->str, keys->element[i]->len);
+      }
+    }
+  }
+}
+
+/* applies the invalidations already received, never blocks */
+void mrb_redis_cache_poll(mrb_state *mrb, mrb_redis_cache *cache)
+{
+  redisContext *c = cache->redirect;
+  struct pollfd pfd;
+  void *reply;
+
+  while (c) {
+    if (redisReaderGetReply(c->reader, &reply) != REDIS_OK) {
+      mrb_redis_cache_lost(mrb, cache);
+      return;
+    }
+    if (reply) {
+      mrb_redis_cache_handle(mrb, cache, (redisReply *)reply);
+      freeReplyObject(reply);
+      continue;
+    }
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) {
+      return;
+    }
+    if (redisBufferRead(c) != REDIS_OK) {
+      mrb_redis_cache_lost(mrb, cache);
+      return;
+    }
+  }
+}
+
+static mrb_value mrb_redis_cache_value_get(mrb_state *mrb, mrb_redis_cache_value *v, enum mrb_redis_cache_kind kind)
+{
+  mrb_value hash;
+  const char *p, *end;
+
+  if (v->nil) {
+    return mrb_nil_value();
+  }
+  if (kind != MRB_REDIS_CACHE_HASH) {
+    return mrb_str_new(mrb, v->data + v->fieldlen, v->len);
+  }
+
+  /* [len][bytes] of each field and value */
+  hash = mrb_hash_new(mrb);
+  p = v->data;
+  end = v->data + v->len;
+  while (p < end) {
+    mrb_value pair[2];
+    int i;
+    for (i = 0; i < 2; i++) {
+      size_t len;
+      memcpy(&len, p, sizeof(len));
+      p += sizeof(len);
+      pair[i] = mrb_str_new(mrb, p, len);
+      p += len;
+    }
+    mrb_hash_set(mrb, hash, pair[0], pair[1]);
+  }
+  return hash;
+}
+
+mrb_bool mrb_redis_cache_lookup(mrb_state *mrb, mrb_redis_cache *cache, enum mrb_redis_cache_kind kind,
+                                const char *key, size_t keylen, const char *field, size_t fieldlen, mrb_value *out)
+{
+  mrb_redis_cache_entry *e;
+  mrb_redis_cache_value *v = NULL;
+
+  e = cache->count ? mrb_redis_cache_find(cache, key, keylen, mrb_redis_cache_hash(key, keylen)) : NULL;
+  if (e) {
+    switch (kind) {
+    case MRB_REDIS_CACHE_STRING:
+      v = e->string;
+      break;
+    case MRB_REDIS_CACHE_HASH:
+      v = e->all;
+      break;
+    case MRB_REDIS_CACHE_FIELD:
+      for (v = e->fields; v; v = v->next) {
+        if (v->fieldlen == fieldlen && memcmp(v->data, field, fieldlen) == 0) {
+          break;
+        }
+      }
+      break;
+    }
+  }
+  if (v == NULL) {
+    cache->misses++;
+    return FALSE;
+  }
+
+  cache->hits++;
+  mrb_redis_cache_touch(cache, e);
+  *out = mrb_redis_cache_value_get(mrb, v, kind);
+  return TRUE;
+}
+
+/* copies a reply into a value, NULL when it is not something to cache */
+static mrb_redis_cache_value *mrb_redis_cache_value_new(mrb_state *mrb, enum mrb_redis_cache_kind kind,
+                                                        const char *field, size_t fieldlen, mrb_value reply)
+{
+  mrb_redis_cache_value *v;
+  size_t len = 0;
+  mrb_int i;
+
+  if (mrb_nil_p(reply)) {
+    v = (mrb_redis_cache_value *)mrb_malloc(mrb, sizeof(mrb_redis_cache_value) + fieldlen);
+    v->nil = TRUE;
+  } else if (kind != MRB_REDIS_CACHE_HASH && mrb_string_p(reply)) {
+    len = RSTRING_LEN(reply);
+    v = (mrb_redis_cache_value *)mrb_malloc(mrb, sizeof(mrb_redis_cache_value) + fieldlen + len);
+    v->nil = FALSE;
+    memcpy(v->data + fieldlen, RSTRING_PTR(reply), len);
+  } else if (kind == MRB_REDIS_CACHE_HASH && mrb_hash_p(reply)) {
+    mrb_value keys = mrb_hash_keys(mrb, reply);
+    char *p;
+
+    for (i = 0; i < RARRAY_LEN(keys); i++) {
+      mrb_value k = RARRAY_PTR(keys)[i], val = mrb_hash_get(mrb, reply, k);
+      if (!mrb_string_p(k) || !mrb_string_p(val)) {
+        return NULL;
+      }
+      len += 2 * sizeof(size_t) + RSTRING_LEN(k) + RSTRING_LEN(val);
+    }
+    v = (mrb_redis_cache_value *)mrb_malloc(mrb, sizeof(mrb_redis_cache_value) + len);
+    v->nil = FALSE;
+    p = v->data;
+    for (i = 0; i < RARRAY_LEN(keys); i++) {
+      mrb_value pair[2];
+      int j;
+      pair[0] = RARRAY_PTR(keys)[i];
+      pair[1] = mrb_hash_get(mrb, reply, pair[0]);
+      for (j = 0; j < 2; j++) {
+        size_t l = RSTRING_LEN(pair[j]);
+        memcpy(p, &l, sizeof(l));
+        p += sizeof(l);
+        memcpy(p, RSTRING_PTR(pair[j]), l);
+        p += l;
+      }
+    }
+  } else {
+    return NULL;
+  }
+
+  v->next = NULL;
+  v->fieldlen = fieldlen;
+  v->len = len;
+  if (fieldlen) {
+    memcpy(v->data, field, fieldlen);
+  }
+  return v;
+}
+
+static void mrb_redis_cache_grow(mrb_state *mrb, mrb_redis_cache *cache)
+{
+  size_t n = cache->nbuckets * 2, i;
+  mrb_redis_cache_entry **buckets = (mrb_redis_cache_entry **)mrb_calloc(mrb, n, sizeof(mrb_redis_cache_entry *));
+
+  for (i = 0; i < cache->nbuckets; i++) {
+    mrb_redis_cache_entry *e = cache->buckets[i];
+    while (e) {
+      mrb_redis_cache_entry *chain = e->chain;
+      e->chain = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+      e = chain;
+    }
+  }
+  mrb_free(mrb, cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = n;
+}
+
+void mrb_redis_cache_store(mrb_state *mrb, mrb_redis_cache *cache, enum mrb_redis_cache_kind kind, const char *key,
+                           size_t keylen, const char *field, size_t fieldlen, mrb_value reply)
+{
+  uint32_t hash = mrb_redis_cache_hash(key, keylen);
+  mrb_redis_cache_entry *e;
+  mrb_redis_cache_value *v, **slot;
+  size_t size;
+
+  /*
+   * No poll here: an invalidation that came with the reply may be about a
+   * write made after the read, it has to evict the value stored now. The
+   * next lookup applies it.
+   */
+  if (cache->redirect == NULL) {
+    return;
+  }
+  v = mrb_redis_cache_value_new(mrb, kind, field, fieldlen, reply);
+  if (v == NULL) {
+    return;
+  }
+  size = sizeof(mrb_redis_cache_value) + v->fieldlen + v->len;
+  if (size + sizeof(mrb_redis_cache_entry) + keylen > cache->max_memory) {
+    mrb_free(mrb, v);
+    return;
+  }
+
+  e = mrb_redis_cache_find(cache, key, keylen, hash);
+  if (e == NULL) {
+    if (cache->count >= cache->nbuckets) {
+      mrb_redis_cache_grow(mrb, cache);
+    }
+    e = (mrb_redis_cache_entry *)mrb_calloc(mrb, 1, sizeof(mrb_redis_cache_entry) + keylen);
+    e->hash = hash;
+    e->keylen = keylen;
+    memcpy(e->key, key, keylen);
+    e->memory = sizeof(mrb_redis_cache_entry) + keylen;
+    e->chain = cache->buckets[hash & (cache->nbuckets - 1)];
+    cache->buckets[hash & (cache->nbuckets - 1)] = e;
+    cache->memory += e->memory;
+    cache->count++;
+  }
+
+  /* replace the previous value of the same kind (and field) */
+  slot = kind == MRB_REDIS_CACHE_STRING ? &e->string : kind == MRB_REDIS_CACHE_HASH ? &e->all : &e->fields;
+  if (kind == MRB_REDIS_CACHE_FIELD) {
+    while (*slot && !((*slot)->fieldlen == fieldlen && memcmp((*slot)->data, field, fieldlen) == 0)) {
+      slot = &(*slot)->next;
+    }
+  }
+  if (*slot) {
+    mrb_redis_cache_value *old = *slot;
+    size_t old_size = sizeof(mrb_redis_cache_value) + old->fieldlen + old->len;
+    v->next = old->next;
+    e->memory -= old_size;
+    cache->memory -= old_size;
+    mrb_free(mrb, old);
+  }
+  *slot = v;
+  e->memory += size;
+  cache->memory += size;
+  mrb_redis_cache_touch(cache, e);
+
+  while (cache->memory > cache->max_memory && cache->tail) {
+    mrb_redis_cache_remove(mrb, cache, cache->tail);
+    cache->evictions++;
+  }
+}
+
+void mrb_redis_cache_free(mrb_state *mrb, mrb_redis_cache *cache)
+{
+  if (cache == NULL) {
+    return;
+  }
+  mrb_redis_cache_flush(mrb, cache);
+  if (cache->redirect) {
+    redisFree(cache->redirect);
+  }
+  mrb_free(mrb, cache->password);
+  mrb_free(mrb, cache->buckets);
+  mrb_free(mrb, cache);
+}
+
+/* blocking command on the redirect connection, before it subscribes */
+static redisReply *mrb_redis_cache_command(mrb_state *mrb, redisContext *c, int argc, const char **argv)
+{
+  redisReply *reply = redisCommandArgv(c, argc, argv, NULL);
+
+  if (reply == NULL) {
+    mrb_raisef(mrb, E_REDIS_ERROR, "client cache: %S", mrb_str_new_cstr(mrb, c->errstr));
+  }
+  if (reply->type == REDIS_REPLY_ERROR) {
+    mrb_value msg = mrb_str_new(mrb, reply->str, reply->len);
+    freeReplyObject(reply);
+    mrb_exc_raise(mrb, mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, msg));
+  }
+  return reply;
+}
+
+/*
+ * Opens the redirect connection, to the same server as self, and turns
+ * tracking on for self. The cache is left lost when that fails.
+ */
+static void mrb_redis_cache_track(mrb_state *mrb, mrb_value self, mrb_redis_data *data, mrb_redis_cache *cache)
+{
+  redisContext *rc = data->rc, *c;
+  redisReply *reply;
+  struct timeval timeout = {1, 0};
+  long long id;
+  char idbuf[32];
+  int i;
+  const char *argv[5];
+  size_t lens[5];
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  if (rc->connection_type == REDIS_CONN_UNIX) {
+    c = redisConnectUnixWithTimeout(rc->unix_sock.path, timeout);
+  } else {
+    c = redisConnectWithTimeout(rc->tcp.host, rc->tcp.port, timeout);
+  }
+  if (c == NULL || c->err) {
+    if (c) {
+      redisFree(c);
+    }
+    mrb_raise(mrb, E_REDIS_ERROR, "client cache: redirect connection failed.");
+  }
+  cache->redirect = c;
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    if (cache->password) {
+      argv[0] = "AUTH";
+      argv[1] = cache->password;
+      freeReplyObject(mrb_redis_cache_command(mrb, c, 2, argv));
+    }
+    argv[0] = "CLIENT";
+    argv[1] = "ID";
+    reply = mrb_redis_cache_command(mrb, c, 2, argv);
+    id = reply->integer;
+    freeReplyObject(reply);
+    argv[0] = "SUBSCRIBE";
+    argv[1] = MRB_REDIS_CACHE_CHANNEL;
+    freeReplyObject(mrb_redis_cache_command(mrb, c, 2, argv));
+
+    snprintf(idbuf, sizeof(idbuf), "%lld", id);
+    argv[0] = "CLIENT";
+    argv[1] = "TRACKING";
+    argv[2] = "ON";
+    argv[3] = "REDIRECT";
+    argv[4] = idbuf;
+    for (i = 0; i < 5; i++) {
+      lens[i] = strlen(argv[i]);
+    }
+    mrb_redis_call(mrb, self, 5, argv, lens, &rule);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    /* not tracked: an entry could never be invalidated */
+    mrb_redis_cache_lost(mrb, cache);
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+}
+
+/*
+ * data->rc was reconnected: its tracking went with the old connection and
+ * the entries were dropped (mrb_redis_reset_context). Tracking is turned on
+ * again for the new one, a failure leaves the cache lost (tracking: false)
+ * rather than failing the command that reconnected.
+ */
+void mrb_redis_cache_reconnected(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
+{
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  if (data->cache == NULL) {
+    return;
+  }
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    mrb_redis_cache_track(mrb, self, data, data->cache);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    mrb->exc = NULL;
+  }
+  MRB_END_EXC(&c_jmp);
+}
+
+/*
+ * enable_client_cache(max_memory: bytes, password: "...")
+ * Opens the redirect connection, to the same server as self, and turns
+ * tracking on for self.
+ */
+static mrb_value mrb_redis_enable_client_cache(mrb_state *mrb, mrb_value self)
+{
+  mrb_value opts = mrb_nil_value(), v, password = mrb_nil_value();
+  mrb_int max_memory = 16 * 1024 * 1024;
+  mrb_redis_data *data;
+  mrb_redis_cache *cache;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  mrb_get_args(mrb, "|H", &opts);
+  if (!mrb_nil_p(opts)) {
+    if (!mrb_nil_p(v = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "max_memory"))))) {
+      max_memory = mrb_fixnum(mrb_to_int(mrb, v));
+    }
+    password = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "password")));
+  }
+  if (max_memory <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_memory should be positive");
+  }
+  if (!mrb_nil_p(password)) {
+    password = mrb_str_to_str(mrb, password);
+    mrb_str_to_cstr(mrb, password);
+  }
+
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  if (data->cache) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "client cache already enabled");
+  }
+
+  cache = (mrb_redis_cache *)mrb_calloc(mrb, 1, sizeof(mrb_redis_cache));
+  cache->max_memory = (size_t)max_memory;
+  cache->nbuckets = 64;
+  cache->buckets = (mrb_redis_cache_entry **)mrb_calloc(mrb, cache->nbuckets, sizeof(mrb_redis_cache_entry *));
+  if (!mrb_nil_p(password)) {
+    cache->password = (char *)mrb_malloc(mrb, RSTRING_LEN(password) + 1);
+    memcpy(cache->password, RSTRING_PTR(password), RSTRING_LEN(password) + 1);
+  }
+  /* freed with the connection from now on, a reconnection while tracking is set up sees it */
+  data->cache = cache;
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    mrb_redis_cache_track(mrb, self, data, cache);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    /* the connection may have been closed meanwhile, and the cache with it */
+    data = (mrb_redis_data *)DATA_PTR(self);
+    if (data && data->cache == cache) {
+      data->cache = NULL;
+      mrb_redis_cache_free(mrb, cache);
+    }
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  return self;
+}
+
+static mrb_value mrb_redis_disable_client_cache(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+  const char *argv[] = {"CLIENT", "TRACKING", "OFF"};
+  size_t lens[] = {6, 8, 3};
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  if (data == NULL || data->cache == NULL) {
+    return mrb_nil_value();
+  }
+  mrb_redis_cache_free(mrb, data->cache);
+  data->cache = NULL;
+  if (data->rc) {
+    mrb_redis_call(mrb, self, 3, argv, lens, &rule);
+  }
+
+  return self;
+}
+
+static mrb_value mrb_redis_client_cache_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+  mrb_redis_cache *cache;
+  mrb_value stats;
+
+  if (data == NULL || data->cache == NULL) {
+    return mrb_nil_value();
+  }
+  cache = data->cache;
+  mrb_redis_cache_poll(mrb, cache);
+
+  stats = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "hits")), mrb_fixnum_value(cache->hits));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "misses")), mrb_fixnum_value(cache->misses));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "evictions")), mrb_fixnum_value(cache->evictions));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "invalidations")),
+               mrb_fixnum_value(cache->invalidations));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "keys")), mrb_fixnum_value((mrb_int)cache->count));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "memory")), mrb_fixnum_value((mrb_int)cache->memory));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "max_memory")),
+               mrb_fixnum_value((mrb_int)cache->max_memory));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "tracking")), mrb_bool_value(cache->redirect != NULL));
+
+  return stats;
+}
+
+void mrb_redis_cache_init(mrb_state *mrb, struct RClass *redis)
+{
+  mrb_define_method(mrb, redis, "enable_client_cache", mrb_redis_enable_client_cache, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, redis, "disable_client_cache", mrb_redis_disable_client_cache, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "client_cache_stats", mrb_redis_client_cache_stats, MRB_ARGS_NONE());
+}
@@ -0,0 +1,479 @@
+/*
+// mrb_redis_cluster.c - Redis::Cluster, slot aware client for Redis Cluster
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/numeric.h"
+#include "mruby/string.h"
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MRB_REDIS_CLUSTER_SLOTS 16384
+#define MRB_REDIS_CLUSTER_MAX_REDIRECTS 5
+
+/* CRC16-CCITT (XMODEM), as specified by the Redis Cluster spec */
+static const uint16_t crc16tab[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static uint16_t mrb_redis_crc16(const char *buf, size_t len)
+{
+  uint16_t crc = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    crc = (crc << 8) ^ crc16tab[((crc >> 8) ^ (unsigned char)buf[i]) & 0xff];
+  }
+  return crc;
+}
+
+const char *mrb_redis_hashtag(const char *key, size_t len, size_t *taglen)
+{
+  const char *open = memchr(key, '{', len);
+  const char *close;
+
+  if (open) {
+    close = memchr(open + 1, '}', len - (open + 1 - key));
+    /* "{}" is not a hash tag, the whole key is hashed */
+    if (close && close != open + 1) {
+      *taglen = close - open - 1;
+      return open + 1;
+    }
+  }
+  *taglen = len;
+  return key;
+}
+
+int mrb_redis_keyslot(const char *key, size_t len)
+{
+  size_t taglen;
+  const char *tag = mrb_redis_hashtag(key, len, &taglen);
+  return mrb_redis_crc16(tag, taglen) & (MRB_REDIS_CLUSTER_SLOTS - 1);
+}
+
+typedef struct mrb_redis_cluster {
+  mrb_redis_router router; /* first: the cluster is its router */
+  int16_t slots[MRB_REDIS_CLUSTER_SLOTS]; /* index into router.nodes, -1 when unknown */
+} mrb_redis_cluster;
+
+static void mrb_redis_cluster_free(mrb_state *mrb, void *p)
+{
+  mrb_redis_cluster *c = (mrb_redis_cluster *)p;
+
+  if (c == NULL) {
+    return;
+  }
+  mrb_redis_router_free(mrb, &c->router);
+  mrb_free(mrb, c);
+}
+
+static const struct mrb_data_type mrb_redis_cluster_type = {
+    "redisCluster", mrb_redis_cluster_free,
+};
+
+static inline mrb_redis_cluster *mrb_redis_cluster_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_cluster *c = (mrb_redis_cluster *)mrb_data_get_ptr(mrb, self, &mrb_redis_cluster_type);
+  if (!c) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return c;
+}
+
+static int mrb_redis_cluster_node_index(mrb_state *mrb, mrb_redis_cluster *c, const char *host, size_t host_len,
+                                        int port)
+{
+  int i = mrb_redis_router_find(&c->router, host, host_len, port);
+
+  if (i >= 0) {
+    return i;
+  }
+  if (c->router.nodes_len >= INT16_MAX) {
+    mrb_raise(mrb, E_REDIS_ERROR, "too many cluster nodes");
+  }
+  return mrb_redis_router_add(mrb, &c->router, host, host_len, port);
+}
+
+static mrb_bool mrb_redis_cluster_load_slots(mrb_state *mrb, mrb_redis_cluster *c, int index)
+{
+  redisContext *rc = mrb_redis_router_context(&c->router, index);
+  redisReply *rr;
+  size_t i;
+
+  if (rc == NULL) {
+    return FALSE;
+  }
+  rr = redisCommand(rc, "CLUSTER SLOTS");
+  if (rr == NULL || rr->type != REDIS_REPLY_ARRAY) {
+    if (rr) {
+      freeReplyObject(rr);
+    }
+    return FALSE;
+  }
+
+  /* slots no longer listed have no owner anymore */
+  memset(c->slots, 0xff, sizeof(c->slots));
+  for (i = 0; i < rr->elements; i++) {
+    redisReply *range = rr->element[i];
+    redisReply *master;
+    long long slot;
+    int node;
+
+    if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 || range->element[0]->type != REDIS_REPLY_INTEGER ||
+        range->element[1]->type != REDIS_REPLY_INTEGER) {
+      continue;
+    }
+    master = range->element[2];
+    if (master->type != REDIS_REPLY_ARRAY || master->elements < 2 || master->element[0]->type != REDIS_REPLY_STRING ||
+        master->element[1]->type != REDIS_REPLY_INTEGER) {
+      continue;
+    }
+    if (master->element[0]->len == 0) {
+      /* empty host means "the node you asked" */
+      node = mrb_redis_cluster_node_index(mrb, c, c->router.nodes[index].host, strlen(c->router.nodes[index].host),
+                                          (int)master->element[1]->integer);
+    } else {
+      node = mrb_redis_cluster_node_index(mrb, c, master->element[0]->str, master->element[0]->len,
+                                          (int)master->element[1]->integer);
+    }
+    for (slot = range->element[0]->integer < 0 ? 0 : range->element[0]->integer;
+         slot <= range->element[1]->integer && slot < MRB_REDIS_CLUSTER_SLOTS; slot++) {
+      c->slots[slot] = (int16_t)node;
+    }
+  }
+  freeReplyObject(rr);
+
+  return TRUE;
+}
+
+static mrb_bool mrb_redis_cluster_refresh(mrb_state *mrb, mrb_redis_cluster *c)
+{
+  int i;
+
+  for (i = 0; i < c->router.nodes_len; i++) {
+    if (mrb_redis_cluster_load_slots(mrb, c, i)) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static inline int mrb_redis_cluster_slot_node(mrb_redis_cluster *c, int slot)
+{
+  int i;
+
+  if (slot >= 0 && c->slots[slot] >= 0) {
+    return c->slots[slot];
+  }
+  /* keyless command or unknown slot: any reachable node */
+  for (i = 0; i < c->router.nodes_len; i++) {
+    if (c->router.nodes[i].rc) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Parse "MOVED 3999 127.0.0.1:6381" / "ASK 3999 127.0.0.1:6381".
+ * Returns the node index of the target, or -1 if the reply is not a redirection.
+ */
+static int mrb_redis_cluster_redirection(mrb_state *mrb, mrb_redis_cluster *c, redisReply *rr, mrb_bool *ask,
+                                         int *slot)
+{
+  const char *p, *end, *colon;
+  char *endp;
+  long n;
+
+  if (rr->type != REDIS_REPLY_ERROR) {
+    return -1;
+  }
+  if (rr->len > 6 && memcmp(rr->str, "MOVED ", 6) == 0) {
+    *ask = FALSE;
+    p = rr->str + 6;
+  } else if (rr->len > 4 && memcmp(rr->str, "ASK ", 4) == 0) {
+    *ask = TRUE;
+    p = rr->str + 4;
+  } else {
+    return -1;
+  }
+  end = rr->str + rr->len;
+
+  /* the slot indexes c->slots: anything else is an error reply like any other */
+  n = strtol(p, &endp, 10);
+  if (endp == p || *endp != ' ' || n < 0 || n >= MRB_REDIS_CLUSTER_SLOTS) {
+    return -1;
+  }
+  *slot = (int)n;
+  p = endp + 1;
+  /* the port follows the last colon so that IPv6 addresses work too */
+  for (colon = end - 1; colon > p && *colon != ':'; colon--)
+    ;
+  if (colon == p) {
+    return -1;
+  }
+  return mrb_redis_cluster_node_index(mrb, c, p, colon - p, (int)strtol(colon + 1, NULL, 10));
+}
+
+/*
+ * Run one command on the node owning slot (-1 for keyless commands),
+ * following MOVED/ASK redirections. The caller frees the returned reply.
+ */
+static redisReply *mrb_redis_cluster_command(mrb_state *mrb, mrb_redis_cluster *c, int slot, int argc,
+                                             const char **argv, const size_t *lens)
+{
+  int node = mrb_redis_cluster_slot_node(c, slot);
+  mrb_bool asking = FALSE;
+  int attempt;
+
+  for (attempt = 0; attempt <= MRB_REDIS_CLUSTER_MAX_REDIRECTS; attempt++) {
+    redisContext *rc = mrb_redis_router_context(&c->router, node);
+    redisReply *rr = NULL;
+    mrb_bool ask;
+    int target, moved_slot;
+
+    if (rc != NULL) {
+      if (asking) {
+        redisAppendCommand(rc, "ASKING");
+        redisAppendCommandArgv(rc, argc, argv, lens);
+        if (redisGetReply(rc, (void **)&rr) == REDIS_OK) {
+          freeReplyObject(rr);
+          rr = NULL;
+          redisGetReply(rc, (void **)&rr);
+        }
+      } else {
+        rr = redisCommandArgv(rc, argc, argv, lens);
+      }
+    }
+
+    if (rr == NULL) {
+      /* the node went away, ask the cluster who owns the slot now */
+      mrb_redis_router_disconnect(&c->router, node);
+      if (!mrb_redis_cluster_refresh(mrb, c)) {
+        mrb_raise(mrb, E_REDIS_ERROR, "can't reach any cluster node");
+      }
+      node = mrb_redis_cluster_slot_node(c, slot);
+      asking = FALSE;
+      continue;
+    }
+
+    target = mrb_redis_cluster_redirection(mrb, c, rr, &ask, &moved_slot);
+    if (target < 0) {
+      return rr;
+    }
+    freeReplyObject(rr);
+    if (!ask) {
+      c->slots[moved_slot] = (int16_t)target;
+    }
+    node = target;
+    asking = ask;
+  }
+
+  mrb_raise(mrb, E_REDIS_ERROR, "too many cluster redirections");
+  return NULL;
+}
+
+static int mrb_redis_cluster_shard(mrb_redis_router *r, const char *key, size_t len)
+{
+  return mrb_redis_keyslot(key, len);
+}
+
+static int mrb_redis_cluster_shard_node(mrb_redis_router *r, int slot)
+{
+  return mrb_redis_cluster_slot_node((mrb_redis_cluster *)r, slot);
+}
+
+static redisReply *mrb_redis_cluster_routed(mrb_state *mrb, mrb_redis_router *r, int slot, int argc,
+                                            const char **argv, const size_t *lens)
+{
+  return mrb_redis_cluster_command(mrb, (mrb_redis_cluster *)r, slot, argc, argv, lens);
+}
+
+/* a MOVED reply updates the slot map first, so that the command is run again on the new owner */
+static int mrb_redis_cluster_redirected(mrb_state *mrb, mrb_redis_router *r, redisReply *rr)
+{
+  mrb_redis_cluster *c = (mrb_redis_cluster *)r;
+  mrb_bool ask;
+  int slot, target = mrb_redis_cluster_redirection(mrb, c, rr, &ask, &slot);
+
+  if (target >= 0 && !ask) {
+    c->slots[slot] = (int16_t)target;
+  }
+  return target >= 0;
+}
+
+static mrb_value mrb_redis_cluster_connect(mrb_state *mrb, mrb_value self)
+{
+  mrb_value seeds, timeout = mrb_fixnum_value(1);
+  mrb_redis_cluster *c;
+  double sec;
+  mrb_int i;
+
+  c = (mrb_redis_cluster *)DATA_PTR(self);
+  if (c) {
+    mrb_redis_cluster_free(mrb, c);
+  }
+  DATA_TYPE(self) = &mrb_redis_cluster_type;
+  DATA_PTR(self) = NULL;
+
+  mrb_get_args(mrb, "A|o", &seeds, &timeout);
+  if (RARRAY_LEN(seeds) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no cluster node given");
+  }
+  /* fractional seconds, as Redis.new takes them */
+  sec = mrb_redis_seconds(mrb, timeout);
+
+  c = (mrb_redis_cluster *)mrb_calloc(mrb, 1, sizeof(mrb_redis_cluster));
+  memset(c->slots, 0xff, sizeof(c->slots));
+  c->router.timeout = mrb_redis_timeval(sec);
+  c->router.keyless = TRUE;
+  c->router.shard = mrb_redis_cluster_shard;
+  c->router.shard_node = mrb_redis_cluster_shard_node;
+  c->router.command = mrb_redis_cluster_routed;
+  c->router.redirected = mrb_redis_cluster_redirected;
+  DATA_PTR(self) = c;
+
+  /* seed nodes are given as "host:port" or [host, port] */
+  for (i = 0; i < RARRAY_LEN(seeds); i++) {
+    const char *host;
+    size_t host_len;
+    int port = mrb_redis_router_spec(mrb, mrb_ary_ref(mrb, seeds, i), &host, &host_len);
+
+    mrb_redis_cluster_node_index(mrb, c, host, host_len, port);
+  }
+
+  if (!mrb_redis_cluster_refresh(mrb, c)) {
+    mrb_raise(mrb, E_REDIS_ERROR, "redis connection failed.");
+  }
+
+  return self;
+}
+
+static mrb_value mrb_redis_cluster_call(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_call(mrb, &mrb_redis_cluster_get(mrb, self)->router);
+}
+
+/*
+ * MGET/MSET/DEL over keys living in different slots: one pipelined round
+ * trip per node, see mrb_redis_router_multi_key. Groups that were
+ * redirected while we were at it are replayed one by one.
+ */
+static mrb_value mrb_redis_cluster_mget(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_multi_key(mrb, &mrb_redis_cluster_get(mrb, self)->router, "MGET", 1, MERGE_ARRAY);
+}
+
+static mrb_value mrb_redis_cluster_mset(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_multi_key(mrb, &mrb_redis_cluster_get(mrb, self)->router, "MSET", 2, MERGE_STATUS);
+}
+
+static mrb_value mrb_redis_cluster_del(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_multi_key(mrb, &mrb_redis_cluster_get(mrb, self)->router, "DEL", 1, MERGE_SUM);
+}
+
+static mrb_value mrb_redis_cluster_refresh_slots(mrb_state *mrb, mrb_value self)
+{
+  if (!mrb_redis_cluster_refresh(mrb, mrb_redis_cluster_get(mrb, self))) {
+    mrb_raise(mrb, E_REDIS_ERROR, "can't reach any cluster node");
+  }
+  return self;
+}
+
+static mrb_value mrb_redis_cluster_node_for(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_cluster *c = mrb_redis_cluster_get(mrb, self);
+  mrb_value key;
+  int slot;
+
+  mrb_get_args(mrb, "S", &key);
+  slot = mrb_redis_keyslot(RSTRING_PTR(key), RSTRING_LEN(key));
+  if (c->slots[slot] < 0) {
+    return mrb_nil_value();
+  }
+  return mrb_redis_router_node_name(mrb, &c->router, c->slots[slot]);
+}
+
+static mrb_value mrb_redis_cluster_nodes(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_nodes(mrb, &mrb_redis_cluster_get(mrb, self)->router);
+}
+
+static mrb_value mrb_redis_cluster_keyslot(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value key;
+
+  mrb_get_args(mrb, "S", &key);
+  return mrb_fixnum_value(mrb_redis_keyslot(RSTRING_PTR(key), RSTRING_LEN(key)));
+}
+
+static mrb_value mrb_redis_cluster_close(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_cluster_free(mrb, DATA_PTR(self));
+
+  DATA_PTR(self) = NULL;
+  DATA_TYPE(self) = NULL;
+
+  return mrb_nil_value();
+}
+
+void mrb_redis_cluster_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *cluster;
+
+  cluster = mrb_define_class_under(mrb, redis, "Cluster", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cluster, MRB_TT_DATA);
+
+  mrb_define_method(mrb, cluster, "initialize", mrb_redis_cluster_connect, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, cluster, "call", mrb_redis_cluster_call, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, cluster, "mget", mrb_redis_cluster_mget, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cluster, "mset", mrb_redis_cluster_mset, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cluster, "del", mrb_redis_cluster_del, MRB_ARGS_ANY());
+  mrb_define_method(mrb, cluster, "refresh_slots", mrb_redis_cluster_refresh_slots, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cluster, "node_for", mrb_redis_cluster_node_for, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cluster, "nodes", mrb_redis_cluster_nodes, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cluster, "close", mrb_redis_cluster_close, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cluster, "keyslot", mrb_redis_cluster_keyslot, MRB_ARGS_REQ(1));
+}
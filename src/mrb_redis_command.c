@@ -0,0 +1,177 @@
+/*
+// mrb_redis_command.c - Redis::Command, commands whose RESP head is formatted once
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * HINCRBY = Redis::Command.compile("HINCRBY", arity: 3) keeps
+ * "*4\r\n$7\r\nHINCRBY\r\n" and HINCRBY.call(redis, key, field, 1) only
+ * formats the arguments after it, straight into the output buffer of the
+ * connection. The command goes through Redis#pipelined, the reconnect
+ * policy, the statistics... like any method of Redis: data->compiled only
+ * tells mrb_redis_append that its head is already there.
+ */
+
+static void mrb_redis_command_free(mrb_state *mrb, void *p)
+{
+  mrb_redis_command *command = (mrb_redis_command *)p;
+
+  if (command) {
+    mrb_free(mrb, command->name);
+    mrb_free(mrb, command->header);
+    mrb_free(mrb, command);
+  }
+}
+
+static const struct mrb_data_type mrb_redis_command_type = {
+    "redisCommand", mrb_redis_command_free,
+};
+
+static inline mrb_redis_command *mrb_redis_command_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_command *command = (mrb_redis_command *)mrb_data_get_ptr(mrb, self, &mrb_redis_command_type);
+  if (!command) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "command is not compiled");
+  }
+  return command;
+}
+
+/* Redis::Command.compile(name, arity: nil) */
+static mrb_value mrb_redis_command_compile(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value name, opts = mrb_nil_value(), arity_v = mrb_nil_value(), self;
+  mrb_redis_command *command;
+  mrb_int arity = -1;
+  char *p;
+
+  mrb_get_args(mrb, "S|H", &name, &opts);
+  if (RSTRING_LEN(name) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty command name");
+  }
+  if (!mrb_nil_p(opts)) {
+    arity_v = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "arity")));
+  }
+  if (!mrb_nil_p(arity_v)) {
+    arity = mrb_fixnum(mrb_to_int(mrb, arity_v));
+    if (arity < 0 || arity > INT32_MAX - 1) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "arity should not be negative");
+    }
+  }
+
+  self = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(klass), NULL, &mrb_redis_command_type));
+  command = (mrb_redis_command *)mrb_calloc(mrb, 1, sizeof(mrb_redis_command));
+  DATA_PTR(self) = command;
+  command->name_len = RSTRING_LEN(name);
+  command->name = (char *)mrb_malloc(mrb, command->name_len + 1);
+  memcpy(command->name, RSTRING_PTR(name), command->name_len);
+  command->name[command->name_len] = '\0';
+  command->arity = arity;
+
+  /* "*" arity + 1, then "$" len: 20 digits at most each */
+  command->header = p = (char *)mrb_malloc(mrb, command->name_len + 50);
+  if (arity >= 0) {
+    p += sprintf(p, "*%ld\r\n", (long)arity + 1);
+  }
+  p += sprintf(p, "$%lu\r\n", (unsigned long)command->name_len);
+  memcpy(p, command->name, command->name_len);
+  p += command->name_len;
+  *p++ = '\r';
+  *p++ = '\n';
+  command->header_len = p - command->header;
+
+  return self;
+}
+
+/* command.call(redis, *args) */
+static mrb_value mrb_redis_command_call(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_command *command = mrb_redis_command_get(mrb, self);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  mrb_value redis, *mrb_argv, reply = mrb_nil_value();
+  mrb_redis_data *data;
+  mrb_int argc;
+  int nargs;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  mrb_get_args(mrb, "o*", &redis, &mrb_argv, &argc);
+  if (!mrb_obj_is_kind_of(mrb, redis, mrb_class_get(mrb, "Redis"))) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "%S is not a Redis", redis);
+  }
+  if (command->arity >= 0 && argc != command->arity) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of arguments for %S (given %S, expected %S)",
+               mrb_str_new(mrb, command->name, command->name_len), mrb_fixnum_value(argc),
+               mrb_fixnum_value(command->arity));
+  }
+  data = (mrb_redis_data *)DATA_PTR(redis);
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+
+  /* the argument buffer of the connection, like the variadic commands */
+  nargs = mrb_redis_build_args(mrb, data, command->name, NULL, 0, mrb_argv, argc);
+  data->argvlen[0] = command->name_len;
+
+  /* cleared whatever happens: the pointer must not outlive the call */
+  data->compiled = command;
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    reply = mrb_redis_call(mrb, redis, nargs, data->argv, data->argvlen, &rule);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    if (DATA_PTR(redis)) {
+      ((mrb_redis_data *)DATA_PTR(redis))->compiled = NULL;
+    }
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+  if (DATA_PTR(redis)) {
+    ((mrb_redis_data *)DATA_PTR(redis))->compiled = NULL;
+  }
+
+  return reply;
+}
+
+static mrb_value mrb_redis_command_name(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_command *command = mrb_redis_command_get(mrb, self);
+  return mrb_str_new(mrb, command->name, command->name_len);
+}
+
+static mrb_value mrb_redis_command_arity(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_command *command = mrb_redis_command_get(mrb, self);
+  return command->arity >= 0 ? mrb_fixnum_value(command->arity) : mrb_nil_value();
+}
+
+void mrb_redis_command_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *command;
+
+  command = mrb_define_class_under(mrb, redis, "Command", mrb->object_class);
+  MRB_SET_INSTANCE_TT(command, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, command, "new");
+
+  mrb_define_class_method(mrb, command, "compile", mrb_redis_command_compile, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, command, "call", mrb_redis_command_call, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, command, "name", mrb_redis_command_name, MRB_ARGS_NONE());
+  mrb_define_method(mrb, command, "arity", mrb_redis_command_arity, MRB_ARGS_NONE());
+}
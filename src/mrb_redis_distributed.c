@@ -0,0 +1,283 @@
+/*
+// mrb_redis_distributed.c - Redis::Distributed, keys sharded over independent servers by a hash ring
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A ketama style ring: every node is hashed at MRB_REDIS_RING_POINTS
+ * points ("host:port-i", 4 points per digest), a key belongs to the node
+ * of the first point at or after its own hash. Adding a node only takes
+ * the keys falling just before its points, about 1/N of them. The digest
+ * is SHA1 rather than the MD5 of ketama, SHA1 being already here for the
+ * scripts. Keys are hashed by their {hashtag} like Redis Cluster does, so
+ * that related keys stay together.
+ */
+
+#define MRB_REDIS_RING_POINTS 160
+
+typedef struct mrb_redis_ring_point {
+  uint32_t hash;
+  int node;
+} mrb_redis_ring_point;
+
+typedef struct mrb_redis_distributed {
+  mrb_redis_router router; /* first: the ring is its router */
+  mrb_redis_ring_point *ring; /* sorted by hash */
+  size_t ring_len;
+} mrb_redis_distributed;
+
+static void mrb_redis_distributed_free(mrb_state *mrb, void *p)
+{
+  mrb_redis_distributed *d = (mrb_redis_distributed *)p;
+
+  if (d == NULL) {
+    return;
+  }
+  mrb_redis_router_free(mrb, &d->router);
+  mrb_free(mrb, d->ring);
+  mrb_free(mrb, d);
+}
+
+static const struct mrb_data_type mrb_redis_distributed_type = {
+    "redisDistributed", mrb_redis_distributed_free,
+};
+
+static inline mrb_redis_distributed *mrb_redis_distributed_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_distributed *d = (mrb_redis_distributed *)mrb_data_get_ptr(mrb, self, &mrb_redis_distributed_type);
+  if (!d) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return d;
+}
+
+static int mrb_redis_ring_point_cmp(const void *a, const void *b)
+{
+  const mrb_redis_ring_point *x = (const mrb_redis_ring_point *)a, *y = (const mrb_redis_ring_point *)b;
+
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  /* the same point for two nodes: decided by their order, not by qsort */
+  return x->node < y->node ? -1 : (x->node > y->node);
+}
+
+static inline uint32_t mrb_redis_ring_word(const unsigned char *digest, int i)
+{
+  return (uint32_t)digest[i * 4 + 3] << 24 | (uint32_t)digest[i * 4 + 2] << 16 | (uint32_t)digest[i * 4 + 1] << 8 |
+         digest[i * 4];
+}
+
+static uint32_t mrb_redis_ring_hash(const char *key, size_t len)
+{
+  unsigned char digest[20];
+  size_t taglen;
+  const char *tag = mrb_redis_hashtag(key, len, &taglen);
+
+  mrb_redis_sha1(tag, taglen, digest);
+  return mrb_redis_ring_word(digest, 0);
+}
+
+/* adds the points of the node, the ring stays sorted */
+static void mrb_redis_ring_add(mrb_state *mrb, mrb_redis_distributed *d, int node)
+{
+  char label[300];
+  unsigned char digest[20];
+  int i, k, len;
+
+  d->ring = (mrb_redis_ring_point *)mrb_realloc(mrb, d->ring,
+                                                 sizeof(mrb_redis_ring_point) * (d->ring_len + MRB_REDIS_RING_POINTS));
+  for (i = 0; i < MRB_REDIS_RING_POINTS / 4; i++) {
+    len = snprintf(label, sizeof(label), "%s:%d-%d", d->router.nodes[node].host, d->router.nodes[node].port, i);
+    mrb_redis_sha1(label, (size_t)len < sizeof(label) ? (size_t)len : sizeof(label) - 1, digest);
+    for (k = 0; k < 4; k++) {
+      d->ring[d->ring_len].hash = mrb_redis_ring_word(digest, k);
+      d->ring[d->ring_len].node = node;
+      d->ring_len++;
+    }
+  }
+  qsort(d->ring, d->ring_len, sizeof(mrb_redis_ring_point), mrb_redis_ring_point_cmp);
+}
+
+static int mrb_redis_ring_node(mrb_redis_distributed *d, const char *key, size_t len)
+{
+  uint32_t hash = mrb_redis_ring_hash(key, len);
+  size_t lo = 0, hi = d->ring_len;
+
+  /* the first point at or after hash, wrapping around */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (d->ring[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return d->ring[lo == d->ring_len ? 0 : lo].node;
+}
+
+/* "host:port" or [host, port] */
+static void mrb_redis_distributed_add(mrb_state *mrb, mrb_redis_distributed *d, mrb_value spec)
+{
+  const char *host;
+  size_t host_len;
+  int port = mrb_redis_router_spec(mrb, spec, &host, &host_len);
+
+  if (mrb_redis_router_find(&d->router, host, host_len, port) >= 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "node %S given twice", spec);
+  }
+  mrb_redis_ring_add(mrb, d, mrb_redis_router_add(mrb, &d->router, host, host_len, port));
+}
+
+static int mrb_redis_distributed_shard(mrb_redis_router *r, const char *key, size_t len)
+{
+  return mrb_redis_ring_node((mrb_redis_distributed *)r, key, len);
+}
+
+/* the shard of a key is its node */
+static int mrb_redis_distributed_shard_node(mrb_redis_router *r, int node)
+{
+  return node;
+}
+
+static redisReply *mrb_redis_distributed_command(mrb_state *mrb, mrb_redis_router *r, int node, int argc,
+                                                 const char **argv, const size_t *lens)
+{
+  redisContext *rc = mrb_redis_router_context(r, node);
+  redisReply *rr = NULL;
+
+  if (rc == NULL || (rr = redisCommandArgv(rc, argc, argv, lens)) == NULL) {
+    mrb_redis_router_disconnect(r, node);
+    mrb_raisef(mrb, E_REDIS_ERROR, "can't reach node %S", mrb_redis_router_node_name(mrb, r, node));
+  }
+  return rr;
+}
+
+/* Redis::Distributed.new(nodes, timeout = 1) */
+static mrb_value mrb_redis_distributed_init_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_value nodes, timeout = mrb_fixnum_value(1);
+  mrb_redis_distributed *d;
+  mrb_float sec;
+  mrb_int i;
+
+  d = (mrb_redis_distributed *)DATA_PTR(self);
+  if (d) {
+    mrb_redis_distributed_free(mrb, d);
+  }
+  DATA_TYPE(self) = &mrb_redis_distributed_type;
+  DATA_PTR(self) = NULL;
+
+  mrb_get_args(mrb, "A|o", &nodes, &timeout);
+  if (RARRAY_LEN(nodes) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no node given");
+  }
+  sec = mrb_to_flo(mrb, timeout);
+  if (sec < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "timeout should not be negative");
+  }
+
+  d = (mrb_redis_distributed *)mrb_calloc(mrb, 1, sizeof(mrb_redis_distributed));
+  d->router.timeout.tv_sec = (time_t)sec;
+  d->router.timeout.tv_usec = (suseconds_t)((sec - (double)d->router.timeout.tv_sec) * 1000000);
+  d->router.shard = mrb_redis_distributed_shard;
+  d->router.shard_node = mrb_redis_distributed_shard_node;
+  d->router.command = mrb_redis_distributed_command;
+  DATA_PTR(self) = d;
+  for (i = 0; i < RARRAY_LEN(nodes); i++) {
+    mrb_redis_distributed_add(mrb, d, mrb_ary_ref(mrb, nodes, i));
+  }
+
+  return self;
+}
+
+/* call(command, key, *args): on the node owning key */
+static mrb_value mrb_redis_distributed_call(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_call(mrb, &mrb_redis_distributed_get(mrb, self)->router);
+}
+
+/*
+ * MGET/MSET/DEL over several nodes: one command per node with its keys,
+ * see mrb_redis_router_multi_key.
+ */
+static mrb_value mrb_redis_distributed_mget(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_multi_key(mrb, &mrb_redis_distributed_get(mrb, self)->router, "MGET", 1, MERGE_ARRAY);
+}
+
+static mrb_value mrb_redis_distributed_mset(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_multi_key(mrb, &mrb_redis_distributed_get(mrb, self)->router, "MSET", 2, MERGE_STATUS);
+}
+
+static mrb_value mrb_redis_distributed_del(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_multi_key(mrb, &mrb_redis_distributed_get(mrb, self)->router, "DEL", 1, MERGE_SUM);
+}
+
+/* add_node("host:port"): the keys of about 1/N of the ring move to it */
+static mrb_value mrb_redis_distributed_add_node(mrb_state *mrb, mrb_value self)
+{
+  mrb_value spec;
+
+  mrb_get_args(mrb, "o", &spec);
+  mrb_redis_distributed_add(mrb, mrb_redis_distributed_get(mrb, self), spec);
+  return self;
+}
+
+static mrb_value mrb_redis_distributed_node_for(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_distributed *d = mrb_redis_distributed_get(mrb, self);
+  mrb_value key;
+  int node;
+
+  mrb_get_args(mrb, "S", &key);
+  node = mrb_redis_ring_node(d, RSTRING_PTR(key), RSTRING_LEN(key));
+  return mrb_redis_router_node_name(mrb, &d->router, node);
+}
+
+static mrb_value mrb_redis_distributed_nodes(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_router_nodes(mrb, &mrb_redis_distributed_get(mrb, self)->router);
+}
+
+static mrb_value mrb_redis_distributed_close(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_distributed_free(mrb, DATA_PTR(self));
+  DATA_PTR(self) = NULL;
+
+  return mrb_nil_value();
+}
+
+void mrb_redis_distributed_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *distributed;
+
+  distributed = mrb_define_class_under(mrb, redis, "Distributed", mrb->object_class);
+  MRB_SET_INSTANCE_TT(distributed, MRB_TT_DATA);
+
+  mrb_define_method(mrb, distributed, "initialize", mrb_redis_distributed_init_m, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, distributed, "call", mrb_redis_distributed_call, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, distributed, "mget", mrb_redis_distributed_mget, MRB_ARGS_ANY());
+  mrb_define_method(mrb, distributed, "mset", mrb_redis_distributed_mset, MRB_ARGS_ANY());
+  mrb_define_method(mrb, distributed, "del", mrb_redis_distributed_del, MRB_ARGS_ANY());
+  mrb_define_method(mrb, distributed, "add_node", mrb_redis_distributed_add_node, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, distributed, "node_for", mrb_redis_distributed_node_for, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, distributed, "nodes", mrb_redis_distributed_nodes, MRB_ARGS_NONE());
+  mrb_define_method(mrb, distributed, "close", mrb_redis_distributed_close, MRB_ARGS_NONE());
+}
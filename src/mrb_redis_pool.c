@@ -0,0 +1,310 @@
+/*
+// mrb_redis_pool.c - Redis::Pool, process wide connection pool
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include <errno.h>
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Pools are plain C structures living in a process wide list so that every
+ * mrb_state (e.g. one per request in mod_mruby) checks out warm connections
+ * from the same pool. They are allocated with malloc, not mrb_malloc, and
+ * are never freed: a pool outlives the interpreters using it.
+ */
+struct mrb_redis_pool {
+  char *host;
+  int port;
+  struct timeval connect_timeout;
+  double wait_timeout; /* seconds to wait for a free connection */
+  double idle_timeout; /* idle connections older than this are closed, 0 keeps them */
+  int size;            /* max number of connections */
+  int created;         /* idle + checked out */
+  redisContext **idle; /* LIFO, the warmest connection is on top */
+  double *idle_since;
+  int idle_len;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct mrb_redis_pool *next;
+};
+
+static mrb_redis_pool *pools = NULL;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline double mrb_redis_pool_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static mrb_redis_pool *mrb_redis_pool_lookup(const char *host, int port, int size, double wait_timeout,
+                                             double idle_timeout, struct timeval connect_timeout)
+{
+  mrb_redis_pool *pool;
+
+  pthread_mutex_lock(&pools_lock);
+  for (pool = pools; pool; pool = pool->next) {
+    if (pool->port == port && strcmp(pool->host, host) == 0) {
+      pthread_mutex_unlock(&pools_lock);
+      return pool;
+    }
+  }
+
+  pool = (mrb_redis_pool *)calloc(1, sizeof(mrb_redis_pool));
+  if (pool) {
+    pool->host = strdup(host);
+    pool->idle = (redisContext **)calloc(size, sizeof(redisContext *));
+    pool->idle_since = (double *)calloc(size, sizeof(double));
+    if (!pool->host || !pool->idle || !pool->idle_since) {
+      free(pool->host);
+      free(pool->idle);
+      free(pool->idle_since);
+      free(pool);
+      pthread_mutex_unlock(&pools_lock);
+      return NULL;
+    }
+    pool->port = port;
+    pool->size = size;
+    pool->wait_timeout = wait_timeout;
+    pool->idle_timeout = idle_timeout;
+    pool->connect_timeout = connect_timeout;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->next = pools;
+    pools = pool;
+  }
+  pthread_mutex_unlock(&pools_lock);
+
+  return pool;
+}
+
+/* called with pool->lock held */
+static void mrb_redis_pool_evict(mrb_redis_pool *pool)
+{
+  double now;
+  int i, kept = 0;
+
+  if (pool->idle_timeout <= 0) {
+    return;
+  }
+  now = mrb_redis_pool_now();
+  for (i = 0; i < pool->idle_len; i++) {
+    if (now - pool->idle_since[i] > pool->idle_timeout) {
+      redisFree(pool->idle[i]);
+      pool->created--;
+    } else {
+      pool->idle[kept] = pool->idle[i];
+      pool->idle_since[kept] = pool->idle_since[i];
+      kept++;
+    }
+  }
+  pool->idle_len = kept;
+}
+
+/* Gives a context back, may be called from a GC free function: no mruby calls here. */
+void mrb_redis_pool_release(mrb_redis_pool *pool, redisContext *rc)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (rc->err || pool->idle_len >= pool->size) {
+    /* broken connections are not recycled */
+    redisFree(rc);
+    pool->created--;
+  } else {
+    pool->idle[pool->idle_len] = rc;
+    pool->idle_since[pool->idle_len] = mrb_redis_pool_now();
+    pool->idle_len++;
+  }
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void mrb_redis_pool_type_free(mrb_state *mrb, void *p)
+{
+  /* pools are process wide, see above */
+}
+
+static const struct mrb_data_type mrb_redis_pool_type = {
+    "redisPool", mrb_redis_pool_type_free,
+};
+
+static inline mrb_redis_pool *mrb_redis_pool_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_pool *pool = (mrb_redis_pool *)mrb_data_get_ptr(mrb, self, &mrb_redis_pool_type);
+  if (!pool) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "pool is not initialized yet.");
+  }
+  return pool;
+}
+
+static inline mrb_value mrb_redis_pool_option(mrb_state *mrb, mrb_value opts, const char *name)
+{
+  if (mrb_nil_p(opts)) {
+    return mrb_nil_value();
+  }
+  return mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+}
+
+static mrb_value mrb_redis_pool_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value host, opts = mrb_nil_value(), v;
+  mrb_int port, size = 5;
+  double wait_timeout = 1.0, idle_timeout = 0, connect_timeout = 1.0;
+  mrb_redis_pool *pool;
+
+  DATA_TYPE(self) = &mrb_redis_pool_type;
+  DATA_PTR(self) = NULL;
+
+  mrb_get_args(mrb, "Si|H", &host, &port, &opts);
+
+  if (!mrb_nil_p(v = mrb_redis_pool_option(mrb, opts, "size"))) {
+    size = mrb_fixnum(mrb_to_int(mrb, v));
+  }
+  if (!mrb_nil_p(v = mrb_redis_pool_option(mrb, opts, "timeout"))) {
+    wait_timeout = mrb_to_flo(mrb, v);
+  }
+  if (!mrb_nil_p(v = mrb_redis_pool_option(mrb, opts, "idle_timeout"))) {
+    idle_timeout = mrb_to_flo(mrb, v);
+  }
+  if (!mrb_nil_p(v = mrb_redis_pool_option(mrb, opts, "connect_timeout"))) {
+    connect_timeout = mrb_redis_seconds(mrb, v);
+  }
+  if (size < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "pool size should be positive");
+  }
+
+  /* the options of the first interpreter creating the pool win */
+  pool = mrb_redis_pool_lookup(mrb_str_to_cstr(mrb, host), (int)port, (int)size, wait_timeout, idle_timeout,
+                               mrb_redis_timeval(connect_timeout));
+  if (pool == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_OOM, "can't allocate redis pool");
+  }
+  DATA_PTR(self) = pool;
+
+  return self;
+}
+
+static mrb_value mrb_redis_pool_checkout(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_pool *pool = mrb_redis_pool_get(mrb, self);
+  redisContext *rc = NULL;
+  struct timespec deadline;
+  mrb_bool timed_out = FALSE;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)pool->wait_timeout;
+  deadline.tv_nsec += (long)((pool->wait_timeout - (time_t)pool->wait_timeout) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    mrb_redis_pool_evict(pool);
+    if (pool->idle_len > 0) {
+      rc = pool->idle[--pool->idle_len];
+      break;
+    }
+    if (pool->created < pool->size) {
+      /* reserve the slot, connect outside of the lock */
+      pool->created++;
+      break;
+    }
+    if (pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) == ETIMEDOUT) {
+      timed_out = TRUE;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (timed_out) {
+    mrb_raise(mrb, E_REDIS_ERR_POOL_TIMEOUT, "no connection available in the pool");
+  }
+
+  if (rc == NULL) {
+    rc = redisConnectWithTimeout(pool->host, pool->port, pool->connect_timeout);
+    if (rc == NULL || rc->err) {
+      if (rc) {
+        redisFree(rc);
+      }
+      pthread_mutex_lock(&pool->lock);
+      pool->created--;
+      pthread_cond_signal(&pool->cond);
+      pthread_mutex_unlock(&pool->lock);
+      mrb_raise(mrb, E_REDIS_ERROR, "redis connection failed.");
+    }
+  }
+
+  return mrb_redis_wrap_context(mrb, rc, pool);
+}
+
+static mrb_value mrb_redis_pool_checkin(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_pool *pool = mrb_redis_pool_get(mrb, self);
+  mrb_value redis;
+
+  mrb_get_args(mrb, "o", &redis);
+  mrb_redis_pool_release(pool, mrb_redis_detach_context(mrb, redis, pool));
+
+  return mrb_nil_value();
+}
+
+static mrb_value mrb_redis_pool_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(mrb_redis_pool_get(mrb, self)->size);
+}
+
+static mrb_value mrb_redis_pool_idle(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_pool *pool = mrb_redis_pool_get(mrb, self);
+  int idle;
+
+  pthread_mutex_lock(&pool->lock);
+  mrb_redis_pool_evict(pool);
+  idle = pool->idle_len;
+  pthread_mutex_unlock(&pool->lock);
+
+  return mrb_fixnum_value(idle);
+}
+
+static mrb_value mrb_redis_pool_active(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_pool *pool = mrb_redis_pool_get(mrb, self);
+  int active;
+
+  pthread_mutex_lock(&pool->lock);
+  active = pool->created - pool->idle_len;
+  pthread_mutex_unlock(&pool->lock);
+
+  return mrb_fixnum_value(active);
+}
+
+void mrb_redis_pool_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *pool;
+
+  pool = mrb_define_class_under(mrb, redis, "Pool", mrb->object_class);
+  MRB_SET_INSTANCE_TT(pool, MRB_TT_DATA);
+  mrb_define_class_under(mrb, pool, "TimeoutError", mrb_class_get_under(mrb, redis, "ConnectionError"));
+
+  mrb_define_method(mrb, pool, "initialize", mrb_redis_pool_initialize, MRB_ARGS_ARG(2, 1));
+  mrb_define_method(mrb, pool, "checkout", mrb_redis_pool_checkout, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pool, "checkin", mrb_redis_pool_checkin, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pool, "size", mrb_redis_pool_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pool, "idle", mrb_redis_pool_idle, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pool, "active", mrb_redis_pool_active, MRB_ARGS_NONE());
+}
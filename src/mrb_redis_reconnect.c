@@ -0,0 +1,339 @@
+/*
+// mrb_redis_reconnect.c - reconnect policy, health checks and retry of read commands
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include <ctype.h>
+#include <errno.h>
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Once enabled, a broken connection is reconnected by redisReconnect
+ * before the next command, with AUTH, SELECT and HELLO replayed, and a
+ * connection idle for health_check seconds is PINGed first. A command whose
+ * connection fails while it waits for the reply is sent again only when it
+ * is a read in the table below: the server may have run it already.
+ */
+struct mrb_redis_reconnect {
+  mrb_int attempts;    /* reconnections tried before giving up */
+  double base_delay;   /* sec, doubled at each attempt */
+  double max_delay;    /* sec */
+  double health_check; /* sec, 0 disables */
+  uint64_t last_used;  /* usec, mrb_redis_stats_clock */
+};
+
+/*
+ * read only commands, sorted. A write is never in it, even one that sets
+ * the same value again: SET k v NX, SADD, DEL... reply something else the
+ * second time when the first one reached the server.
+ */
+static const char *const retryable_commands[] = {
+    "DBSIZE", "ECHO", "EXISTS", "GET", "GETRANGE", "HEXISTS", "HGET", "HGETALL", "HKEYS", "HLEN", "HMGET", "HSCAN",
+    "HVALS", "KEYS", "LINDEX", "LLEN", "LRANGE", "MGET", "PFCOUNT", "PING", "PTTL", "SCAN", "SCARD", "SISMEMBER",
+    "SMEMBERS", "SSCAN", "STRLEN", "TIME", "TTL", "TYPE", "XLEN", "XRANGE", "XREVRANGE", "ZCARD", "ZCOUNT", "ZRANGE",
+    "ZRANGEBYSCORE", "ZRANK", "ZREVRANGE", "ZREVRANGEBYSCORE", "ZREVRANK", "ZSCAN", "ZSCORE",
+};
+
+mrb_bool mrb_redis_retryable(const char *name, size_t len)
+{
+  char upper[24];
+  size_t i;
+  int lo = 0, hi = sizeof(retryable_commands) / sizeof(retryable_commands[0]) - 1;
+
+  if (len >= sizeof(upper)) {
+    return FALSE;
+  }
+  for (i = 0; i < len; i++) {
+    upper[i] = toupper((unsigned char)name[i]);
+  }
+  upper[len] = '\0';
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2, cmp = strcmp(upper, retryable_commands[mid]);
+    if (cmp == 0) {
+      return TRUE;
+    }
+    if (cmp < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return FALSE;
+}
+
+/* base_delay * 2^attempt, capped, then between half and all of it */
+static void mrb_redis_backoff(const mrb_redis_reconnect *policy, mrb_int attempt)
+{
+  double delay = policy->base_delay;
+  struct timespec ts;
+
+  while (attempt-- > 0 && delay < policy->max_delay) {
+    delay *= 2;
+  }
+  if (delay > policy->max_delay) {
+    delay = policy->max_delay;
+  }
+  delay *= 0.5 + 0.5 * ((double)rand() / RAND_MAX);
+  ts.tv_sec = (time_t)delay;
+  ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+/* AUTH, SELECT and HELLO as they were sent on the previous connection */
+static void mrb_redis_replay(mrb_state *mrb, mrb_value self)
+{
+  mrb_value password = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "password"));
+  mrb_value db = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "db"));
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+  const char *argv[2];
+  size_t lens[2];
+
+  if (mrb_string_p(password)) {
+    argv[0] = "AUTH";
+    lens[0] = 4;
+    argv[1] = RSTRING_PTR(password);
+    lens[1] = RSTRING_LEN(password);
+    mrb_redis_call(mrb, self, 2, argv, lens, &rule);
+  }
+  if (mrb_string_p(db)) {
+    argv[0] = "SELECT";
+    lens[0] = 6;
+    argv[1] = RSTRING_PTR(db);
+    lens[1] = RSTRING_LEN(db);
+    mrb_redis_call(mrb, self, 2, argv, lens, &rule);
+  }
+  if (data->protocol == 3) {
+    argv[0] = "HELLO";
+    lens[0] = 5;
+    argv[1] = "3";
+    lens[1] = 1;
+    mrb_redis_call(mrb, self, 2, argv, lens, &rule);
+  }
+  if (mrb_symbol_p(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "keepalive"))) &&
+      mrb_symbol(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "keepalive"))) == mrb_intern_lit(mrb, "on")) {
+    redisEnableKeepAlive(data->rc);
+  }
+}
+
+/* data->rc was connected again, or replaced (Redis::Sentinel): the state of the previous one is set up on it */
+void mrb_redis_reconnected(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
+{
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  mrb_redis_reset_context(mrb, data);
+  if (data->command_timeout > 0) {
+    mrb_redis_set_command_timeout(mrb, data, data->command_timeout);
+  }
+  mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "loaded_scripts"));
+  data->stats.reconnects++;
+  data->reconnecting = TRUE;
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    mrb_redis_replay(mrb, self);
+    mrb_redis_cache_reconnected(mrb, self, data);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    data->reconnecting = FALSE;
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+  data->reconnecting = FALSE;
+  if (data->reconnect) {
+    data->reconnect->last_used = mrb_redis_stats_clock();
+  }
+}
+
+/* reconnects the context of self, FALSE when every attempt failed */
+static mrb_bool mrb_redis_reconnect_now(mrb_state *mrb, mrb_value self, mrb_redis_data *data, mrb_int attempts)
+{
+  mrb_int i;
+
+  for (i = 0; i < attempts; i++) {
+    if (i > 0) {
+      mrb_redis_backoff(data->reconnect, i - 1);
+    }
+    errno = 0;
+    if (redisReconnect(data->rc) == REDIS_OK) {
+      break;
+    }
+  }
+  if (i == attempts) {
+    return FALSE;
+  }
+  mrb_redis_reconnected(mrb, self, data);
+
+  return TRUE;
+}
+
+/* runs a command, what it raised goes to *exc */
+mrb_value mrb_redis_try_roundtrip(mrb_state *mrb, mrb_redis_data *data, int argc, const char **argv,
+                                  const size_t *lens, const ReplyHandlingRule *rule, mrb_value *error, mrb_value *exc)
+{
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  mrb_value reply = mrb_nil_value();
+
+  *exc = mrb_nil_value();
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    reply = mrb_redis_roundtrip(mrb, data, argc, argv, lens, rule, error);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    *exc = mrb_obj_value(mrb->exc);
+    mrb->exc = NULL;
+    mrb_gc_protect(mrb, *exc);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  return reply;
+}
+
+/* a broken connection, or one that doesn't answer PING after idling, is replaced first */
+static void mrb_redis_health_check(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
+{
+  mrb_redis_reconnect *policy = data->reconnect;
+  mrb_bool broken = data->rc->err != 0;
+
+  if (!broken && policy->health_check > 0 &&
+      mrb_redis_stats_clock() - policy->last_used > (uint64_t)(policy->health_check * 1000000)) {
+    const char *argv[] = {"PING"};
+    size_t lens[] = {4};
+    ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+    mrb_value error, exc;
+
+    mrb_redis_try_roundtrip(mrb, data, 1, argv, lens, &rule, &error, &exc);
+    broken = !mrb_nil_p(exc) && data->rc->err != 0;
+  }
+  if (broken && !mrb_redis_reconnect_now(mrb, self, data, policy->attempts)) {
+    mrb_raise(mrb, E_REDIS_ERROR, "reconnection failed.");
+  }
+}
+
+mrb_value mrb_redis_reconnect_execute(mrb_state *mrb, mrb_value self, mrb_redis_data *data, int argc, const char **argv,
+                                      const size_t *lens, const ReplyHandlingRule *rule, mrb_value *error)
+{
+  mrb_value reply, exc;
+
+  mrb_redis_health_check(mrb, self, data);
+  reply = mrb_redis_try_roundtrip(mrb, data, argc, argv, lens, rule, error, &exc);
+  if (!mrb_nil_p(exc)) {
+    /*
+     * only I/O errors, the connection is left as it is on anything else. A
+     * timed out command is neither sent again nor waits for a reconnection:
+     * the next command reconnects.
+     */
+    if (data->rc == NULL || data->rc->err == 0 || mrb_obj_is_kind_of(mrb, exc, E_REDIS_ERR_TIMEOUT)) {
+      mrb_exc_raise(mrb, exc);
+    }
+    if (!mrb_redis_reconnect_now(mrb, self, data, data->reconnect->attempts) ||
+        !mrb_redis_retryable(argv[0], lens[0])) {
+      mrb_exc_raise(mrb, exc);
+    }
+    reply = mrb_redis_roundtrip(mrb, data, argc, argv, lens, rule, error);
+  }
+  data->reconnect->last_used = mrb_redis_stats_clock();
+
+  return reply;
+}
+
+static double mrb_redis_reconnect_option(mrb_state *mrb, mrb_value opts, const char *name, double def)
+{
+  mrb_value v = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+  double d;
+
+  if (mrb_nil_p(v)) {
+    return def;
+  }
+  d = mrb_to_flo(mrb, v);
+  if (d < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S should not be negative", mrb_str_new_cstr(mrb, name));
+  }
+  return d;
+}
+
+/* enable_reconnect(attempts: 3, base_delay: 0.05, max_delay: 1.0, health_check: 0) */
+static mrb_value mrb_redis_enable_reconnect(mrb_state *mrb, mrb_value self)
+{
+  mrb_value opts = mrb_hash_new(mrb);
+  mrb_redis_data *data;
+  mrb_redis_reconnect policy;
+
+  mrb_get_args(mrb, "|H", &opts);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+
+  policy.attempts = (mrb_int)mrb_redis_reconnect_option(mrb, opts, "attempts", 3);
+  policy.base_delay = mrb_redis_reconnect_option(mrb, opts, "base_delay", 0.05);
+  policy.max_delay = mrb_redis_reconnect_option(mrb, opts, "max_delay", 1.0);
+  policy.health_check = mrb_redis_reconnect_option(mrb, opts, "health_check", 0);
+  policy.last_used = mrb_redis_stats_clock();
+  if (policy.attempts < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "attempts should be 1 or more");
+  }
+
+  if (data->reconnect == NULL) {
+    data->reconnect = (mrb_redis_reconnect *)mrb_malloc(mrb, sizeof(mrb_redis_reconnect));
+  }
+  *data->reconnect = policy;
+  return self;
+}
+
+static mrb_value mrb_redis_disable_reconnect(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+
+  if (data) {
+    mrb_free(mrb, data->reconnect);
+    data->reconnect = NULL;
+  }
+  return mrb_nil_value();
+}
+
+/* reconnects now, with the policy when there is one */
+static mrb_value mrb_redis_reconnect_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  if (data->pipelining || data->subscribed) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "can't reconnect inside pipelined or subscribe");
+  }
+  if (!mrb_redis_reconnect_now(mrb, self, data, data->reconnect ? data->reconnect->attempts : 1)) {
+    mrb_raise(mrb, E_REDIS_ERROR, "reconnection failed.");
+  }
+  return self;
+}
+
+void mrb_redis_reconnect_init(mrb_state *mrb, struct RClass *redis)
+{
+  mrb_define_method(mrb, redis, "enable_reconnect", mrb_redis_enable_reconnect, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, redis, "disable_reconnect", mrb_redis_disable_reconnect, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "reconnect", mrb_redis_reconnect_m, MRB_ARGS_NONE());
+}
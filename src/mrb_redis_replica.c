@@ -0,0 +1,361 @@
+/*
+// mrb_redis_replica.c - Redis::ReplicaSet, reads spread over the replicas of a primary
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/proc.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The primary and the replicas are plain Redis objects, kept in the
+ * @primary and @replicas ivars by mrblib/replica.rb, which routes every
+ * command to __read or __write. Only the choice of the replica is done
+ * here. A replica whose connection is lost, or answering LOADING or
+ * MASTERDOWN while it syncs, is left aside for retry_after seconds and the
+ * read goes to the next one, then to the primary. An iterator (scan_each...)
+ * is not sent elsewhere once its block has run: that would yield the same
+ * elements again.
+ */
+
+enum mrb_redis_replica_strategy {
+  MRB_REDIS_ROUND_ROBIN,
+  MRB_REDIS_LEAST_OUTSTANDING,
+  MRB_REDIS_LATENCY,
+};
+
+#define MRB_REDIS_MAX_REPLICAS 64
+/* weight of the last sample in the latency average */
+#define MRB_REDIS_EWMA_ALPHA 0.2
+/* with :latency, one read in this many goes round robin so that the average of the others stays current */
+#define MRB_REDIS_LATENCY_PROBE 32
+
+typedef struct {
+  double ewma_us;
+  mrb_int inflight;    /* reads of this object waiting for their reply */
+  uint64_t down_until; /* usec, 0 when up */
+  mrb_int reads;
+  mrb_int failures;
+} mrb_redis_replica;
+
+typedef struct {
+  enum mrb_redis_replica_strategy strategy;
+  mrb_int size;
+  mrb_int next; /* round robin cursor */
+  mrb_int reads;
+  mrb_int primary_reads;
+  uint64_t window;      /* usec, reads stay on the primary this long after a write */
+  uint64_t retry_after; /* usec */
+  uint64_t last_write;
+  mrb_redis_replica *replicas;
+} mrb_redis_replica_set;
+
+static void mrb_redis_replica_set_free(mrb_state *mrb, void *p)
+{
+  mrb_redis_replica_set *set = (mrb_redis_replica_set *)p;
+
+  if (set) {
+    mrb_free(mrb, set->replicas);
+    mrb_free(mrb, set);
+  }
+}
+
+static const struct mrb_data_type mrb_redis_replica_set_type = {
+    "redisReplicaSet", mrb_redis_replica_set_free,
+};
+
+static inline mrb_redis_replica_set *mrb_redis_replica_set_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_replica_set *set =
+      (mrb_redis_replica_set *)mrb_data_get_ptr(mrb, self, &mrb_redis_replica_set_type);
+  if (!set) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return set;
+}
+
+/* __setup(replicas, strategy, read_your_writes, retry_after) */
+static mrb_value mrb_redis_replica_set_setup(mrb_state *mrb, mrb_value self)
+{
+  mrb_int size;
+  mrb_sym strategy;
+  mrb_float window, retry_after;
+  mrb_redis_replica_set *set;
+
+  mrb_get_args(mrb, "inff", &size, &strategy, &window, &retry_after);
+  if (size > MRB_REDIS_MAX_REPLICAS) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many replicas");
+  }
+  if (window < 0 || retry_after < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "read_your_writes and retry_after should not be negative");
+  }
+
+  set = (mrb_redis_replica_set *)mrb_calloc(mrb, 1, sizeof(mrb_redis_replica_set));
+  if (strategy == mrb_intern_lit(mrb, "round_robin")) {
+    set->strategy = MRB_REDIS_ROUND_ROBIN;
+  } else if (strategy == mrb_intern_lit(mrb, "least_outstanding")) {
+    set->strategy = MRB_REDIS_LEAST_OUTSTANDING;
+  } else if (strategy == mrb_intern_lit(mrb, "latency")) {
+    set->strategy = MRB_REDIS_LATENCY;
+  } else {
+    mrb_free(mrb, set);
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "strategy should be :round_robin, :least_outstanding or :latency");
+  }
+  set->size = size;
+  set->window = (uint64_t)(window * 1000000);
+  set->retry_after = (uint64_t)(retry_after * 1000000);
+  set->replicas = (mrb_redis_replica *)mrb_calloc(mrb, size > 0 ? size : 1, sizeof(mrb_redis_replica));
+
+  mrb_redis_replica_set_free(mrb, DATA_PTR(self));
+  DATA_TYPE(self) = &mrb_redis_replica_set_type;
+  DATA_PTR(self) = set;
+
+  return self;
+}
+
+/* replies the connection owes: ours, Redis#queue and Redis#pipelined ones */
+static mrb_int mrb_redis_replica_outstanding(mrb_value node, const mrb_redis_replica *replica)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(node);
+  mrb_int n = replica->inflight;
+
+  if (data) {
+    n += data->queue_counter + data->pipeline_len;
+  }
+  return n;
+}
+
+/* the replica to read from, -1 for the primary */
+static mrb_int mrb_redis_replica_pick(mrb_redis_replica_set *set, mrb_value nodes, uint64_t now, mrb_bool *tried)
+{
+  mrb_int i, k, best = -1;
+  mrb_int len = RARRAY_LEN(nodes) < set->size ? RARRAY_LEN(nodes) : set->size;
+  mrb_bool rr = set->strategy == MRB_REDIS_ROUND_ROBIN ||
+                (set->strategy == MRB_REDIS_LATENCY && set->reads % MRB_REDIS_LATENCY_PROBE == 0);
+
+  if (len == 0 || (set->window > 0 && now - set->last_write < set->window)) {
+    return -1;
+  }
+
+  /* starting at the cursor, so that ties go round robin */
+  for (k = 0; k < len; k++) {
+    i = (set->next + k) % len;
+    if (tried[i] || now < set->replicas[i].down_until) {
+      continue;
+    }
+    if (best < 0 || rr) {
+      best = i;
+      if (rr) {
+        break;
+      }
+    } else if (set->strategy == MRB_REDIS_LEAST_OUTSTANDING) {
+      if (mrb_redis_replica_outstanding(RARRAY_PTR(nodes)[i], &set->replicas[i]) <
+          mrb_redis_replica_outstanding(RARRAY_PTR(nodes)[best], &set->replicas[best])) {
+        best = i;
+      }
+    } else if (set->replicas[i].ewma_us < set->replicas[best].ewma_us) {
+      best = i;
+    }
+  }
+  if (best >= 0) {
+    set->next = (best + 1) % len;
+  }
+  return best;
+}
+
+/*
+ * a lost connection, or the replies of a replica still loading its data
+ * set or cut from its primary. Anything else (a reply error, an exception
+ * of the block) is the caller's.
+ */
+static mrb_bool mrb_redis_replica_unavailable_p(mrb_state *mrb, mrb_value node, mrb_value exc)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(node);
+  mrb_value message;
+
+  if (data == NULL || data->rc == NULL || data->rc->err != 0) {
+    return TRUE;
+  }
+  if (!mrb_obj_is_kind_of(mrb, exc, E_REDIS_REPLY_ERROR)) {
+    return FALSE;
+  }
+  message = mrb_funcall(mrb, exc, "message", 0);
+  return mrb_string_p(message) &&
+         ((RSTRING_LEN(message) >= 7 && memcmp(RSTRING_PTR(message), "LOADING", 7) == 0) ||
+          (RSTRING_LEN(message) >= 10 && memcmp(RSTRING_PTR(message), "MASTERDOWN", 10) == 0));
+}
+
+/* calls the method on node, what it raised goes to *exc */
+static mrb_value mrb_redis_replica_try(mrb_state *mrb, mrb_value node, mrb_sym cmd, mrb_int argc, const mrb_value *argv,
+                                       mrb_value blk, mrb_bool reconnect, mrb_value *exc)
+{
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  mrb_value reply = mrb_nil_value();
+
+  *exc = mrb_nil_value();
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    if (reconnect) {
+      /* back from retry_after: the connection was lost */
+      mrb_funcall(mrb, node, "reconnect", 0);
+    }
+    reply = mrb_funcall_with_block(mrb, node, cmd, argc, argv, blk);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    *exc = mrb_obj_value(mrb->exc);
+    mrb->exc = NULL;
+    mrb_gc_protect(mrb, *exc);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  return reply;
+}
+
+/* the block of an iterator: env[0] is the block, env[1] an Array holding true once it ran */
+static mrb_value mrb_redis_replica_yield(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *argv;
+  mrb_int argc;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  mrb_ary_set(mrb, mrb_cfunc_env_get(mrb, 1), 0, mrb_true_value());
+  return mrb_yield_argv(mrb, mrb_cfunc_env_get(mrb, 0), argc, argv);
+}
+
+/* __read(command, *args, &block): on a replica, or the primary */
+static mrb_value mrb_redis_replica_set_read(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_replica_set *set = mrb_redis_replica_set_get(mrb, self);
+  mrb_value nodes = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@replicas"));
+  mrb_value *argv, blk, reply, exc, yielded = mrb_nil_value();
+  mrb_int argc, i, attempts;
+  mrb_sym cmd;
+  mrb_bool tried[MRB_REDIS_MAX_REPLICAS] = {FALSE};
+
+  mrb_get_args(mrb, "n*&", &cmd, &argv, &argc, &blk);
+  if (!mrb_array_p(nodes)) {
+    nodes = mrb_ary_new(mrb);
+  }
+  if (!mrb_nil_p(blk)) {
+    mrb_value env[2];
+
+    env[0] = blk;
+    env[1] = yielded = mrb_ary_new(mrb);
+    blk = mrb_obj_value(mrb_proc_new_cfunc_with_env(mrb, mrb_redis_replica_yield, 2, env));
+  }
+  set->reads++;
+
+  for (attempts = 0; attempts < set->size; attempts++) {
+    mrb_redis_replica *replica;
+    uint64_t started = mrb_redis_stats_clock();
+
+    i = mrb_redis_replica_pick(set, nodes, started, tried);
+    if (i < 0) {
+      break;
+    }
+    replica = &set->replicas[i];
+    tried[i] = TRUE;
+    replica->inflight++;
+    reply = mrb_redis_replica_try(mrb, RARRAY_PTR(nodes)[i], cmd, argc, argv, blk, replica->down_until != 0, &exc);
+    replica->inflight--;
+
+    if (mrb_nil_p(exc)) {
+      double us = (double)(mrb_redis_stats_clock() - started);
+      replica->ewma_us =
+          replica->reads == 0 ? us : MRB_REDIS_EWMA_ALPHA * us + (1 - MRB_REDIS_EWMA_ALPHA) * replica->ewma_us;
+      replica->reads++;
+      replica->down_until = 0;
+      return reply;
+    }
+    if (!mrb_redis_replica_unavailable_p(mrb, RARRAY_PTR(nodes)[i], exc)) {
+      mrb_exc_raise(mrb, exc);
+    }
+    replica->failures++;
+    replica->down_until = mrb_redis_stats_clock() + set->retry_after + 1;
+    if (mrb_array_p(yielded) && RARRAY_LEN(yielded) > 0) {
+      /* the block has seen part of the elements, from this replica */
+      mrb_exc_raise(mrb, exc);
+    }
+  }
+
+  set->primary_reads++;
+  return mrb_funcall_with_block(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@primary")), cmd, argc, argv, blk);
+}
+
+/* __write(command, *args, &block): on the primary, the reads that follow stay there for read_your_writes sec */
+static mrb_value mrb_redis_replica_set_write(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_replica_set *set = mrb_redis_replica_set_get(mrb, self);
+  mrb_value *argv, blk, reply;
+  mrb_int argc;
+  mrb_sym cmd;
+
+  mrb_get_args(mrb, "n*&", &cmd, &argv, &argc, &blk);
+  /* stamped before the call too: the write may be applied even if it raises */
+  set->last_write = mrb_redis_stats_clock();
+  reply = mrb_funcall_with_block(mrb, mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@primary")), cmd, argc, argv, blk);
+  set->last_write = mrb_redis_stats_clock();
+
+  return reply;
+}
+
+/* {:reads=>..., :primary_reads=>..., :replicas=>[{:reads, :failures, :latency_us, :outstanding, :up}, ...]} */
+static mrb_value mrb_redis_replica_set_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_replica_set *set = mrb_redis_replica_set_get(mrb, self);
+  mrb_value nodes = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@replicas"));
+  mrb_value stats = mrb_hash_new(mrb), list = mrb_ary_new_capa(mrb, set->size);
+  uint64_t now = mrb_redis_stats_clock();
+  mrb_int i;
+
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "reads")), mrb_fixnum_value(set->reads));
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "primary_reads")),
+               mrb_fixnum_value(set->primary_reads));
+  for (i = 0; i < set->size; i++) {
+    mrb_redis_replica *replica = &set->replicas[i];
+    mrb_value h = mrb_hash_new(mrb);
+
+    mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "reads")), mrb_fixnum_value(replica->reads));
+    mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "failures")), mrb_fixnum_value(replica->failures));
+    mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "latency_us")),
+                 mrb_fixnum_value((mrb_int)replica->ewma_us));
+    mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "outstanding")),
+                 mrb_fixnum_value(mrb_array_p(nodes) && i < RARRAY_LEN(nodes)
+                                      ? mrb_redis_replica_outstanding(RARRAY_PTR(nodes)[i], replica)
+                                      : replica->inflight));
+    mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "up")), mrb_bool_value(now >= replica->down_until));
+    mrb_ary_push(mrb, list, h);
+  }
+  mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "replicas")), list);
+
+  return stats;
+}
+
+void mrb_redis_replica_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *set;
+
+  set = mrb_define_class_under(mrb, redis, "ReplicaSet", mrb->object_class);
+  MRB_SET_INSTANCE_TT(set, MRB_TT_DATA);
+
+  mrb_define_method(mrb, set, "__setup", mrb_redis_replica_set_setup, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, set, "__read", mrb_redis_replica_set_read, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, set, "__write", mrb_redis_replica_set_write, (MRB_ARGS_REQ(1) | MRB_ARGS_REST()));
+  mrb_define_method(mrb, set, "stats", mrb_redis_replica_set_stats, MRB_ARGS_NONE());
+}
@@ -0,0 +1,404 @@
+/*
+// mrb_redis_resp.c - Redis::RESP, the protocol without a connection
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/hash.h"
+#include "mruby/numeric.h"
+#include "mruby/string.h"
+#include <errno.h>
+#include <math.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Redis::RESP.encode formats commands as they are sent on a connection
+ * (mass insertion files, fixtures), Redis::RESP.decode parses captured
+ * replies into the values the Redis methods return: error replies become
+ * Redis::ReplyError instances, RESP3 maps Hashes, doubles Floats... An
+ * incomplete buffer is not an error, decode returns nil until the rest of
+ * the frame has been appended to it.
+ */
+
+/* nested aggregates deeper than this are taken for garbage */
+#define MRB_REDIS_RESP_MAX_DEPTH 64
+
+/* flushes encode_many to an IO every so often, not once per command */
+#define MRB_REDIS_RESP_IO_CHUNK 65536
+
+/*
+ * The first "\r\n" in [p, p + len), NULL if there is none. With SSE2, 16
+ * positions are tested at once: the bytes equal to '\r' and the following
+ * ones equal to '\n'.
+ */
+const char *mrb_redis_find_crlf(const char *p, size_t len)
+{
+  const char *end = p + len, *cr;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  const __m128i r = _mm_set1_epi8('\r'), n = _mm_set1_epi8('\n');
+
+  while (end - p >= 17) {
+    __m128i at = _mm_loadu_si128((const __m128i *)p), next = _mm_loadu_si128((const __m128i *)(p + 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(at, r), _mm_cmpeq_epi8(next, n)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (end - p >= 2) {
+    if ((cr = memchr(p, '\r', end - p - 1)) == NULL) {
+      return NULL;
+    }
+    if (cr[1] == '\n') {
+      return cr;
+    }
+    p = cr + 1;
+  }
+  return NULL;
+}
+
+typedef struct mrb_redis_resp_parser {
+  const char *buf;
+  size_t len;
+  size_t pos;
+} mrb_redis_resp_parser;
+
+static void mrb_redis_resp_invalid(mrb_state *mrb, const char *what)
+{
+  mrb_raisef(mrb, E_REDIS_ERR_PROTOCOL, "invalid RESP: %S", mrb_str_new_cstr(mrb, what));
+}
+
+/* the line after the type byte, FALSE while it is incomplete */
+static mrb_bool mrb_redis_resp_line(mrb_redis_resp_parser *parser, const char **line, size_t *len)
+{
+  const char *start = parser->buf + parser->pos + 1;
+  const char *crlf = mrb_redis_find_crlf(start, parser->len - parser->pos - 1);
+
+  if (crlf == NULL) {
+    return FALSE;
+  }
+  *line = start;
+  *len = crlf - start;
+  parser->pos = crlf + 2 - parser->buf;
+  return TRUE;
+}
+
+static long long mrb_redis_resp_integer(mrb_state *mrb, const char *line, size_t len)
+{
+  char digits[24];
+  char *endp;
+  long long value;
+
+  if (len == 0 || len >= sizeof(digits)) {
+    mrb_redis_resp_invalid(mrb, "bad integer");
+  }
+  memcpy(digits, line, len);
+  digits[len] = '\0';
+  errno = 0;
+  value = strtoll(digits, &endp, 10);
+  if (*endp != '\0' || errno == ERANGE) {
+    mrb_redis_resp_invalid(mrb, "bad integer");
+  }
+  return value;
+}
+
+static mrb_bool mrb_redis_resp_value(mrb_state *mrb, mrb_redis_resp_parser *parser, mrb_value *out, int depth);
+
+/* count elements, or count pairs when hash, into an Array or a Hash */
+static mrb_bool mrb_redis_resp_aggregate(mrb_state *mrb, mrb_redis_resp_parser *parser, long long count,
+                                         mrb_bool hash, mrb_value *out, int depth)
+{
+  mrb_value container, key, value;
+  long long i;
+  int ai;
+
+  if (depth >= MRB_REDIS_RESP_MAX_DEPTH) {
+    mrb_redis_resp_invalid(mrb, "too deeply nested");
+  }
+  /* the count comes from the buffer: it doesn't size anything before the elements are there */
+  container = hash ? mrb_hash_new(mrb) : mrb_ary_new(mrb);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < count; i++) {
+    if (hash) {
+      if (!mrb_redis_resp_value(mrb, parser, &key, depth + 1) ||
+          !mrb_redis_resp_value(mrb, parser, &value, depth + 1)) {
+        return FALSE;
+      }
+      mrb_hash_set(mrb, container, key, value);
+    } else {
+      if (!mrb_redis_resp_value(mrb, parser, &value, depth + 1)) {
+        return FALSE;
+      }
+      mrb_ary_push(mrb, container, value);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  *out = container;
+  return TRUE;
+}
+
+/* parses the value at parser->pos, FALSE when the buffer ends before it does */
+static mrb_bool mrb_redis_resp_value(mrb_state *mrb, mrb_redis_resp_parser *parser, mrb_value *out, int depth)
+{
+  const char *line;
+  size_t len;
+  long long n;
+  char type;
+
+  if (parser->pos >= parser->len) {
+    return FALSE;
+  }
+  type = parser->buf[parser->pos];
+  if (!mrb_redis_resp_line(parser, &line, &len)) {
+    return FALSE;
+  }
+
+  switch (type) {
+  case '+': /* status */
+    *out = mrb_str_new(mrb, line, len);
+    return TRUE;
+  case '-': /* error */
+    *out = mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, mrb_str_new(mrb, line, len));
+    return TRUE;
+  case ':': /* integer */
+    n = mrb_redis_resp_integer(mrb, line, len);
+    *out = FIXABLE(n) ? mrb_fixnum_value((mrb_int)n) : mrb_float_value(mrb, (mrb_float)n);
+    return TRUE;
+  case '(': /* big number: an Integer when it fits, its digits otherwise */
+    if (len > 0 && len < 19 && FIXABLE(n = mrb_redis_resp_integer(mrb, line, len))) {
+      *out = mrb_fixnum_value((mrb_int)n);
+    } else {
+      *out = mrb_str_new(mrb, line, len);
+    }
+    return TRUE;
+  case ',': { /* double */
+    char digits[64];
+    char *endp;
+
+    if (len == 0 || len >= sizeof(digits)) {
+      mrb_redis_resp_invalid(mrb, "bad double");
+    }
+    memcpy(digits, line, len);
+    digits[len] = '\0';
+    if (strcmp(digits, "inf") == 0) {
+      *out = mrb_float_value(mrb, INFINITY);
+    } else if (strcmp(digits, "-inf") == 0) {
+      *out = mrb_float_value(mrb, -INFINITY);
+    } else {
+      *out = mrb_float_value(mrb, strtod(digits, &endp));
+      if (*endp != '\0') {
+        mrb_redis_resp_invalid(mrb, "bad double");
+      }
+    }
+    return TRUE;
+  }
+  case '#': /* boolean */
+    if (len != 1 || (line[0] != 't' && line[0] != 'f')) {
+      mrb_redis_resp_invalid(mrb, "bad boolean");
+    }
+    *out = mrb_bool_value(line[0] == 't');
+    return TRUE;
+  case '_': /* null */
+    *out = mrb_nil_value();
+    return TRUE;
+  case '$':   /* bulk string */
+  case '!':   /* bulk error */
+  case '=': { /* verbatim string, "txt:" in front of the text */
+    n = mrb_redis_resp_integer(mrb, line, len);
+    if (n < 0) {
+      *out = mrb_nil_value();
+      return TRUE;
+    }
+    if ((unsigned long long)n > parser->len - parser->pos || parser->len - parser->pos - (size_t)n < 2) {
+      return FALSE;
+    }
+    line = parser->buf + parser->pos;
+    if (line[n] != '\r' || line[n + 1] != '\n') {
+      mrb_redis_resp_invalid(mrb, "bulk string not terminated by CRLF");
+    }
+    parser->pos += (size_t)n + 2;
+    if (type == '=' && n >= 4 && line[3] == ':') {
+      line += 4;
+      n -= 4;
+    }
+    *out = mrb_str_new(mrb, line, (size_t)n);
+    if (type == '!') {
+      *out = mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, *out);
+    }
+    return TRUE;
+  }
+  case '*': /* array */
+  case '~': /* set */
+  case '>': /* push */
+    n = mrb_redis_resp_integer(mrb, line, len);
+    if (n < 0) {
+      *out = mrb_nil_value();
+      return TRUE;
+    }
+    return mrb_redis_resp_aggregate(mrb, parser, n, FALSE, out, depth);
+  case '%': /* map */
+    n = mrb_redis_resp_integer(mrb, line, len);
+    if (n < 0) {
+      mrb_redis_resp_invalid(mrb, "bad map length");
+    }
+    return mrb_redis_resp_aggregate(mrb, parser, n, TRUE, out, depth);
+  case '|': { /* attributes, dropped: the value is the one following them */
+    mrb_value attributes;
+
+    n = mrb_redis_resp_integer(mrb, line, len);
+    if (n < 0) {
+      mrb_redis_resp_invalid(mrb, "bad attribute length");
+    }
+    if (!mrb_redis_resp_aggregate(mrb, parser, n, TRUE, &attributes, depth)) {
+      return FALSE;
+    }
+    return mrb_redis_resp_value(mrb, parser, out, depth);
+  }
+  default:
+    mrb_redis_resp_invalid(mrb, "unknown type");
+  }
+  return FALSE;
+}
+
+/* Redis::RESP.decode(buffer, offset = 0) => [value, offset after it], or nil when incomplete */
+static mrb_value mrb_redis_resp_decode(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value buffer, value, result;
+  mrb_int offset = 0;
+  mrb_redis_resp_parser parser;
+
+  mrb_get_args(mrb, "S|i", &buffer, &offset);
+  if (offset < 0 || offset > RSTRING_LEN(buffer)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "offset out of the buffer");
+  }
+  parser.buf = RSTRING_PTR(buffer);
+  parser.len = RSTRING_LEN(buffer);
+  parser.pos = offset;
+
+  if (!mrb_redis_resp_value(mrb, &parser, &value, 0)) {
+    return mrb_nil_value();
+  }
+  result = mrb_ary_new_capa(mrb, 2);
+  mrb_ary_push(mrb, result, value);
+  mrb_ary_push(mrb, result, mrb_fixnum_value((mrb_int)parser.pos));
+  return result;
+}
+
+/* appends the frame of command, [name, *args], to the String out */
+static void mrb_redis_resp_append(mrb_state *mrb, mrb_value out, mrb_value command)
+{
+  mrb_int offset = RSTRING_LEN(out), argc = RARRAY_LEN(command), i;
+  mrb_value args;
+  const char **argv;
+  size_t *lens, size;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  if (argc == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty command");
+  }
+  /* converted before anything is allocated, into an array of ours: the command given is left as it is */
+  args = mrb_ary_new_capa(mrb, argc);
+  for (i = 0; i < argc; i++) {
+    mrb_ary_push(mrb, args, mrb_str_to_str(mrb, mrb_ary_ref(mrb, command, i)));
+  }
+
+  /* one block for both, freed whatever mrb_str_resize does */
+  argv = (const char **)mrb_malloc(mrb, argc * (sizeof(char *) + sizeof(size_t)));
+  lens = (size_t *)(argv + argc);
+  for (i = 0; i < argc; i++) {
+    argv[i] = RSTRING_PTR(RARRAY_PTR(args)[i]);
+    lens[i] = RSTRING_LEN(RARRAY_PTR(args)[i]);
+  }
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    size = mrb_redis_frame_size(NULL, (int)argc, lens);
+    mrb_str_resize(mrb, out, offset + size);
+    mrb_redis_format_frame(RSTRING_PTR(out) + offset, NULL, (int)argc, argv, lens);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    mrb_free(mrb, argv);
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+  mrb_free(mrb, argv);
+}
+
+/* a String is appended to, anything else is written to with #write */
+static mrb_value mrb_redis_resp_flush(mrb_state *mrb, mrb_value out, mrb_value buf)
+{
+  if (!mrb_nil_p(out) && !mrb_string_p(out)) {
+    mrb_funcall(mrb, out, "write", 1, buf);
+    return mrb_str_new(mrb, NULL, 0);
+  }
+  return buf;
+}
+
+/* Redis::RESP.encode([name, *args], out = nil) */
+static mrb_value mrb_redis_resp_encode(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value command, out = mrb_nil_value(), buf;
+
+  mrb_get_args(mrb, "A|o", &command, &out);
+  buf = mrb_string_p(out) ? out : mrb_str_new(mrb, NULL, 0);
+  mrb_redis_resp_append(mrb, buf, command);
+  mrb_redis_resp_flush(mrb, out, buf);
+
+  return mrb_nil_p(out) ? buf : out;
+}
+
+/* Redis::RESP.encode_many([[name, *args], ...], out = nil) */
+static mrb_value mrb_redis_resp_encode_many(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value commands, out = mrb_nil_value(), buf;
+  mrb_int i;
+  int ai;
+
+  mrb_get_args(mrb, "A|o", &commands, &out);
+  buf = mrb_string_p(out) ? out : mrb_str_new(mrb, NULL, 0);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < RARRAY_LEN(commands); i++) {
+    mrb_value command = mrb_ary_ref(mrb, commands, i);
+
+    if (!mrb_array_p(command)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "command should be an Array, %S given", command);
+    }
+    mrb_redis_resp_append(mrb, buf, command);
+    if (!mrb_nil_p(out) && !mrb_string_p(out) && RSTRING_LEN(buf) >= MRB_REDIS_RESP_IO_CHUNK) {
+      buf = mrb_redis_resp_flush(mrb, out, buf);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+    mrb_gc_protect(mrb, buf);
+  }
+  if (RSTRING_LEN(buf) > 0) {
+    mrb_redis_resp_flush(mrb, out, buf);
+  }
+
+  return mrb_nil_p(out) ? buf : out;
+}
+
+void mrb_redis_resp_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *resp;
+
+  resp = mrb_define_module_under(mrb, redis, "RESP");
+  mrb_define_module_function(mrb, resp, "encode", mrb_redis_resp_encode, MRB_ARGS_ARG(1, 1));
+  mrb_define_module_function(mrb, resp, "encode_many", mrb_redis_resp_encode_many, MRB_ARGS_ARG(1, 1));
+  mrb_define_module_function(mrb, resp, "decode", mrb_redis_resp_decode, MRB_ARGS_ARG(1, 1));
+}
@@ -0,0 +1,485 @@
+/*
+// mrb_redis_router.c - commands routed over several nodes by their key, for Redis::Cluster and Redis::Distributed
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/string.h"
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Redis::Cluster hashes a key to one of 16384 slots and asks the cluster
+ * which node owns it, Redis::Distributed hashes it on a ring of
+ * independent servers. Everything else is the same and lives here: the
+ * nodes and their lazy connections, the arguments taken from Ruby, the
+ * command routed by its key, and MGET/MSET/DEL split per node.
+ */
+
+int mrb_redis_router_find(mrb_redis_router *r, const char *host, size_t host_len, int port)
+{
+  int i;
+
+  for (i = 0; i < r->nodes_len; i++) {
+    if (r->nodes[i].port == port && strlen(r->nodes[i].host) == host_len &&
+        memcmp(r->nodes[i].host, host, host_len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int mrb_redis_router_add(mrb_state *mrb, mrb_redis_router *r, const char *host, size_t host_len, int port)
+{
+  if (r->nodes_len == r->nodes_capa) {
+    r->nodes_capa = r->nodes_capa ? r->nodes_capa * 2 : 8;
+    r->nodes = (mrb_redis_router_node *)mrb_realloc(mrb, r->nodes, sizeof(mrb_redis_router_node) * r->nodes_capa);
+  }
+  r->nodes[r->nodes_len].host = (char *)mrb_malloc(mrb, host_len + 1);
+  memcpy(r->nodes[r->nodes_len].host, host, host_len);
+  r->nodes[r->nodes_len].host[host_len] = '\0';
+  r->nodes[r->nodes_len].port = port;
+  r->nodes[r->nodes_len].rc = NULL;
+  return r->nodes_len++;
+}
+
+/* "host:port" or [host, port]: returns the port, host points into spec */
+int mrb_redis_router_spec(mrb_state *mrb, mrb_value spec, const char **host, size_t *host_len)
+{
+  mrb_value addr;
+  const char *colon;
+
+  if (mrb_array_p(spec) && RARRAY_LEN(spec) == 2) {
+    addr = mrb_str_to_str(mrb, mrb_ary_ref(mrb, spec, 0));
+    *host = RSTRING_PTR(addr);
+    *host_len = RSTRING_LEN(addr);
+    return (int)mrb_fixnum(mrb_to_int(mrb, mrb_ary_ref(mrb, spec, 1)));
+  }
+
+  addr = mrb_str_to_str(mrb, spec);
+  *host = RSTRING_PTR(addr);
+  /* the port follows the last colon so that IPv6 addresses work too */
+  colon = *host + RSTRING_LEN(addr) - 1;
+  while (colon > *host && *colon != ':') {
+    colon--;
+  }
+  if (colon <= *host) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid node %S", spec);
+  }
+  *host_len = colon - *host;
+  return (int)strtol(colon + 1, NULL, 10);
+}
+
+void mrb_redis_router_disconnect(mrb_redis_router *r, int index)
+{
+  if (r->nodes[index].rc) {
+    redisFree(r->nodes[index].rc);
+    r->nodes[index].rc = NULL;
+  }
+}
+
+/* returns NULL when the node can't be reached */
+redisContext *mrb_redis_router_context(mrb_redis_router *r, int index)
+{
+  mrb_redis_router_node *node = &r->nodes[index];
+
+  if (node->rc && node->rc->err) {
+    mrb_redis_router_disconnect(r, index);
+  }
+  if (node->rc == NULL) {
+    node->rc = redisConnectWithTimeout(node->host, node->port, r->timeout);
+    if (node->rc == NULL || node->rc->err) {
+      mrb_redis_router_disconnect(r, index);
+      return NULL;
+    }
+  }
+  return node->rc;
+}
+
+/* the nodes, not r itself */
+void mrb_redis_router_free(mrb_state *mrb, mrb_redis_router *r)
+{
+  int i;
+
+  for (i = 0; i < r->nodes_len; i++) {
+    mrb_redis_router_disconnect(r, i);
+    mrb_free(mrb, r->nodes[i].host);
+  }
+  mrb_free(mrb, r->nodes);
+  r->nodes = NULL;
+  r->nodes_len = r->nodes_capa = 0;
+}
+
+mrb_value mrb_redis_router_node_name(mrb_state *mrb, mrb_redis_router *r, int index)
+{
+  return mrb_format(mrb, "%S:%S", mrb_str_new_cstr(mrb, r->nodes[index].host),
+                    mrb_fixnum_value(r->nodes[index].port));
+}
+
+mrb_value mrb_redis_router_nodes(mrb_state *mrb, mrb_redis_router *r)
+{
+  mrb_value nodes = mrb_ary_new_capa(mrb, r->nodes_len);
+  int i;
+
+  for (i = 0; i < r->nodes_len; i++) {
+    mrb_ary_push(mrb, nodes, mrb_redis_router_node_name(mrb, r, i));
+  }
+  return nodes;
+}
+
+/* frees rr, even when its conversion raises, and raises the error replies */
+mrb_value mrb_redis_router_reply(mrb_state *mrb, redisReply *rr, const ReplyHandlingRule *rule)
+{
+  mrb_value reply = mrb_nil_value();
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    reply = mrb_redis_get_reply(rr, mrb, rule);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    freeReplyObject(rr);
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  freeReplyObject(rr);
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, reply);
+  }
+  return reply;
+}
+
+/*
+ * argv/lens of the arguments given from Ruby, symbols are accepted as
+ * command names. Both live in the GC arena, as the converted Strings do.
+ */
+static void mrb_redis_router_argv(mrb_state *mrb, mrb_value *values, mrb_int len, const char ***argv, size_t **lens)
+{
+  mrb_int i;
+
+  *argv = (const char **)mrb_redis_scratch(mrb, len * sizeof(char *));
+  *lens = (size_t *)mrb_redis_scratch(mrb, len * sizeof(size_t));
+  for (i = 0; i < len; i++) {
+    mrb_value curr = values[i];
+    if (mrb_symbol_p(curr)) {
+      mrb_int sym_len;
+      (*argv)[i] = mrb_sym2name_len(mrb, mrb_symbol(curr), &sym_len);
+      (*lens)[i] = sym_len;
+    } else {
+      /* scores: "+inf" and all the digits of the double */
+      curr = mrb_float_p(curr) ? mrb_redis_score_arg(mrb, curr) : mrb_str_to_str(mrb, curr);
+      values[i] = curr;
+      (*argv)[i] = RSTRING_PTR(curr);
+      (*lens)[i] = RSTRING_LEN(curr);
+    }
+  }
+}
+
+/* position of the first key for the commands that don't take it as the first argument */
+static inline int mrb_redis_router_key_index(const char *cmd, size_t len, int argc)
+{
+  if ((len == 4 && strncasecmp(cmd, "EVAL", 4) == 0) || (len == 7 && strncasecmp(cmd, "EVALSHA", 7) == 0)) {
+    return argc > 3 ? 3 : -1;
+  }
+  return argc > 1 ? 1 : -1;
+}
+
+static mrb_bool mrb_redis_router_is(const char *name, const char *arg, size_t len)
+{
+  return strlen(name) == len && strncasecmp(name, arg, len) == 0;
+}
+
+/*
+ * The reply of call as the Redis method of the same name gives it, for
+ * the methods of Redis::Router: they send the arguments Redis's would.
+ */
+static void mrb_redis_router_rule(int argc, const char **argv, const size_t *lens, ReplyHandlingRule *rule)
+{
+  static const char *const ranges[] = {"ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE"};
+  static const char *const zadd_flags[] = {"NX", "XX", "GT", "LT", "CH", "INCR"};
+  static const struct {
+    const char *name;
+    ReplyHandlingRule rule;
+  } rules[] = {
+    {"SETNX", {.integer_to_bool = TRUE}},
+    {"EXPIRE", {.integer_to_bool = TRUE}},
+    {"HSET", {.integer_to_bool = TRUE}},
+    {"HKEYS", {.emptyarray_to_nil = TRUE}},
+    {"HVALS", {.emptyarray_to_nil = TRUE}},
+    {"HMGET", {.emptyarray_to_nil = TRUE, .emptystring_to_nil = TRUE}},
+    {"ZSCORE", {.score_to_float = TRUE}},
+    {"ZINCRBY", {.score_to_float = TRUE}},
+  };
+  int i;
+  size_t n;
+
+  for (n = 0; n < sizeof(rules) / sizeof(rules[0]); n++) {
+    if (mrb_redis_router_is(rules[n].name, argv[0], lens[0])) {
+      *rule = rules[n].rule;
+      rule->return_exception = TRUE;
+      return;
+    }
+  }
+  if (mrb_redis_router_is("ZADD", argv[0], lens[0])) {
+    /* the new score with INCR, among the flags before the first score */
+    for (i = 2; i < argc; i++) {
+      for (n = 0; n < sizeof(zadd_flags) / sizeof(zadd_flags[0]); n++) {
+        if (mrb_redis_router_is(zadd_flags[n], argv[i], lens[i])) {
+          break;
+        }
+      }
+      if (n == sizeof(zadd_flags) / sizeof(zadd_flags[0])) {
+        break;
+      }
+      rule->score_to_float |= mrb_redis_router_is("INCR", argv[i], lens[i]);
+    }
+  } else if (mrb_redis_router_is("ZPOPMIN", argv[0], lens[0]) || mrb_redis_router_is("ZPOPMAX", argv[0], lens[0])) {
+    rule->withscores = TRUE;
+    rule->first_element = argc == 2;
+  } else {
+    for (n = 0; n < sizeof(ranges) / sizeof(ranges[0]); n++) {
+      if (mrb_redis_router_is(ranges[n], argv[0], lens[0])) {
+        for (i = 4; i < argc; i++) {
+          rule->withscores |= mrb_redis_router_is("WITHSCORES", argv[i], lens[i]);
+        }
+      }
+    }
+  }
+}
+
+/* call(command, key, *args): on the node owning key */
+mrb_value mrb_redis_router_call(mrb_state *mrb, mrb_redis_router *r)
+{
+  mrb_value *mrb_argv;
+  mrb_int argc;
+  const char **argv;
+  size_t *lens;
+  int key, shard = -1;
+  ReplyHandlingRule rule = {.return_exception = TRUE};
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+  if (argc < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
+  }
+  if (argc > INT_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many arguments");
+  }
+  mrb_redis_router_argv(mrb, mrb_argv, argc, &argv, &lens);
+
+  key = mrb_redis_router_key_index(argv[0], lens[0], (int)argc);
+  if (key >= 0) {
+    shard = r->shard(r, argv[key], lens[key]);
+  } else if (!r->keyless) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S: no key to find the node with", mrb_argv[0]);
+  }
+
+  mrb_redis_router_rule((int)argc, argv, lens, &rule);
+  return mrb_redis_router_reply(mrb, r->command(mrb, r, shard, (int)argc, argv, lens), &rule);
+}
+
+typedef struct mrb_redis_router_key {
+  int shard;
+  mrb_int index;
+} mrb_redis_router_key;
+
+static int mrb_redis_router_key_cmp(const void *a, const void *b)
+{
+  const mrb_redis_router_key *x = (const mrb_redis_router_key *)a, *y = (const mrb_redis_router_key *)b;
+
+  if (x->shard != y->shard) {
+    return x->shard < y->shard ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* the arguments of group g, after cmd in gargv/glens: returns gargc */
+static int mrb_redis_router_group_argv(const char *cmd, const mrb_redis_router_key *keys, const mrb_int *group_start,
+                                       mrb_int g, mrb_int step, const char **argv, const size_t *lens,
+                                       const char **gargv, size_t *glens)
+{
+  int gargc = 1;
+  mrb_int i, k;
+
+  gargv[0] = cmd;
+  glens[0] = strlen(cmd);
+  for (i = group_start[g]; i < group_start[g + 1]; i++) {
+    for (k = 0; k < step; k++) {
+      gargv[gargc] = argv[keys[i].index * step + k];
+      glens[gargc] = lens[keys[i].index * step + k];
+      gargc++;
+    }
+  }
+  return gargc;
+}
+
+/*
+ * MGET/MSET/DEL over keys living on several nodes: the keys are grouped per
+ * shard, every group is appended to its node's output buffer first and the
+ * replies are read afterwards, so that the round trips to the nodes overlap
+ * instead of adding up. Groups whose node failed or redirected them are run
+ * again one by one, r->command raising when it can't. The replies are put
+ * back in the order of the keys.
+ */
+mrb_value mrb_redis_router_multi_key(mrb_state *mrb, mrb_redis_router *r, const char *cmd, mrb_int step,
+                                     enum mrb_redis_merge merge)
+{
+  mrb_value *mrb_argv, result;
+  mrb_int argc, nkeys, i, g, ngroups, sum = 0;
+  mrb_redis_router_key *keys;
+  mrb_int *group_start;
+  int *group_node;
+  redisReply **replies;
+  const char **argv, **gargv;
+  size_t *lens, *glens;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+  if (argc == 0 || argc % step != 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments");
+  }
+  if (argc >= INT_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many arguments");
+  }
+  nkeys = argc / step;
+
+  mrb_redis_router_argv(mrb, mrb_argv, argc, &argv, &lens);
+  gargv = (const char **)mrb_redis_scratch(mrb, (argc + 1) * sizeof(char *));
+  glens = (size_t *)mrb_redis_scratch(mrb, (argc + 1) * sizeof(size_t));
+  keys = (mrb_redis_router_key *)mrb_redis_scratch(mrb, nkeys * sizeof(mrb_redis_router_key));
+  group_start = (mrb_int *)mrb_redis_scratch(mrb, (nkeys + 1) * sizeof(mrb_int));
+  group_node = (int *)mrb_redis_scratch(mrb, nkeys * sizeof(int));
+  replies = (redisReply **)mrb_redis_scratch(mrb, nkeys * sizeof(redisReply *));
+  memset(replies, 0, nkeys * sizeof(redisReply *));
+
+  for (i = 0; i < nkeys; i++) {
+    keys[i].index = i;
+    keys[i].shard = r->shard(r, argv[i * step], lens[i * step]);
+  }
+  qsort(keys, nkeys, sizeof(mrb_redis_router_key), mrb_redis_router_key_cmp);
+
+  ngroups = 0;
+  for (i = 0; i < nkeys; i++) {
+    if (i == 0 || keys[i].shard != keys[i - 1].shard) {
+      group_start[ngroups++] = i;
+    }
+  }
+  group_start[ngroups] = nkeys;
+
+  /* write phase: one command per shard, queued on its node */
+  for (g = 0; g < ngroups; g++) {
+    redisContext *rc;
+    int gargc;
+
+    group_node[g] = r->shard_node(r, keys[group_start[g]].shard);
+    rc = mrb_redis_router_context(r, group_node[g]);
+    if (rc == NULL) {
+      group_node[g] = -1;
+      continue;
+    }
+    gargc = mrb_redis_router_group_argv(cmd, keys, group_start, g, step, argv, lens, gargv, glens);
+    if (redisAppendCommandArgv(rc, gargc, gargv, glens) != REDIS_OK) {
+      group_node[g] = -1;
+    }
+  }
+
+  /* read phase, in the same order so that each node's replies line up */
+  for (g = 0; g < ngroups; g++) {
+    if (group_node[g] < 0 || r->nodes[group_node[g]].rc == NULL) {
+      continue;
+    }
+    if (redisGetReply(r->nodes[group_node[g]].rc, (void **)&replies[g]) != REDIS_OK) {
+      replies[g] = NULL;
+      mrb_redis_router_disconnect(r, group_node[g]);
+    }
+  }
+
+  /* replay what failed or was redirected, and merge */
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    for (g = 0; g < ngroups; g++) {
+      if (replies[g] != NULL && (r->redirected == NULL || !r->redirected(mrb, r, replies[g]))) {
+        continue;
+      }
+      if (replies[g] != NULL) {
+        freeReplyObject(replies[g]);
+        replies[g] = NULL;
+      }
+      replies[g] = r->command(mrb, r, keys[group_start[g]].shard,
+                              mrb_redis_router_group_argv(cmd, keys, group_start, g, step, argv, lens, gargv, glens),
+                              gargv, glens);
+    }
+
+    result = mrb_nil_value();
+    if (merge == MERGE_ARRAY) {
+      result = mrb_ary_new_capa(mrb, nkeys);
+      for (i = 0; i < nkeys; i++) {
+        mrb_ary_push(mrb, result, mrb_nil_value());
+      }
+    }
+    for (g = 0; g < ngroups; g++) {
+      redisReply *rr = replies[g];
+
+      if (rr->type == REDIS_REPLY_ERROR) {
+        result = mrb_exc_new_str(mrb, E_REDIS_REPLY_ERROR, mrb_str_new(mrb, rr->str, rr->len));
+        break;
+      }
+      switch (merge) {
+      case MERGE_ARRAY:
+        for (i = group_start[g]; i < group_start[g + 1] && (size_t)(i - group_start[g]) < rr->elements; i++) {
+          redisReply *element = rr->element[i - group_start[g]];
+          /* "" is nil, as with Redis#mget */
+          if (element->type == REDIS_REPLY_STRING && element->len > 0) {
+            mrb_ary_set(mrb, result, keys[i].index, mrb_str_new(mrb, element->str, element->len));
+          }
+        }
+        break;
+      case MERGE_SUM:
+        sum += rr->integer;
+        break;
+      default:
+        result = mrb_str_new(mrb, rr->str, rr->len);
+        break;
+      }
+    }
+    if (merge == MERGE_SUM && !mrb_exception_p(result)) {
+      result = mrb_fixnum_value(sum);
+    }
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    for (g = 0; g < ngroups; g++) {
+      if (replies[g]) {
+        freeReplyObject(replies[g]);
+      }
+    }
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  for (g = 0; g < ngroups; g++) {
+    freeReplyObject(replies[g]);
+  }
+  if (mrb_exception_p(result)) {
+    mrb_exc_raise(mrb, result);
+  }
+  return result;
+}
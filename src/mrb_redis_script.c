@@ -0,0 +1,294 @@
+/*
+// mrb_redis_script.c - Lua scripts run by their SHA1, EVAL on NOSCRIPT
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include <mruby/redis.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Redis::Script keeps a script and its SHA1, computed here as Redis does it
+ * in SCRIPT LOAD. Outside of a pipeline or a transaction the script is run
+ * by EVALSHA, and by EVAL when the server answers NOSCRIPT (first use,
+ * restart, SCRIPT FLUSH). Inside them the reply comes too late for that:
+ * EVAL is queued unless the script is known to be loaded on this
+ * connection, which the "loaded_scripts" ivar of the Redis object records.
+ */
+
+typedef struct {
+  uint32_t h[5];
+  uint64_t len;
+  unsigned char block[64];
+} mrb_redis_sha1_ctx;
+
+#define SHA1_ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void mrb_redis_sha1_block(uint32_t *h, const unsigned char *p)
+{
+  uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f, k, t;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+  }
+  for (i = 16; i < 80; i++) {
+    w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  for (i = 0; i < 80; i++) {
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    t = SHA1_ROL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = SHA1_ROL(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+static void mrb_redis_sha1_init(mrb_redis_sha1_ctx *ctx)
+{
+  ctx->h[0] = 0x67452301;
+  ctx->h[1] = 0xefcdab89;
+  ctx->h[2] = 0x98badcfe;
+  ctx->h[3] = 0x10325476;
+  ctx->h[4] = 0xc3d2e1f0;
+  ctx->len = 0;
+}
+
+static void mrb_redis_sha1_update(mrb_redis_sha1_ctx *ctx, const unsigned char *p, size_t len)
+{
+  size_t used = ctx->len % 64;
+
+  ctx->len += len;
+  if (used > 0) {
+    size_t n = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->block + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64) {
+      return;
+    }
+    mrb_redis_sha1_block(ctx->h, ctx->block);
+  }
+  for (; len >= 64; p += 64, len -= 64) {
+    mrb_redis_sha1_block(ctx->h, p);
+  }
+  memcpy(ctx->block, p, len);
+}
+
+static void mrb_redis_sha1_final(mrb_redis_sha1_ctx *ctx, unsigned char *digest)
+{
+  unsigned char pad[72] = {0x80}, bits[8];
+  uint64_t len = ctx->len * 8;
+  size_t padlen = (ctx->len % 64 < 56 ? 56 : 120) - ctx->len % 64;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    bits[i] = (unsigned char)(len >> (56 - i * 8));
+  }
+  mrb_redis_sha1_update(ctx, pad, padlen);
+  mrb_redis_sha1_update(ctx, bits, 8);
+  for (i = 0; i < 20; i++) {
+    digest[i] = (unsigned char)(ctx->h[i / 4] >> (24 - (i % 4) * 8));
+  }
+}
+
+/* digest: 20 bytes, also used by the hash ring of Redis::Distributed */
+void mrb_redis_sha1(const char *str, size_t len, unsigned char *digest)
+{
+  mrb_redis_sha1_ctx ctx;
+
+  mrb_redis_sha1_init(&ctx);
+  mrb_redis_sha1_update(&ctx, (const unsigned char *)str, len);
+  mrb_redis_sha1_final(&ctx, digest);
+}
+
+/* Redis::Script.sha1(str): hex digest */
+static mrb_value mrb_redis_script_s_sha1(mrb_state *mrb, mrb_value klass)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned char digest[20];
+  char out[40];
+  char *str;
+  mrb_int len;
+  int i;
+
+  mrb_get_args(mrb, "s", &str, &len);
+  mrb_redis_sha1(str, len, digest);
+  for (i = 0; i < 20; i++) {
+    out[i * 2] = hex[digest[i] >> 4];
+    out[i * 2 + 1] = hex[digest[i] & 15];
+  }
+  return mrb_str_new(mrb, out, 40);
+}
+
+static mrb_value mrb_redis_loaded_scripts(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym sym = mrb_intern_lit(mrb, "loaded_scripts");
+  mrb_value scripts = mrb_iv_get(mrb, self, sym);
+
+  if (!mrb_hash_p(scripts)) {
+    scripts = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, sym, scripts);
+  }
+  return scripts;
+}
+
+static mrb_bool mrb_redis_noscript_p(mrb_state *mrb, mrb_value reply)
+{
+  mrb_value message;
+
+  if (!mrb_exception_p(reply)) {
+    return FALSE;
+  }
+  message = mrb_funcall(mrb, reply, "message", 0);
+  return mrb_string_p(message) && RSTRING_LEN(message) >= 8 && memcmp(RSTRING_PTR(message), "NOSCRIPT", 8) == 0;
+}
+
+/* __script_call(sha, source, keys, argv), see Redis::Script#call */
+static mrb_value mrb_redis_script_call(mrb_state *mrb, mrb_value self)
+{
+  mrb_value sha, source, keys, argv, scripts, reply;
+  mrb_redis_data *data;
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  mrb_get_args(mrb, "SSAA", &sha, &source, &keys, &argv);
+  data = (mrb_redis_data *)DATA_PTR(self);
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  scripts = mrb_redis_loaded_scripts(mrb, self);
+
+  if (data->pipelining || data->multi) {
+    /* the reply is read later: the script is only known loaded once an EVAL outside succeeded */
+    mrb_bool loaded = mrb_test(mrb_hash_get(mrb, scripts, sha));
+    return mrb_redis_eval(mrb, self, loaded ? "EVALSHA" : "EVAL", loaded ? sha : source, keys, argv, &rule);
+  }
+
+  rule.return_exception = TRUE;
+  reply = mrb_redis_eval(mrb, self, "EVALSHA", sha, keys, argv, &rule);
+  if (mrb_redis_noscript_p(mrb, reply)) {
+    reply = mrb_redis_eval(mrb, self, "EVAL", source, keys, argv, &rule);
+  }
+  if (mrb_exception_p(reply)) {
+    mrb_exc_raise(mrb, reply);
+  }
+  mrb_hash_set(mrb, scripts, sha, mrb_true_value());
+  return reply;
+}
+
+/* eval(source, keys = [], argv = []), evalsha(sha, keys = [], argv = []) */
+static mrb_value mrb_redis_eval_generic(mrb_state *mrb, mrb_value self, const char *cmd)
+{
+  mrb_value script, keys = mrb_nil_value(), argv = mrb_nil_value();
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  mrb_get_args(mrb, "S|AA", &script, &keys, &argv);
+  return mrb_redis_eval(mrb, self, cmd, script, mrb_nil_p(keys) ? mrb_ary_new(mrb) : keys,
+                        mrb_nil_p(argv) ? mrb_ary_new(mrb) : argv, &rule);
+}
+
+static mrb_value mrb_redis_eval_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_eval_generic(mrb, self, "EVAL");
+}
+
+static mrb_value mrb_redis_evalsha(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_eval_generic(mrb, self, "EVALSHA");
+}
+
+/* the SHA1 of the script */
+static mrb_value mrb_redis_script_load(mrb_state *mrb, mrb_value self)
+{
+  mrb_value source, sha;
+  const char *argv[3] = {"SCRIPT", "LOAD"};
+  size_t lens[3] = {6, 4};
+  ReplyHandlingRule rule = DEFAULT_REPLY_HANDLING_RULE;
+
+  mrb_get_args(mrb, "S", &source);
+  argv[2] = RSTRING_PTR(source);
+  lens[2] = RSTRING_LEN(source);
+  sha = mrb_redis_call(mrb, self, 3, argv, lens, &rule);
+  if (mrb_string_p(sha)) {
+    mrb_hash_set(mrb, mrb_redis_loaded_scripts(mrb, self), sha, mrb_true_value());
+  }
+  return sha;
+}
+
+/* script_exists(sha) => true/false, script_exists(sha1, sha2, ...) => [true, false, ...] */
+static mrb_value mrb_redis_script_exists(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *shas, reply;
+  mrb_int len, i;
+  const char *argv[34] = {"SCRIPT", "EXISTS"};
+  size_t lens[34] = {6, 6};
+  ReplyHandlingRule rule = {.integer_to_bool = TRUE};
+
+  mrb_get_args(mrb, "*", &shas, &len);
+  if (len == 0 || len > 32) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "1 to 32 SHA1 expected");
+  }
+  for (i = 0; i < len; i++) {
+    mrb_value sha = mrb_str_to_str(mrb, shas[i]);
+    argv[2 + i] = RSTRING_PTR(sha);
+    lens[2 + i] = RSTRING_LEN(sha);
+  }
+  reply = mrb_redis_call(mrb, self, (int)len + 2, argv, lens, &rule);
+  if (len == 1 && mrb_array_p(reply) && RARRAY_LEN(reply) == 1) {
+    return RARRAY_PTR(reply)[0];
+  }
+  return reply;
+}
+
+static mrb_value mrb_redis_script_flush(mrb_state *mrb, mrb_value self)
+{
+  const char *argv[2] = {"SCRIPT", "FLUSH"};
+  size_t lens[2] = {6, 5};
+  ReplyHandlingRule rule = {.status_to_symbol = TRUE};
+  mrb_value reply = mrb_redis_call(mrb, self, 2, argv, lens, &rule);
+
+  mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "loaded_scripts"));
+  return reply;
+}
+
+void mrb_redis_script_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *script = mrb_define_class_under(mrb, redis, "Script", mrb->object_class);
+
+  mrb_define_class_method(mrb, script, "sha1", mrb_redis_script_s_sha1, MRB_ARGS_REQ(1));
+
+  mrb_define_method(mrb, redis, "eval", mrb_redis_eval_m, (MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2)));
+  mrb_define_method(mrb, redis, "evalsha", mrb_redis_evalsha, (MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2)));
+  mrb_define_method(mrb, redis, "script_load", mrb_redis_script_load, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, redis, "script_exists", mrb_redis_script_exists, MRB_ARGS_ANY());
+  mrb_define_method(mrb, redis, "script_flush", mrb_redis_script_flush, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "__script_call", mrb_redis_script_call, MRB_ARGS_REQ(4));
+}
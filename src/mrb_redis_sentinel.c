@@ -0,0 +1,461 @@
+/*
+// mrb_redis_sentinel.c - Redis::Sentinel, a client following the master named by Redis Sentinel
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include <errno.h>
+#include <hiredis/hiredis.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The address of the master is asked to the sentinels once, then kept. A
+ * second connection to one of them is subscribed to +switch-master and
+ * polled before each command, without a round trip: the connection moves
+ * to the new master as soon as a failover is announced. A lost connection
+ * or a READONLY reply (a demoted master) asks the sentinels again. Lost
+ * sentinels are looked for again at most once per second.
+ */
+
+#define MRB_REDIS_SENTINEL_RESUBSCRIBE 1000000 /* usec */
+
+typedef struct {
+  char *host;
+  int port;
+} mrb_redis_sentinel_node;
+
+struct mrb_redis_sentinel {
+  char *name;
+  mrb_redis_sentinel_node *nodes;
+  mrb_int len;
+  mrb_int current; /* the sentinel that answered last, asked first */
+  char *password;  /* of the sentinels, NULL without */
+  struct timeval timeout;
+  redisContext *sub; /* subscribed to +switch-master, NULL when lost */
+  uint64_t resubscribe_at;
+  char host[256]; /* the master */
+  int port;
+  mrb_int switches;
+};
+
+void mrb_redis_sentinel_free(mrb_state *mrb, mrb_redis_sentinel *s)
+{
+  mrb_int i;
+
+  if (s == NULL) {
+    return;
+  }
+  if (s->sub) {
+    redisFree(s->sub);
+  }
+  for (i = 0; i < s->len; i++) {
+    mrb_free(mrb, s->nodes[i].host);
+  }
+  mrb_free(mrb, s->nodes);
+  mrb_free(mrb, s->name);
+  mrb_free(mrb, s->password);
+  mrb_free(mrb, s);
+}
+
+static char *mrb_redis_sentinel_strdup(mrb_state *mrb, mrb_value str)
+{
+  char *p;
+
+  str = mrb_str_to_str(mrb, str);
+  p = (char *)mrb_malloc(mrb, RSTRING_LEN(str) + 1);
+  memcpy(p, RSTRING_PTR(str), RSTRING_LEN(str));
+  p[RSTRING_LEN(str)] = '\0';
+  return p;
+}
+
+/* sentinels: [[host, port], ...] */
+static mrb_redis_sentinel *mrb_redis_sentinel_new(mrb_state *mrb, mrb_value sentinels, mrb_value name,
+                                                  mrb_float timeout, mrb_value password)
+{
+  mrb_redis_sentinel *s;
+  mrb_int i;
+
+  if (RARRAY_LEN(sentinels) == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no sentinel given");
+  }
+  for (i = 0; i < RARRAY_LEN(sentinels); i++) {
+    mrb_value node = RARRAY_PTR(sentinels)[i];
+    if (!mrb_array_p(node) || RARRAY_LEN(node) != 2) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "sentinel should be [host, port]");
+    }
+    mrb_str_to_str(mrb, RARRAY_PTR(node)[0]);
+    mrb_to_int(mrb, RARRAY_PTR(node)[1]);
+  }
+  if (!mrb_nil_p(password)) {
+    mrb_str_to_str(mrb, password);
+  }
+
+  s = (mrb_redis_sentinel *)mrb_calloc(mrb, 1, sizeof(mrb_redis_sentinel));
+  s->nodes = (mrb_redis_sentinel_node *)mrb_calloc(mrb, RARRAY_LEN(sentinels), sizeof(mrb_redis_sentinel_node));
+  for (i = 0; i < RARRAY_LEN(sentinels); i++) {
+    mrb_value node = RARRAY_PTR(sentinels)[i];
+    s->nodes[i].host = mrb_redis_sentinel_strdup(mrb, RARRAY_PTR(node)[0]);
+    s->nodes[i].port = (int)mrb_fixnum(mrb_to_int(mrb, RARRAY_PTR(node)[1]));
+    s->len++;
+  }
+  s->name = mrb_redis_sentinel_strdup(mrb, name);
+  s->password = mrb_nil_p(password) ? NULL : mrb_redis_sentinel_strdup(mrb, password);
+  s->timeout.tv_sec = (time_t)timeout;
+  s->timeout.tv_usec = (suseconds_t)((timeout - (double)s->timeout.tv_sec) * 1000000);
+  return s;
+}
+
+/* a reply of a command sent to a sentinel, NULL on any error */
+static redisReply *mrb_redis_sentinel_command(redisContext *c, int argc, const char **argv, int type)
+{
+  redisReply *reply = (redisReply *)redisCommandArgv(c, argc, argv, NULL);
+
+  if (reply && reply->type != type) {
+    freeReplyObject(reply);
+    return NULL;
+  }
+  return reply;
+}
+
+static redisContext *mrb_redis_sentinel_connect(mrb_redis_sentinel *s, mrb_int i)
+{
+  redisContext *c = redisConnectWithTimeout(s->nodes[i].host, s->nodes[i].port, s->timeout);
+  const char *argv[2] = {"AUTH", s->password};
+  redisReply *reply;
+
+  if (c == NULL || c->err || redisSetTimeout(c, s->timeout) != REDIS_OK) {
+    goto error;
+  }
+  if (s->password) {
+    if ((reply = mrb_redis_sentinel_command(c, 2, argv, REDIS_REPLY_STATUS)) == NULL) {
+      goto error;
+    }
+    freeReplyObject(reply);
+  }
+  return c;
+
+error:
+  if (c) {
+    redisFree(c);
+  }
+  return NULL;
+}
+
+/* SENTINEL get-master-addr-by-name, the sentinel that answered last first */
+static mrb_bool mrb_redis_sentinel_resolve(mrb_redis_sentinel *s)
+{
+  const char *argv[3] = {"SENTINEL", "get-master-addr-by-name", s->name};
+  mrb_int k;
+
+  for (k = 0; k < s->len; k++) {
+    mrb_int i = (s->current + k) % s->len;
+    redisContext *c = mrb_redis_sentinel_connect(s, i);
+    redisReply *reply;
+
+    if (c == NULL) {
+      continue;
+    }
+    reply = mrb_redis_sentinel_command(c, 3, argv, REDIS_REPLY_ARRAY);
+    redisFree(c);
+    if (reply == NULL) {
+      continue;
+    }
+    if (reply->elements == 2 && reply->element[0]->type == REDIS_REPLY_STRING &&
+        reply->element[1]->type == REDIS_REPLY_STRING) {
+      snprintf(s->host, sizeof(s->host), "%s", reply->element[0]->str);
+      s->port = atoi(reply->element[1]->str);
+      s->current = i;
+      freeReplyObject(reply);
+      return TRUE;
+    }
+    /* a sentinel that doesn't monitor this master */
+    freeReplyObject(reply);
+  }
+  return FALSE;
+}
+
+/* SUBSCRIBE +switch-master on the first sentinel answering */
+static void mrb_redis_sentinel_subscribe(mrb_redis_sentinel *s)
+{
+  const char *argv[2] = {"SUBSCRIBE", "+switch-master"};
+  mrb_int k;
+
+  for (k = 0; k < s->len; k++) {
+    mrb_int i = (s->current + k) % s->len;
+    redisContext *c = mrb_redis_sentinel_connect(s, i);
+    redisReply *reply;
+
+    if (c == NULL) {
+      continue;
+    }
+    if ((reply = mrb_redis_sentinel_command(c, 2, argv, REDIS_REPLY_ARRAY)) == NULL) {
+      redisFree(c);
+      continue;
+    }
+    freeReplyObject(reply);
+    s->sub = c;
+    return;
+  }
+  s->resubscribe_at = mrb_redis_stats_clock() + MRB_REDIS_SENTINEL_RESUBSCRIBE;
+}
+
+/* connects self to the master the sentinels agreed on, the previous connection is dropped */
+static void mrb_redis_sentinel_switch(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
+{
+  mrb_redis_sentinel *s = data->sentinel;
+  redisContext *c = redisConnectWithTimeout(s->host, s->port, s->timeout);
+
+  if (c == NULL || c->err) {
+    if (c) {
+      redisFree(c);
+    }
+    /* asked again by the next command */
+    data->rc->err = REDIS_ERR_EOF;
+    snprintf(data->rc->errstr, sizeof(data->rc->errstr), "%s", "The master has moved");
+    mrb_raisef(mrb, E_REDIS_ERROR, "sentinel: connection to the master %S:%S failed.",
+               mrb_str_new_cstr(mrb, s->host), mrb_fixnum_value(s->port));
+  }
+  redisFree(data->rc);
+  data->rc = c;
+  s->switches++;
+  mrb_redis_reconnected(mrb, self, data);
+}
+
+/* asks the sentinels where the master is, moves there when it moved or the connection is lost */
+static void mrb_redis_sentinel_failover(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
+{
+  mrb_redis_sentinel *s = data->sentinel;
+  char host[sizeof(s->host)];
+  int port = s->port;
+
+  memcpy(host, s->host, sizeof(host));
+  if (!mrb_redis_sentinel_resolve(s)) {
+    mrb_raisef(mrb, E_REDIS_ERROR, "sentinel: no sentinel knows the master %S.", mrb_str_new_cstr(mrb, s->name));
+  }
+  if (data->rc->err != 0 || port != s->port || strcmp(host, s->host) != 0) {
+    mrb_redis_sentinel_switch(mrb, self, data);
+  }
+}
+
+/* "<master name> <old ip> <old port> <new ip> <new port>" */
+static void mrb_redis_sentinel_handle(mrb_state *mrb, mrb_value self, mrb_redis_data *data, redisReply *reply)
+{
+  mrb_redis_sentinel *s = data->sentinel;
+  char name[256], old_host[256], new_host[256];
+  int old_port, new_port;
+  redisReply *payload;
+
+  if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 || reply->element[2]->type != REDIS_REPLY_STRING) {
+    return;
+  }
+  payload = reply->element[2];
+  if (sscanf(payload->str, "%255s %255s %d %255s %d", name, old_host, &old_port, new_host, &new_port) != 5 ||
+      strcmp(name, s->name) != 0) {
+    return;
+  }
+  if (new_port == s->port && strcmp(new_host, s->host) == 0 && data->rc->err == 0) {
+    return;
+  }
+  snprintf(s->host, sizeof(s->host), "%s", new_host);
+  s->port = new_port;
+  mrb_redis_sentinel_switch(mrb, self, data);
+}
+
+/* reads the announcements received so far, never waits */
+static void mrb_redis_sentinel_poll(mrb_state *mrb, mrb_value self, mrb_redis_data *data)
+{
+  mrb_redis_sentinel *s = data->sentinel;
+  struct pollfd pfd;
+  void *reply;
+
+  if (s->sub == NULL) {
+    if (mrb_redis_stats_clock() < s->resubscribe_at) {
+      return;
+    }
+    mrb_redis_sentinel_subscribe(s);
+  }
+  while (s->sub) {
+    if (redisReaderGetReply(s->sub->reader, &reply) != REDIS_OK) {
+      break;
+    }
+    if (reply) {
+      mrb_value exc = mrb_nil_value();
+      struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+      struct mrb_jmpbuf c_jmp;
+
+      /* freed even if the switch raises */
+      MRB_TRY(&c_jmp)
+      {
+        mrb->jmp = &c_jmp;
+        mrb_redis_sentinel_handle(mrb, self, data, (redisReply *)reply);
+        mrb->jmp = prev_jmp;
+      }
+      MRB_CATCH(&c_jmp)
+      {
+        mrb->jmp = prev_jmp;
+        exc = mrb_obj_value(mrb->exc);
+        mrb->exc = NULL;
+      }
+      MRB_END_EXC(&c_jmp);
+      freeReplyObject(reply);
+      if (!mrb_nil_p(exc)) {
+        mrb_exc_raise(mrb, exc);
+      }
+      continue;
+    }
+    pfd.fd = s->sub->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) {
+      return;
+    }
+    if (redisBufferRead(s->sub) != REDIS_OK) {
+      break;
+    }
+  }
+  /* the sentinel is lost: a failover may be missed meanwhile, the errors of the master tell it */
+  if (s->sub) {
+    redisFree(s->sub);
+    s->sub = NULL;
+  }
+  s->resubscribe_at = mrb_redis_stats_clock() + MRB_REDIS_SENTINEL_RESUBSCRIBE;
+}
+
+static mrb_bool mrb_redis_readonly_p(mrb_state *mrb, mrb_value error)
+{
+  mrb_value message;
+
+  if (!mrb_exception_p(error)) {
+    return FALSE;
+  }
+  message = mrb_funcall(mrb, error, "message", 0);
+  return mrb_string_p(message) && RSTRING_LEN(message) >= 8 && memcmp(RSTRING_PTR(message), "READONLY", 8) == 0;
+}
+
+mrb_value mrb_redis_sentinel_execute(mrb_state *mrb, mrb_value self, mrb_redis_data *data, int argc, const char **argv,
+                                     const size_t *lens, const ReplyHandlingRule *rule, mrb_value *error)
+{
+  mrb_value reply, exc;
+
+  mrb_redis_sentinel_poll(mrb, self, data);
+  if (data->rc->err != 0) {
+    /* lost, or closed after a timeout, since the last command */
+    mrb_redis_sentinel_failover(mrb, self, data);
+  }
+
+  reply = mrb_redis_try_roundtrip(mrb, data, argc, argv, lens, rule, error, &exc);
+  if (!mrb_nil_p(exc)) {
+    if (data->rc->err == 0 || mrb_obj_is_kind_of(mrb, exc, E_REDIS_ERR_TIMEOUT)) {
+      mrb_exc_raise(mrb, exc);
+    }
+    mrb_redis_sentinel_failover(mrb, self, data);
+    if (!mrb_redis_retryable(argv[0], lens[0])) {
+      mrb_exc_raise(mrb, exc);
+    }
+  } else if (mrb_redis_readonly_p(mrb, *error)) {
+    /* a demoted master: the write was refused, it can go to the new one */
+    mrb_redis_sentinel_failover(mrb, self, data);
+  } else {
+    return reply;
+  }
+
+  *error = mrb_nil_value();
+  return mrb_redis_roundtrip(mrb, data, argc, argv, lens, rule, error);
+}
+
+/* Redis::Sentinel.__resolve(sentinels, master_name, timeout, password) => [host, port] */
+static mrb_value mrb_redis_sentinel_s_resolve(mrb_state *mrb, mrb_value klass)
+{
+  mrb_value sentinels, name, password, addr;
+  mrb_float timeout;
+  mrb_redis_sentinel *s;
+
+  mrb_get_args(mrb, "ASfo", &sentinels, &name, &timeout, &password);
+  s = mrb_redis_sentinel_new(mrb, sentinels, name, timeout, password);
+  if (!mrb_redis_sentinel_resolve(s)) {
+    mrb_redis_sentinel_free(mrb, s);
+    mrb_raisef(mrb, E_REDIS_ERROR, "sentinel: no sentinel knows the master %S.", name);
+  }
+  addr = mrb_assoc_new(mrb, mrb_str_new_cstr(mrb, s->host), mrb_fixnum_value(s->port));
+  mrb_redis_sentinel_free(mrb, s);
+
+  return addr;
+}
+
+/* __watch(sentinels, master_name, timeout, password), once connected to the master */
+static mrb_value mrb_redis_sentinel_watch(mrb_state *mrb, mrb_value self)
+{
+  mrb_value sentinels, name, password;
+  mrb_float timeout;
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+  mrb_redis_sentinel *s;
+
+  mrb_get_args(mrb, "ASfo", &sentinels, &name, &timeout, &password);
+  if (data == NULL || data->rc == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  s = mrb_redis_sentinel_new(mrb, sentinels, name, timeout, password);
+  snprintf(s->host, sizeof(s->host), "%s", data->rc->tcp.host);
+  s->port = data->rc->tcp.port;
+  mrb_redis_sentinel_free(mrb, data->sentinel);
+  data->sentinel = s;
+  mrb_redis_sentinel_subscribe(s);
+
+  return self;
+}
+
+static inline mrb_redis_sentinel *mrb_redis_sentinel_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+
+  if (data == NULL || data->rc == NULL || data->sentinel == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return data->sentinel;
+}
+
+/* [host, port] of the master, as last known */
+static mrb_value mrb_redis_sentinel_master_addr(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_sentinel *s = mrb_redis_sentinel_get(mrb, self);
+
+  mrb_redis_sentinel_poll(mrb, self, (mrb_redis_data *)DATA_PTR(self));
+  return mrb_assoc_new(mrb, mrb_str_new_cstr(mrb, s->host), mrb_fixnum_value(s->port));
+}
+
+/* asks the sentinels now */
+static mrb_value mrb_redis_sentinel_refresh(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_sentinel_get(mrb, self);
+  mrb_redis_sentinel_failover(mrb, self, (mrb_redis_data *)DATA_PTR(self));
+
+  return mrb_redis_sentinel_master_addr(mrb, self);
+}
+
+static mrb_value mrb_redis_sentinel_switches(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(mrb_redis_sentinel_get(mrb, self)->switches);
+}
+
+void mrb_redis_sentinel_init(mrb_state *mrb, struct RClass *redis)
+{
+  struct RClass *sentinel = mrb_define_class_under(mrb, redis, "Sentinel", redis);
+
+  mrb_define_class_method(mrb, sentinel, "__resolve", mrb_redis_sentinel_s_resolve, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, sentinel, "__watch", mrb_redis_sentinel_watch, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, sentinel, "master_addr", mrb_redis_sentinel_master_addr, MRB_ARGS_NONE());
+  mrb_define_method(mrb, sentinel, "refresh_master", mrb_redis_sentinel_refresh, MRB_ARGS_NONE());
+  mrb_define_method(mrb, sentinel, "switches", mrb_redis_sentinel_switches, MRB_ARGS_NONE());
+}
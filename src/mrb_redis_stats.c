@@ -0,0 +1,367 @@
+/*
+// mrb_redis_stats.c - per command latency histograms and connection counters
+//
+// See Copyright Notice in mrb_redis.c
+*/
+
+#include "mrb_redis.h"
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include <ctype.h>
+#include <mruby/redis.h>
+#include <mruby/throw.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Recording costs a clock read and a few increments: the command entry is
+ * found by a linear search starting with the last one used, and nothing
+ * here touches mruby. Every connection keeps its own counters, they are
+ * folded into the process wide ones when it is freed or reset, so
+ * Redis.stats survives the mrb_state that did the work (one per request in
+ * mod_mruby).
+ */
+static mrb_redis_stats global_stats;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t mrb_redis_stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* 0-3 usec have a bucket each, then 4 buckets per power of two */
+static inline int mrb_redis_stats_bucket(uint64_t usec)
+{
+  int log2, idx;
+
+  if (usec < 4) {
+    return (int)usec;
+  }
+  log2 = 63 - __builtin_clzll(usec);
+  idx = (log2 - 1) * 4 + (int)((usec >> (log2 - 2)) & 3);
+  return idx < MRB_REDIS_STATS_BUCKETS ? idx : MRB_REDIS_STATS_BUCKETS - 1;
+}
+
+/* largest latency counted in a bucket */
+static inline uint64_t mrb_redis_stats_bucket_max(int idx)
+{
+  int log2, sub;
+
+  if (idx < 4) {
+    return idx;
+  }
+  log2 = idx / 4 + 1;
+  sub = idx % 4;
+  return ((uint64_t)(4 + sub) << (log2 - 2)) + ((uint64_t)1 << (log2 - 2)) - 1;
+}
+
+static inline int mrb_redis_stats_same(const char *upper, const char *name, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (upper[i] != toupper((unsigned char)name[i])) {
+      return 0;
+    }
+  }
+  return upper[len] == '\0';
+}
+
+static int mrb_redis_stats_lookup(mrb_redis_stats *stats, const char *name, size_t len)
+{
+  mrb_redis_command_stats *cs;
+  size_t i;
+  int idx;
+
+  if (len >= sizeof(cs->name)) {
+    len = sizeof(cs->name) - 1;
+  }
+  if (stats->last < stats->len && mrb_redis_stats_same(stats->per_command[stats->last].name, name, len)) {
+    return stats->last;
+  }
+  for (idx = 0; idx < stats->len; idx++) {
+    if (mrb_redis_stats_same(stats->per_command[idx].name, name, len)) {
+      stats->last = idx;
+      return idx;
+    }
+  }
+
+  if (stats->len == stats->capa) {
+    int capa = stats->capa ? stats->capa * 2 : 16;
+    cs = (mrb_redis_command_stats *)realloc(stats->per_command, capa * sizeof(mrb_redis_command_stats));
+    if (cs == NULL) {
+      /* not worth an exception */
+      return -1;
+    }
+    stats->per_command = cs;
+    stats->capa = capa;
+  }
+  cs = &stats->per_command[stats->len];
+  memset(cs, 0, sizeof(*cs));
+  for (i = 0; i < len; i++) {
+    cs->name[i] = toupper((unsigned char)name[i]);
+  }
+  stats->last = stats->len;
+  return stats->len++;
+}
+
+/* a command was appended to the output buffer, returns its entry (-1 if none) */
+int mrb_redis_stats_count(mrb_redis_stats *stats, int argc, const char **argv, const size_t *lens)
+{
+  uint64_t bytes = 3 + mrb_redis_digits(argc);
+  int i, idx;
+
+  if (stats->inflight) {
+    /* the reply of the previous command never came (I/O error) */
+    if (stats->inflight <= stats->len) {
+      stats->per_command[stats->inflight - 1].errors++;
+    }
+    stats->errors++;
+    stats->inflight = 0;
+  }
+
+  /* *argc CRLF, then $len CRLF arg CRLF for each argument */
+  for (i = 0; i < argc; i++) {
+    bytes += 5 + mrb_redis_digits(lens[i]) + lens[i];
+  }
+  stats->bytes_written += bytes;
+  stats->commands++;
+
+  idx = mrb_redis_stats_lookup(stats, argv[0], lens[0]);
+  if (idx >= 0) {
+    stats->per_command[idx].calls++;
+  }
+  return idx;
+}
+
+void mrb_redis_stats_sample(mrb_redis_stats *stats, int idx, uint64_t usec, mrb_bool error)
+{
+  mrb_redis_command_stats *cs;
+
+  if (error) {
+    stats->errors++;
+  }
+  if (idx < 0 || idx >= stats->len) {
+    return;
+  }
+  cs = &stats->per_command[idx];
+  cs->samples++;
+  cs->total_usec += usec;
+  if (usec > cs->max_usec) {
+    cs->max_usec = usec;
+  }
+  cs->buckets[mrb_redis_stats_bucket(usec)]++;
+  if (error) {
+    cs->errors++;
+  }
+}
+
+void mrb_redis_stats_pipeline(mrb_redis_stats *stats, mrb_int depth)
+{
+  stats->pipelines++;
+  stats->pipelined_commands += depth;
+  if ((uint64_t)depth > stats->max_pipeline_depth) {
+    stats->max_pipeline_depth = depth;
+  }
+}
+
+static void mrb_redis_stats_merge(mrb_redis_stats *dst, const mrb_redis_stats *src)
+{
+  int i, j, idx;
+
+  dst->commands += src->commands;
+  dst->errors += src->errors;
+  dst->bytes_written += src->bytes_written;
+  dst->bytes_read += src->bytes_read;
+  dst->reconnects += src->reconnects;
+  dst->pipelines += src->pipelines;
+  dst->pipelined_commands += src->pipelined_commands;
+  if (src->max_pipeline_depth > dst->max_pipeline_depth) {
+    dst->max_pipeline_depth = src->max_pipeline_depth;
+  }
+
+  for (i = 0; i < src->len; i++) {
+    const mrb_redis_command_stats *s = &src->per_command[i];
+    mrb_redis_command_stats *d;
+
+    idx = mrb_redis_stats_lookup(dst, s->name, strlen(s->name));
+    if (idx < 0) {
+      continue;
+    }
+    d = &dst->per_command[idx];
+    d->calls += s->calls;
+    d->errors += s->errors;
+    d->samples += s->samples;
+    d->total_usec += s->total_usec;
+    if (s->max_usec > d->max_usec) {
+      d->max_usec = s->max_usec;
+    }
+    for (j = 0; j < MRB_REDIS_STATS_BUCKETS; j++) {
+      d->buckets[j] += s->buckets[j];
+    }
+  }
+}
+
+static void mrb_redis_stats_clear(mrb_redis_stats *stats)
+{
+  free(stats->per_command);
+  memset(stats, 0, sizeof(*stats));
+}
+
+/* adds the counters of a connection to the process wide ones and clears them */
+void mrb_redis_stats_fold(mrb_redis_stats *stats)
+{
+  if (stats->commands == 0 && stats->len == 0) {
+    return;
+  }
+  pthread_mutex_lock(&global_lock);
+  mrb_redis_stats_merge(&global_stats, stats);
+  pthread_mutex_unlock(&global_lock);
+  mrb_redis_stats_clear(stats);
+}
+
+static inline mrb_value mrb_redis_stats_value(mrb_state *mrb, uint64_t v)
+{
+  if (v <= (uint64_t)MRB_INT_MAX) {
+    return mrb_fixnum_value((mrb_int)v);
+  }
+  return mrb_float_value(mrb, (mrb_float)v);
+}
+
+/* upper bound of the bucket holding the q-th quantile */
+static uint64_t mrb_redis_stats_percentile(const mrb_redis_command_stats *cs, double q)
+{
+  uint64_t target = (uint64_t)(cs->samples * q), seen = 0, bound;
+  int i;
+
+  if (cs->samples == 0) {
+    return 0;
+  }
+  if (target == 0) {
+    target = 1;
+  }
+  for (i = 0; i < MRB_REDIS_STATS_BUCKETS; i++) {
+    seen += cs->buckets[i];
+    if (seen >= target) {
+      break;
+    }
+  }
+  bound = mrb_redis_stats_bucket_max(i < MRB_REDIS_STATS_BUCKETS ? i : MRB_REDIS_STATS_BUCKETS - 1);
+  return bound < cs->max_usec ? bound : cs->max_usec;
+}
+
+#define STATS_SET(hash, name, v)                                                                                       \
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, name)), mrb_redis_stats_value(mrb, v))
+
+static mrb_value mrb_redis_stats_to_hash(mrb_state *mrb, const mrb_redis_stats *stats)
+{
+  mrb_value hash = mrb_hash_new(mrb), per_command = mrb_hash_new(mrb);
+  int i, ai;
+
+  STATS_SET(hash, "commands", stats->commands);
+  STATS_SET(hash, "errors", stats->errors);
+  STATS_SET(hash, "bytes_written", stats->bytes_written);
+  STATS_SET(hash, "bytes_read", stats->bytes_read);
+  STATS_SET(hash, "reconnects", stats->reconnects);
+  STATS_SET(hash, "pipelines", stats->pipelines);
+  STATS_SET(hash, "pipelined_commands", stats->pipelined_commands);
+  STATS_SET(hash, "max_pipeline_depth", stats->max_pipeline_depth);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "per_command")), per_command);
+
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < stats->len; i++) {
+    const mrb_redis_command_stats *cs = &stats->per_command[i];
+    mrb_value h = mrb_hash_new(mrb);
+
+    STATS_SET(h, "calls", cs->calls);
+    STATS_SET(h, "errors", cs->errors);
+    STATS_SET(h, "samples", cs->samples);
+    STATS_SET(h, "avg_us", cs->samples ? cs->total_usec / cs->samples : 0);
+    STATS_SET(h, "p50_us", mrb_redis_stats_percentile(cs, 0.50));
+    STATS_SET(h, "p90_us", mrb_redis_stats_percentile(cs, 0.90));
+    STATS_SET(h, "p99_us", mrb_redis_stats_percentile(cs, 0.99));
+    STATS_SET(h, "p999_us", mrb_redis_stats_percentile(cs, 0.999));
+    STATS_SET(h, "max_us", cs->max_usec);
+    mrb_hash_set(mrb, per_command, mrb_str_new_cstr(mrb, cs->name), h);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return hash;
+}
+
+static mrb_redis_stats *mrb_redis_stats_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_data *data = (mrb_redis_data *)DATA_PTR(self);
+
+  if (data == NULL) {
+    mrb_raise(mrb, E_REDIS_ERR_CLOSED, "connection is already closed or not initialized yet.");
+  }
+  return &data->stats;
+}
+
+static mrb_value mrb_redis_stats_m(mrb_state *mrb, mrb_value self)
+{
+  return mrb_redis_stats_to_hash(mrb, mrb_redis_stats_get(mrb, self));
+}
+
+static mrb_value mrb_redis_stats_reset(mrb_state *mrb, mrb_value self)
+{
+  mrb_redis_stats *stats = mrb_redis_stats_get(mrb, self);
+
+  /* Redis.stats keeps them */
+  mrb_redis_stats_fold(stats);
+  return mrb_nil_value();
+}
+
+static mrb_value mrb_redis_s_stats(mrb_state *mrb, mrb_value klass)
+{
+  mrb_redis_stats copy;
+  mrb_value hash = mrb_nil_value();
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+
+  /* copied under the lock, the Hash is built outside of it */
+  memset(&copy, 0, sizeof(copy));
+  pthread_mutex_lock(&global_lock);
+  mrb_redis_stats_merge(&copy, &global_stats);
+  pthread_mutex_unlock(&global_lock);
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    hash = mrb_redis_stats_to_hash(mrb, &copy);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    free(copy.per_command);
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+  free(copy.per_command);
+
+  return hash;
+}
+
+static mrb_value mrb_redis_s_stats_reset(mrb_state *mrb, mrb_value klass)
+{
+  pthread_mutex_lock(&global_lock);
+  mrb_redis_stats_clear(&global_stats);
+  pthread_mutex_unlock(&global_lock);
+  return mrb_nil_value();
+}
+
+void mrb_redis_stats_init(mrb_state *mrb, struct RClass *redis)
+{
+  mrb_define_method(mrb, redis, "stats", mrb_redis_stats_m, MRB_ARGS_NONE());
+  mrb_define_method(mrb, redis, "stats_reset", mrb_redis_stats_reset, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, redis, "stats", mrb_redis_s_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, redis, "stats_reset", mrb_redis_s_stats_reset, MRB_ARGS_NONE());
+}
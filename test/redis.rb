@@ -6,7 +6,10 @@ HOST         = "127.0.0.1"
 PORT         = 6379
 SECURED_PORT = 6380
 CLUSTER_PORT = 7000
+SOCKET_PATH  = "/tmp/redis.sock"
 NUM_OF_CLUSTER_NODES = 6
+SENTINEL_PORT = 26379
+SENTINEL_MASTER = "mymaster"
 
 assert("Redis#ping") do
   r = Redis.new HOST, PORT
@@ -47,6 +50,24 @@ assert("Redis#host, Redis#port") do
   assert_raise(Redis::ClosedError) {r.port}
 end
 
+assert("Redis#path") do
+  r = Redis.new path: SOCKET_PATH
+
+  assert_equal SOCKET_PATH, r.path
+  assert_nil r.host
+  assert_nil r.port
+  assert_equal "PONG", r.ping
+  r.close
+  assert_raise(Redis::ClosedError) {r.path}
+
+  r = Redis.new HOST, PORT
+  assert_nil r.path
+  r.close
+
+  assert_raise(ArgumentError) {Redis.new timeout: 1}
+  assert_raise(Redis::ConnectionError) {Redis.new path: "/nonexistent/redis.sock"}
+end
+
 assert("Redis#select") do
   r = Redis.new HOST, PORT
   ret1 = r.select 0
@@ -905,6 +926,49 @@ assert("Redis#srem") do
   assert_raise(Redis::ClosedError) {r.srem("set", "hoge")}
 end
 
+assert("Redis#command_chunk_size") do
+  r = Redis.new HOST, PORT
+  r.del "mruby-redis-test:chunk-set"
+
+  assert_equal 0, r.command_chunk_size
+  assert_raise(ArgumentError) { r.command_chunk_size = -1 }
+  r.command_chunk_size = 100
+
+  members = []
+  1001.times { |i| members << "m#{i}" }
+  assert_equal 1001, r.sadd("mruby-redis-test:chunk-set", *members)
+  assert_equal 1, r.sadd("mruby-redis-test:chunk-set", "m0", "m1", *(members + ["new"]))
+  assert_equal 1002, r.scard("mruby-redis-test:chunk-set")
+  assert_equal 1002, r.srem("mruby-redis-test:chunk-set", "new", *members)
+
+  pairs = []
+  keys = []
+  301.times do |i|
+    pairs << "mruby-redis-test:chunk-#{i}" << i.to_s
+    keys << "mruby-redis-test:chunk-#{i}"
+  end
+  assert_equal r, r.mset(*pairs)
+  values = r.mget(*(keys + ["mruby-redis-test:nonexistent"]))
+  assert_equal 302, values.length
+  assert_equal "0", values.first
+  assert_equal "300", values[300]
+  assert_nil values.last
+  # the chunks are pipelined: counted, but not timed one by one
+  stats = r.stats
+  assert_equal 4, stats[:per_command]["MGET"][:calls]
+  assert_equal 0, stats[:per_command]["MGET"][:samples]
+  assert_true stats[:pipelined_commands] >= 4
+
+  # an error in any chunk is raised once every reply is read
+  r.set "mruby-redis-test:chunk-string", "a"
+  assert_raise(Redis::ReplyError) { r.sadd("mruby-redis-test:chunk-string", *members) }
+  assert_equal "PONG", r.ping
+
+  r.del "mruby-redis-test:chunk-string"
+  r.pipelined { |pipe| keys.each { |k| pipe.del k } }
+  r.close
+end
+
 assert("Non-authrozied Redis#srem") do
   r = Redis.new HOST, SECURED_PORT
   assert_raise(Redis::ReplyError) {r.srem("set", "hoge")}
@@ -1039,6 +1103,158 @@ end
 #  assert_equal ["b", "c", "a"], ret
 #end
 
+assert("Redis#zadd with many members and options") do
+  r = Redis.new HOST, PORT
+  r.del "zadd_test"
+  assert_equal 1, r.zadd("zadd_test", 80, "a")
+  assert_equal 2, r.zadd("zadd_test", 50.1, "b", 60, "c")
+  assert_equal 2, r.zadd("zadd_test", [[90, "d"], [70, "e"]])
+  assert_equal 2, r.zadd("zadd_test", {"a" => 85, "f" => 10}, ch: true)
+  assert_equal 0, r.zadd("zadd_test", 1, "a", nx: true)
+  assert_equal 90.0, r.zadd("zadd_test", 5, "a", incr: true, xx: true)
+  assert_nil r.zadd("zadd_test", 5, "z", incr: true, xx: true)
+  assert_equal 6, r.zcard("zadd_test")
+
+  r.command_chunk_size = 4
+  assert_equal 5, r.zadd("zadd_test", 1, "m1", 2, "m2", 3, "m3", 4, "m4", 5, "m5")
+  assert_equal 11, r.zcard("zadd_test")
+
+  assert_raise(ArgumentError) {r.zadd "zadd_test", 1}
+  assert_raise(ArgumentError) {r.zadd "zadd_test", [[1]]}
+  assert_raise(TypeError) {r.zadd "zadd_test", nil, "a"}
+  r.close
+end
+
+assert("Redis#zrange withscores, Redis#zrangebyscore, Redis#zscore") do
+  r = Redis.new HOST, PORT
+  r.del "zrange_test"
+  r.zadd "zrange_test", 80, "a", 50.1, "b", 60, "c", -1.0 / 0, "d"
+
+  assert_equal ["d", "b", "c", "a"], r.zrange("zrange_test", 0, -1)
+  assert_equal [["d", -1.0 / 0], ["b", 50.1], ["c", 60.0], ["a", 80.0]], r.zrange("zrange_test", 0, -1, withscores: true)
+  assert_equal [["a", 80.0], ["c", 60.0]], r.zrevrange("zrange_test", 0, 1, withscores: true)
+  assert_equal ["c", "a"], r.zrangebyscore("zrange_test", 55, "+inf")
+  assert_equal [["b", 50.1]], r.zrangebyscore("zrange_test", "(0", 100, withscores: true, limit: [0, 1])
+  assert_equal ["a", "c"], r.zrevrangebyscore("zrange_test", "+inf", 55)
+  assert_raise(ArgumentError) {r.zrangebyscore "zrange_test", 0, 1, limit: 1}
+
+  assert_equal 50.1, r.zscore("zrange_test", "b")
+  assert_equal (-1.0 / 0), r.zscore("zrange_test", "d")
+  assert_nil r.zscore("zrange_test", "none")
+  assert_equal 82.5, r.zincrby("zrange_test", 2.5, "a")
+
+  replies = r.pipelined do
+    r.zscore "zrange_test", "c"
+    r.zrange "zrange_test", 0, 0, withscores: true
+  end
+  assert_equal [60.0, [["d", -1.0 / 0]]], replies
+  r.close
+end
+
+assert("Redis#zrem, Redis#zpopmin, Redis#zpopmax") do
+  r = Redis.new HOST, PORT
+  r.del "zpop_test"
+  r.zadd "zpop_test", 1, "a", 2, "b", 3, "c", 4, "d"
+
+  assert_equal ["a", 1.0], r.zpopmin("zpop_test")
+  assert_equal [["d", 4.0], ["c", 3.0]], r.zpopmax("zpop_test", 2)
+  assert_equal 1, r.zrem("zpop_test", "b", "none")
+  assert_nil r.zpopmax("zpop_test")
+  assert_equal [], r.zpopmin("zpop_test", 1)
+
+  r.zadd "zpop_test", 1, "a", 2, "b"
+  replies = r.pipelined do |pipe|
+    pipe.zpopmin "zpop_test"
+    pipe.zpopmax "zpop_test", 1
+    pipe.zpopmin "zpop_test"
+  end
+  assert_equal [["a", 1.0], [["b", 2.0]], nil], replies
+  r.close
+end
+
+assert("Redis#xadd, Redis#xlen, Redis#xrange, Redis#xread") do
+  r = Redis.new HOST, PORT
+  r.del "stream_test"
+
+  id1 = r.xadd("stream_test", {"a" => "1", "b" => "2"}, id: "1-1")
+  assert_equal "1-1", id1
+  id2 = r.xadd("stream_test", ["a", 3])
+  assert_equal 2, r.xlen("stream_test")
+  assert_raise(ArgumentError) { r.xadd("stream_test", {}) }
+  assert_raise(ArgumentError) { r.xadd("stream_test", {"a" => 1}, maxlen: 1, minid: "0-1") }
+
+  assert_equal [["1-1", {"a" => "1", "b" => "2"}], [id2, {"a" => "3"}]], r.xrange("stream_test")
+  assert_equal [[id2, {"a" => "3"}]], r.xrange("stream_test", "(1-1", "+", count: 10)
+
+  assert_equal({"stream_test" => [[id2, {"a" => "3"}]]}, r.xread("stream_test", "1-1"))
+  assert_equal({"stream_test" => [["1-1", {"a" => "1", "b" => "2"}]]}, r.xread(["stream_test"], ["0"], count: 1))
+  assert_nil r.xread("stream_test", "$", block: 100)
+
+  r.xadd "stream_test", {"a" => "4"}, maxlen: 1
+  assert_equal 1, r.xlen("stream_test")
+
+  r3 = Redis.new HOST, PORT, protocol: 3
+  entries = r3.xread("stream_test", "0")["stream_test"]
+  assert_equal [{"a" => "4"}], entries.map { |_, fields| fields }
+  r3.close
+
+  r.del "stream_test"
+  r.close
+end
+
+assert("Redis#xreadgroup, Redis#xack, Redis#xpending, Redis#xclaim, Redis#xautoclaim") do
+  r = Redis.new HOST, PORT
+  r.del "stream_test"
+  assert_equal "OK", r.xgroup_create("stream_test", "group", "$", mkstream: true)
+  ids = (0...5).map { |i| r.xadd("stream_test", {"n" => i}) }
+
+  read = r.xreadgroup("group", "c1", "stream_test", count: 3)
+  assert_equal ids[0, 3], read["stream_test"].map { |id, _| id }
+  assert_equal({"n" => "0"}, read["stream_test"][0][1])
+  assert_equal 3, r.xpending("stream_test", "group")[0]
+  assert_equal [[ids[0], "c1"]], r.xpending("stream_test", "group", count: 1).map { |e| e[0, 2] }
+
+  assert_equal 2, r.xack("stream_test", "group", ids[0], ids[1])
+  assert_equal 0, r.xack("stream_test", "group", [ids[0]])
+
+  claimed = r.xclaim("stream_test", "group", "c2", 0, [ids[2]])
+  assert_equal [[ids[2], {"n" => "2"}]], claimed
+  assert_equal [ids[2]], r.xclaim("stream_test", "group", "c1", 0, ids[2], justid: true)
+  auto = r.xautoclaim("stream_test", "group", "c2", 0, "0-0", count: 10)
+  assert_equal [[ids[2], {"n" => "2"}]], auto[1]
+
+  r.del "stream_test"
+  r.close
+end
+
+assert("Redis#xconsume") do
+  r = Redis.new HOST, PORT
+  r.del "stream_test"
+  r.xgroup_create "stream_test", "group", "$", mkstream: true
+  ids = (0...10).map { |i| r.xadd("stream_test", {"n" => i}) }
+
+  # stopped in the middle of a batch: what was not processed is delivered again
+  seen = []
+  r.xconsume("stream_test", "group", "c1", count: 4, block: 100) do |id, fields|
+    break if fields["n"] == "6"
+    seen << fields["n"]
+  end
+  assert_equal (0...6).map(&:to_s), seen
+  # 6 and 7 were read with 4 and 5, only the entries the block returned for are acknowledged
+  assert_equal 2, r.xpending("stream_test", "group")[0]
+
+  seen = []
+  r.xconsume("stream_test", "group", "c1", count: 4, block: 100) do |id, fields|
+    break if id == ids[9]
+    seen << fields["n"]
+  end
+  assert_equal (6...9).map(&:to_s), seen
+  assert_equal [[ids[9], "c1"]], r.xpending("stream_test", "group", count: 10).map { |e| e[0, 2] }
+
+  r.del "stream_test"
+  r.close
+end
+
 assert("Redis#zcard") do
   r = Redis.new HOST, PORT
   r.zadd "myzset", 1, "one"
@@ -1082,6 +1298,150 @@ assert("Pipelined commands") do
   assert_raise(Redis::ClosedError) {redis.reply}
 end
 
+assert("Redis#zero_copy_threshold") do
+  r = Redis.new HOST, PORT
+  assert_equal 0, r.zero_copy_threshold
+  assert_raise(ArgumentError) { r.zero_copy_threshold = -1 }
+  r.zero_copy_threshold = 1024
+
+  blob = "x" * 100_000
+  r.set "mruby-redis-test:blob", blob
+  r.set "mruby-redis-test:small", "small"
+  assert_equal blob, r.get("mruby-redis-test:blob")
+  assert_equal "small", r.get("mruby-redis-test:small")
+  assert_equal [blob, "small", blob], r.pipelined { |pipe|
+    pipe.get "mruby-redis-test:blob"
+    pipe.get "mruby-redis-test:small"
+    pipe.get "mruby-redis-test:blob"
+  }
+  assert_equal "PONG", r.ping
+
+  # the reply still goes through the conversion of the method
+  r.zero_copy_threshold = 1
+  r.zadd "mruby-redis-test:zset", 1.5, "a"
+  assert_equal 1.5, r.zscore("mruby-redis-test:zset", "a")
+  assert_equal "small", r.get("mruby-redis-test:small")
+
+  r.del "mruby-redis-test:blob", "mruby-redis-test:small", "mruby-redis-test:zset"
+  r.close
+end
+
+assert("Redis#scan_each") do
+  r = Redis.new HOST, PORT
+  keys = []
+  50.times { |i| keys << "mruby-redis-test:scan:#{i}" }
+  r.pipelined { |pipe| keys.each { |k| pipe.set k, "v" } }
+
+  cursor, page = r.scan("0", match: "mruby-redis-test:scan:*", count: 10)
+  assert_kind_of String, cursor
+  assert_kind_of Array, page
+
+  found = []
+  r.scan_each(match: "mruby-redis-test:scan:*", count: 10) { |k| found << k }
+  assert_equal keys.sort, found.sort
+
+  # the block may use the connection while the next page is in flight
+  found = []
+  r.scan_each(match: "mruby-redis-test:scan:*", count: 10, prefetch: true) { |k| found << k if r.get(k) == "v" }
+  assert_equal keys.sort, found.sort
+
+  assert_equal keys.sort, r.scan_each(match: "mruby-redis-test:scan:*").to_a.sort
+
+  assert_raise(RuntimeError) do
+    r.scan_each(match: "mruby-redis-test:scan:*", count: 5, prefetch: true) { |k| raise "stop" }
+  end
+  assert_equal "PONG", r.ping
+
+  # an iteration inside the block doesn't take the page prefetched by the outer one
+  hashes = []
+  10.times { |i| hashes << "mruby-redis-test:scan-nested:#{i}" }
+  r.pipelined { |pipe| hashes.each { |k| pipe.hmset k, "f1", "v1", "f2", "v2" } }
+  fields = []
+  r.scan_each(match: "mruby-redis-test:scan-nested:*", count: 2, prefetch: true) do |k|
+    r.hscan_each(k, prefetch: true) { |f, v| fields << "#{k}/#{f}" }
+  end
+  assert_equal hashes.map { |k| ["#{k}/f1", "#{k}/f2"] }.flatten.sort, fields.sort
+
+  r.pipelined { |pipe| (keys + hashes).each { |k| pipe.del k } }
+  r.close
+end
+
+assert("Redis#sscan_each, Redis#hscan_each, Redis#zscan_each") do
+  r = Redis.new HOST, PORT
+  r.del "mruby-redis-test:sscan"
+  r.del "mruby-redis-test:hscan"
+  r.del "mruby-redis-test:zscan"
+
+  r.sadd "mruby-redis-test:sscan", "a", "b", "c"
+  r.hmset "mruby-redis-test:hscan", "f1", "v1", "f2", "v2"
+  r.zadd "mruby-redis-test:zscan", 1.5, "m1"
+  r.zadd "mruby-redis-test:zscan", 2, "m2"
+
+  members = []
+  r.sscan_each("mruby-redis-test:sscan", prefetch: true) { |m| members << m }
+  assert_equal ["a", "b", "c"], members.sort
+
+  hash = {}
+  r.hscan_each("mruby-redis-test:hscan") { |f, v| hash[f] = v }
+  assert_equal({"f1" => "v1", "f2" => "v2"}, hash)
+
+  scores = {}
+  r.zscan_each("mruby-redis-test:zscan", count: 1) { |m, score| scores[m] = score }
+  assert_equal({"m1" => 1.5, "m2" => 2.0}, scores)
+
+  assert_raise(Redis::ReplyError) { r.sscan_each("mruby-redis-test:hscan") {} }
+
+  r.del "mruby-redis-test:sscan"
+  r.del "mruby-redis-test:hscan"
+  r.del "mruby-redis-test:zscan"
+  r.close
+end
+
+assert("Redis#pipelined") do
+  redis = Redis.new HOST, PORT
+  redis.del "mruby-redis-test:pipe", "mruby-redis-test:pipe-hash"
+
+  ret = redis.pipelined do |pipe|
+    assert_nil pipe.set("mruby-redis-test:pipe", "1")
+    pipe.incr "mruby-redis-test:pipe"
+    pipe.exists? "mruby-redis-test:pipe"
+    pipe.hset "mruby-redis-test:pipe-hash", "a", "b"
+    pipe.hgetall "mruby-redis-test:pipe-hash"
+    pipe.mget "mruby-redis-test:pipe", "mruby-redis-test:nonexistent"
+    pipe.hgetall "mruby-redis-test:pipe"
+    pipe.queue :get, "mruby-redis-test:pipe"
+  end
+
+  assert_equal "OK", ret[0]
+  assert_equal 2, ret[1]
+  assert_true ret[2]
+  assert_equal true, ret[3]
+  assert_equal({"a" => "b"}, ret[4])
+  assert_equal ["2", nil], ret[5]
+  assert_kind_of Redis::ReplyError, ret[6]
+  assert_equal "2", ret[7]
+  assert_equal [], redis.pipelined {}
+
+  assert_equal redis, redis.mset("mruby-redis-test:pipe", "3")
+  ret = redis.pipelined do |pipe|
+    assert_nil pipe.mset("mruby-redis-test:pipe", "4")
+    assert_nil pipe.hmset("mruby-redis-test:pipe-hash", "a", "c")
+  end
+  assert_equal ["OK", "OK"], ret
+
+  assert_raise(RuntimeError) do
+    redis.pipelined do |pipe|
+      pipe.incr "mruby-redis-test:pipe"
+      raise "abort"
+    end
+  end
+  assert_equal "2", redis.get("mruby-redis-test:pipe")
+
+  redis.del "mruby-redis-test:pipe", "mruby-redis-test:pipe-hash"
+  redis.close
+  assert_raise(Redis::ClosedError) { redis.pipelined { |pipe| pipe.ping } }
+end
+
 #assert("Redis#zrevrange") do
 #  r = Redis.new HOST, PORT
 #  r.del "hs"
@@ -1186,6 +1546,91 @@ assert("Non-authrozied Redis#publish") do
   r.close
 end
 
+assert("Redis#subscribe") do
+  r = Redis.new HOST, PORT
+  producer = Redis.new HOST, PORT
+  events = []
+
+  r.subscribe("chan1", "chan2") do |on|
+    on.subscribe do |channel, count|
+      events << [:subscribe, channel, count]
+      producer.publish(channel, "hello #{channel}") if count == 2
+    end
+    on.message do |channel, message|
+      events << [:message, channel, message]
+      assert_raise(RuntimeError) {r.get "key"}
+      r.unsubscribe
+    end
+    on.unsubscribe { |channel, count| events << [:unsubscribe, channel, count] }
+  end
+
+  assert_equal [:subscribe, "chan1", 1], events[0]
+  assert_equal [:subscribe, "chan2", 2], events[1]
+  assert_equal [:message, "chan2", "hello chan2"], events[2]
+  assert_equal 0, events.last[2]
+  assert_false r.subscribed?
+
+  # back in step
+  r.set "key", "value"
+  assert_equal "value", r.get("key")
+
+  assert_raise(RuntimeError) {r.unsubscribe}
+  assert_raise(ArgumentError) {r.subscribe "chan1"}
+  r.close
+  producer.close
+end
+
+assert("Redis#psubscribe") do
+  r = Redis.new HOST, PORT
+  producer = Redis.new HOST, PORT
+  got = nil
+
+  r.psubscribe("news.*") do |on|
+    on.psubscribe { |pattern, count| producer.publish("news.tech", "mruby") }
+    on.pmessage do |pattern, channel, message|
+      got = [pattern, channel, message]
+      # both replies are read before the loop returns
+      r.punsubscribe
+      r.unsubscribe
+    end
+  end
+
+  assert_equal ["news.*", "news.tech", "mruby"], got
+  assert_equal "PONG", r.ping
+  r.close
+  producer.close
+end
+
+assert("Redis#subscribe_with_timeout") do
+  r = Redis.new HOST, PORT
+  unsubscribed = []
+
+  r.subscribe_with_timeout(0.1, "quiet") do |on|
+    on.unsubscribe { |channel, count| unsubscribed << channel }
+  end
+
+  assert_equal ["quiet"], unsubscribed
+  assert_equal "PONG", r.ping
+  r.close
+end
+
+assert("Redis#subscribe with a raising handler") do
+  r = Redis.new HOST, PORT
+  producer = Redis.new HOST, PORT
+
+  assert_raise(RuntimeError) do
+    r.subscribe("chan1") do |on|
+      on.subscribe { |channel, count| producer.publish(channel, "boom") }
+      on.message { |channel, message| raise message }
+    end
+  end
+
+  assert_false r.subscribed?
+  assert_equal "PONG", r.ping
+  r.close
+  producer.close
+end
+
 assert("Redis#pfadd") do
   r = Redis.new HOST, PORT
   assert_equal 1, r.pfadd("foos")
@@ -1298,6 +1743,30 @@ assert("Redis#exec") do
   assert_raise(Redis::ClosedError) {client1.exec}
 end
 
+assert("Redis#exec with nested replies") do
+  r = Redis.new HOST, PORT
+  r.del "mruby-redis-test:nested", "mruby-redis-test:nested-list"
+
+  list = []
+  1000.times { |i| list << i.to_s }
+  r.pipelined { |pipe| list.each { |v| pipe.rpush "mruby-redis-test:nested-list", v } }
+  assert_equal list, r.lrange("mruby-redis-test:nested-list", 0, -1)
+
+  r.multi
+  r.set "mruby-redis-test:nested", "a"
+  r.lrange "mruby-redis-test:nested-list", 0, 2
+  r.get "mruby-redis-test:nonexistent"
+  assert_equal ["OK", ["0", "1", "2"], nil], r.exec
+
+  r.multi
+  r.incr "mruby-redis-test:nested"
+  assert_raise(Redis::ReplyError) { r.exec }
+  assert_equal "PONG", r.ping
+
+  r.del "mruby-redis-test:nested", "mruby-redis-test:nested-list"
+  r.close
+end
+
 assert("Non-authrozied Redis#exec") do
   r = Redis.new HOST, SECURED_PORT
   assert_raise(Redis::ReplyError) {r.exec}
@@ -1459,3 +1928,718 @@ assert("Redis#cluster") do
   r.close
   assert_raise(Redis::ClosedError) {r.cluster "info"}
 end
+
+assert("Redis::Async#call, Redis::Async#wait") do
+  a = Redis::Async.new HOST, PORT
+  replies = []
+  a.call(:set, "mruby-redis-test:async", "bar") { |reply| replies << reply }
+  a.call(:get, "mruby-redis-test:async") { |reply| replies << reply }
+  a.call(:nonexistant) { |reply| replies << reply }
+  a.call(:del, "mruby-redis-test:async")
+
+  assert_equal 4, a.pending
+  assert_true a.wait(1)
+  assert_equal 0, a.pending
+  assert_true a.connected?
+  assert_equal "OK", replies[0]
+  assert_equal "bar", replies[1]
+  assert_kind_of Redis::ReplyError, replies[2]
+
+  a.call(:ping) { raise ArgumentError, "in callback" }
+  assert_raise(ArgumentError) { a.wait }
+
+  a.close
+  assert_false a.connected?
+  assert_raise(Redis::ClosedError) { a.call(:ping) }
+  assert_raise(Redis::ClosedError) { a.wait }
+end
+
+assert("Redis::Async.wait_all") do
+  clients = [Redis::Async.new(HOST, PORT), Redis::Async.new(HOST, PORT)]
+  count = 0
+  clients.each do |a|
+    10.times { a.call(:incr, "mruby-redis-test:async-counter") { |reply| count += 1 } }
+  end
+
+  assert_true Redis::Async.wait_all(clients, 1)
+  assert_equal 20, count
+
+  clients.each { |a| a.call(:del, "mruby-redis-test:async-counter") }
+  Redis::Async.wait_all(clients)
+  clients.each { |a| a.close }
+end
+
+assert("Redis#import") do
+  r = Redis.new HOST, PORT
+  r.del "import-list"
+  r.set "import-string", "1"
+
+  rows = (0...50).map { |i| ["import-list", i] }
+  result = r.import(rows, window: 8) { |key, i| [:rpush, key, i] }
+  assert_equal 50, result[:count]
+  assert_equal [], result[:errors]
+  assert_equal 50, r.llen("import-list")
+  assert_equal "49", r.lindex("import-list", -1)
+
+  # error replies are collected with the index of their row, nil rows are skipped
+  result = r.import([["incr", "import-string"], ["lpush", "import-string", "a"], nil, [:incr, "import-string"]], window: 2)
+  assert_equal 3, result[:count]
+  assert_equal 1, result[:errors].length
+  assert_equal 1, result[:errors][0][0]
+  assert_kind_of Redis::ReplyError, result[:errors][0][1]
+  assert_equal "3", r.get("import-string")
+
+  # the replies owed are read when the block raises
+  assert_raise(RuntimeError) { r.import(1..10, window: 4) { |i| raise "stop" if i == 7; [:incr, "import-string"] } }
+  assert_equal "9", r.get("import-string")
+  assert_raise(ArgumentError) { r.import([], window: 0) }
+
+  r.del "import-list", "import-string"
+  r.close
+end
+
+assert("Redis::Command") do
+  r = Redis.new HOST, PORT
+  r.del "hash"
+  hincrby = Redis::Command.compile "HINCRBY", arity: 3
+  assert_equal "HINCRBY", hincrby.name
+  assert_equal 3, hincrby.arity
+  assert_equal 1, hincrby.call(r, "hash", "field", 1)
+  assert_equal 3, hincrby.call(r, "hash", "field", "2")
+  assert_raise(ArgumentError) { hincrby.call(r, "hash", "field") }
+  assert_equal [4, 5, 6], r.pipelined { 3.times { hincrby.call(r, "hash", "field", 1) } }
+  assert_equal "6", r.hget("hash", "field")
+
+  # any number of arguments, mixed with the other commands
+  del = Redis::Command.compile "DEL"
+  assert_nil del.arity
+  r.set "foo", "1"
+  assert_equal 2, del.call(r, "hash", "foo", "none")
+  assert_raise(Redis::ReplyError) { Redis::Command.compile("NONEXISTANT").call(r, "foo") }
+  assert_equal "PONG", r.ping
+
+  r.close
+  assert_raise(Redis::ClosedError) { hincrby.call(r, "hash", "field", 1) }
+end
+
+assert("Redis::RESP.encode") do
+  assert_equal "*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$1\r\n1\r\n", Redis::RESP.encode(["SET", "foo", 1])
+  assert_equal "*1\r\n$4\r\nPING\r\n*2\r\n$4\r\nINCR\r\n$0\r\n\r\n", Redis::RESP.encode_many([[:PING], ["INCR", ""]])
+  assert_raise(ArgumentError) { Redis::RESP.encode([]) }
+  command = [:set, "k", 1]
+  Redis::RESP.encode(command)
+  assert_equal [:set, "k", 1], command
+  assert_equal "*2\r\n$3\r\nGET\r\n$1\r\nk\r\n", Redis::RESP.encode([:GET, "k"].freeze)
+
+  buffer = "prefix"
+  assert_equal buffer, Redis::RESP.encode_many([["PING"]], buffer)
+  assert_equal "prefix*1\r\n$4\r\nPING\r\n", buffer
+
+  io = []
+  def io.write(s)
+    push(s)
+    s.length
+  end
+  Redis::RESP.encode_many((0...5000).map { |i| ["SET", "key:#{i}", "x" * 20] }, io)
+  assert_true io.length > 1
+  assert_equal Redis::RESP.encode_many((0...5000).map { |i| ["SET", "key:#{i}", "x" * 20] }), io.join
+end
+
+assert("Redis::RESP.decode") do
+  buffer = "*2\r\n$3\r\nfoo\r\n:42\r\n+OK\r"
+  assert_equal [["foo", 42], 18], Redis::RESP.decode(buffer)
+  assert_nil Redis::RESP.decode(buffer, 18)
+  buffer << "\n$-1\r\n*-1\r\n-ERR bad\r\n"
+  assert_equal ["OK", 23], Redis::RESP.decode(buffer, 18)
+  assert_equal [nil, 28], Redis::RESP.decode(buffer, 23)
+  assert_equal [nil, 33], Redis::RESP.decode(buffer, 28)
+  error = Redis::RESP.decode(buffer, 33)[0]
+  assert_kind_of Redis::ReplyError, error
+  assert_equal "ERR bad", error.message
+
+  # incomplete bulk string, then complete
+  assert_nil Redis::RESP.decode("$5\r\nhel")
+  assert_equal ["hello", 11], Redis::RESP.decode("$5\r\nhello\r\n")
+  assert_equal ["a\r\nb" * 10, 47], Redis::RESP.decode("$40\r\n" + "a\r\nb" * 10 + "\r\n")
+
+  # RESP3
+  assert_equal [{"a" => 1, "b" => [true, false]}, 28], Redis::RESP.decode("%2\r\n+a\r\n:1\r\n+b\r\n*2\r\n#t\r\n#f\r\n")
+  assert_equal [1.5, 6], Redis::RESP.decode(",1.5\r\n")
+  assert_equal [nil, 3], Redis::RESP.decode("_\r\n")
+  assert_equal ["hello", 15], Redis::RESP.decode("=9\r\ntxt:hello\r\n")
+  assert_equal [1, 18], Redis::RESP.decode("|1\r\n+ttl\r\n:3\r\n:1\r\n")
+
+  assert_raise(Redis::ProtocolError) { Redis::RESP.decode("?\r\n") }
+  assert_raise(Redis::ProtocolError) { Redis::RESP.decode(":abc\r\n") }
+  assert_raise(Redis::ProtocolError) { Redis::RESP.decode("*1\r\n" * 100 + ":1\r\n") }
+end
+
+assert("Redis::Cluster.keyslot") do
+  assert_equal 12182, Redis::Cluster.keyslot("foo")
+  assert_equal 5061, Redis::Cluster.keyslot("bar")
+  assert_equal Redis::Cluster.keyslot("user1000"), Redis::Cluster.keyslot("{user1000}.following")
+  assert_equal Redis::Cluster.keyslot("{}foo"), Redis::Cluster.keyslot("{}foo")
+  assert_not_equal Redis::Cluster.keyslot("foo"), Redis::Cluster.keyslot("{}foo")
+end
+
+assert("Redis::Cluster") do
+  c = Redis::Cluster.new ["#{HOST}:#{CLUSTER_PORT}"]
+  assert_equal NUM_OF_CLUSTER_NODES, c.nodes.length
+
+  keys = (0..20).map { |i| "mruby-redis-test:cluster:#{i}" }
+  keys.each { |k| assert_equal "OK", c.set(k, k) }
+  keys.each { |k| assert_equal k, c.get(k) }
+  assert_equal keys + [nil], c.mget(*(keys + ["mruby-redis-test:cluster:none"]))
+
+  assert_equal "OK", c.mset("{mruby-redis-test}a", "1", "mruby-redis-test:b", "2")
+  assert_equal ["1", "2"], c.mget("{mruby-redis-test}a", "mruby-redis-test:b")
+  assert_equal 1, c.call(:exists, "mruby-redis-test:b")
+  assert_true c.exists?("mruby-redis-test:b")
+
+  assert_equal keys.length + 2, c.del(*(keys + ["{mruby-redis-test}a", "mruby-redis-test:b"]))
+  assert_raise(Redis::ReplyError) { c.call(:nonexistant, "foo") }
+
+  # the replies of Redis's methods
+  assert_true c.setnx("mruby-redis-test:c", "")
+  assert_false c.setnx("mruby-redis-test:c", "x")
+  assert_true c.expire("mruby-redis-test:c", 60)
+  assert_equal [nil, nil], c.mget("mruby-redis-test:c", "mruby-redis-test:none")
+  assert_true c.hset("mruby-redis-test:h", "f", "")
+  assert_false c.hset("mruby-redis-test:h", "f", "")
+  assert_equal [nil, nil], c.hmget("mruby-redis-test:h", "f", "none")
+  assert_nil c.hkeys("mruby-redis-test:none")
+  assert_nil c.hvals("mruby-redis-test:none")
+  c.del "mruby-redis-test:c", "mruby-redis-test:h"
+
+  c.close
+  assert_raise(Redis::ClosedError) { c.get("foo") }
+end
+
+assert("Redis::Cluster sorted sets") do
+  # a fractional connect timeout is not cut down to 0
+  c = Redis::Cluster.new ["#{HOST}:#{CLUSTER_PORT}"], 0.5
+  c.del "mruby-redis-test:cluster:zset"
+
+  assert_equal 3, c.zadd("mruby-redis-test:cluster:zset", {"a" => 1, "b" => 2.5, "c" => -1.0 / 0})
+  assert_equal 4.5, c.zadd("mruby-redis-test:cluster:zset", 2, "b", incr: true)
+  assert_equal 4.5, c.zscore("mruby-redis-test:cluster:zset", "b")
+  assert_nil c.zscore("mruby-redis-test:cluster:zset", "none")
+  assert_equal 2.5, c.zincrby("mruby-redis-test:cluster:zset", 1.5, "a")
+  assert_equal ["c", "a", "b"], c.zrange("mruby-redis-test:cluster:zset", 0, -1)
+  assert_equal [["c", -1.0 / 0], ["a", 2.5], ["b", 4.5]],
+               c.zrange("mruby-redis-test:cluster:zset", 0, -1, withscores: true)
+  assert_equal [["b", 4.5]], c.zrevrangebyscore("mruby-redis-test:cluster:zset", "+inf", 3, withscores: true)
+  assert_equal ["c", -1.0 / 0], c.zpopmin("mruby-redis-test:cluster:zset")
+  assert_equal [["b", 4.5], ["a", 2.5]], c.zpopmax("mruby-redis-test:cluster:zset", 2)
+  assert_nil c.zpopmax("mruby-redis-test:cluster:zset")
+
+  c.close
+end
+
+assert("Redis::Cluster follows MOVED") do
+  c = Redis::Cluster.new ["#{HOST}:#{CLUSTER_PORT}"]
+  c.set "foo", "bar"
+  other = c.nodes.find { |n| n != c.node_for("foo") }
+  r = Redis.new HOST, other.split(":")[1].to_i
+
+  # any other node answers with a MOVED error, the cluster client follows it
+  assert_raise(Redis::ReplyError) { r.get("foo") }
+  assert_equal "bar", c.get("foo")
+
+  c.del "foo"
+  c.close
+  r.close
+end
+
+assert("Redis::Distributed") do
+  # two names for the same server: two nodes of the ring as far as the client knows
+  d = Redis::Distributed.new ["#{HOST}:#{PORT}", ["localhost", PORT]]
+  assert_equal ["#{HOST}:#{PORT}", "localhost:#{PORT}"], d.nodes
+  assert_raise(ArgumentError) { Redis::Distributed.new [] }
+  assert_raise(ArgumentError) { Redis::Distributed.new ["#{HOST}:#{PORT}", "#{HOST}:#{PORT}"] }
+
+  keys = (0..20).map { |i| "mruby-redis-test:distributed:#{i}" }
+  assert_equal 2, keys.map { |k| d.node_for(k) }.uniq.length
+  assert_equal d.node_for("{mruby-redis-test}a"), d.node_for("{mruby-redis-test}b")
+
+  keys.each { |k| assert_equal "OK", d.set(k, k) }
+  keys.each { |k| assert_equal k, d[k] }
+  assert_equal keys + [nil], d.mget(*(keys + ["mruby-redis-test:distributed:none"]))
+  assert_equal "OK", d.mset("mruby-redis-test:distributed:a", "1", "mruby-redis-test:distributed:b", "2")
+  assert_equal ["1", "2"], d.mget("mruby-redis-test:distributed:a", "mruby-redis-test:distributed:b")
+  assert_true d.exists?("mruby-redis-test:distributed:a")
+  assert_equal 3, d.call(:incrby, "mruby-redis-test:distributed:a", 2)
+  assert_equal keys.length + 2, d.del(*(keys + ["mruby-redis-test:distributed:a", "mruby-redis-test:distributed:b"]))
+  assert_raise(Redis::ReplyError) { d.call(:nonexistant, "foo") }
+
+  d.close
+  assert_raise(Redis::ClosedError) { d.get("foo") }
+end
+
+assert("Redis::Distributed#add_node") do
+  d = Redis::Distributed.new ["127.0.0.1:6379", "127.0.0.1:6380", "127.0.0.1:6381"]
+  keys = (0...3000).map { |i| "key:#{i}" }
+  before = keys.map { |k| d.node_for(k) }
+  d.add_node "127.0.0.1:6382"
+  after = keys.map { |k| d.node_for(k) }
+
+  # the moved keys only go to the new node, about a quarter of them
+  moved = (0...keys.length).select { |i| before[i] != after[i] }
+  assert_true moved.all? { |i| after[i] == "127.0.0.1:6382" }
+  assert_true moved.length > 500 && moved.length < 1000
+  d.close
+end
+
+assert("Redis::ReplicaSet") do
+  primary = Redis.new HOST, PORT
+  replicas = [Redis.new(HOST, PORT), Redis.new(HOST, PORT)]
+  assert_raise(ArgumentError) {Redis::ReplicaSet.new primary, replicas, strategy: :random}
+  set = Redis::ReplicaSet.new primary, replicas
+  assert_equal primary, set.primary
+
+  assert_equal "OK", set.set("replica_key", "value")
+  4.times { assert_equal "value", set.get("replica_key") }
+  assert_equal ["value", nil], set.mget("replica_key", "replica_none")
+  stats = set.stats
+  assert_equal 5, stats[:reads]
+  assert_equal 0, stats[:primary_reads]
+  assert_equal [3, 2], stats[:replicas].map { |r| r[:reads] }
+
+  # a lost replica: the read goes to the other one
+  replicas[0].queue(:client, "id")
+  id = replicas[0].reply
+  primary.queue(:client, "kill", "id", id.to_s)
+  primary.reply
+  2.times { assert_equal "value", set.get("replica_key") }
+  stats = set.stats
+  assert_equal 1, stats[:replicas][0][:failures]
+  assert_false stats[:replicas][0][:up]
+  assert_equal 4, stats[:replicas][1][:reads]
+  assert_raise(Redis::ReplyError) {set.hget "replica_key", "field"}
+  set.close
+end
+
+assert("Redis::ReplicaSet doesn't retry an iterator that has yielded") do
+  primary = Redis.new HOST, PORT
+  replicas = [Redis.new(HOST, PORT), Redis.new(HOST, PORT)]
+  set = Redis::ReplicaSet.new primary, replicas
+  primary.del "replica_set"
+  primary.sadd "replica_set", *(1..100).map(&:to_s)
+  ids = replicas.map { |r| r.queue(:client, "id"); r.reply }
+
+  seen = []
+  assert_raise(EOFError, SystemCallError) do
+    set.sscan_each("replica_set", count: 10) do |member|
+      ids.each { |id| primary.queue(:client, "kill", "id", id.to_s); primary.reply } if seen.empty?
+      seen << member
+    end
+  end
+  assert_true seen.size < 100
+  assert_equal seen.uniq, seen
+  primary.del "replica_set"
+  set.close
+end
+
+assert("Redis::ReplicaSet read_your_writes") do
+  set = Redis::ReplicaSet.new [HOST, PORT], ["#{HOST}:#{PORT}"], strategy: :latency, read_your_writes: 0.2
+  set.del "replica_key"
+  assert_nil set.get("replica_key")
+  usleep 300_000
+  assert_nil set.get("replica_key")
+  stats = set.stats
+  assert_equal 1, stats[:primary_reads]
+  assert_equal 1, stats[:replicas][0][:reads]
+  set.close
+end
+
+assert("Redis::Sentinel") do
+  assert_raise(Redis::ConnectionError) {Redis::Sentinel.new ["#{HOST}:#{SENTINEL_PORT}"], "nomaster"}
+  r = Redis::Sentinel.new ["#{HOST}:1", [HOST, SENTINEL_PORT]], SENTINEL_MASTER, timeout: 0.5
+  host, port = r.master_addr
+  assert_equal HOST, host
+  assert_include [6390, 6391], port
+  assert_equal port, r.port
+  assert_equal "OK", r.set("sentinel_key", "value")
+  assert_equal "value", r.get("sentinel_key")
+  assert_equal [host, port], r.refresh_master
+  assert_equal 0, r.switches
+  r.close
+end
+
+assert("Redis::Sentinel follows a failover") do
+  r = Redis::Sentinel.new ["#{HOST}:#{SENTINEL_PORT}"], SENTINEL_MASTER
+  r.select 1
+  r.set "sentinel_key", "1"
+  old = r.master_addr
+
+  admin = Redis.new HOST, SENTINEL_PORT
+  # refused until the sentinel knows the replica
+  20.times do
+    ok = begin
+           admin.queue(:sentinel, "failover", SENTINEL_MASTER)
+           admin.reply == "OK"
+         rescue Redis::ReplyError
+           false
+         end
+    break if ok
+    usleep 500_000
+  end
+  # +switch-master is read before the next command
+  100.times do
+    break if r.master_addr != old
+    usleep 100_000
+  end
+  assert_not_equal old, r.master_addr
+  assert_equal 1, r.switches
+  assert_equal r.master_addr[1], r.port
+  assert_equal "1", r.get("sentinel_key")
+  assert_equal 2, r.incr("sentinel_key")
+  admin.close
+  r.close
+end
+
+assert("Redis::Pool") do
+  pool = Redis::Pool.new HOST, PORT, size: 2, timeout: 0.1
+  assert_equal 2, pool.size
+
+  r1 = pool.checkout
+  r2 = pool.checkout
+  assert_equal "PONG", r1.ping
+  assert_equal 2, pool.active
+  assert_raise(Redis::Pool::TimeoutError) { pool.checkout }
+
+  pool.checkin r1
+  assert_raise(Redis::ClosedError) { r1.ping }
+  assert_equal 1, pool.idle
+
+  ret = pool.with { |r| r.set "mruby-redis-test:pool", "bar"; r.get "mruby-redis-test:pool" }
+  assert_equal "bar", ret
+  assert_equal 1, pool.idle
+
+  # the same host/port gives the same pool
+  assert_equal 2, Redis::Pool.new(HOST, PORT, size: 10).size
+
+  # a fractional connect timeout is not cut down to 0
+  assert_equal "PONG", Redis::Pool.new("localhost", PORT, connect_timeout: 0.5).with { |r| r.ping }
+
+  r2.close
+  assert_equal 2, pool.idle
+  assert_equal 0, pool.active
+
+  # a connection owing a reply, or on another db, is closed rather than handed out again
+  r = pool.checkout
+  r.queue(:ping)
+  r.close
+  assert_equal 1, pool.idle
+  r = pool.checkout
+  r.select 1
+  pool.checkin r
+  assert_equal 0, pool.idle
+  pool.with { |r| assert_equal "bar", r.get("mruby-redis-test:pool") }
+
+  # only the connections it handed out are given back to a pool
+  other = Redis.new HOST, PORT
+  assert_raise(ArgumentError) { pool.checkin other }
+  assert_equal "PONG", other.ping
+  other.close
+end
+
+assert("Redis#enable_client_cache") do
+  r = Redis.new HOST, PORT
+  writer = Redis.new HOST, PORT
+  r.set "cached", "v1"
+  r.hset "cached_hash", "f", "h1"
+  r.del "cached_missing"
+
+  r.enable_client_cache max_memory: 1024 * 1024
+  assert_raise(RuntimeError) {r.enable_client_cache}
+
+  assert_equal "v1", r.get("cached")
+  assert_equal "v1", r.get("cached")
+  assert_equal "h1", r.hget("cached_hash", "f")
+  assert_equal({"f" => "h1"}, r.hgetall("cached_hash"))
+  assert_nil r.get("cached_missing")
+  assert_equal ["v1", nil], r.mget("cached", "cached_missing")
+  stats = r.client_cache_stats
+  assert_equal 3, stats[:hits]
+  assert_equal 4, stats[:misses]
+  assert_true stats[:tracking]
+
+  writer.set "cached", "v2"
+  writer.hset "cached_hash", "f", "h2"
+  # the invalidations are read on the next lookups
+  assert_equal "v2", r.get("cached")
+  assert_equal "h2", r.hget("cached_hash", "f")
+  assert_true r.client_cache_stats[:invalidations] >= 2
+
+  # the writes of the client itself are read back at once
+  assert_equal "v2", r.get("cached")
+  r.set "cached", "v3"
+  assert_equal "v3", r.get("cached")
+  r.hset "cached_hash", "f", "h3"
+  assert_equal "h3", r.hget("cached_hash", "f")
+  r.del "cached"
+  assert_nil r.get("cached")
+
+  r.multi
+  assert_equal "QUEUED", r.get("cached")
+  r.exec
+
+  # still tracking on the new connection
+  r.set "cached", "v4"
+  r.get "cached"
+  r.reconnect
+  assert_equal 0, r.client_cache_stats[:keys]
+  assert_true r.client_cache_stats[:tracking]
+  r.get "cached"
+  writer.set "cached", "v5"
+  assert_equal "v5", r.get("cached")
+
+  r.disable_client_cache
+  assert_nil r.client_cache_stats
+  r.close
+  writer.close
+end
+
+assert("Redis#enable_client_cache max_memory") do
+  r = Redis.new HOST, PORT
+  r.set "cached1", "a" * 600
+  r.set "cached2", "b" * 600
+
+  r.enable_client_cache max_memory: 1000
+  r.get "cached1"
+  r.get "cached2"
+  stats = r.client_cache_stats
+  assert_equal 1, stats[:keys]
+  assert_equal 1, stats[:evictions]
+  assert_true stats[:memory] <= 1000
+
+  assert_raise(ArgumentError) {Redis.new(HOST, PORT).enable_client_cache max_memory: 0}
+  r.close
+end
+
+assert("Redis.new with protocol: 3") do
+  r = Redis.new HOST, PORT, protocol: 3
+  assert_equal 3, r.protocol
+  assert_equal 2, Redis.new(HOST, PORT).protocol
+
+  r.del "resp3_hash"
+  r.hset "resp3_hash", "field", "value"
+  assert_equal({"field" => "value"}, r.hgetall("resp3_hash"))
+  r.del "resp3_missing"
+  assert_nil r.hgetall("resp3_missing")
+
+  r.del "resp3_zset"
+  r.zadd "resp3_zset", 1.5, "member"
+  assert_equal 1.5, r.zscore("resp3_zset", "member")
+  assert_equal "PONG", r.ping
+
+  assert_raise(ArgumentError) {Redis.new HOST, PORT, protocol: 4}
+  r.close
+end
+
+assert("Redis#on_push") do
+  r = Redis.new HOST, PORT, protocol: 3
+  writer = Redis.new HOST, PORT
+  pushes = []
+
+  r.on_push { |message| pushes << message }
+  r.queue(:client, "tracking", "on")
+  assert_equal :OK, r.reply
+  r.set "resp3_tracked", "v1"
+  r.get "resp3_tracked"
+  writer.set "resp3_tracked", "v2"
+  assert_equal "PONG", r.ping
+  assert_equal ["invalidate", ["resp3_tracked"]], pushes.last
+
+  r.on_push
+  r.get "resp3_tracked"
+  writer.set "resp3_tracked", "v3"
+  assert_equal "v3", r.get("resp3_tracked")
+  r.close
+  writer.close
+end
+
+assert("Redis#stats") do
+  r = Redis.new HOST, PORT
+  r.set "stats_key", "value"
+  r.set "stats_key", "value"
+  assert_equal "value", r.get("stats_key")
+  assert_raise(Redis::ReplyError) {r.incr "stats_key"}
+
+  stats = r.stats
+  assert_equal 4, stats[:commands]
+  assert_equal 1, stats[:errors]
+  assert_true stats[:bytes_written] > 0
+  assert_true stats[:bytes_read] > 0
+  assert_equal 2, stats[:per_command]["SET"][:calls]
+  assert_equal 1, stats[:per_command]["GET"][:samples]
+  assert_equal 1, stats[:per_command]["INCR"][:errors]
+  assert_true stats[:per_command]["SET"][:p99_us] >= stats[:per_command]["SET"][:p50_us]
+  assert_true stats[:per_command]["SET"][:max_us] >= stats[:per_command]["SET"][:p99_us]
+
+  r.pipelined do
+    r.get "stats_key"
+    r.get "stats_key"
+  end
+  stats = r.stats
+  assert_equal 1, stats[:pipelines]
+  assert_equal 2, stats[:max_pipeline_depth]
+  assert_equal 3, stats[:per_command]["GET"][:calls]
+  assert_equal 1, stats[:per_command]["GET"][:samples]
+
+  Redis.stats_reset
+  r.stats_reset
+  assert_equal 0, r.stats[:commands]
+  # connections of other tests may be collected meanwhile
+  assert_true Redis.stats[:commands] >= 7
+  assert_true Redis.stats[:per_command]["GET"][:calls] >= 3
+
+  r.get "stats_key"
+  before = Redis.stats[:per_command]["GET"][:calls]
+  r.close
+  assert_true Redis.stats[:per_command]["GET"][:calls] > before
+end
+
+assert("Redis#enable_reconnect") do
+  r = Redis.new HOST, PORT
+  killer = Redis.new HOST, PORT
+  kill = lambda do
+    r.queue(:client, "id")
+    id = r.reply
+    killer.queue(:client, "kill", "id", id.to_s)
+    killer.reply
+  end
+  assert_raise(ArgumentError) {r.enable_reconnect attempts: 0}
+  r.enable_reconnect attempts: 3, base_delay: 0.01, max_delay: 0.1
+  r.set "reconnect_key", "value"
+
+  kill.call
+  assert_equal "value", r.get("reconnect_key")
+  assert_equal 1, r.stats[:reconnects]
+
+  # EOFError, or a SystemCallError when the write notices it first
+  kill.call
+  assert_raise(EOFError, SystemCallError) {r.incr "reconnect_counter"}
+  assert_equal "value", r.get("reconnect_key")
+  assert_equal 2, r.stats[:reconnects]
+
+  # a write is not sent again, even one setting the same value
+  kill.call
+  assert_raise(EOFError, SystemCallError) {r.set "reconnect_key", "value"}
+  assert_equal 3, r.stats[:reconnects]
+
+  r.disable_reconnect
+  kill.call
+  assert_raise(EOFError, SystemCallError) {r.get "reconnect_key"}
+  r.reconnect
+  assert_equal "value", r.get("reconnect_key")
+  r.close
+  killer.close
+end
+
+assert("Redis#enable_reconnect health_check") do
+  r = Redis.new HOST, PORT
+  killer = Redis.new HOST, PORT
+  r.select 1
+  r.set "reconnect_db", "1"
+  r.del "reconnect_health"
+  r.enable_reconnect health_check: 0.1
+  r.queue(:client, "id")
+  id = r.reply
+  killer.queue(:client, "kill", "id", id.to_s)
+  killer.reply
+  usleep 500_000
+
+  # PINGed and reconnected first: INCR is sent once, SELECT replayed
+  assert_equal 1, r.incr("reconnect_health")
+  assert_equal "1", r.get("reconnect_db")
+  assert_equal 1, r.stats[:reconnects]
+  r.del "reconnect_db", "reconnect_health"
+  r.close
+  killer.close
+end
+
+assert("Redis#command_timeout, Redis#with_timeout") do
+  assert_raise(ArgumentError) {Redis.new HOST, PORT, -1}
+  r = Redis.new HOST, PORT, 0.5, command_timeout: 2
+  assert_equal 2.0, r.command_timeout
+  r.del "timeout_list"
+
+  # BLPOP waits 1 sec on the server
+  assert_raise(Redis::TimeoutError) do
+    r.with_timeout(0.05) do
+      r.queue(:blpop, "timeout_list", "1")
+      r.reply
+    end
+  end
+  assert_equal 2.0, r.command_timeout
+  assert_kind_of Redis::ConnectionError, Redis::TimeoutError.new
+
+  # the late reply is not taken for the reply of the next command
+  assert_raise(EOFError) {r.get "timeout_list"}
+  r.reconnect
+  assert_nil r.get("timeout_list")
+
+  r.command_timeout = nil
+  assert_nil r.command_timeout
+  r.close
+end
+
+assert("Redis::Script.sha1") do
+  assert_equal "da39a3ee5e6b4b0d3255bfef95601890afd80709", Redis::Script.sha1("")
+  assert_equal "a9993e364706816aba3e25717850c26c9cd0d89d", Redis::Script.sha1("abc")
+  assert_equal "34aa973cd4c4daa4f61eeb2bdbad27316534016f", Redis::Script.sha1("a" * 1000000)
+end
+
+assert("Redis#eval, Redis#evalsha, Redis#script_load") do
+  r = Redis.new HOST, PORT
+  r.script_flush
+  assert_equal "hello", r.eval("return ARGV[1]", [], ["hello"])
+  assert_equal ["k1", "a1"], r.eval("return {KEYS[1], ARGV[1]}", ["k1"], ["a1"])
+
+  sha = r.script_load("return 42")
+  assert_equal Redis::Script.sha1("return 42"), sha
+  assert_equal 42, r.evalsha(sha)
+  assert_true r.script_exists(sha)
+  assert_equal [true, false], r.script_exists(sha, "0" * 40)
+  assert_raise(Redis::ReplyError) {r.evalsha "0" * 40}
+  r.close
+end
+
+assert("Redis::Script#call") do
+  r = Redis.new HOST, PORT
+  script = Redis::Script.new("return redis.call('INCRBY', KEYS[1], ARGV[1])")
+  r.del "script_counter"
+  r.script_flush
+
+  assert_false r.script_exists(script.sha)
+  assert_equal 2, script.call(r, ["script_counter"], [2])
+  assert_true r.script_exists(script.sha)
+  assert_equal 5, script.call(r, ["script_counter"], [3])
+
+  # forgotten by the server: EVAL again
+  r.script_flush
+  assert_equal 6, script.call(r, ["script_counter"], [1])
+
+  r.script_flush
+  replies = r.pipelined do
+    script.call(r, ["script_counter"], [1])
+    script.call(r, ["script_counter"], [1])
+  end
+  assert_equal [7, 8], replies
+
+  r.multi
+  script.call(r, ["script_counter"], [2])
+  assert_equal [10], r.exec
+
+  # a queued EVAL that never ran does not load the script
+  r.script_flush
+  r.multi
+  script.call(r, ["script_counter"], [2])
+  r.discard
+  assert_equal [11], r.pipelined { script.call(r, ["script_counter"], [1]) }
+
+  assert_raise(Redis::ReplyError) {Redis::Script.new("syntax error").call(r)}
+  r.close
+end